@@ -48,9 +48,19 @@ LOCAL_LDFLAGS := $(bub_common_ldflags)
 LOCAL_C_INCLUDES :=
 LOCAL_SRC_FILES := \
     bub_ab_flow.c \
+    bub_arena.c \
+    bub_async_posix.c \
+    bub_boot_image.c \
+    bub_cpu.c \
+    bub_decompress.c \
+    bub_disk.c \
+    bub_log.c \
+    bub_ops.c \
     bub_sysdeps_posix.c \
     bub_util.c \
-    bub_crc32.c
+    bub_crc32.c \
+    bub_sha256.c \
+    bub_timings.c
 include $(BUILD_HOST_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
@@ -70,11 +80,118 @@ LOCAL_C_INCLUDES := \
 LOCAL_STATIC_LIBRARIES := \
     libbub_host \
     libgmock_host \
-    libgtest_host
+    libgtest_host \
+    libz-host
 LOCAL_SHARED_LIBRARIES := \
     libchrome
 LOCAL_SRC_FILES := \
     bub_ab_flow_unittest.cc \
-    bub_image_util.cc
-LOCAL_LDLIBS_linux := -lrt
+    bub_arena_unittest.cc \
+    bub_async_posix_unittest.cc \
+    bub_boot_image_unittest.cc \
+    bub_compress.cc \
+    bub_crc32_unittest.cc \
+    bub_decompress_unittest.cc \
+    bub_disk_unittest.cc \
+    bub_image_util.cc \
+    bub_log_unittest.cc \
+    bub_sha256_unittest.cc \
+    bub_timings_unittest.cc
+LOCAL_LDLIBS_linux := -lrt -lpthread
 include $(BUILD_HOST_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := bub_crc32_benchmark
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MODULE_TAGS := optional
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CLANG := true
+LOCAL_CFLAGS := $(bub_common_cflags) -DBUB_COMPILATION
+LOCAL_CPPFLAGS := $(bub_common_cppflags)
+LOCAL_LDFLAGS := $(bub_common_ldflags)
+LOCAL_STATIC_LIBRARIES := \
+    libbub_host
+LOCAL_SRC_FILES := \
+    bub_crc32_benchmark.cc
+LOCAL_LDLIBS_linux := -lrt
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := bub_sha256_benchmark
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MODULE_TAGS := optional
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CLANG := true
+LOCAL_CFLAGS := $(bub_common_cflags) -DBUB_COMPILATION
+LOCAL_CPPFLAGS := $(bub_common_cppflags)
+LOCAL_LDFLAGS := $(bub_common_ldflags)
+LOCAL_STATIC_LIBRARIES := \
+    libbub_host
+LOCAL_SRC_FILES := \
+    bub_sha256_benchmark.cc
+LOCAL_LDLIBS_linux := -lrt
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := bub_decompress_benchmark
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MODULE_TAGS := optional
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CLANG := true
+LOCAL_CFLAGS := $(bub_common_cflags) -DBUB_COMPILATION
+LOCAL_CPPFLAGS := $(bub_common_cppflags)
+LOCAL_LDFLAGS := $(bub_common_ldflags)
+LOCAL_STATIC_LIBRARIES := \
+    libbub_host \
+    libz-host
+LOCAL_SRC_FILES := \
+    bub_compress.cc \
+    bub_decompress_benchmark.cc
+LOCAL_LDLIBS_linux := -lrt
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := bub_pack_boot_image
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CLANG := true
+LOCAL_CFLAGS := $(bub_common_cflags) -DBUB_COMPILATION
+LOCAL_CPPFLAGS := $(bub_common_cppflags)
+LOCAL_LDFLAGS := $(bub_common_ldflags)
+LOCAL_STATIC_LIBRARIES := \
+    libbub_host \
+    libz-host
+LOCAL_SRC_FILES := \
+    bub_compress.cc \
+    bub_pack_boot_image.cc
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := bub_sim
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MODULE_TAGS := optional
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CLANG := true
+LOCAL_CFLAGS := $(bub_common_cflags) -DBUB_COMPILATION
+LOCAL_CPPFLAGS := $(bub_common_cppflags)
+LOCAL_LDFLAGS := $(bub_common_ldflags)
+LOCAL_STATIC_LIBRARIES := \
+    libbub_host
+LOCAL_SRC_FILES := \
+    bub_sim.cc
+LOCAL_LDLIBS_linux := -lrt
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := bub_timings_report.py
+LOCAL_MODULE_CLASS := EXECUTABLES
+LOCAL_IS_HOST_MODULE := true
+LOCAL_MODULE := bub_timings_report
+include $(BUILD_PREBUILT)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := bub_hash_boot_image.py
+LOCAL_MODULE_CLASS := EXECUTABLES
+LOCAL_IS_HOST_MODULE := true
+LOCAL_MODULE := bub_hash_boot_image
+include $(BUILD_PREBUILT)
@@ -18,7 +18,7 @@
 #include "bub_util.h"
 
 static const uint8_t magic[] = BUB_BOOT_CTRL_MAGIC;
-static const char* bub_suffixes[2] = {"_a", "_b"};
+static const uint8_t log_magic[] = BUB_AB_LOG_MAGIC;
 
 static int normalize_slot(BubSlotData *slot) {
   if (slot->priority > 0) {
@@ -42,171 +42,363 @@ static int slot_is_bootable(const BubSlotData *slot) {
   return (slot->successful_boot || slot->tries_remaining > 0);
 }
 
-static int reset_metadata(BubOps* ops) {
-  BubAbData metadata;
-
-  bub_memset(&metadata, 0, sizeof(BubAbData));
-  bub_memcpy(&metadata.magic, magic, sizeof(metadata.magic));
-  metadata.major_version = BUB_MAJOR_VERSION;
-  metadata.minor_version = BUB_MINOR_VERSION;
-  metadata.slots[0].priority = 15;
-  metadata.slots[0].tries_remaining = 7;
-  metadata.slots[0].successful_boot = 0;
-  metadata.slots[1].priority = 15;
-  metadata.slots[1].tries_remaining = 7;
-  metadata.slots[1].successful_boot = 0;
-  return bub_write_ab_data_to_misc(ops, &metadata);
+/* Returns the number of slots in use in |data|, which must have passed
+ * validate_ab_data().
+ */
+static unsigned int ab_num_slots(const BubAbData* data) {
+  if (data->minor_version == 0)
+    return BUB_AB_DEFAULT_NUM_SLOTS;
+  return data->num_slots;
 }
 
-BubAbFlowResult bub_ab_flow(BubOps* ops,
-                            char* out_selected_suffix,
-                            size_t suffix_num_bytes) {
-  bub_assert(out_selected_suffix != NULL);
-  bub_assert(suffix_num_bytes >= 3);
-
-  BubAbFlowResult ab_err;
-  BubAbData ab_ctl;
-  int target_slot_index_to_boot = -1;
-  int new_metadata = 0;
+/* Checks magic and crc32 of |data| as read from disk and converts the crc32
+ * to host byte order.
+ */
+static BubAbFlowResult validate_ab_data(BubAbData* data) {
+  uint32_t crc;
 
-  // No selection has been made yet.
-  bub_memset(out_selected_suffix, 0, 3);
+  if (bub_memcmp(data->magic, magic, 4) != 0)
+    return BUB_AB_FLOW_ERROR_INVALID_METADATA;
 
-  ab_err = bub_read_ab_data_from_misc(ops, &ab_ctl);
-  if (ab_err != BUB_AB_FLOW_RESULT_OK) {
-    if (ab_err == BUB_AB_FLOW_ERROR_INVALID_METADATA) {
-      bub_warning("Reseting metadata.\n");
-      if (!reset_metadata(ops)) {
-        bub_warning("Unable to reset metadata.\n");
-      }
-    }
-    return ab_err;
-  }
+  crc = bub_be32toh(data->crc32);
+  data->crc32 = 0;
+  if (crc != bub_crc32(0, data, sizeof(BubAbData)))
+    return BUB_AB_FLOW_ERROR_INVALID_METADATA;
 
-  // Ensure only proper slot states exist.
-  if (normalize_slot(&ab_ctl.slots[0])) {
-    bub_warning("State of slot A was normalized.\n");
-    new_metadata = 1;
-  }
-  if (normalize_slot(&ab_ctl.slots[1])) {
-    bub_warning("State of slot B was normalized.\n");
-    new_metadata = 1;
-  }
+  // Assign host byte order to necessary variables needed here.
+  data->crc32 = crc;
 
-  if (slot_is_bootable(&ab_ctl.slots[0]) && slot_is_bootable(&ab_ctl.slots[1]))
-  {
-    if (ab_ctl.slots[1].priority > ab_ctl.slots[0].priority)
-      target_slot_index_to_boot = 1;
-    else
-      target_slot_index_to_boot = 0;
-  } else if (slot_is_bootable(&ab_ctl.slots[0])) {
-    // Choose slot A.
-    target_slot_index_to_boot = 0;
-  } else if (slot_is_bootable(&ab_ctl.slots[1])) {
-    // Choose slot B.
-    target_slot_index_to_boot = 1;
-  } else {
-    if (new_metadata && !bub_write_ab_data_to_misc(ops, &ab_ctl))
-      return BUB_AB_FLOW_ERROR_WRITE_METADATA;
-    // If neither was chosen, there are no valid slots.
-    bub_warning("No valid slot found.\n");
-    return BUB_AB_FLOW_ERROR_NO_VALID_SLOTS;
-  }
+  if (data->minor_version > 0 &&
+      (data->num_slots == 0 || data->num_slots > BUB_AB_MAX_SLOTS))
+    return BUB_AB_FLOW_ERROR_INVALID_METADATA;
 
-  // Found usable slot to attempt boot on. Decrement tries remaining and write
-  // out the new AB metadata if the slots is in "Updated" state.
-  if (ab_ctl.slots[target_slot_index_to_boot].tries_remaining > 0) {
-    ab_ctl.slots[target_slot_index_to_boot].tries_remaining--;
-    new_metadata = 1;
-  }
+  return BUB_AB_FLOW_RESULT_OK;
+}
 
-  if (new_metadata)
-    if (!bub_write_ab_data_to_misc(ops, &ab_ctl))
-      return BUB_AB_FLOW_ERROR_WRITE_METADATA;
+/* Reads the log record in |slot| into |record|. |valid| is set to zero if
+ * the slot was never written, holds a torn write or lies past the end of
+ * the partition.
+ */
+static BubAbFlowResult read_log_record(BubOps* ops, int slot,
+                                       BubAbLogRecord* record, int* valid) {
+  BubIOResult io_result;
+  size_t num_bytes_read;
+  uint32_t crc;
 
-  // Write selected suffix to caller's pointer.
-  bub_memcpy(out_selected_suffix, bub_suffixes[target_slot_index_to_boot], 3);
+  io_result = ops->read_from_partition(ops, "misc", record,
+                                       BUB_AB_LOG_OFFSET +
+                                         (int64_t)slot *
+                                           BUB_AB_LOG_RECORD_STRIDE,
+                                       sizeof(BubAbLogRecord),
+                                       &num_bytes_read);
+  if (io_result != BUB_IO_RESULT_OK) {
+    bub_warning("Could not read metadata log from misc partition.\n");
+    return BUB_AB_FLOW_ERROR_READ_METADATA;
+  }
 
+  *valid = 0;
+  if (num_bytes_read != sizeof(BubAbLogRecord) ||
+      bub_memcmp(record->magic, log_magic, sizeof(record->magic)) != 0)
+    return BUB_AB_FLOW_RESULT_OK;
+  crc = bub_be32toh(record->crc32);
+  if (crc != bub_crc32(0, record, sizeof(BubAbLogRecord) - sizeof(crc)))
+    return BUB_AB_FLOW_RESULT_OK;
+  *valid = validate_ab_data(&record->data) == BUB_AB_FLOW_RESULT_OK;
   return BUB_AB_FLOW_RESULT_OK;
 }
 
-int bub_ab_mark_as_invalid(BubOps* ops, const char* invalid_suffix) {
-  bub_assert(invalid_suffix != NULL);
-  bub_assert(bub_strlen(invalid_suffix) >= 2);
-
-  BubAbData ab_ctl;
+/* Finds the latest record of the metadata log, storing its position in
+ * |state| and the record in |latest|.
+ *
+ * Records are written to consecutive slots with consecutive sequence
+ * numbers, so the slots from 0 up to the latest record hold the sequence
+ * number of slot 0 plus their index, and no later slot does. That allows a
+ * binary search instead of reading every slot.
+ */
+static BubAbFlowResult find_log_head(BubOps* ops, BubAbLogState* state,
+                                     BubAbLogRecord* latest) {
   BubAbFlowResult ab_err;
-  unsigned int i;
+  BubAbLogRecord record;
+  uint32_t first_sequence;
+  int valid;
+  int lo, hi, mid;
 
-  ab_err = bub_read_ab_data_from_misc(ops, &ab_ctl);
+  ab_err = read_log_record(ops, 0, latest, &valid);
   if (ab_err != BUB_AB_FLOW_RESULT_OK)
     return ab_err;
 
-  // Find suffix in small list.
-  for (i = 0; i < 2; ++i)
-  {
-    if (!bub_memcmp(bub_suffixes[i], invalid_suffix, 3)) {
-      // Found the corresponding index to invalid_suffix. Invalidate the slot
-      // and write out.
-      bub_memset(&ab_ctl.slots[i], 0, sizeof(BubSlotData));
-      return bub_write_ab_data_to_misc(ops, &ab_ctl);
+  if (!valid) {
+    // Either the log is empty or a write wrapping around to slot 0 was
+    // interrupted, leaving the last slot with the latest record.
+    ab_err = read_log_record(ops, BUB_AB_LOG_NUM_RECORDS - 1, latest, &valid);
+    if (ab_err != BUB_AB_FLOW_RESULT_OK)
+      return ab_err;
+    state->head = valid ? BUB_AB_LOG_NUM_RECORDS - 1 : -1;
+    state->sequence = bub_be32toh(latest->sequence);
+    return BUB_AB_FLOW_RESULT_OK;
+  }
+
+  first_sequence = bub_be32toh(latest->sequence);
+  lo = 0;
+  hi = BUB_AB_LOG_NUM_RECORDS;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    ab_err = read_log_record(ops, mid, &record, &valid);
+    if (ab_err != BUB_AB_FLOW_RESULT_OK)
+      return ab_err;
+    if (valid && bub_be32toh(record.sequence) == first_sequence + mid) {
+      lo = mid;
+      bub_memcpy(latest, &record, sizeof(BubAbLogRecord));
+    } else {
+      hi = mid;
     }
   }
 
-  bub_warning("Could not find requested slot.\n");
-  return 0;
+  state->head = lo;
+  state->sequence = first_sequence + lo;
+  return BUB_AB_FLOW_RESULT_OK;
 }
 
-BubAbFlowResult bub_read_ab_data_from_misc(BubOps* ops, BubAbData* data) {
+/* Reads the current A/B metadata into |data|, see
+ * bub_read_ab_data_from_misc(). |state| is filled in for a following
+ * write_ab_state() even if the metadata is invalid.
+ */
+static BubAbFlowResult read_ab_state(BubOps* ops, BubAbData* data,
+                                     BubAbLogState* state) {
   BubIOResult io_result;
+  BubAbFlowResult ab_err;
+  BubAbFlowResult legacy_result;
+  BubAbLogRecord latest;
   size_t num_bytes_read;
-  uint32_t crc;
 
   io_result = ops->read_from_partition(ops, "misc", data, 0,
-                                    sizeof(BubAbData), &num_bytes_read);
+                                       sizeof(BubAbData), &num_bytes_read);
   if (io_result != BUB_IO_RESULT_OK || num_bytes_read != sizeof(BubAbData)) {
     bub_warning("Could not read metadata from misc partition.\n");
     return BUB_AB_FLOW_ERROR_READ_METADATA;
   }
+  state->legacy_crc32 = bub_crc32(0, data, sizeof(BubAbData));
+  legacy_result = validate_ab_data(data);
 
-  if(bub_memcmp(data->magic, magic, 4) != 0) {
-    bub_warning("AB metadata magic did not match.\n");
-    return BUB_AB_FLOW_ERROR_INVALID_METADATA;
-  }
+  ab_err = find_log_head(ops, state, &latest);
+  if (ab_err != BUB_AB_FLOW_RESULT_OK)
+    return ab_err;
 
-  crc = bub_be32toh(data->crc32);
-  data->crc32 = 0;
-  if (crc != bub_crc32(0, data, sizeof(BubAbData))) {
-    bub_warning("AB metadata crc is invalid.\n");
-    return BUB_AB_FLOW_ERROR_INVALID_METADATA;
+  // A valid BubAbData at offset 0 that changed since the latest record was
+  // written by someone else and takes precedence.
+  if (state->head >= 0 &&
+      (legacy_result != BUB_AB_FLOW_RESULT_OK ||
+       bub_be32toh(latest.legacy_crc32) == state->legacy_crc32)) {
+    bub_memcpy(data, &latest.data, sizeof(BubAbData));
+    return BUB_AB_FLOW_RESULT_OK;
   }
 
-  // Assign host byte order to necessary variables needed here.
-  data->crc32 = crc;
-
-  return BUB_AB_FLOW_RESULT_OK;
+  if (legacy_result != BUB_AB_FLOW_RESULT_OK)
+    bub_warning("AB metadata magic or crc is invalid.\n");
+  return legacy_result;
 }
 
-int bub_write_ab_data_to_misc(BubOps* ops, const BubAbData* data) {
+/* Appends |data| to the metadata log at the position given by |state| and
+ * advances |state| past it.
+ */
+static int write_ab_state(BubOps* ops, const BubAbData* data,
+                          BubAbLogState* state) {
   BubIOResult io_result;
-  BubAbData metadata;
+  BubAbLogRecord record;
+  int slot = (state->head + 1) % BUB_AB_LOG_NUM_RECORDS;
+  uint32_t sequence = state->head < 0 ? 1 : state->sequence + 1;
 
-  bub_memcpy(&metadata, data, sizeof(BubAbData));
+  bub_memcpy(record.magic, log_magic, sizeof(record.magic));
+  record.sequence = bub_be32toh(sequence);
+  record.legacy_crc32 = bub_be32toh(state->legacy_crc32);
+  bub_memcpy(&record.data, data, sizeof(BubAbData));
 
   // Assign big endian order to necessary variables here.
 
   // Calculate crc assign back to crc field, maintaining big endianness.
-  metadata.crc32 = 0;
-  metadata.crc32 = bub_be32toh(bub_crc32(0, &metadata, sizeof(BubAbData)));
+  record.data.crc32 = 0;
+  record.data.crc32 =
+    bub_be32toh(bub_crc32(0, &record.data, sizeof(BubAbData)));
+  record.crc32 = bub_be32toh(
+    bub_crc32(0, &record, sizeof(BubAbLogRecord) - sizeof(record.crc32)));
+
   io_result = ops->write_to_partition(ops,
                                       "misc",
-                                      &metadata,
-                                      0,
-                                      sizeof(BubAbData));
+                                      &record,
+                                      BUB_AB_LOG_OFFSET +
+                                        (int64_t)slot *
+                                          BUB_AB_LOG_RECORD_STRIDE,
+                                      sizeof(BubAbLogRecord));
   if (io_result != BUB_IO_RESULT_OK) {
     bub_warning("Could not write to misc partition.\n");
     return 0;
   }
 
+  state->head = slot;
+  state->sequence = sequence;
+  return 1;
+}
+
+static void reset_metadata(BubAbData* metadata) {
+  unsigned int i;
+
+  bub_memset(metadata, 0, sizeof(BubAbData));
+  bub_memcpy(&metadata->magic, magic, sizeof(metadata->magic));
+  metadata->major_version = BUB_MAJOR_VERSION;
+  metadata->minor_version = BUB_MINOR_VERSION;
+  metadata->num_slots = BUB_AB_DEFAULT_NUM_SLOTS;
+  for (i = 0; i < BUB_AB_DEFAULT_NUM_SLOTS; ++i) {
+    metadata->slots[i].priority = 15;
+    metadata->slots[i].tries_remaining = 7;
+    metadata->slots[i].successful_boot = 0;
+  }
+}
+
+BubAbFlowResult bub_ab_session_load(BubAbSession* session, BubOps* ops) {
+  BubAbFlowResult ab_err;
+
+  session->ops = ops;
+  session->dirty = 0;
+  ab_err = read_ab_state(ops, &session->data, &session->log);
+  if (ab_err == BUB_AB_FLOW_ERROR_INVALID_METADATA) {
+    bub_warning("Reseting metadata.\n");
+    reset_metadata(&session->data);
+    session->dirty = 1;
+  }
+  return ab_err;
+}
+
+BubAbFlowResult bub_ab_session_select(BubAbSession* session,
+                                      char* out_selected_suffix,
+                                      size_t suffix_num_bytes) {
+  bub_assert(out_selected_suffix != NULL);
+  bub_assert(suffix_num_bytes >= 3);
+
+  BubAbData* ab_ctl = &session->data;
+  unsigned int num_slots = ab_num_slots(ab_ctl);
+  BubSlotData* slot;
+  int target_slot_index_to_boot = -1;
+  int normalized = 0;
+  unsigned int i;
+
+  // No selection has been made yet.
+  bub_memset(out_selected_suffix, 0, 3);
+
+  // Ensure only proper slot states exist, and keep the first of the
+  // bootable slots with the highest priority on the way.
+  for (i = 0; i < num_slots; ++i) {
+    slot = &ab_ctl->slots[i];
+    normalized |= normalize_slot(slot);
+    if (slot_is_bootable(slot) &&
+        (target_slot_index_to_boot < 0 ||
+         slot->priority > ab_ctl->slots[target_slot_index_to_boot].priority))
+      target_slot_index_to_boot = i;
+  }
+  if (normalized) {
+    bub_warning("Slot states were normalized.\n");
+    session->dirty = 1;
+  }
+
+  if (target_slot_index_to_boot < 0) {
+    bub_warning("No valid slot found.\n");
+    return BUB_AB_FLOW_ERROR_NO_VALID_SLOTS;
+  }
+
+  // Found usable slot to attempt boot on. Decrement tries remaining if the
+  // slot is in "Updated" state.
+  if (ab_ctl->slots[target_slot_index_to_boot].tries_remaining > 0) {
+    ab_ctl->slots[target_slot_index_to_boot].tries_remaining--;
+    session->dirty = 1;
+  }
+
+  // Write selected suffix to caller's pointer.
+  out_selected_suffix[0] = '_';
+  out_selected_suffix[1] = 'a' + target_slot_index_to_boot;
+
+  return BUB_AB_FLOW_RESULT_OK;
+}
+
+int bub_ab_session_mark_as_invalid(BubAbSession* session,
+                                   const char* invalid_suffix) {
+  bub_assert(invalid_suffix != NULL);
+  bub_assert(bub_strlen(invalid_suffix) >= 2);
+
+  // Suffixes are "_a" plus the slot index.
+  unsigned int i = (unsigned int)(uint8_t)invalid_suffix[1] - 'a';
+
+  if (invalid_suffix[0] != '_' || invalid_suffix[2] != '\0' ||
+      i >= ab_num_slots(&session->data)) {
+    bub_warning("Could not find requested slot.\n");
+    return 0;
+  }
+
+  bub_memset(&session->data.slots[i], 0, sizeof(BubSlotData));
+  session->dirty = 1;
+  return 1;
+}
+
+int bub_ab_session_flush(BubAbSession* session) {
+  if (!session->dirty)
+    return 1;
+  if (!write_ab_state(session->ops, &session->data, &session->log))
+    return 0;
+  session->dirty = 0;
   return 1;
-}
\ No newline at end of file
+}
+
+BubAbFlowResult bub_ab_flow(BubOps* ops,
+                            char* out_selected_suffix,
+                            size_t suffix_num_bytes) {
+  bub_assert(out_selected_suffix != NULL);
+  bub_assert(suffix_num_bytes >= 3);
+
+  BubAbFlowResult ab_err;
+  BubAbSession session;
+
+  // No selection has been made yet.
+  bub_memset(out_selected_suffix, 0, 3);
+
+  ab_err = bub_ab_session_load(&session, ops);
+  if (ab_err == BUB_AB_FLOW_RESULT_OK)
+    ab_err = bub_ab_session_select(&session, out_selected_suffix,
+                                   suffix_num_bytes);
+  if (ab_err == BUB_AB_FLOW_ERROR_READ_METADATA)
+    return ab_err;
+
+  if (!bub_ab_session_flush(&session)) {
+    if (ab_err == BUB_AB_FLOW_ERROR_INVALID_METADATA) {
+      bub_warning("Unable to reset metadata.\n");
+      return ab_err;
+    }
+    bub_memset(out_selected_suffix, 0, 3);
+    return BUB_AB_FLOW_ERROR_WRITE_METADATA;
+  }
+  return ab_err;
+}
+
+int bub_ab_mark_as_invalid(BubOps* ops, const char* invalid_suffix) {
+  BubAbSession session;
+
+  if (bub_ab_session_load(&session, ops) != BUB_AB_FLOW_RESULT_OK)
+    return 0;
+  if (!bub_ab_session_mark_as_invalid(&session, invalid_suffix))
+    return 0;
+  return bub_ab_session_flush(&session);
+}
+
+BubAbFlowResult bub_read_ab_data_from_misc(BubOps* ops, BubAbData* data) {
+  BubAbLogState state;
+
+  return read_ab_state(ops, data, &state);
+}
+
+int bub_write_ab_data_to_misc(BubOps* ops, const BubAbData* data) {
+  BubAbData current;
+  BubAbLogState state;
+
+  // Only the position in the log is needed, the current metadata may well
+  // be invalid.
+  if (read_ab_state(ops, &current, &state) == BUB_AB_FLOW_ERROR_READ_METADATA)
+    return 0;
+  return write_ab_state(ops, data, &state);
+}
@@ -26,14 +26,23 @@ extern "C" {
 /* Magic for the Brillo Uefi metadata header */
 #define BUB_BOOT_CTRL_MAGIC {'B', 'U', 'E', 'F'}
 
-/* The current major and minor versions used for AB metadata structs */
+/* The current major and minor versions used for AB metadata structs. Minor
+ * version 0 has exactly two slots, minor version 1 adds |num_slots|.
+ */
 #define BUB_MAJOR_VERSION 1
-#define BUB_MINOR_VERSION 0
+#define BUB_MINOR_VERSION 1
 
 #define BUB_BLOCK_SIZE 512
 #define BUB_AB_DATA_SIZE 64
 #define BUB_SUFFIX_SIZE 3
 
+/* Most slots BubAbData can hold. Slot i has the suffix "_a" + i, so "_a",
+ * "_b", "_c" and so on.
+ */
+#define BUB_AB_MAX_SLOTS 6
+/* Slots of metadata with minor version 0, and after a reset. */
+#define BUB_AB_DEFAULT_NUM_SLOTS 2
+
 typedef enum {
   BUB_AB_FLOW_RESULT_OK,
   BUB_AB_FLOW_ERROR_INPUT,
@@ -68,20 +77,129 @@ typedef struct {
     uint8_t minor_version;
     // Reserved for slot alignment.
     uint8_t reserved1[2];
-    // Per-slot information.
-    BubSlotData slots[2];
+    // Per-slot information. Only the first |num_slots| are used; slots 0
+    // and 1 are at the same place in every minor version.
+    BubSlotData slots[BUB_AB_MAX_SLOTS];
+    // Number of slots, from 1 to BUB_AB_MAX_SLOTS. Zero and ignored in
+    // minor version 0, which always has two slots.
+    uint8_t num_slots;
     // Reserved for further use.
-    uint8_t reserved2[36];
+    uint8_t reserved2[3];
     // CRC32 of all 60 bytes preceding this field.
     uint32_t crc32;
 } __attribute__((__packed__)) BubAbData;
 
 
+/* Magic for records of the A/B metadata log */
+#define BUB_AB_LOG_MAGIC {'B', 'U', 'B', 'L'}
+
+/* Layout of the A/B metadata log in the 1 MiB misc partition. The BubAbData
+ * at offset 0 is no longer written by the boot loader; it is still read so
+ * that tools and Boot Control HALs writing it keep working.
+ */
+#define BUB_AB_LOG_OFFSET 4096
+#define BUB_AB_LOG_RECORD_STRIDE 4096
+#define BUB_AB_LOG_NUM_RECORDS 255
+#define BUB_AB_LOG_RECORD_SIZE 80
+
+/* A/B metadata log record
+ *
+ * Every metadata update is appended as one of these to a ring of
+ * BUB_AB_LOG_NUM_RECORDS slots, each in its own BUB_AB_LOG_RECORD_STRIDE
+ * bytes, so that no two updates in a row write the same block and an
+ * interrupted write leaves the previous record intact. Big-endian order is
+ * used.
+ */
+typedef struct {
+    // Log record magic number (see BUB_AB_LOG_MAGIC).
+    uint8_t magic[4];
+    // One more than the sequence number of the previous record.
+    uint32_t sequence;
+    // CRC32 of the 64 bytes at offset 0 of misc when this record was
+    // written. If the BubAbData there changes, it is newer than the log.
+    uint32_t legacy_crc32;
+    // Metadata, including its own crc32.
+    BubAbData data;
+    // CRC32 of all 76 bytes preceding this field.
+    uint32_t crc32;
+} __attribute__((__packed__)) BubAbLogRecord;
+
 #if defined(__GNUC__) && __GNUC__ >= 4 && __GNUC_MINOR__ >= 6
  _Static_assert(sizeof(BubAbData) == BUB_AB_DATA_SIZE,
                 "BubAbData has wrong size!");
+ _Static_assert(sizeof(BubAbLogRecord) == BUB_AB_LOG_RECORD_SIZE,
+                "BubAbLogRecord has wrong size!");
 #endif
 
+/* Position of the latest record in the A/B metadata log. */
+typedef struct {
+  // Slot of the latest log record, -1 if the log is empty.
+  int head;
+  // Sequence number of the latest log record.
+  uint32_t sequence;
+  // CRC32 of the 64 bytes at offset 0 of misc.
+  uint32_t legacy_crc32;
+} BubAbLogState;
+
+/* A/B metadata of one boot, read from misc once by bub_ab_session_load().
+ * Slot selection and invalidation only change |data| and set |dirty|; the
+ * result reaches misc with bub_ab_session_flush(), at most once per boot
+ * attempt.
+ */
+typedef struct {
+  BubOps* ops;
+  // Metadata in host byte order.
+  BubAbData data;
+  // Where the next write goes in the metadata log.
+  BubAbLogState log;
+  // Non-zero if |data| differs from misc.
+  int dirty;
+} BubAbSession;
+
+/* Reads the A/B metadata from the "misc" partition of |ops| into |session|,
+ * see bub_read_ab_data_from_misc(). If the metadata is invalid, |session|
+ * is reset to an 'updating' state with BUB_AB_DEFAULT_NUM_SLOTS slots that
+ * all have tries remaining;
+ * like any other change, that is only written by bub_ab_session_flush().
+ *
+ * @return: BUB_AB_FLOW_RESULT_OK on success.
+ *          BUB_AB_FLOW_ERROR_INVALID_METADATA if the metadata was reset.
+ *          BUB_AB_FLOW_ERROR_READ_METADATA on i/o error, in which case
+ *          |session| must not be used further.
+ */
+BubAbFlowResult bub_ab_session_load(BubAbSession* session, BubOps* ops);
+
+/* Normalizes the slot states of |session|, chooses the bootable slot with
+ * the highest priority, the lowest index among equals, and decrements its
+ * "tries remaining" attribute, all in memory and in one pass over the
+ * slots. The suffix of the slot, including a terminating NUL-byte, is
+ * written to |out_selected_suffix|, which must hold at least
+ * |suffix_num_bytes| >= 3 bytes.
+ *
+ * @return: BUB_AB_FLOW_RESULT_OK on success,
+ *          BUB_AB_FLOW_ERROR_NO_VALID_SLOTS if no slot is bootable.
+ */
+BubAbFlowResult bub_ab_session_select(BubAbSession* session,
+                                      char* out_selected_suffix,
+                                      size_t suffix_num_bytes);
+
+/* Marks the slot with |invalid_suffix| invalid in |session|, see
+ * bub_ab_mark_as_invalid(). The slot index is taken from the suffix, so
+ * this does not depend on the number of slots.
+ *
+ * @return: non-zero on success, zero if there is no such slot.
+ */
+int bub_ab_session_mark_as_invalid(BubAbSession* session,
+                                   const char* invalid_suffix);
+
+/* Writes the metadata of |session| to misc if it changed since it was
+ * loaded or last flushed. Must be called before control leaves the boot
+ * loader, whether by starting a kernel or on a fatal error.
+ *
+ * @return: non-zero on success, zero on i/o error.
+ */
+int bub_ab_session_flush(BubAbSession* session);
+
 /* A/B flow logic for Brillo booting. Reads A/B metadata from the 'misc'
  * partition and validates it. Chooses a bootable slot based on its state. Upon
  * finding the bootable slot, its "tries remaining" attribute is decremented
@@ -90,8 +208,9 @@ typedef struct {
  * |out_selected_suffix| on success. Caller must specify the size of the
  * |out_selected_suffix| in |suffix_num_bytes| which must be at least 3
  * otherwise aborting the program. If BUB_AB_FLOW_INVALID_AB_METADATA is
- * returned, metadata on disk will be reset to an 'updating' state where both
- * slots have tries remaining to reattempt booting.
+ * returned, metadata on disk will be reset to an 'updating' state where all
+ * slots have tries remaining to reattempt booting. This is a whole
+ * BubAbSession in one call, for callers that boot only one slot.
  *
  * @return: BUB_AB_FLOW_RESULT_OK on success. BUB_AB_FLOW_INVALID_AB_METADATA
  *          if AB metadata is invalid. BUB_AB_FLOW_RESULT_ERROR if no available
@@ -104,27 +223,30 @@ BubAbFlowResult bub_ab_flow(BubOps* ops,
 
 /* Marks a boot slot with |invalid_suffix| invalid by assigning zero to its
  * priority, tries_remaining, and successful_boot member variables. Caller
- * must pass |invalid_suffix| as a NUL_terminated string with length 2.
+ * must pass |invalid_suffix| as a NUL_terminated string with length 2, one
+ * of the suffixes of the slots in use.
  *
- * @return: 0 on success. 1 on failure.
+ * @return: non-zero on success, zero on failure.
  */
 int bub_ab_mark_as_invalid(BubOps* ops, const char *invalid_suffix);
 
 /* Helper function to read and check validity of AB metadata using |ops|
  * read_from_partition method.  Will read from "misc" partition and assign
- * fields to |data| in host byte order. Checks magic field matches expected
- * value and calculates crc32.
+ * fields to |data| in host byte order. The latest valid record of the
+ * metadata log is used, unless the BubAbData at offset 0 is valid and has
+ * been rewritten since that record. Checks magic field matches expected
+ * value, calculates crc32 and checks the number of slots.
  *
  * @return: BUB_AB_FLOW_ERROR_READ_METADATA on i/o error.
- *          BUB_AB_FLOW_ERROR_INVALID_METADATA if magic or crc are not
- *          correct. BUB_AB_FLOW_RESULT_OK on success.
+ *          BUB_AB_FLOW_ERROR_INVALID_METADATA if neither the log nor the
+ *          data at offset 0 are valid. BUB_AB_FLOW_RESULT_OK on success.
  *
  */
 BubAbFlowResult bub_read_ab_data_from_misc(BubOps* ops, BubAbData* data);
 
 /* Helper function to write AB metadata using |ops| write_to_partition method.
- * Will write to "misc" partition and assign fields to |data| in big-endian byte
- * order. Calculates crc32 as well.
+ * Will append |data| to the metadata log in the "misc" partition, assigning
+ * fields in big-endian byte order. Calculates crc32 as well.
  *
  * @return: 0 on i/o error, 1 on success.
  *
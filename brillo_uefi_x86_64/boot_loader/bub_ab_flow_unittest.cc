@@ -27,17 +27,26 @@
     GenerateMiscImage(&init);                                                 \
   } while(0)
 
+/* Runs bub_ab_flow() and checks its result and the number of misc partition
+ * reads and writes it did. Loading the metadata reads offset 0 and the
+ * first slot of the metadata log, then either the last slot if the log is
+ * empty or 7 to 8 slots for the binary search.
+ */
 #define test_ab_flow(a_priority, a_tries_remaining, a_successful_boot,        \
                      b_priority, b_tries_remaining, b_successful_boot,        \
-                     expected_result, expected_suffix)                        \
+                     expected_result, expected_suffix,                        \
+                     expected_reads, expected_writes)                         \
   do {                                                                        \
     char suffix[BUB_SUFFIX_SIZE] = {0};                                       \
     BubAbData ab_result;                                                      \
     ops_.write_ab_metadata(&ab_result, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,       \
                            a_priority, a_tries_remaining, a_successful_boot,  \
                            b_priority, b_tries_remaining, b_successful_boot); \
+    ops_.reset_io_counts();                                                   \
     EXPECT_EQ(expected_result,                                                \
               bub_ab_flow((BubOps*)ops_.bub_ops(), suffix, BUB_SUFFIX_SIZE)); \
+    EXPECT_EQ(expected_reads, ops_.num_reads);                                \
+    EXPECT_EQ(expected_writes, ops_.num_writes);                              \
     EXPECT_EQ(0, bub_memcmp(expected_suffix, suffix, BUB_SUFFIX_SIZE));       \
     EXPECT_EQ(0, CompareMiscImage(ab_result));                                \
   } while (0)
@@ -82,7 +91,8 @@ TEST_F(AbTest, NoValidSlots) {
   test_ab_flow(
     0, 0, 0, 0, 0, 0,                   // Expected A/B state.
     BUB_AB_FLOW_ERROR_NO_VALID_SLOTS,   // Expected A/B result.
-    "\0\0");                            // Expected A/B suffix.
+    "\0\0",                             // Expected A/B suffix.
+    3, 0);                              // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, InvalidMetadataMagicInvalidSlots) {
@@ -109,7 +119,8 @@ TEST_F(AbTest, InvalidMetadataMagicInvalidSlots) {
   test_ab_flow(
     15, 6, 0, 15, 7, 0,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");
+    "_a",                  // Expected A/B suffix.
+    9, 1);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, InvalidMetadataMagicValidSlots) {
@@ -136,7 +147,8 @@ TEST_F(AbTest, InvalidMetadataMagicValidSlots) {
   test_ab_flow(
     15, 6, 0, 15, 7, 0,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    9, 1);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, SingleSuccessfulSlot) {
@@ -145,7 +157,8 @@ TEST_F(AbTest, SingleSuccessfulSlot) {
   test_ab_flow(
     14, 0, 1, 0, 0, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    3, 0);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, SingleTryingSlot) {
@@ -154,7 +167,8 @@ TEST_F(AbTest, SingleTryingSlot) {
   test_ab_flow(
     14, 2, 0, 0, 0, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    3, 1);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, TwoValidSlotsA) {
@@ -163,7 +177,8 @@ TEST_F(AbTest, TwoValidSlotsA) {
   test_ab_flow(
     15, 0, 1, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    3, 0);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, TwoValidSlotsB) {
@@ -172,7 +187,8 @@ TEST_F(AbTest, TwoValidSlotsB) {
   test_ab_flow(
     14, 0, 1, 15, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    3, 0);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, TryingFallback) {
@@ -182,43 +198,51 @@ TEST_F(AbTest, TryingFallback) {
   test_ab_flow(
     15, 6, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    3, 1);                 // Expected misc reads and writes.
 
   test_ab_flow(
     15, 5, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    9, 1);                 // Expected misc reads and writes.
 
   test_ab_flow(
     15, 4, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 3, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 2, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 1, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 0, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   // Should revert to slot b.
   test_ab_flow(
     0, 0, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, TryingNoFallbackRecovery) {
@@ -228,42 +252,50 @@ TEST_F(AbTest, TryingNoFallbackRecovery) {
   test_ab_flow(
     15, 6, 0, 0, 0, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    3, 1);                 // Expected misc reads and writes.
 
   test_ab_flow(
     15, 5, 0, 0, 0, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    9, 1);                 // Expected misc reads and writes.
 
   test_ab_flow(
     15, 4, 0, 0, 0, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 3, 0, 0, 0, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 2, 0, 0, 0, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 1, 0, 0, 0, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 0, 0, 0, 0, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     0, 0, 0, 0, 0, 0,                // Expected A/B state.
     BUB_AB_FLOW_ERROR_NO_VALID_SLOTS, // Expected A/B result.
-    "\0\0");                          // Expected A/B suffix.
+    "\0\0",                           // Expected A/B suffix.
+    10, 1);                           // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, SingleTryingSuccess) {
@@ -276,37 +308,44 @@ TEST_F(AbTest, SingleTryingSuccess) {
   test_ab_flow(
     15, 6, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    3, 1);                 // Expected misc reads and writes.
 
   test_ab_flow(
     15, 5, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    9, 1);                 // Expected misc reads and writes.
 
   test_ab_flow(
     15, 4, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 3, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 2, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 1, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 0, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   // Boot Control HAL should do this.
   ab_init(BUB_BOOT_CTRL_MAGIC, 15, 0, 1, 14, 0, 1);
@@ -314,13 +353,15 @@ TEST_F(AbTest, SingleTryingSuccess) {
   test_ab_flow(
     15, 0, 1, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    3, 0);                 // Expected misc reads and writes.
 
   // Should not have changed still.
   test_ab_flow(
     15, 0, 1, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    3, 0);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, TwoTryingRecovery) {
@@ -330,37 +371,44 @@ TEST_F(AbTest, TwoTryingRecovery) {
   test_ab_flow(
     15, 6, 0, 14, 7, 0,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    3, 1);                 // Expected misc reads and writes.
 
   test_ab_flow(
     15, 5, 0, 14, 7, 0,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    9, 1);                 // Expected misc reads and writes.
 
   test_ab_flow(
     15, 4, 0, 14, 7, 0,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 3, 0, 14, 7, 0,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 2, 0, 14, 7, 0,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 1, 0, 14, 7, 0,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     15, 0, 0, 14, 7, 0,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   // At this point a should have run out of tries, so we expect the other
   // updating slot to be chosen.
@@ -369,42 +417,50 @@ TEST_F(AbTest, TwoTryingRecovery) {
   test_ab_flow(
     0, 0, 0, 14, 6, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     0, 0, 0, 14, 5, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     0, 0, 0, 14, 4, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     0, 0, 0, 14, 3, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     0, 0, 0, 14, 2, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     0, 0, 0, 14, 1, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     0, 0, 0, 14, 0, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    10, 1);                // Expected misc reads and writes.
 
   test_ab_flow(
     0, 0, 0, 0, 0, 0,                 // Expected A/B state.
     BUB_AB_FLOW_ERROR_NO_VALID_SLOTS, // Expected A/B result.
-    "\0\0");                          // Expected A/B suffix.
+    "\0\0",                           // Expected A/B suffix.
+    10, 1);                           // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, MarkedInvalidFallback) {
@@ -414,7 +470,8 @@ TEST_F(AbTest, MarkedInvalidFallback) {
   test_ab_flow(
     15, 0, 1, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    3, 0);                 // Expected misc reads and writes.
 
   // Invalidate slot a. We expect this slot to be all zero values with slot b
   // unchanged.
@@ -424,7 +481,8 @@ TEST_F(AbTest, MarkedInvalidFallback) {
   test_ab_flow(
      0, 0, 0, 14, 0, 1,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    9, 0);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, ValidAndInvalidHigherPriority) {
@@ -434,7 +492,8 @@ TEST_F(AbTest, ValidAndInvalidHigherPriority) {
   test_ab_flow(
     14, 0, 1, 0, 0, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_a");                 // Expected A/B suffix.
+    "_a",                  // Expected A/B suffix.
+    3, 1);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, ValidAndUpdatingBadSuccessfulBoot) {
@@ -444,7 +503,8 @@ TEST_F(AbTest, ValidAndUpdatingBadSuccessfulBoot) {
   test_ab_flow(
     14, 0, 1, 15, 6, 0,    // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    3, 1);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, InvalidBadTriesRemainingAndValid) {
@@ -454,7 +514,8 @@ TEST_F(AbTest, InvalidBadTriesRemainingAndValid) {
   test_ab_flow(
     0, 0, 0, 14, 0, 1,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    3, 1);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, InvalidBadSuccessfulBootandValid) {
@@ -464,7 +525,8 @@ TEST_F(AbTest, InvalidBadSuccessfulBootandValid) {
   test_ab_flow(
     0, 0, 0, 14, 0, 1,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
+    "_b",                  // Expected A/B suffix.
+    3, 1);                 // Expected misc reads and writes.
 }
 
 TEST_F(AbTest, InvalidTriesBootAndUpdatingBadSuccessfulBoot) {
@@ -474,5 +536,463 @@ TEST_F(AbTest, InvalidTriesBootAndUpdatingBadSuccessfulBoot) {
   test_ab_flow(
     0, 0, 0, 15, 6, 0,     // Expected A/B state.
     BUB_AB_FLOW_RESULT_OK, // Expected A/B result.
-    "_b");                 // Expected A/B suffix.
-}
\ No newline at end of file
+    "_b",                  // Expected A/B suffix.
+    3, 1);                 // Expected misc reads and writes.
+}
+
+// Reads the raw metadata log record in |slot| of the misc image.
+static void read_log_record(MyOps* ops, int slot, BubAbLogRecord* record) {
+  size_t num_read;
+  memset(record, 0, sizeof(BubAbLogRecord));
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            ops->read_from_partition("misc", record,
+                                     BUB_AB_LOG_OFFSET +
+                                       slot * BUB_AB_LOG_RECORD_STRIDE,
+                                     sizeof(BubAbLogRecord), &num_read));
+}
+
+// Overwrites the BubAbData at offset 0 in place, the way a Boot Control HAL
+// unaware of the metadata log would.
+static void write_legacy_metadata(MyOps* ops, const BubAbData* data) {
+  BubAbData data_be;
+  memcpy(&data_be, data, sizeof(BubAbData));
+  data_be.crc32 = 0;
+  data_be.crc32 = bub_be32toh(bub_crc32(0, &data_be, sizeof(BubAbData)));
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            ops->write_to_partition("misc", &data_be, 0, sizeof(BubAbData)));
+}
+
+TEST_F(AbTest, LogAppendsInsteadOfRewriting) {
+  ab_init(BUB_BOOT_CTRL_MAGIC, 15, 7, 0, 14, 0, 1);
+  std::string legacy_before;
+  ASSERT_TRUE(base::ReadFileToString(testdir_.Append("misc.img"),
+                                     &legacy_before));
+
+  test_ab_flow(15, 6, 0, 14, 0, 1, BUB_AB_FLOW_RESULT_OK, "_a", 3, 1);
+  test_ab_flow(15, 5, 0, 14, 0, 1, BUB_AB_FLOW_RESULT_OK, "_a", 9, 1);
+  test_ab_flow(15, 4, 0, 14, 0, 1, BUB_AB_FLOW_RESULT_OK, "_a", 10, 1);
+
+  // Each boot wrote the next slot; offset 0 is untouched.
+  for (int slot = 0; slot < 3; ++slot) {
+    BubAbLogRecord record;
+    read_log_record(&ops_, slot, &record);
+    EXPECT_EQ(0, memcmp(record.magic, "BUBL", 4));
+    EXPECT_EQ((uint32_t)slot + 1, bub_be32toh(record.sequence));
+    EXPECT_EQ(6 - slot, record.data.slots[0].tries_remaining);
+  }
+  std::string misc;
+  ASSERT_TRUE(base::ReadFileToString(testdir_.Append("misc.img"), &misc));
+  EXPECT_EQ(legacy_before, misc.substr(0, sizeof(BubAbData)));
+}
+
+TEST_F(AbTest, LogWrapsAround) {
+  ab_init(BUB_BOOT_CTRL_MAGIC, 15, 7, 0, 14, 0, 1);
+
+  BubAbData data;
+  BubAbData actual;
+  for (int n = 0; n < BUB_AB_LOG_NUM_RECORDS + 2; ++n) {
+    ops_.write_ab_metadata(&data, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                           n % 15 + 1, n % 8, 0, 14, 0, 1);
+    ASSERT_EQ(1, bub_write_ab_data_to_misc(ops_.bub_ops(), &data));
+    ASSERT_EQ(BUB_AB_FLOW_RESULT_OK,
+              bub_read_ab_data_from_misc(ops_.bub_ops(), &actual));
+    ASSERT_EQ(n % 15 + 1, actual.slots[0].priority);
+    ASSERT_EQ(n % 8, actual.slots[0].tries_remaining);
+  }
+
+  // The last two records went to the first two slots again.
+  BubAbLogRecord record;
+  read_log_record(&ops_, 1, &record);
+  EXPECT_EQ((uint32_t)BUB_AB_LOG_NUM_RECORDS + 2,
+            bub_be32toh(record.sequence));
+  read_log_record(&ops_, 2, &record);
+  EXPECT_EQ(3U, bub_be32toh(record.sequence));
+}
+
+TEST_F(AbTest, LogTornWriteKeepsPreviousState) {
+  ab_init(BUB_BOOT_CTRL_MAGIC, 15, 7, 0, 14, 0, 1);
+  test_ab_flow(15, 6, 0, 14, 0, 1, BUB_AB_FLOW_RESULT_OK, "_a", 3, 1);
+  test_ab_flow(15, 5, 0, 14, 0, 1, BUB_AB_FLOW_RESULT_OK, "_a", 9, 1);
+
+  // Power cut while writing the second record.
+  uint8_t garbage[40];
+  memset(garbage, 0xa5, sizeof(garbage));
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            ops_.write_to_partition("misc", garbage,
+                                    BUB_AB_LOG_OFFSET +
+                                      BUB_AB_LOG_RECORD_STRIDE + 40,
+                                    sizeof(garbage)));
+  BubAbData expected;
+  ops_.write_ab_metadata(&expected, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                         15, 6, 0, 14, 0, 1);
+  EXPECT_EQ(0, CompareMiscImage(expected));
+
+  // The next boot counts from the surviving record.
+  test_ab_flow(15, 5, 0, 14, 0, 1, BUB_AB_FLOW_RESULT_OK, "_a", 9, 1);
+  BubAbLogRecord record;
+  read_log_record(&ops_, 1, &record);
+  EXPECT_EQ(2U, bub_be32toh(record.sequence));
+}
+
+TEST_F(AbTest, LogLegacyRewriteTakesPrecedence) {
+  ab_init(BUB_BOOT_CTRL_MAGIC, 15, 7, 0, 14, 0, 1);
+  test_ab_flow(15, 6, 0, 14, 0, 1, BUB_AB_FLOW_RESULT_OK, "_a", 3, 1);
+
+  // Boot Control HAL marks slot a successful at offset 0.
+  BubAbData legacy;
+  ops_.write_ab_metadata(&legacy, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                         15, 0, 1, 14, 0, 1);
+  write_legacy_metadata(&ops_, &legacy);
+  test_ab_flow(15, 0, 1, 14, 0, 1, BUB_AB_FLOW_RESULT_OK, "_a", 9, 0);
+
+  // Once migrated into the log, updates are appended again.
+  ops_.write_ab_metadata(&legacy, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                         14, 0, 1, 15, 7, 0);
+  write_legacy_metadata(&ops_, &legacy);
+  test_ab_flow(14, 0, 1, 15, 6, 0, BUB_AB_FLOW_RESULT_OK, "_b", 9, 1);
+  test_ab_flow(14, 0, 1, 15, 5, 0, BUB_AB_FLOW_RESULT_OK, "_b", 10, 1);
+}
+
+TEST_F(AbTest, LogSurvivesCorruptLegacy) {
+  ab_init(BUB_BOOT_CTRL_MAGIC, 15, 7, 0, 14, 0, 1);
+  test_ab_flow(15, 6, 0, 14, 0, 1, BUB_AB_FLOW_RESULT_OK, "_a", 3, 1);
+
+  uint8_t zeros[BUB_AB_DATA_SIZE] = {0};
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            ops_.write_to_partition("misc", zeros, 0, sizeof(zeros)));
+  test_ab_flow(15, 5, 0, 14, 0, 1, BUB_AB_FLOW_RESULT_OK, "_a", 9, 1);
+}
+
+TEST_F(AbTest, SessionInvalidSlotThenBoot) {
+  ab_init(BUB_BOOT_CTRL_MAGIC, 15, 7, 0, 14, 7, 0);
+  char suffix[BUB_SUFFIX_SIZE] = {0};
+  BubAbSession session;
+
+  ops_.reset_io_counts();
+  ASSERT_EQ(BUB_AB_FLOW_RESULT_OK,
+            bub_ab_session_load(&session, ops_.bub_ops()));
+  EXPECT_EQ(3, ops_.num_reads);
+
+  // Slot a fails to load and slot b is tried next, all in memory.
+  ASSERT_EQ(BUB_AB_FLOW_RESULT_OK,
+            bub_ab_session_select(&session, suffix, BUB_SUFFIX_SIZE));
+  EXPECT_STREQ("_a", suffix);
+  ASSERT_NE(0, bub_ab_session_mark_as_invalid(&session, suffix));
+  ASSERT_EQ(BUB_AB_FLOW_RESULT_OK,
+            bub_ab_session_select(&session, suffix, BUB_SUFFIX_SIZE));
+  EXPECT_STREQ("_b", suffix);
+  EXPECT_EQ(3, ops_.num_reads);
+  EXPECT_EQ(0, ops_.num_writes);
+
+  // One write before the kernel starts, none for a repeated flush.
+  EXPECT_NE(0, bub_ab_session_flush(&session));
+  EXPECT_NE(0, bub_ab_session_flush(&session));
+  EXPECT_EQ(3, ops_.num_reads);
+  EXPECT_EQ(1, ops_.num_writes);
+
+  BubAbData expected;
+  ops_.write_ab_metadata(&expected, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                         0, 0, 0, 14, 6, 0);
+  EXPECT_EQ(0, CompareMiscImage(expected));
+}
+
+TEST_F(AbTest, SessionNoValidSlotsFlushesNormalization) {
+  ab_init(BUB_BOOT_CTRL_MAGIC, 0, 0, 1, 0, 3, 0);
+  char suffix[BUB_SUFFIX_SIZE] = {0};
+  BubAbSession session;
+
+  ASSERT_EQ(BUB_AB_FLOW_RESULT_OK,
+            bub_ab_session_load(&session, ops_.bub_ops()));
+  EXPECT_EQ(BUB_AB_FLOW_ERROR_NO_VALID_SLOTS,
+            bub_ab_session_select(&session, suffix, BUB_SUFFIX_SIZE));
+  ops_.reset_io_counts();
+  EXPECT_NE(0, bub_ab_session_flush(&session));
+  EXPECT_EQ(0, ops_.num_reads);
+  EXPECT_EQ(1, ops_.num_writes);
+
+  BubAbData expected;
+  ops_.write_ab_metadata(&expected, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                         0, 0, 0, 0, 0, 0);
+  EXPECT_EQ(0, CompareMiscImage(expected));
+}
+
+TEST_F(AbTest, SessionInvalidMetadataResetOnFlush) {
+  BubAbData ab_init;
+  BubAbSession session;
+
+  ops_.write_ab_metadata(&ab_init, (uint8_t[4]){'N','O','P','E'},
+                         15, 7, 0, 15, 7, 0);
+  GenerateMiscImage(&ab_init);
+
+  ops_.reset_io_counts();
+  EXPECT_EQ(BUB_AB_FLOW_ERROR_INVALID_METADATA,
+            bub_ab_session_load(&session, ops_.bub_ops()));
+  EXPECT_EQ(0, ops_.num_writes);
+  EXPECT_NE(0, bub_ab_session_flush(&session));
+  EXPECT_EQ(3, ops_.num_reads);
+  EXPECT_EQ(1, ops_.num_writes);
+
+  BubAbData expected;
+  ops_.write_ab_metadata(&expected, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                         15, 7, 0, 15, 7, 0);
+  EXPECT_EQ(0, CompareMiscImage(expected));
+}
+
+// Writes a misc image with the first |num_slots| of |slots| in use.
+#define ab_init_slots(slots, num_slots)                                       \
+  do {                                                                        \
+    BubAbData init;                                                           \
+    ops_.write_ab_metadata(&init, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,            \
+                           slots, num_slots);                                 \
+    GenerateMiscImage(&init);                                                 \
+  } while (0)
+
+TEST_F(AbTest, ThreeSlotsGoldenFallback) {
+  BubSlotData slots[3] = {{15, 1, 0, {0}}, {14, 0, 0, {0}}, {1, 0, 1, {0}}};
+  char suffix[BUB_SUFFIX_SIZE] = {0};
+  BubAbData expected;
+
+  ab_init_slots(slots, 3);
+  ops_.reset_io_counts();
+  EXPECT_EQ(BUB_AB_FLOW_RESULT_OK,
+            bub_ab_flow(ops_.bub_ops(), suffix, BUB_SUFFIX_SIZE));
+  EXPECT_STREQ("_a", suffix);
+  EXPECT_EQ(3, ops_.num_reads);
+  EXPECT_EQ(1, ops_.num_writes);
+
+  // Slot a ran out of tries and slot b never succeeded, so the golden slot
+  // is left.
+  EXPECT_EQ(BUB_AB_FLOW_RESULT_OK,
+            bub_ab_flow(ops_.bub_ops(), suffix, BUB_SUFFIX_SIZE));
+  EXPECT_STREQ("_c", suffix);
+  BubSlotData expected_slots[3] = {{0, 0, 0, {0}}, {0, 0, 0, {0}},
+                                   {1, 0, 1, {0}}};
+  ops_.write_ab_metadata(&expected, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                         expected_slots, 3);
+  EXPECT_EQ(0, CompareMiscImage(expected));
+
+  EXPECT_NE(0, bub_ab_mark_as_invalid(ops_.bub_ops(), "_c"));
+  EXPECT_EQ(BUB_AB_FLOW_ERROR_NO_VALID_SLOTS,
+            bub_ab_flow(ops_.bub_ops(), suffix, BUB_SUFFIX_SIZE));
+  EXPECT_EQ(0, bub_ab_mark_as_invalid(ops_.bub_ops(), "_d"));
+}
+
+TEST_F(AbTest, MinorVersionZeroHasTwoSlots) {
+  BubSlotData slots[3] = {{0, 0, 0, {0}}, {0, 0, 0, {0}}, {15, 0, 1, {0}}};
+  char suffix[BUB_SUFFIX_SIZE] = {0};
+  BubAbData data;
+  BubAbData actual;
+
+  ops_.write_ab_metadata(&data, (uint8_t[4])BUB_BOOT_CTRL_MAGIC, slots, 3);
+  data.minor_version = 0;
+  data.num_slots = 0;
+  GenerateMiscImage(&data);
+
+  EXPECT_EQ(BUB_AB_FLOW_ERROR_NO_VALID_SLOTS,
+            bub_ab_flow(ops_.bub_ops(), suffix, BUB_SUFFIX_SIZE));
+  EXPECT_EQ(0, bub_ab_mark_as_invalid(ops_.bub_ops(), "_c"));
+
+  // Updates keep the version they were read with.
+  slots[1].priority = 14;
+  slots[1].tries_remaining = 2;
+  ops_.write_ab_metadata(&data, (uint8_t[4])BUB_BOOT_CTRL_MAGIC, slots, 3);
+  data.minor_version = 0;
+  data.num_slots = 0;
+  GenerateMiscImage(&data);
+  EXPECT_EQ(BUB_AB_FLOW_RESULT_OK,
+            bub_ab_flow(ops_.bub_ops(), suffix, BUB_SUFFIX_SIZE));
+  EXPECT_STREQ("_b", suffix);
+  ASSERT_EQ(BUB_AB_FLOW_RESULT_OK,
+            bub_read_ab_data_from_misc(ops_.bub_ops(), &actual));
+  EXPECT_EQ(0, actual.minor_version);
+  EXPECT_EQ(1, actual.slots[1].tries_remaining);
+}
+
+TEST_F(AbTest, BadNumSlotsResets) {
+  BubSlotData slots[BUB_AB_MAX_SLOTS] = {{15, 0, 1, {0}}};
+  char suffix[BUB_SUFFIX_SIZE] = {0};
+  BubAbData data;
+  BubAbData expected;
+
+  ops_.write_ab_metadata(&expected, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                         15, 7, 0, 15, 7, 0);
+  for (uint8_t num_slots : {0, BUB_AB_MAX_SLOTS + 1, 255}) {
+    SCOPED_TRACE(num_slots);
+    ops_.write_ab_metadata(&data, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                           slots, BUB_AB_MAX_SLOTS);
+    data.num_slots = num_slots;
+    GenerateMiscImage(&data);
+    EXPECT_EQ(BUB_AB_FLOW_ERROR_INVALID_METADATA,
+              bub_ab_flow(ops_.bub_ops(), suffix, BUB_SUFFIX_SIZE));
+    EXPECT_EQ(0, CompareMiscImage(expected));
+  }
+}
+
+TEST(AbSessionTest, MarkAsInvalidBySuffix) {
+  BubAbSession session;
+
+  memset(&session, 0, sizeof(session));
+  session.data.minor_version = BUB_MINOR_VERSION;
+  session.data.num_slots = 4;
+  for (int i = 0; i < BUB_AB_MAX_SLOTS; ++i)
+    session.data.slots[i] = (BubSlotData){15, 0, 1, {0}};
+
+  EXPECT_NE(0, bub_ab_session_mark_as_invalid(&session, "_d"));
+  EXPECT_EQ(0, session.data.slots[3].priority);
+  EXPECT_EQ(15, session.data.slots[2].priority);
+  EXPECT_NE(0, session.dirty);
+
+  session.dirty = 0;
+  for (const char* suffix : {"_e", "_f", "_z", "_A", "__", "a_", "_a_"}) {
+    SCOPED_TRACE(suffix);
+    EXPECT_EQ(0, bub_ab_session_mark_as_invalid(&session, suffix));
+  }
+  EXPECT_EQ(0, session.dirty);
+  EXPECT_EQ(15, session.data.slots[4].priority);
+}
+
+/* Slot states the exhaustive test runs through: every combination of an
+ * unbootable, a low and a high priority, no, one and the most tries and
+ * both successful_boot values. That covers every normalization rule and
+ * ties between equal priorities.
+ */
+static const uint8_t kPriorities[] = {0, 1, 15};
+static const uint8_t kTries[] = {0, 1, 7};
+static const int kNumStates = 3 * 3 * 2;
+
+static BubSlotData slot_state(int n) {
+  BubSlotData slot;
+  memset(&slot, 0, sizeof(slot));
+  slot.priority = kPriorities[n % 3];
+  slot.tries_remaining = kTries[n / 3 % 3];
+  slot.successful_boot = n / 9;
+  return slot;
+}
+
+// State of |slot| after normalization, see bub_ab_session_select().
+static BubSlotData normalized(BubSlotData slot) {
+  if (slot.priority == 0 ||
+      (slot.tries_remaining == 0 && !slot.successful_boot)) {
+    memset(&slot, 0, sizeof(slot));
+  } else if (slot.tries_remaining > 0) {
+    slot.successful_boot = 0;
+  }
+  return slot;
+}
+
+TEST(AbSessionTest, SelectEverySlotStateUpToFourSlots) {
+  // Bootable slot past |num_slots| that must never be chosen or changed.
+  const BubSlotData unused = {15, 7, 1, {0}};
+
+  for (int num_slots = 1; num_slots <= 4; ++num_slots) {
+    int num_combinations = 1;
+    for (int i = 0; i < num_slots; ++i)
+      num_combinations *= kNumStates;
+
+    for (int n = 0; n < num_combinations; ++n) {
+      BubAbSession session;
+      BubSlotData expected[BUB_AB_MAX_SLOTS];
+      char suffix[BUB_SUFFIX_SIZE] = {'x', 'x', 'x'};
+      int expected_target = -1;
+      int expected_dirty = 0;
+      int i, state;
+
+      memset(&session, 0, sizeof(session));
+      session.data.minor_version = BUB_MINOR_VERSION;
+      session.data.num_slots = num_slots;
+      for (i = 0, state = n; i < BUB_AB_MAX_SLOTS; ++i, state /= kNumStates) {
+        session.data.slots[i] = i < num_slots ? slot_state(state % kNumStates)
+                                              : unused;
+        expected[i] = session.data.slots[i];
+        if (i >= num_slots)
+          continue;
+        expected[i] = normalized(expected[i]);
+        if (memcmp(&expected[i], &session.data.slots[i], sizeof(BubSlotData)))
+          expected_dirty = 1;
+        if (expected[i].priority > 0 &&
+            (expected_target < 0 ||
+             expected[i].priority > expected[expected_target].priority))
+          expected_target = i;
+      }
+      if (expected_target >= 0 && expected[expected_target].tries_remaining) {
+        expected[expected_target].tries_remaining--;
+        expected_dirty = 1;
+      }
+
+      SCOPED_TRACE(testing::Message() << num_slots << " slots, state " << n);
+      if (expected_target < 0) {
+        ASSERT_EQ(BUB_AB_FLOW_ERROR_NO_VALID_SLOTS,
+                  bub_ab_session_select(&session, suffix, BUB_SUFFIX_SIZE));
+        ASSERT_EQ(0, memcmp("\0\0", suffix, BUB_SUFFIX_SIZE));
+      } else {
+        ASSERT_EQ(BUB_AB_FLOW_RESULT_OK,
+                  bub_ab_session_select(&session, suffix, BUB_SUFFIX_SIZE));
+        ASSERT_EQ('_', suffix[0]);
+        ASSERT_EQ('a' + expected_target, suffix[1]);
+        ASSERT_EQ('\0', suffix[2]);
+      }
+      ASSERT_EQ(0, memcmp(expected, session.data.slots, sizeof(expected)));
+      ASSERT_EQ(expected_dirty, session.dirty);
+    }
+  }
+}
+
+// Boots a few times with |options| in a fresh directory and returns the
+// resulting misc image.
+static std::string run_ab_flow_with(const MyOps::Options& options) {
+  TempDir dir;
+  char suffix[BUB_SUFFIX_SIZE];
+  BubAbData init;
+  std::string misc;
+  uint8_t tail[8] = {0};
+  size_t num_read = 0;
+
+  EXPECT_FALSE(dir.path().empty());
+  {
+    MyOps ops(options);
+    ops.set_partition_dir(dir.path());
+    ops.write_ab_metadata(&init, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                          15, 2, 0, 14, 0, 1);
+    ops.make_metadata_image(&init, "misc.img");
+
+    for (int n = 0; n < 3; ++n)
+      EXPECT_EQ(BUB_AB_FLOW_RESULT_OK,
+                bub_ab_flow(ops.bub_ops(), suffix, BUB_SUFFIX_SIZE));
+    EXPECT_STREQ("_b", suffix);
+    EXPECT_NE(0, bub_ab_mark_as_invalid(ops.bub_ops(), "_b"));
+    EXPECT_EQ(BUB_AB_FLOW_ERROR_NO_VALID_SLOTS,
+              bub_ab_flow(ops.bub_ops(), suffix, BUB_SUFFIX_SIZE));
+
+    // Offsets from the end, and reads past it.
+    EXPECT_EQ(BUB_IO_RESULT_OK,
+              ops.write_to_partition("misc", "tail", -4, 4));
+    EXPECT_EQ(BUB_IO_RESULT_OK,
+              ops.read_from_partition("misc", tail, -6, 8, &num_read));
+    EXPECT_EQ(6U, num_read);
+    EXPECT_EQ(0, memcmp(tail + 2, "tail", 4));
+    EXPECT_TRUE(ops.sync_partitions());
+    EXPECT_EQ(BUB_IO_RESULT_ERROR_IO,
+              ops.read_from_partition("nope", tail, 0, 8, &num_read));
+  }
+  EXPECT_TRUE(base::ReadFileToString(dir.Append("misc.img"), &misc));
+  return misc;
+}
+
+TEST(MyOpsTest, BackendsAgree) {
+  MyOps::Options options;
+
+  options.backend = MyOps::BACKEND_OPEN_PER_CALL;
+  std::string expected = run_ab_flow_with(options);
+  EXPECT_EQ(BUB_AB_LOG_OFFSET + 3 * BUB_AB_LOG_RECORD_STRIDE +
+              BUB_AB_LOG_RECORD_SIZE,
+            expected.size());
+
+  for (MyOps::Backend backend : {MyOps::BACKEND_FD, MyOps::BACKEND_MMAP}) {
+    for (bool sync_writes : {false, true}) {
+      SCOPED_TRACE(testing::Message() << backend << " " << sync_writes);
+      options.backend = backend;
+      options.sync_writes = sync_writes;
+      EXPECT_EQ(expected, run_ab_flow_with(options));
+    }
+  }
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bub_arena.h"
+
+/* |top| of an arena without live allocations. */
+#define ARENA_NONE 0xFFFFFFFFU
+
+#define HEADER_ALLOCATED 0x416C6C6FU
+#define HEADER_FREED 0x46726565U
+
+/* Precedes every allocation. Its size keeps the allocation word-aligned. */
+typedef struct {
+  // Offset of the previous allocation's header, or ARENA_NONE.
+  uint32_t prev;
+  uint32_t state;
+} ArenaHeader;
+
+static BubArena* default_arena;
+
+static ArenaHeader* header_at(BubArena* arena, uint32_t offset) {
+  return (ArenaHeader*)(arena->base + offset);
+}
+
+/* Gives back the top of |arena| for as long as it is freed memory. */
+static void pop_freed(BubArena* arena) {
+  ArenaHeader* header;
+
+  while (arena->top != ARENA_NONE) {
+    header = header_at(arena, arena->top);
+    if (header->state != HEADER_FREED)
+      break;
+    arena->used = arena->top;
+    arena->top = header->prev;
+  }
+}
+
+void bub_arena_init(BubArena* arena, void* base, size_t size) {
+  bub_memset(arena, 0, sizeof(BubArena));
+  arena->base = (uint8_t*)base;
+  // Offsets are kept in 32 bits.
+  arena->size = size < ARENA_NONE ? size : ARENA_NONE - 1;
+  arena->top = ARENA_NONE;
+}
+
+void* bub_arena_alloc(BubArena* arena, size_t size) {
+  ArenaHeader* header;
+  size_t offset = arena->used;
+  size_t num_bytes;
+
+  num_bytes = sizeof(ArenaHeader) +
+              ((size + BUB_WORD_ALIGNMENT_SIZE - 1) &
+               ~(size_t)(BUB_WORD_ALIGNMENT_SIZE - 1));
+  if (size > arena->size || num_bytes > arena->size - offset) {
+    arena->num_failed++;
+    return NULL;
+  }
+
+  header = header_at(arena, (uint32_t)offset);
+  header->prev = arena->top;
+  header->state = HEADER_ALLOCATED;
+  arena->top = (uint32_t)offset;
+  arena->used = offset + num_bytes;
+  if (arena->used > arena->peak_used)
+    arena->peak_used = arena->used;
+  arena->num_allocs++;
+  return header + 1;
+}
+
+void bub_arena_free(BubArena* arena, void* ptr) {
+  ArenaHeader* header = (ArenaHeader*)ptr - 1;
+
+  if (!bub_arena_owns(arena, header) || header->state != HEADER_ALLOCATED) {
+    bub_warning("Bad bub_arena_free.\n");
+    return;
+  }
+  header->state = HEADER_FREED;
+  arena->num_frees++;
+  pop_freed(arena);
+}
+
+int bub_arena_owns(const BubArena* arena, const void* ptr) {
+  const uint8_t* p = (const uint8_t*)ptr;
+  return arena->base != NULL && p >= arena->base &&
+         p < arena->base + arena->used;
+}
+
+BubArenaMark bub_arena_mark(const BubArena* arena) {
+  BubArenaMark mark;
+  mark.used = arena->used;
+  mark.top = arena->top;
+  return mark;
+}
+
+void bub_arena_reset(BubArena* arena, BubArenaMark mark) {
+  bub_assert(mark.used <= arena->used);
+  arena->used = mark.used;
+  arena->top = mark.top;
+  pop_freed(arena);
+}
+
+void bub_arena_set_default(BubArena* arena) {
+  default_arena = arena;
+}
+
+BubArena* bub_arena_get_default(void) {
+  return default_arena;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUB_ARENA_H_
+#define BUB_ARENA_H_
+
+#include "bub_sysdeps.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size of the arena the UEFI boot loader sets up in bub_init(). */
+#define BUB_ARENA_SIZE (256 * 1024)
+
+/* Bump allocator over a caller-provided region. Every allocation carries a
+ * small header linking it to the previous one, so freeing the most recent
+ * allocation gives its space back, together with any older allocations
+ * already freed below it. Allocations freed out of order are reclaimed once
+ * everything above them is freed, or by bub_arena_reset().
+ */
+typedef struct {
+  uint8_t* base;
+  size_t size;
+  // Bytes in use, including headers and padding.
+  size_t used;
+  // Offset of the header of the most recent live allocation.
+  uint32_t top;
+
+  // Statistics for debug output.
+  uint32_t num_allocs;
+  uint32_t num_frees;
+  // Allocations that did not fit and were left to the caller.
+  uint32_t num_failed;
+  size_t peak_used;
+} BubArena;
+
+/* Position in an arena to return to with bub_arena_reset(). */
+typedef struct {
+  size_t used;
+  uint32_t top;
+} BubArenaMark;
+
+/* Sets up |arena| to allocate from the |size| bytes at |base|, which must
+ * be word-aligned. Statistics are cleared.
+ */
+void bub_arena_init(BubArena* arena, void* base, size_t size);
+
+/* Allocates |size| bytes from |arena|. The memory is word-aligned and not
+ * initialized.
+ *
+ * @return NULL if |arena| does not have room.
+ */
+void* bub_arena_alloc(BubArena* arena, size_t size);
+
+/* Frees |ptr|, previously returned by bub_arena_alloc() on |arena|. */
+void bub_arena_free(BubArena* arena, void* ptr);
+
+/* @return non-zero if |ptr| points into the region of |arena|. */
+int bub_arena_owns(const BubArena* arena, const void* ptr);
+
+/* @return the current position of |arena|. */
+BubArenaMark bub_arena_mark(const BubArena* arena);
+
+/* Frees everything allocated from |arena| since |mark| was taken. Pointers
+ * to those allocations must not be used afterwards.
+ */
+void bub_arena_reset(BubArena* arena, BubArenaMark mark);
+
+/* Makes bub_malloc_() on UEFI serve allocations from |arena|, falling back
+ * to the firmware pool when it is full. NULL goes back to the pool only.
+ */
+void bub_arena_set_default(BubArena* arena);
+
+/* @return the arena set with bub_arena_set_default(), or NULL. */
+BubArena* bub_arena_get_default(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUB_ARENA_H_ */
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <vector>
+
+#include "bub_arena.h"
+
+class ArenaTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    region_.resize(kSize / sizeof(uint64_t));
+    bub_arena_init(&arena_, region_.data(), kSize);
+  }
+
+  static const size_t kSize = 4096;
+  std::vector<uint64_t> region_;
+  BubArena arena_;
+};
+
+TEST_F(ArenaTest, AllocIsAlignedAndDistinct) {
+  uint8_t* a = (uint8_t*)bub_arena_alloc(&arena_, 1);
+  uint8_t* b = (uint8_t*)bub_arena_alloc(&arena_, 13);
+  uint8_t* c = (uint8_t*)bub_arena_alloc(&arena_, 0);
+  ASSERT_NE(nullptr, a);
+  ASSERT_NE(nullptr, b);
+  ASSERT_NE(nullptr, c);
+  EXPECT_EQ(0U, (uintptr_t)a % BUB_WORD_ALIGNMENT_SIZE);
+  EXPECT_EQ(0U, (uintptr_t)b % BUB_WORD_ALIGNMENT_SIZE);
+  EXPECT_EQ(0U, (uintptr_t)c % BUB_WORD_ALIGNMENT_SIZE);
+  EXPECT_GE(b, a + 1);
+  EXPECT_GE(c, b + 13);
+  memset(b, 0xff, 13);
+  EXPECT_TRUE(bub_arena_owns(&arena_, a));
+  EXPECT_TRUE(bub_arena_owns(&arena_, b + 12));
+  EXPECT_EQ(3U, arena_.num_allocs);
+}
+
+TEST_F(ArenaTest, FullArenaFails) {
+  EXPECT_EQ(nullptr, bub_arena_alloc(&arena_, kSize));
+  EXPECT_EQ(nullptr, bub_arena_alloc(&arena_, (size_t)-1));
+  EXPECT_NE(nullptr, bub_arena_alloc(&arena_, kSize / 2));
+  EXPECT_EQ(nullptr, bub_arena_alloc(&arena_, kSize / 2));
+  EXPECT_EQ(3U, arena_.num_failed);
+  EXPECT_EQ(1U, arena_.num_allocs);
+}
+
+TEST_F(ArenaTest, FreeTopReclaims) {
+  void* a = bub_arena_alloc(&arena_, 100);
+  size_t used = arena_.used;
+  for (int n = 0; n < 1000; ++n) {
+    void* p = bub_arena_alloc(&arena_, 1000);
+    ASSERT_NE(nullptr, p);
+    bub_arena_free(&arena_, p);
+    EXPECT_EQ(used, arena_.used);
+  }
+  bub_arena_free(&arena_, a);
+  EXPECT_EQ(0U, arena_.used);
+  EXPECT_EQ(1001U, arena_.num_frees);
+}
+
+TEST_F(ArenaTest, OutOfOrderFreeReclaimedLater) {
+  void* a = bub_arena_alloc(&arena_, 100);
+  void* b = bub_arena_alloc(&arena_, 100);
+  size_t used_a = arena_.used;
+  void* c = bub_arena_alloc(&arena_, 100);
+
+  bub_arena_free(&arena_, b);
+  EXPECT_GT(arena_.used, used_a);
+  bub_arena_free(&arena_, c);
+  // b was already free, so both go.
+  EXPECT_LT(arena_.used, used_a);
+  bub_arena_free(&arena_, a);
+  EXPECT_EQ(0U, arena_.used);
+  EXPECT_GT(arena_.peak_used, used_a);
+}
+
+TEST_F(ArenaTest, BadFreeIgnored) {
+  uint8_t* a = (uint8_t*)bub_arena_alloc(&arena_, 100);
+  void* b = bub_arena_alloc(&arena_, 100);
+  size_t used = arena_.used;
+
+  // An interior pointer, a double free and memory from elsewhere.
+  bub_arena_free(&arena_, a + 8);
+  bub_arena_free(&arena_, b);
+  bub_arena_free(&arena_, b);
+  uint64_t other[4];
+  bub_arena_free(&arena_, &other[2]);
+  EXPECT_EQ(1U, arena_.num_frees);
+  EXPECT_LT(arena_.used, used);
+  EXPECT_TRUE(bub_arena_owns(&arena_, a));
+}
+
+TEST_F(ArenaTest, MarkAndReset) {
+  void* keep = bub_arena_alloc(&arena_, 64);
+  BubArenaMark mark = bub_arena_mark(&arena_);
+  size_t used = arena_.used;
+
+  for (int n = 0; n < 10; ++n)
+    ASSERT_NE(nullptr, bub_arena_alloc(&arena_, 100));
+  bub_arena_reset(&arena_, mark);
+  EXPECT_EQ(used, arena_.used);
+  EXPECT_TRUE(bub_arena_owns(&arena_, keep));
+
+  // Memory freed below the mark is reclaimed by the reset too.
+  mark = bub_arena_mark(&arena_);
+  ASSERT_NE(nullptr, bub_arena_alloc(&arena_, 100));
+  bub_arena_free(&arena_, keep);
+  EXPECT_GT(arena_.used, 0U);
+  bub_arena_reset(&arena_, mark);
+  EXPECT_EQ(0U, arena_.used);
+}
+
+TEST_F(ArenaTest, Default) {
+  EXPECT_EQ(nullptr, bub_arena_get_default());
+  bub_arena_set_default(&arena_);
+  EXPECT_EQ(&arena_, bub_arena_get_default());
+  bub_arena_set_default(NULL);
+  EXPECT_EQ(nullptr, bub_arena_get_default());
+}
@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && \
+    defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define BUB_HAVE_IO_URING 1
+#endif
+#endif
+
+#include "bub_async_posix.h"
+#include "bub_sysdeps.h"
+
+/* Entries of the io_uring submission queue. At most this many reads are in
+ * flight with io_uring; further reads complete before they are started.
+ */
+#define QUEUE_DEPTH 64
+
+/* Threads reading when io_uring is not available. */
+#define NUM_THREADS 4
+
+/* Per-read state, kept in BubIORequest.impl. */
+typedef struct {
+  struct iovec iov;
+  int64_t offset;
+  // Next queued read of the thread pool.
+  BubIORequest* next;
+  int fd;
+  // Non-zero once |result| and |num_read| of the request are set.
+  int done;
+} PosixRead;
+
+#if defined(__GNUC__) && __GNUC__ >= 4 && __GNUC_MINOR__ >= 6
+ _Static_assert(sizeof(PosixRead) <= sizeof(((BubIORequest*)0)->impl),
+                "PosixRead does not fit in BubIORequest!");
+#endif
+
+struct BubAsyncQueue {
+  // io_uring, or -1 if the thread pool is used.
+  int ring_fd;
+#ifdef BUB_HAVE_IO_URING
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+#endif
+  unsigned num_in_flight;
+
+  // Thread pool. |lock| protects the queued reads, |stopping| and the
+  // |done| flags of reads started on the pool.
+  pthread_t threads[NUM_THREADS];
+  int num_threads;
+  pthread_mutex_t lock;
+  // Signalled when a read is queued or the pool stops.
+  pthread_cond_t work_cond;
+  // Broadcast when a read completes.
+  pthread_cond_t done_cond;
+  BubIORequest* queue_head;
+  BubIORequest* queue_tail;
+  int stopping;
+};
+
+static PosixRead* posix_read(BubIORequest* request) {
+  return (PosixRead*)request->impl;
+}
+
+/* Sets the outcome of |request| from |res|, a byte count or negative. */
+static void complete_read(BubIORequest* request, ssize_t res) {
+  if (res < 0) {
+    request->result = BUB_IO_RESULT_ERROR_IO;
+    request->num_read = 0;
+  } else {
+    request->result = BUB_IO_RESULT_OK;
+    request->num_read = res;
+  }
+  posix_read(request)->done = 1;
+}
+
+static ssize_t read_now(const PosixRead* r) {
+  ssize_t res;
+
+  do {
+    res = pread(r->fd, r->iov.iov_base, r->iov.iov_len, r->offset);
+  } while (res < 0 && errno == EINTR);
+  return res;
+}
+
+#ifdef BUB_HAVE_IO_URING
+static int ring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                      unsigned flags) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+static void ring_free(BubAsyncQueue* q) {
+  if (q->sqes != NULL)
+    munmap(q->sqes, q->sqes_size);
+  if (q->cq_ring != NULL && q->cq_ring != q->sq_ring)
+    munmap(q->cq_ring, q->cq_ring_size);
+  if (q->sq_ring != NULL)
+    munmap(q->sq_ring, q->sq_ring_size);
+  if (q->ring_fd >= 0)
+    close(q->ring_fd);
+  q->ring_fd = -1;
+}
+
+static void* ring_map(int ring_fd, size_t size, off_t offset) {
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/* Sets up an io_uring for |q|. Fails where io_uring is missing or blocked,
+ * e.g. by a seccomp filter.
+ */
+static int ring_init(BubAsyncQueue* q) {
+  struct io_uring_params params;
+  uint8_t* sq;
+  uint8_t* cq;
+
+  memset(&params, 0, sizeof(params));
+  q->ring_fd = syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params);
+  if (q->ring_fd < 0) {
+    q->ring_fd = -1;
+    return 0;
+  }
+
+  q->sq_ring_size = params.sq_off.array +
+                    params.sq_entries * sizeof(unsigned);
+  q->cq_ring_size = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (q->cq_ring_size > q->sq_ring_size)
+      q->sq_ring_size = q->cq_ring_size;
+    q->cq_ring_size = q->sq_ring_size;
+  }
+  q->sq_ring = ring_map(q->ring_fd, q->sq_ring_size, IORING_OFF_SQ_RING);
+  if (q->sq_ring == NULL) {
+    ring_free(q);
+    return 0;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    q->cq_ring = q->sq_ring;
+  else
+    q->cq_ring = ring_map(q->ring_fd, q->cq_ring_size, IORING_OFF_CQ_RING);
+  q->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  q->sqes = ring_map(q->ring_fd, q->sqes_size, IORING_OFF_SQES);
+  if (q->cq_ring == NULL || q->sqes == NULL) {
+    ring_free(q);
+    return 0;
+  }
+
+  sq = q->sq_ring;
+  cq = q->cq_ring;
+  q->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  q->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  q->sq_array = (unsigned*)(sq + params.sq_off.array);
+  q->cq_head = (unsigned*)(cq + params.cq_off.head);
+  q->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  q->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  q->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return 1;
+}
+
+static BubIOResult ring_submit(BubAsyncQueue* q, BubIORequest* request) {
+  PosixRead* r = posix_read(request);
+  unsigned tail = *q->sq_tail;
+  unsigned index = tail & *q->sq_mask;
+  struct io_uring_sqe* sqe = &q->sqes[index];
+  int ret;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = r->fd;
+  sqe->addr = (uintptr_t)&r->iov;
+  sqe->len = 1;
+  sqe->off = r->offset;
+  sqe->user_data = (uintptr_t)request;
+  q->sq_array[index] = index;
+  __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  do {
+    ret = ring_enter(q->ring_fd, 1, 0, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret != 1) {
+    // Nothing was consumed; take the entry back.
+    __atomic_store_n(q->sq_tail, tail, __ATOMIC_RELEASE);
+    return BUB_IO_RESULT_ERROR_IO;
+  }
+  q->num_in_flight++;
+  return BUB_IO_RESULT_OK;
+}
+
+/* Completes the requests of all completion queue entries. */
+static void ring_reap(BubAsyncQueue* q) {
+  unsigned head = *q->cq_head;
+
+  while (head != __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &q->cqes[head & *q->cq_mask];
+    complete_read((BubIORequest*)(uintptr_t)cqe->user_data, cqe->res);
+    q->num_in_flight--;
+    head++;
+  }
+  __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int ring_poll(BubAsyncQueue* q, BubIORequest* request, int wait) {
+  PosixRead* r = posix_read(request);
+
+  ring_reap(q);
+  while (!r->done && wait) {
+    if (ring_enter(q->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      bub_warning("Could not wait for io_uring completion.\n");
+      return 0;
+    }
+    ring_reap(q);
+  }
+  return r->done;
+}
+#else
+static int ring_init(BubAsyncQueue* q) {
+  q->ring_fd = -1;
+  return 0;
+}
+
+static void ring_free(BubAsyncQueue* q) {}
+
+static BubIOResult ring_submit(BubAsyncQueue* q, BubIORequest* request) {
+  return BUB_IO_RESULT_ERROR_IO;
+}
+
+static int ring_poll(BubAsyncQueue* q, BubIORequest* request, int wait) {
+  return posix_read(request)->done;
+}
+#endif
+
+static void* worker_main(void* arg) {
+  BubAsyncQueue* q = arg;
+  BubIORequest* request;
+  ssize_t res;
+
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    while (q->queue_head == NULL && !q->stopping)
+      pthread_cond_wait(&q->work_cond, &q->lock);
+    request = q->queue_head;
+    if (request == NULL)
+      break;
+    q->queue_head = posix_read(request)->next;
+    if (q->queue_head == NULL)
+      q->queue_tail = NULL;
+
+    pthread_mutex_unlock(&q->lock);
+    res = read_now(posix_read(request));
+    pthread_mutex_lock(&q->lock);
+
+    complete_read(request, res);
+    q->num_in_flight--;
+    pthread_cond_broadcast(&q->done_cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+BubAsyncQueue* bub_async_queue_new(int try_io_uring) {
+  BubAsyncQueue* q = calloc(1, sizeof(BubAsyncQueue));
+
+  if (q == NULL)
+    return NULL;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->work_cond, NULL);
+  pthread_cond_init(&q->done_cond, NULL);
+
+  if (try_io_uring && ring_init(q))
+    return q;
+
+  q->ring_fd = -1;
+  while (q->num_threads < NUM_THREADS &&
+         pthread_create(&q->threads[q->num_threads], NULL, worker_main, q) ==
+           0)
+    q->num_threads++;
+  if (q->num_threads == 0) {
+    bub_async_queue_free(q);
+    return NULL;
+  }
+  return q;
+}
+
+void bub_async_queue_free(BubAsyncQueue* queue) {
+  int i;
+
+  if (queue == NULL)
+    return;
+
+  pthread_mutex_lock(&queue->lock);
+  queue->stopping = 1;
+  pthread_cond_broadcast(&queue->work_cond);
+  pthread_mutex_unlock(&queue->lock);
+  for (i = 0; i < queue->num_threads; ++i)
+    pthread_join(queue->threads[i], NULL);
+
+  ring_free(queue);
+  pthread_cond_destroy(&queue->done_cond);
+  pthread_cond_destroy(&queue->work_cond);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue);
+}
+
+int bub_async_queue_uses_io_uring(const BubAsyncQueue* queue) {
+  return queue->ring_fd >= 0;
+}
+
+BubIOResult bub_async_queue_read(BubAsyncQueue* queue, int fd, void* buf,
+                                 size_t num_bytes, int64_t offset,
+                                 BubIORequest* request) {
+  PosixRead* r = posix_read(request);
+
+  if (offset < 0)
+    return BUB_IO_RESULT_ERROR_IO;
+
+  memset(r, 0, sizeof(PosixRead));
+  r->iov.iov_base = buf;
+  r->iov.iov_len = num_bytes;
+  r->offset = offset;
+  r->fd = fd;
+
+  if (queue->ring_fd >= 0) {
+    if (queue->num_in_flight < QUEUE_DEPTH)
+      return ring_submit(queue, request);
+    // The ring is full. Completing right away is still correct.
+    complete_read(request, read_now(r));
+    return BUB_IO_RESULT_OK;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->queue_tail != NULL)
+    posix_read(queue->queue_tail)->next = request;
+  else
+    queue->queue_head = request;
+  queue->queue_tail = request;
+  queue->num_in_flight++;
+  pthread_cond_signal(&queue->work_cond);
+  pthread_mutex_unlock(&queue->lock);
+  return BUB_IO_RESULT_OK;
+}
+
+int bub_async_queue_poll(BubAsyncQueue* queue, BubIORequest* request,
+                         int wait) {
+  PosixRead* r = posix_read(request);
+  int done;
+
+  if (queue->ring_fd >= 0)
+    return ring_poll(queue, request, wait);
+
+  pthread_mutex_lock(&queue->lock);
+  while (!r->done && wait)
+    pthread_cond_wait(&queue->done_cond, &queue->lock);
+  done = r->done;
+  pthread_mutex_unlock(&queue->lock);
+  return done;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUB_ASYNC_POSIX_H_
+#define BUB_ASYNC_POSIX_H_
+
+#include "bub_ops.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Asynchronous file reads for host BubOps implementations, completing
+ * BubIORequests for their read_from_partition_async and poll_completion.
+ * Reads go through io_uring where the kernel allows it and through a small
+ * pool of pread() threads otherwise.
+ *
+ * A queue must only be used by one thread at a time, and every read
+ * started on it must have completed before it is freed.
+ */
+typedef struct BubAsyncQueue BubAsyncQueue;
+
+/* Creates a queue. io_uring is only tried if |try_io_uring| is non-zero.
+ *
+ * @return: the queue, or NULL if out of memory or threads.
+ */
+BubAsyncQueue* bub_async_queue_new(int try_io_uring);
+
+void bub_async_queue_free(BubAsyncQueue* queue);
+
+/* Returns non-zero if |queue| uses io_uring rather than threads. */
+int bub_async_queue_uses_io_uring(const BubAsyncQueue* queue);
+
+/* Starts reading |num_bytes| at |offset| of |fd| into |buf|. Reads past
+ * the end of the file are short, as with pread().
+ *
+ * @return: BUB_IO_RESULT_OK if the read was started and must be completed
+ *          with bub_async_queue_poll(), BUB_IO_RESULT_ERROR_IO otherwise.
+ */
+BubIOResult bub_async_queue_read(BubAsyncQueue* queue, int fd, void* buf,
+                                 size_t num_bytes, int64_t offset,
+                                 BubIORequest* request);
+
+/* Checks whether the read of |request| has completed, waiting for it if
+ * |wait| is non-zero, see BubOps.poll_completion.
+ *
+ * @return: non-zero once |request| has completed.
+ */
+int bub_async_queue_poll(BubAsyncQueue* queue, BubIORequest* request,
+                         int wait);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUB_ASYNC_POSIX_H_ */
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "bub_async_posix.h"
+#include "bub_image_util.h"
+
+// More than the io_uring queue depth, so that some reads have to wait.
+static const int kNumReads = 100;
+static const size_t kReadSize = 4096;
+
+class AsyncPosixTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_FALSE(dir_.path().empty());
+    image_.resize(kNumReads * kReadSize);
+    uint32_t x = 0x12345678;
+    for (size_t n = 0; n < image_.size(); ++n) {
+      x = x * 1103515245 + 12345;
+      image_[n] = (uint8_t)(x >> 16);
+    }
+    path_ = dir_.Append("boot.img").value();
+    int fd = open(path_.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ((ssize_t)image_.size(), write(fd, image_.data(), image_.size()));
+    close(fd);
+  }
+
+  // Reads all of the image through |queue| with every read in flight at
+  // once, and checks the data.
+  void ReadAll(BubAsyncQueue* queue) {
+    std::vector<uint8_t> buf(image_.size());
+    std::vector<BubIORequest> requests(kNumReads);
+    int fd = open(path_.c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+
+    for (int n = 0; n < kNumReads; ++n) {
+      ASSERT_EQ(BUB_IO_RESULT_OK,
+                bub_async_queue_read(queue, fd, &buf[n * kReadSize],
+                                     kReadSize, n * kReadSize,
+                                     &requests[n]));
+    }
+    // Complete them out of order.
+    for (int n = kNumReads - 1; n >= 0; --n) {
+      EXPECT_NE(0, bub_async_queue_poll(queue, &requests[n], 1));
+      EXPECT_EQ(BUB_IO_RESULT_OK, requests[n].result);
+      EXPECT_EQ(kReadSize, requests[n].num_read);
+    }
+    EXPECT_EQ(image_, buf);
+
+    // A read past the end is short.
+    ASSERT_EQ(BUB_IO_RESULT_OK,
+              bub_async_queue_read(queue, fd, buf.data(), 2 * kReadSize,
+                                   image_.size() - 10, &requests[0]));
+    EXPECT_NE(0, bub_async_queue_poll(queue, &requests[0], 1));
+    EXPECT_EQ(BUB_IO_RESULT_OK, requests[0].result);
+    EXPECT_EQ(10U, requests[0].num_read);
+    close(fd);
+
+    // One from a closed descriptor fails.
+    BubIOResult result = bub_async_queue_read(queue, fd, buf.data(),
+                                              kReadSize, 0, &requests[0]);
+    if (result == BUB_IO_RESULT_OK) {
+      EXPECT_NE(0, bub_async_queue_poll(queue, &requests[0], 1));
+      result = requests[0].result;
+    }
+    EXPECT_EQ(BUB_IO_RESULT_ERROR_IO, result);
+  }
+
+  TempDir dir_;
+  std::string path_;
+  std::vector<uint8_t> image_;
+};
+
+TEST_F(AsyncPosixTest, Threads) {
+  BubAsyncQueue* queue = bub_async_queue_new(0);
+  ASSERT_TRUE(queue != nullptr);
+  EXPECT_EQ(0, bub_async_queue_uses_io_uring(queue));
+  ReadAll(queue);
+  bub_async_queue_free(queue);
+}
+
+// Falls back to threads where io_uring is not available.
+TEST_F(AsyncPosixTest, IoUring) {
+  BubAsyncQueue* queue = bub_async_queue_new(1);
+  ASSERT_TRUE(queue != nullptr);
+  ReadAll(queue);
+  bub_async_queue_free(queue);
+}
+
+TEST_F(AsyncPosixTest, BubOpsBackendsAgree) {
+  struct {
+    MyOps::Backend backend;
+    MyOps::AsyncBackend async;
+  } configs[] = {
+      {MyOps::BACKEND_FD, MyOps::ASYNC_IO_URING},
+      {MyOps::BACKEND_FD, MyOps::ASYNC_THREADS},
+      {MyOps::BACKEND_FD, MyOps::ASYNC_NONE},
+      {MyOps::BACKEND_MMAP, MyOps::ASYNC_IO_URING},
+      {MyOps::BACKEND_OPEN_PER_CALL, MyOps::ASYNC_IO_URING},
+  };
+
+  for (const auto& config : configs) {
+    SCOPED_TRACE(testing::Message() << config.backend << " " << config.async);
+    MyOps::Options options;
+    options.backend = config.backend;
+    options.async = config.async;
+    MyOps ops(options);
+    ops.set_partition_dir(dir_.path());
+    EXPECT_EQ(config.backend == MyOps::BACKEND_FD &&
+                  config.async != MyOps::ASYNC_NONE,
+              ops.bub_ops()->read_from_partition_async != nullptr);
+
+    std::vector<uint8_t> buf(image_.size());
+    std::vector<BubIORequest> requests(kNumReads);
+    for (int n = 0; n < kNumReads; ++n) {
+      ASSERT_EQ(BUB_IO_RESULT_OK,
+                bub_ops_read_async(ops.bub_ops(), "boot", &buf[n * kReadSize],
+                                   n * kReadSize, kReadSize, &requests[n]));
+    }
+    for (int n = 0; n < kNumReads; ++n) {
+      EXPECT_NE(0, bub_ops_poll_completion(ops.bub_ops(), &requests[n], 1));
+      EXPECT_EQ(BUB_IO_RESULT_OK, requests[n].result);
+      EXPECT_EQ(kReadSize, requests[n].num_read);
+    }
+    EXPECT_EQ(image_, buf);
+    EXPECT_EQ(kNumReads, ops.num_reads);
+
+    // Offsets from the end, as with read_from_partition.
+    uint8_t tail[8];
+    ASSERT_EQ(BUB_IO_RESULT_OK,
+              bub_ops_read_async(ops.bub_ops(), "boot", tail, -4,
+                                 sizeof(tail), &requests[0]));
+    EXPECT_NE(0, bub_ops_poll_completion(ops.bub_ops(), &requests[0], 1));
+    EXPECT_EQ(4U, requests[0].num_read);
+    EXPECT_EQ(0, memcmp(tail, &image_[image_.size() - 4], 4));
+
+    EXPECT_NE(BUB_IO_RESULT_OK,
+              bub_ops_read_async(ops.bub_ops(), "nonexistent", tail, 0,
+                                 sizeof(tail), &requests[0]));
+  }
+}
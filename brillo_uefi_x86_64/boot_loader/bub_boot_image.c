@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bub_boot_image.h"
+
+/* Rounds |size| up to a multiple of |page_size|. */
+static uint64_t page_align(uint64_t size, uint32_t page_size) {
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+static int compression_valid(uint32_t compression, uint64_t stored_size,
+                             uint64_t decompressed_size) {
+  switch (compression) {
+    case BUB_COMPRESSION_NONE:
+      return decompressed_size == stored_size;
+    case BUB_COMPRESSION_LZ4:
+    case BUB_COMPRESSION_GZIP:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* Fills in the compression fields of |out_layout| from the BubBootImageExt
+ * following |hdr|.
+ */
+static BubBootImageResult get_compression(const boot_img_hdr* hdr,
+                                          BubBootImageLayout* out_layout) {
+  static const uint8_t ext_magic[BUB_BOOT_IMAGE_EXT_MAGIC_SIZE] =
+    BUB_BOOT_IMAGE_EXT_MAGIC;
+  const BubBootImageExt* ext = (const BubBootImageExt*)(hdr + 1);
+
+  if (hdr->page_size < BUB_BOOT_IMAGE_HEADER_SIZE ||
+      bub_memcmp(ext_magic, ext->magic, BUB_BOOT_IMAGE_EXT_MAGIC_SIZE) ||
+      ext->reserved != 0 ||
+      !compression_valid(ext->kernel_compression, hdr->kernel_size,
+                         ext->kernel_decompressed_size) ||
+      !compression_valid(ext->ramdisk_compression, hdr->ramdisk_size,
+                         ext->ramdisk_decompressed_size)) {
+    bub_warning("Invalid boot image compression header.\n");
+    return BUB_BOOT_IMAGE_ERROR_COMPRESSION;
+  }
+
+  out_layout->kernel_compression = (BubCompression)ext->kernel_compression;
+  out_layout->ramdisk_compression = (BubCompression)ext->ramdisk_compression;
+  out_layout->kernel_decompressed_size = ext->kernel_decompressed_size;
+  out_layout->ramdisk_decompressed_size = ext->ramdisk_decompressed_size;
+  return BUB_BOOT_IMAGE_RESULT_OK;
+}
+
+BubBootImageResult bub_boot_image_get_layout(const boot_img_hdr* hdr,
+                                             uint64_t partition_size,
+                                             BubBootImageLayout* out_layout) {
+  static const uint8_t boot_magic[BOOT_MAGIC_SIZE] = BOOT_MAGIC;
+  uint64_t kernel_bytes;
+
+  bub_memset(out_layout, 0, sizeof(BubBootImageLayout));
+
+  // Check boot image header magic field.
+  if (bub_memcmp(boot_magic, hdr->magic, BOOT_MAGIC_SIZE)) {
+    bub_warning("Wrong boot image header magic.\n");
+    return BUB_BOOT_IMAGE_ERROR_MAGIC;
+  }
+
+  // Checks on buffer overflow.
+  if (partition_size < sizeof(boot_img_hdr) ||
+      hdr->page_size == 0 ||
+      hdr->page_size > partition_size - sizeof(boot_img_hdr)) {
+    bub_warning("Page size invalid.\n");
+    return BUB_BOOT_IMAGE_ERROR_PAGE_SIZE;
+  }
+
+  // Kernel and ramdisk are each padded to page_size and adjacent on flash.
+  kernel_bytes = page_align(hdr->kernel_size, hdr->page_size);
+  out_layout->kernel_offset = hdr->page_size;
+  out_layout->kernel_size = hdr->kernel_size;
+  out_layout->ramdisk_offset = kernel_bytes;
+  out_layout->ramdisk_size = hdr->ramdisk_size;
+  out_layout->load_size =
+    kernel_bytes + page_align(hdr->ramdisk_size, hdr->page_size);
+  if (out_layout->load_size > partition_size - hdr->page_size) {
+    bub_warning("Kernel and ramdisk beyond allowed boundary.\n");
+    return BUB_BOOT_IMAGE_ERROR_SIZE;
+  }
+
+  out_layout->kernel_compression = BUB_COMPRESSION_NONE;
+  out_layout->ramdisk_compression = BUB_COMPRESSION_NONE;
+  out_layout->kernel_decompressed_size = hdr->kernel_size;
+  out_layout->ramdisk_decompressed_size = hdr->ramdisk_size;
+  if (hdr->unused & BUB_BOOT_IMAGE_FLAG_COMPRESSED)
+    return get_compression(hdr, out_layout);
+
+  return BUB_BOOT_IMAGE_RESULT_OK;
+}
+
+int bub_boot_image_hash_header(BubSha256Ctx* ctx,
+                               const uint8_t* header_page,
+                               size_t page_size) {
+  static const uint8_t zero_id[sizeof(((boot_img_hdr*)0)->id)];
+  size_t id_offset = offsetof(boot_img_hdr, id);
+  size_t id_end = id_offset + sizeof(zero_id);
+
+  if (page_size < sizeof(boot_img_hdr))
+    return 0;
+
+  bub_sha256_update(ctx, header_page, id_offset);
+  bub_sha256_update(ctx, zero_id, sizeof(zero_id));
+  bub_sha256_update(ctx, header_page + id_end, page_size - id_end);
+  return 1;
+}
+
+int bub_boot_image_verify_digest(const boot_img_hdr* hdr,
+                                 const uint8_t* digest) {
+  if (bub_safe_memcmp(hdr->id, digest, BUB_SHA256_DIGEST_SIZE)) {
+    bub_warning("Boot image digest mismatch.\n");
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Offsets of x86 setup header fields from the start of the kernel. */
+#define SETUP_BOOT_FLAG_OFFSET 0x1fe
+#define SETUP_HEADER_MAGIC_OFFSET 0x202
+#define SETUP_VERSION_OFFSET 0x206
+#define SETUP_KERNEL_ALIGNMENT_OFFSET 0x230
+#define SETUP_RELOCATABLE_KERNEL_OFFSET 0x234
+#define SETUP_PREF_ADDRESS_OFFSET 0x258
+
+#define SETUP_BOOT_FLAG 0xaa55
+#define SETUP_HEADER_MAGIC 0x53726448 /* "HdrS" */
+#define SETUP_LEGACY_LOAD_ADDRESS 0x100000
+
+static uint64_t load_le(const uint8_t* buf, size_t num_bytes) {
+  uint64_t value = 0;
+
+  while (num_bytes-- > 0)
+    value = (value << 8) | buf[num_bytes];
+  return value;
+}
+
+int bub_boot_image_get_kernel_placement(const uint8_t* kernel,
+                                        size_t size,
+                                        BubKernelPlacement* out_placement) {
+  uint64_t version;
+  uint64_t alignment;
+
+  out_placement->alignment = BUB_KERNEL_DEFAULT_ALIGNMENT;
+  out_placement->pref_address = 0;
+  out_placement->relocatable = 1;
+
+  if (size < BUB_KERNEL_SETUP_HEADER_SIZE ||
+      load_le(kernel + SETUP_BOOT_FLAG_OFFSET, 2) != SETUP_BOOT_FLAG ||
+      load_le(kernel + SETUP_HEADER_MAGIC_OFFSET, 4) != SETUP_HEADER_MAGIC)
+    return 0;
+
+  // kernel_alignment and relocatable_kernel appeared with version 2.05.
+  version = load_le(kernel + SETUP_VERSION_OFFSET, 2);
+  if (version < 0x0205)
+    return 0;
+
+  alignment = load_le(kernel + SETUP_KERNEL_ALIGNMENT_OFFSET, 4);
+  if (alignment != 0 && (alignment & (alignment - 1)) == 0)
+    out_placement->alignment = alignment;
+  out_placement->relocatable =
+    kernel[SETUP_RELOCATABLE_KERNEL_OFFSET] != 0;
+  out_placement->pref_address =
+    version >= 0x020a ? load_le(kernel + SETUP_PREF_ADDRESS_OFFSET, 8)
+                      : SETUP_LEGACY_LOAD_ADDRESS;
+  return 1;
+}
+
+int bub_boot_image_kernel_runs_in_place(const BubKernelPlacement* placement,
+                                        uint64_t image_base) {
+  if (image_base < placement->pref_address)
+    return 0;
+  if (!placement->relocatable)
+    return image_base == placement->pref_address;
+  return image_base % placement->alignment == 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUB_BOOT_IMAGE_H_
+#define BUB_BOOT_IMAGE_H_
+
+#include "bub_decompress.h"
+#include "bub_sha256.h"
+#include "bub_sysdeps.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Note: The below header definitions are taken from
+ *       system/core/mkbootimg/bootimg.h
+ */
+typedef struct boot_img_hdr boot_img_hdr;
+
+#define BOOT_MAGIC {'A','N','D','R','O','I','D','!'}
+#define BOOT_MAGIC_SIZE 8
+#define BOOT_NAME_SIZE 16
+#define BOOT_ARGS_SIZE 512
+#define BOOT_EXTRA_ARGS_SIZE 1024
+
+struct boot_img_hdr
+{
+    uint8_t magic[BOOT_MAGIC_SIZE];
+
+    uint32_t kernel_size;  /* size in bytes */
+    uint32_t kernel_addr;  /* physical load addr */
+
+    uint32_t ramdisk_size; /* size in bytes */
+    uint32_t ramdisk_addr; /* physical load addr */
+
+    uint32_t second_size;  /* size in bytes */
+    uint32_t second_addr;  /* physical load addr */
+
+    uint32_t tags_addr;    /* physical addr for kernel tags */
+    uint32_t page_size;    /* flash page size we assume */
+    uint32_t unused;       /* reserved for future expansion: MUST be 0 */
+
+    /* operating system version and security patch level; for
+     * version "A.B.C" and patch level "Y-M-D":
+     * ver = A << 14 | B << 7 | C         (7 bits for each of A, B, C)
+     * lvl = ((Y - 2000) & 127) << 4 | M  (7 bits for Y, 4 bits for M)
+     * os_version = ver << 11 | lvl */
+    uint32_t os_version;
+
+    uint8_t name[BOOT_NAME_SIZE]; /* asciiz product name */
+
+    uint8_t cmdline[BOOT_ARGS_SIZE];
+
+    uint32_t id[8]; /* timestamp / checksum / sha1 / etc */
+
+    /* Supplemental command line data; kept here to maintain
+     * binary compatibility with older versions of mkbootimg */
+    uint8_t extra_cmdline[BOOT_EXTRA_ARGS_SIZE];
+} BUB_ATTR_PACKED;
+
+/*
+** +-----------------+
+** | boot header     | 1 page
+** +-----------------+
+** | kernel          | n pages
+** +-----------------+
+** | ramdisk         | m pages
+** +-----------------+
+** | second stage    | o pages
+** +-----------------+
+**
+** n = (kernel_size + page_size - 1) / page_size
+** m = (ramdisk_size + page_size - 1) / page_size
+** o = (second_size + page_size - 1) / page_size
+**
+** 0. all entities are page_size aligned in flash
+** 1. kernel and ramdisk are required (size != 0)
+** 2. second is optional (second_size == 0 -> no second)
+** 3. load each element (kernel, ramdisk, second) at
+**    the specified physical address (kernel_addr, etc)
+** 4. prepare tags at tag_addr.  kernel_args[] is
+**    appended to the kernel commandline in the tags.
+** 5. r0 = 0, r1 = MACHINE_TYPE, r2 = tags_addr
+** 6. if second_size != 0: jump to second_addr
+**    else: jump to kernel_addr
+*/
+
+/* Set in the |unused| field of boot_img_hdr if the kernel or the ramdisk is
+ * stored compressed. A BubBootImageExt then directly follows the header in
+ * the header page, so the page size must be at least
+ * BUB_BOOT_IMAGE_HEADER_SIZE. Boot loaders that do not know the flag reject
+ * such images as the kernel does not parse.
+ */
+#define BUB_BOOT_IMAGE_FLAG_COMPRESSED 0x1
+
+#define BUB_BOOT_IMAGE_EXT_MAGIC {'B','U','B','X'}
+#define BUB_BOOT_IMAGE_EXT_MAGIC_SIZE 4
+
+typedef struct {
+  uint8_t magic[BUB_BOOT_IMAGE_EXT_MAGIC_SIZE];
+  uint32_t kernel_compression;  /* BubCompression */
+  uint32_t ramdisk_compression; /* BubCompression */
+  uint32_t reserved;            /* MUST be 0 */
+  uint64_t kernel_decompressed_size;
+  uint64_t ramdisk_decompressed_size;
+} BUB_ATTR_PACKED BubBootImageExt;
+
+// Number of bytes to read from the start of a boot partition to get both
+// boot_img_hdr and BubBootImageExt.
+#define BUB_BOOT_IMAGE_HEADER_SIZE \
+  (sizeof(boot_img_hdr) + sizeof(BubBootImageExt))
+
+typedef enum {
+  BUB_BOOT_IMAGE_RESULT_OK,
+  BUB_BOOT_IMAGE_ERROR_MAGIC,
+  BUB_BOOT_IMAGE_ERROR_PAGE_SIZE,
+  BUB_BOOT_IMAGE_ERROR_SIZE,
+  BUB_BOOT_IMAGE_ERROR_COMPRESSION,
+} BubBootImageResult;
+
+/* Location of the kernel and ramdisk within a boot partition. Kernel and
+ * ramdisk are adjacent, so a single read of |load_size| bytes at
+ * |kernel_offset| brings in both.
+ */
+typedef struct {
+  // Byte offset of the kernel from the start of the partition.
+  uint64_t kernel_offset;
+  uint64_t kernel_size;
+  // Byte offset of the ramdisk from |kernel_offset|.
+  uint64_t ramdisk_offset;
+  uint64_t ramdisk_size;
+  // Page-padded size of kernel and ramdisk together.
+  uint64_t load_size;
+  // How kernel and ramdisk are stored and their sizes once decompressed.
+  // The sizes equal |kernel_size| and |ramdisk_size| if not compressed.
+  BubCompression kernel_compression;
+  BubCompression ramdisk_compression;
+  uint64_t kernel_decompressed_size;
+  uint64_t ramdisk_decompressed_size;
+} BubBootImageLayout;
+
+/* Validates |hdr| against a boot partition of |partition_size| bytes and
+ * computes the kernel and ramdisk layout into |out_layout|. |hdr| must point
+ * to the first BUB_BOOT_IMAGE_HEADER_SIZE bytes of the partition.
+ *
+ * @return BUB_BOOT_IMAGE_ERROR_MAGIC on bad magic,
+ *         BUB_BOOT_IMAGE_ERROR_PAGE_SIZE on a zero or oversized page size,
+ *         BUB_BOOT_IMAGE_ERROR_SIZE if kernel and ramdisk do not fit the
+ *           partition,
+ *         BUB_BOOT_IMAGE_ERROR_COMPRESSION on a missing or invalid
+ *           BubBootImageExt in a compressed image,
+ *         BUB_BOOT_IMAGE_RESULT_OK on success.
+ */
+BubBootImageResult bub_boot_image_get_layout(const boot_img_hdr* hdr,
+                                             uint64_t partition_size,
+                                             BubBootImageLayout* out_layout);
+
+/* Adds the header page of a boot image, the |page_size| bytes at
+ * |header_page|, to the digest in |ctx| with the |id| field taken as all
+ * zeros. The boot image digest covers this page followed by the |load_size|
+ * bytes at |kernel_offset|, so the command line and the compression fields
+ * are checked along with the payloads.
+ *
+ * @return zero, adding nothing, if |page_size| is too small to hold a
+ *         boot_img_hdr.
+ */
+int bub_boot_image_hash_header(BubSha256Ctx* ctx,
+                               const uint8_t* header_page,
+                               size_t page_size);
+
+/* Checks |digest|, the SHA-256 of the header page as hashed by
+ * bub_boot_image_hash_header() and the |load_size| bytes at |kernel_offset|,
+ * against the digest recorded in the first BUB_SHA256_DIGEST_SIZE bytes of
+ * the |id| field of |hdr|. The comparison takes constant time.
+ *
+ * @return non-zero if the digests match, zero otherwise.
+ */
+int bub_boot_image_verify_digest(const boot_img_hdr* hdr,
+                                 const uint8_t* digest);
+
+/* Number of bytes at the start of an x86 bzImage needed to read its setup
+ * header, see Documentation/x86/boot.txt in the kernel.
+ */
+#define BUB_KERNEL_SETUP_HEADER_SIZE 0x260
+
+/* Physical alignment assumed for kernels without a usable setup header. This
+ * is the default of CONFIG_PHYSICAL_ALIGN on x86_64.
+ */
+#define BUB_KERNEL_DEFAULT_ALIGNMENT 0x200000
+
+/* Where an x86 bzImage wants to be loaded, from its setup header. */
+typedef struct {
+  // Power of two the load address must be a multiple of, if relocatable.
+  uint64_t alignment;
+  // Load address the kernel was linked for. The EFI stub relocates the kernel
+  // if it is loaded below this address.
+  uint64_t pref_address;
+  int relocatable;
+} BubKernelPlacement;
+
+/* Reads the placement requirements of the kernel whose first |size| bytes are
+ * at |kernel| into |out_placement|. Setup header versions before 2.10 lack
+ * pref_address; 0x100000 is assumed for those, as the boot protocol does.
+ *
+ * @return zero if |kernel| does not start with an x86 setup header of
+ *         version 2.05 or later, in which case |out_placement| holds
+ *         BUB_KERNEL_DEFAULT_ALIGNMENT and no preferred address.
+ */
+int bub_boot_image_get_kernel_placement(const uint8_t* kernel,
+                                        size_t size,
+                                        BubKernelPlacement* out_placement);
+
+/* Returns non-zero if a kernel with |placement| loaded at |image_base| can run
+ * where it is, that is if the Linux EFI stub will not copy it elsewhere before
+ * decompressing it.
+ */
+int bub_boot_image_kernel_runs_in_place(const BubKernelPlacement* placement,
+                                        uint64_t image_base);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUB_BOOT_IMAGE_H_ */
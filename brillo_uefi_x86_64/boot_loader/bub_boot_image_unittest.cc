@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <vector>
+
+#include "bub_boot_image.h"
+
+namespace {
+
+void store_le(std::vector<uint8_t>* buf, size_t offset, uint64_t value,
+              size_t num_bytes) {
+  for (size_t n = 0; n < num_bytes; ++n)
+    (*buf)[offset + n] = (uint8_t)(value >> (8 * n));
+}
+
+// Returns the start of a bzImage with a setup header of |version|.
+std::vector<uint8_t> make_kernel(uint16_t version, uint32_t alignment,
+                                 uint8_t relocatable, uint64_t pref_address) {
+  std::vector<uint8_t> kernel(BUB_KERNEL_SETUP_HEADER_SIZE, 0);
+  store_le(&kernel, 0x1fe, 0xaa55, 2);
+  memcpy(&kernel[0x202], "HdrS", 4);
+  store_le(&kernel, 0x206, version, 2);
+  store_le(&kernel, 0x230, alignment, 4);
+  kernel[0x234] = relocatable;
+  store_le(&kernel, 0x258, pref_address, 8);
+  return kernel;
+}
+
+}  // namespace
+
+TEST(KernelPlacementTest, ReadsSetupHeader) {
+  std::vector<uint8_t> kernel = make_kernel(0x020d, 0x200000, 1, 0x1000000);
+  BubKernelPlacement placement;
+
+  EXPECT_EQ(1, bub_boot_image_get_kernel_placement(kernel.data(),
+                                                   kernel.size(),
+                                                   &placement));
+  EXPECT_EQ(0x200000U, placement.alignment);
+  EXPECT_EQ(0x1000000U, placement.pref_address);
+  EXPECT_EQ(1, placement.relocatable);
+}
+
+TEST(KernelPlacementTest, OldVersionHasNoPrefAddress) {
+  std::vector<uint8_t> kernel = make_kernel(0x0209, 0x400000, 0, 0x1000000);
+  BubKernelPlacement placement;
+
+  EXPECT_EQ(1, bub_boot_image_get_kernel_placement(kernel.data(),
+                                                   kernel.size(),
+                                                   &placement));
+  EXPECT_EQ(0x400000U, placement.alignment);
+  EXPECT_EQ(0x100000U, placement.pref_address);
+  EXPECT_EQ(0, placement.relocatable);
+}
+
+TEST(KernelPlacementTest, NotABzImage) {
+  std::vector<uint8_t> kernel = make_kernel(0x020d, 0x1000, 1, 0x1000000);
+  BubKernelPlacement placement;
+
+  // Too short.
+  EXPECT_EQ(0, bub_boot_image_get_kernel_placement(kernel.data(),
+                                                   kernel.size() - 1,
+                                                   &placement));
+  EXPECT_EQ((uint64_t)BUB_KERNEL_DEFAULT_ALIGNMENT, placement.alignment);
+  EXPECT_EQ(0U, placement.pref_address);
+
+  // Protocol too old for kernel_alignment.
+  kernel = make_kernel(0x0204, 0x1000, 1, 0);
+  EXPECT_EQ(0, bub_boot_image_get_kernel_placement(kernel.data(),
+                                                   kernel.size(),
+                                                   &placement));
+
+  kernel = make_kernel(0x020d, 0x1000, 1, 0);
+  kernel[0x202] = 'X';
+  EXPECT_EQ(0, bub_boot_image_get_kernel_placement(kernel.data(),
+                                                   kernel.size(),
+                                                   &placement));
+}
+
+TEST(KernelPlacementTest, BadAlignmentFallsBackToDefault) {
+  std::vector<uint8_t> kernel = make_kernel(0x020d, 0x300000, 1, 0x1000000);
+  BubKernelPlacement placement;
+
+  EXPECT_EQ(1, bub_boot_image_get_kernel_placement(kernel.data(),
+                                                   kernel.size(),
+                                                   &placement));
+  EXPECT_EQ((uint64_t)BUB_KERNEL_DEFAULT_ALIGNMENT, placement.alignment);
+}
+
+TEST(KernelPlacementTest, RunsInPlace) {
+  BubKernelPlacement placement = {0x200000, 0x1000000, 1};
+
+  EXPECT_EQ(1, bub_boot_image_kernel_runs_in_place(&placement, 0x1000000));
+  EXPECT_EQ(1, bub_boot_image_kernel_runs_in_place(&placement, 0x7e400000));
+  EXPECT_EQ(0, bub_boot_image_kernel_runs_in_place(&placement, 0x7e401000));
+  // Below the address the kernel was linked for.
+  EXPECT_EQ(0, bub_boot_image_kernel_runs_in_place(&placement, 0x200000));
+
+  placement.relocatable = 0;
+  EXPECT_EQ(1, bub_boot_image_kernel_runs_in_place(&placement, 0x1000000));
+  EXPECT_EQ(0, bub_boot_image_kernel_runs_in_place(&placement, 0x7e400000));
+}
@@ -30,164 +30,120 @@
 #include <efi.h>
 #include <efilib.h>
 #include "bub_boot_kernel.h"
+#include "bub_log.h"
 #include "bub_sysdeps.h"
-
-/*
- * Note: The below header definitions are taken from
- *       system/core/mkbootimg/bootimg.h
- */
-typedef struct boot_img_hdr boot_img_hdr;
-
-#define BOOT_MAGIC {'A','N','D','R','O','I','D','!'}
-#define BOOT_MAGIC_SIZE 8
-#define BOOT_NAME_SIZE 16
-#define BOOT_ARGS_SIZE 512
-#define BOOT_EXTRA_ARGS_SIZE 1024
-
-struct boot_img_hdr
-{
-    UINT8 magic[BOOT_MAGIC_SIZE];
-
-    UINT32 kernel_size;  /* size in bytes */
-    UINT32 kernel_addr;  /* physical load addr */
-
-    UINT32 ramdisk_size; /* size in bytes */
-    UINT32 ramdisk_addr; /* physical load addr */
-
-    UINT32 second_size;  /* size in bytes */
-    UINT32 second_addr;  /* physical load addr */
-
-    UINT32 tags_addr;    /* physical addr for kernel tags */
-    UINT32 page_size;    /* flash page size we assume */
-    UINT32 unused;       /* reserved for future expansion: MUST be 0 */
-
-    /* operating system version and security patch level; for
-     * version "A.B.C" and patch level "Y-M-D":
-     * ver = A << 14 | B << 7 | C         (7 bits for each of A, B, C)
-     * lvl = ((Y - 2000) & 127) << 4 | M  (7 bits for Y, 4 bits for M)
-     * os_version = ver << 11 | lvl */
-    UINT32 os_version;
-
-    UINT8 name[BOOT_NAME_SIZE]; /* asciiz product name */
-
-    UINT8 cmdline[BOOT_ARGS_SIZE];
-
-    UINT32 id[8]; /* timestamp / checksum / sha1 / etc */
-
-    /* Supplemental command line data; kept here to maintain
-     * binary compatibility with older versions of mkbootimg */
-    UINT8 extra_cmdline[BOOT_EXTRA_ARGS_SIZE];
-} __attribute__((packed));
-
-/*
-** +-----------------+
-** | boot header     | 1 page
-** +-----------------+
-** | kernel          | n pages
-** +-----------------+
-** | ramdisk         | m pages
-** +-----------------+
-** | second stage    | o pages
-** +-----------------+
-**
-** n = (kernel_size + page_size - 1) / page_size
-** m = (ramdisk_size + page_size - 1) / page_size
-** o = (second_size + page_size - 1) / page_size
-**
-** 0. all entities are page_size aligned in flash
-** 1. kernel and ramdisk are required (size != 0)
-** 2. second is optional (second_size == 0 -> no second)
-** 3. load each element (kernel, ramdisk, second) at
-**    the specified physical address (kernel_addr, etc)
-** 4. prepare tags at tag_addr.  kernel_args[] is
-**    appended to the kernel commandline in the tags.
-** 5. r0 = 0, r1 = MACHINE_TYPE, r2 = tags_addr
-** 6. if second_size != 0: jump to second_addr
-**    else: jump to kernel_addr
-*/
+#include "bub_timings.h"
 
 /* uefi_call_wrapper's second arguments is the number of argumets for the
  * called function
  */
 #define NUM_ARGS_HANDLE_PROTOCOL 3
 #define NUM_ARGS_ALLOCATE_POOL 3
+#define NUM_ARGS_ALLOCATE_PAGES 4
+#define NUM_ARGS_FREE_PAGES 2
 #define NUM_ARGS_LOCATE_DEVICE_PATH 3
-#define NUM_ARGS_READ_BLOCKS 5
+#define NUM_ARGS_LOCATE_HANDLE_BUFFER 5
+#define NUM_ARGS_GET_VARIABLE 5
+#define NUM_ARGS_SET_VARIABLE 5
+#define NUM_ARGS_READ_DISK 5
+#define NUM_ARGS_WRITE_DISK 5
 #define NUM_ARGS_LOAD_IMAGE 6
-
-/* Helper method to get the parent path to the current |walker| path given the
- * initial path, |init|. Resulting path is stored in |next|.  Caller is
- * responsible for freeing |next|. Stores allocated bytes for |next| in
- * |out_bytes|.
- *
- * @return EFI_STATUS Standard UEFI error code, EFI_SUCCESS on success.
+#define NUM_ARGS_UNLOAD_IMAGE 1
+#define NUM_ARGS_INSTALL_INITRD 6
+#define NUM_ARGS_UNINSTALL_INITRD 6
+#define NUM_ARGS_INSTALL_KERNEL 6
+#define NUM_ARGS_UNINSTALL_KERNEL 6
+
+/* Vendor media device path the Linux EFI stub looks up to find the protocol
+ * providing its initrd, see drivers/firmware/efi/libstub in the kernel.
  */
-static EFI_STATUS walk_path(IN EFI_DEVICE_PATH *init,
-                            IN EFI_DEVICE_PATH *walker,
-                            OUT EFI_DEVICE_PATH **next,
-                            OUT UINTN* out_bytes) {
-  // Number of bytes from initial path to current walker.
-  UINTN walker_bytes = (UINT8 *)NextDevicePathNode(walker) - (UINT8 *)init;
-  *out_bytes = sizeof(EFI_DEVICE_PATH) + walker_bytes;
-
-  *next = (EFI_DEVICE_PATH*)bub_malloc_(*out_bytes);
-  if (*next == NULL) {
-    *out_bytes = 0;
-    return EFI_NOT_FOUND;
-  }
+#define LINUX_EFI_INITRD_MEDIA_GUID \
+  {0x5568e427, 0x68fc, 0x4f3d, {0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68}}
+#define EFI_LOAD_FILE2_PROTOCOL_GUID \
+  {0x4006c0c1, 0xfcb3, 0x403e, {0x99, 0x6d, 0x4a, 0x6c, 0x87, 0x24, 0xe0, 0x6d}}
 
-  // Copy in the previous paths.
-  bub_memcpy((*next), init, walker_bytes);
-  // Copy in the new ending of the path.
-  bub_memcpy((UINT8 *)(*next) + walker_bytes,
-             EndDevicePath,
-             sizeof(EFI_DEVICE_PATH));
-  return EFI_SUCCESS;
-}
-
-/* Helper method to validate a GPT header, |gpth|.
- *
- * @return EFI_STATUS EFI_SUCCESS on success.
+/* Vendor media device path LoadImage() is pointed at to have the firmware
+ * read the kernel straight from the boot partition, see load_kernel_image().
  */
-static EFI_STATUS validate_gpt(const IN GPTHeader *gpth) {
-  if (bub_memcmp(gpth->signature, GPT_MAGIC, sizeof(gpth->signature))
-      != 0) {
-    bub_warning("GPT signature does not match.\n");
-    return EFI_NOT_FOUND;
-  }
-  // Make sure GPT header bytes are within minimun and block size.
-  if (gpth->header_size < GPT_MIN_SIZE) {
-    bub_warning("GPT header too small.\n");
-    return EFI_NOT_FOUND;
-  }
-  if (gpth->header_size > BUB_BLOCK_SIZE) {
-    bub_warning("GPT header too big.\n");
-    return EFI_NOT_FOUND;
-  }
+#define BUB_KERNEL_MEDIA_GUID \
+  {0x8b3c1a57, 0x0d2e, 0x4f61, {0xa4, 0x19, 0x6e, 0x2b, 0x90, 0x5c, 0xd3, 0x47}}
 
-  GPTHeader gpth_tmp = {{0}};
-  bub_memcpy(&gpth_tmp, gpth, sizeof(GPTHeader));
-  UINT32 gpt_header_crc = gpth_tmp.header_crc32;
-  gpth_tmp.header_crc32 = 0;
-  UINT32 gpt_header_crc_calc =
-    CalculateCrc((UINT8*)&gpth_tmp, gpth_tmp.header_size);
+/* Vendor GUID and name of the non-volatile variable holding the
+ * BubBootDiskHint of the boot disk.
+ */
+#define BUB_BOOT_DISK_HINT_VENDOR_GUID \
+  {0x292d84d1, 0x6a21, 0x4124, {0x9d, 0x7e, 0xcd, 0x86, 0xab, 0xa2, 0x99, 0x4f}}
+static CHAR16 boot_disk_hint_variable[] = L"BubBootDiskHint";
 
-#ifdef BUB_ENABLE_DEBUG
-  Print(L"GPT Header CRC: %d\n", gpt_header_crc);
-  Print(L"GPT Header CRC calculated: %d\n", gpt_header_crc_calc);
+/* Protocol members are called by the kernel with the UEFI calling convention,
+ * independent of how this application calls into the firmware.
+ */
+#if defined(__x86_64__)
+#define BUB_EFIAPI __attribute__((ms_abi))
+#else
+#define BUB_EFIAPI
 #endif
-  if(gpt_header_crc != gpt_header_crc_calc) {
-    bub_warning("GPT header crc invalid.\n");
-    return EFI_NOT_FOUND;
-  }
-
-  if (gpth->revision != GPT_REVISION) {
-    bub_warning("GPT header wrong revision.\n");
-    return EFI_NOT_FOUND;
-  }
 
-  return EFI_SUCCESS;
-}
+typedef struct InitrdLoadFile2 InitrdLoadFile2;
+
+/* EFI_LOAD_FILE2_PROTOCOL serving the ramdisk of the boot image. */
+struct InitrdLoadFile2 {
+  EFI_STATUS (BUB_EFIAPI *LoadFile)(InitrdLoadFile2* This,
+                                    EFI_DEVICE_PATH* FilePath,
+                                    BOOLEAN BootPolicy,
+                                    UINTN* BufferSize,
+                                    VOID* Buffer);
+  const UINT8* ramdisk;
+  UINTN ramdisk_size;
+};
+
+typedef struct {
+  VENDOR_DEVICE_PATH vendor;
+  EFI_DEVICE_PATH end;
+} __attribute__((packed)) InitrdDevicePath;
+
+static InitrdLoadFile2 initrd_load_file2;
+static EFI_HANDLE initrd_handle = NULL;
+static InitrdDevicePath initrd_device_path = {
+  {
+    {MEDIA_DEVICE_PATH, MEDIA_VENDOR_DP, {sizeof(VENDOR_DEVICE_PATH), 0}},
+    LINUX_EFI_INITRD_MEDIA_GUID
+  },
+  {END_DEVICE_PATH_TYPE, END_ENTIRE_DEVICE_PATH_SUBTYPE,
+   {sizeof(EFI_DEVICE_PATH), 0}}
+};
+
+typedef struct KernelLoadFile2 KernelLoadFile2;
+
+/* EFI_LOAD_FILE2_PROTOCOL serving the kernel of the boot image from disk. */
+struct KernelLoadFile2 {
+  EFI_STATUS (BUB_EFIAPI *LoadFile)(KernelLoadFile2* This,
+                                    EFI_DEVICE_PATH* FilePath,
+                                    BOOLEAN BootPolicy,
+                                    UINTN* BufferSize,
+                                    VOID* Buffer);
+  MyBubOps* bub;
+  const char* partition_name;
+  UINT64 kernel_offset;
+  UINT64 kernel_size;
+  // Hashes the kernel as it is read, if not NULL, starting over from
+  // |sha256_start| on every read.
+  BubSha256Ctx* sha256;
+  BubSha256Ctx sha256_start;
+  // Placement requirements from the setup header of the kernel last read.
+  BubKernelPlacement placement;
+  int have_placement;
+};
+
+static KernelLoadFile2 kernel_load_file2;
+static InitrdDevicePath kernel_device_path = {
+  {
+    {MEDIA_DEVICE_PATH, MEDIA_VENDOR_DP, {sizeof(VENDOR_DEVICE_PATH), 0}},
+    BUB_KERNEL_MEDIA_GUID
+  },
+  {END_DEVICE_PATH_TYPE, END_ENTIRE_DEVICE_PATH_SUBTYPE,
+   {sizeof(EFI_DEVICE_PATH), 0}}
+};
 
 /* Allocates a pool of memory in the EfiLoaderData region for the LoadOptions
  * member of |loaded_image|.  The LoadOptions member is needed by next boot
@@ -195,7 +151,8 @@ static EFI_STATUS validate_gpt(const IN GPTHeader *gpth) {
  * stub is expected to pass the stored string (CHAR16 type) to the kernel.
  *
  * |image_header| is assumed to contain the kernel command line string.
- * |image| is the kernel image handle to be booted.
+ * |image| is the kernel image handle to be booted. The boot stage timings are
+ * appended to the command line as the last step before the kernel starts.
  *
  *
  * @return EFI_STATUS EFI_NOT_FOUND on fail. EFI_SUCCESS on success.
@@ -219,7 +176,8 @@ static EFI_STATUS LoadParameters(EFI_HANDLE image,
 
   err = uefi_call_wrapper(BS->AllocatePool, NUM_ARGS_ALLOCATE_POOL,
                           EfiLoaderData,
-                          BOOT_ARGS_SIZE * sizeof(UINT16),
+                          (BOOT_ARGS_SIZE + BUB_TIMINGS_MAX_LEN) *
+                          sizeof(UINT16),
                           &(*loaded_image)->LoadOptions);
   if (EFI_ERROR(err)) {
     bub_warning("Could not allocate for kernel parameters\n");
@@ -227,9 +185,18 @@ static EFI_STATUS LoadParameters(EFI_HANDLE image,
   }
 
   UINT32 i;
-  for (i = 0; image_header->cmdline[i] != '\0'; ++i)
+  for (i = 0; i < BOOT_ARGS_SIZE - 1 && image_header->cmdline[i] != '\0'; ++i)
     ((CHAR16 *)((*loaded_image)->LoadOptions))[i] =
       (CHAR16)image_header->cmdline[i];
+
+  char timings[BUB_TIMINGS_MAX_LEN];
+  UINT32 j;
+  bub_timing_mark(BUB_STAGE_START_IMAGE);
+  bub_timings_format(timings, sizeof(timings));
+  if (i > 0)
+    ((CHAR16 *)((*loaded_image)->LoadOptions))[i++] = L' ';
+  for (j = 0; timings[j] != '\0'; ++j)
+    ((CHAR16 *)((*loaded_image)->LoadOptions))[i++] = (CHAR16)timings[j];
   ((CHAR16 *)((*loaded_image)->LoadOptions))[i] = L'\0';
 
   (*loaded_image)->LoadOptionsSize = i * sizeof(UINT16);
@@ -237,253 +204,565 @@ static EFI_STATUS LoadParameters(EFI_HANDLE image,
   return EFI_SUCCESS;
 }
 
-/* Queries |disk_handle| for a |block_io| device and the corresponding path,
- * |block_path|.  The |block_io| device is found by iteratively querying parent
- * devices and checking for a GPT Header.  This ensures the resulting
- * |block_io| device is the top level block device having access to partition
- * entries.
+static EFI_STATUS BUB_EFIAPI initrd_load_file(InitrdLoadFile2* This,
+                                              EFI_DEVICE_PATH* FilePath,
+                                              BOOLEAN BootPolicy,
+                                              UINTN* BufferSize,
+                                              VOID* Buffer) {
+  if (This != &initrd_load_file2 || BufferSize == NULL)
+    return EFI_INVALID_PARAMETER;
+  if (BootPolicy)
+    return EFI_UNSUPPORTED;
+
+  if (Buffer == NULL || *BufferSize < This->ramdisk_size) {
+    *BufferSize = This->ramdisk_size;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  bub_memcpy(Buffer, This->ramdisk, This->ramdisk_size);
+  *BufferSize = This->ramdisk_size;
+  return EFI_SUCCESS;
+}
+
+/* Publishes |ramdisk| to the next boot stage through the LINUX_EFI_INITRD_MEDIA
+ * LoadFile2 protocol. The protocol is installed once and retargeted on
+ * subsequent calls, e.g. when falling back to the other slot, or removed if
+ * |ramdisk_size| is zero. |ramdisk| must stay valid until the kernel has
+ * started.
  *
- * @return EFI_STATUS EFI_NOT_FOUND on fail, EFI_SUCCESS otherwise.
+ * @return EFI_STATUS EFI_SUCCESS on success.
  */
-static EFI_STATUS getDiskBlockIo(IN EFI_HANDLE* block_handle,
-                                 OUT EFI_BLOCK_IO** block_io,
-                                 OUT EFI_DISK_IO** disk_io,
-                                 OUT EFI_DEVICE_PATH** io_path) {
+static EFI_STATUS InstallInitrd(const UINT8* ramdisk, UINTN ramdisk_size) {
   EFI_STATUS err;
-  EFI_HANDLE disk_handle;
-  UINTN path_bytes;
-  EFI_DEVICE_PATH *disk_path;
-  EFI_DEVICE_PATH *walker_path;
-  EFI_DEVICE_PATH *init_path;
-  GPTHeader gpt_header = {{0}};
-  init_path = DevicePathFromHandle(block_handle);
+  EFI_GUID load_file2_protocol = EFI_LOAD_FILE2_PROTOCOL_GUID;
 
-#ifdef BUB_ENABLE_DEBUG
-  Print(L"Initial Device Path: %s\n", DevicePathToStr(init_path));
-#endif
+  if (ramdisk_size == 0) {
+    if (initrd_handle == NULL)
+      return EFI_SUCCESS;
+    err = uefi_call_wrapper(BS->UninstallMultipleProtocolInterfaces,
+                            NUM_ARGS_UNINSTALL_INITRD,
+                            initrd_handle,
+                            &DevicePathProtocol,
+                            &initrd_device_path,
+                            &load_file2_protocol,
+                            &initrd_load_file2,
+                            NULL);
+    if (EFI_ERROR(err)) {
+      bub_warning("Could not uninstall initrd LoadFile2 protocol.\n");
+      return err;
+    }
+    initrd_handle = NULL;
+    return EFI_SUCCESS;
+  }
 
-  if (!init_path)
-    return EFI_NOT_FOUND;
+  initrd_load_file2.LoadFile = initrd_load_file;
+  initrd_load_file2.ramdisk = ramdisk;
+  initrd_load_file2.ramdisk_size = ramdisk_size;
+  if (initrd_handle != NULL)
+    return EFI_SUCCESS;
 
-  walker_path = init_path;
-  while(!IsDevicePathEnd(walker_path)) {
-    walker_path = NextDevicePathNode(walker_path);
+  err = uefi_call_wrapper(BS->InstallMultipleProtocolInterfaces,
+                          NUM_ARGS_INSTALL_INITRD,
+                          &initrd_handle,
+                          &DevicePathProtocol,
+                          &initrd_device_path,
+                          &load_file2_protocol,
+                          &initrd_load_file2,
+                          NULL);
+  if (EFI_ERROR(err)) {
+    bub_warning("Could not install initrd LoadFile2 protocol.\n");
+    initrd_handle = NULL;
+    return err;
+  }
 
-#ifdef BUB_ENABLE_DEBUG
-    Print(L"DevicePathType: %x\n", DevicePathType(walker_path));
-#endif
+  return EFI_SUCCESS;
+}
 
-    err = walk_path(init_path, walker_path, &(*io_path), &path_bytes);
-    if (EFI_ERROR(err)) {
-      bub_warning("Cannot walk device path.\n");
-      return EFI_NOT_FOUND;
-    }
+/* BubChunkFn hashing the kernel as the firmware's buffer fills. */
+static int hash_kernel_chunk(void* user_data, const UINT8* chunk,
+                             UINTN num_bytes) {
+  bub_sha256_update((BubSha256Ctx*)user_data, chunk, num_bytes);
+  return 1;
+}
 
-#ifdef BUB_ENABLE_DEBUG
-    Print(L"Walking Device Path: %s\n", DevicePathToStr(*io_path));
-#endif
-    disk_path = (EFI_DEVICE_PATH*)bub_malloc_(path_bytes);
-    bub_memcpy(disk_path, *io_path, path_bytes);
-    err = uefi_call_wrapper(BS->LocateDevicePath, NUM_ARGS_LOCATE_DEVICE_PATH,
-                            &BlockIoProtocol,
-                            &(*io_path),
-                            &block_handle);
-    if (EFI_ERROR(err)) {
-      bub_warning("LocateDevicePath, BLOCK_IO_PROTOCOL.\n");
-      bub_free(*io_path);
-      bub_free(disk_path);
-      continue;
-    }
-    err = uefi_call_wrapper(BS->LocateDevicePath, NUM_ARGS_LOCATE_DEVICE_PATH,
-                            &DiskIoProtocol,
-                            &disk_path,
-                            &disk_handle);
-    if (EFI_ERROR(err)) {
-      bub_warning("LocateDevicePath, DISK_IO_PROTOCOL.\n");
-      bub_free(*io_path);
-      bub_free(disk_path);
-      continue;
-    }
+static EFI_STATUS BUB_EFIAPI kernel_load_file(KernelLoadFile2* This,
+                                              EFI_DEVICE_PATH* FilePath,
+                                              BOOLEAN BootPolicy,
+                                              UINTN* BufferSize,
+                                              VOID* Buffer) {
+  BubChunkFn chunk_fn = NULL;
+
+  if (This != &kernel_load_file2 || BufferSize == NULL)
+    return EFI_INVALID_PARAMETER;
+  if (BootPolicy)
+    return EFI_UNSUPPORTED;
+
+  if (Buffer == NULL || *BufferSize < This->kernel_size) {
+    *BufferSize = This->kernel_size;
+    return EFI_BUFFER_TOO_SMALL;
+  }
 
-    // Handle Block and Disk i/o.
-    // Attempt to get handle on device, must be Block/Disk Io type.
-    err = uefi_call_wrapper(BS->HandleProtocol, NUM_ARGS_HANDLE_PROTOCOL,
-                            block_handle,
-                            &BlockIoProtocol,
-                            (VOID **)&(*block_io));
-    if (EFI_ERROR(err)) {
-      bub_warning("Cannot get handle on block device.\n");
-      bub_free(*io_path);
-      bub_free(disk_path);
-      continue;
-    }
-    err = uefi_call_wrapper(BS->HandleProtocol, NUM_ARGS_HANDLE_PROTOCOL,
-                            disk_handle,
-                            &DiskIoProtocol,
-                            (VOID **)&(*disk_io));
-    if (EFI_ERROR(err)) {
-      bub_warning("Cannot get handle on disk device.\n");
-      bub_free(*io_path);
-      bub_free(disk_path);
-      continue;
-    }
+  // Start over in case the firmware asks for the file more than once.
+  if (This->sha256 != NULL) {
+    *This->sha256 = This->sha256_start;
+    chunk_fn = hash_kernel_chunk;
+  }
+  if (bub_stream_from_partition(This->bub,
+                                This->partition_name,
+                                Buffer,
+                                This->kernel_offset,
+                                This->kernel_size,
+                                chunk_fn,
+                                This->sha256)) {
+    bub_warning("Could not read kernel image.\n");
+    return EFI_DEVICE_ERROR;
+  }
+  This->have_placement = bub_boot_image_get_kernel_placement(
+      Buffer, This->kernel_size, &This->placement);
+  *BufferSize = This->kernel_size;
+  return EFI_SUCCESS;
+}
 
-    if ((*block_io)->Media->LogicalPartition ||
-        !(*block_io)->Media->MediaPresent) {
-      bub_warning("Logical partion or No Media Present, continue...\n");
-      bub_free(*io_path);
-      bub_free(disk_path);
-      continue;
-    }
+/* Loads the uncompressed kernel of |layout| by pointing LoadImage() at a
+ * LoadFile2 protocol over the boot partition instead of at a copy in memory.
+ * The firmware reads the kernel into a buffer of its own, relocates it and
+ * frees the buffer again, so the boot loader never holds the kernel. The
+ * protocol is only installed for the duration of the call. If |sha256| is
+ * not NULL, the kernel is hashed into it as it is read, following whatever
+ * was hashed before the call. The placement requirements of the kernel are
+ * stored in |placement|, and |have_placement| is set to zero if it has no
+ * setup header.
+ *
+ * @return EFI_STATUS EFI_SUCCESS on success.
+ */
+static EFI_STATUS load_kernel_image(MyBubOps* bub,
+                                    const char* partition_name,
+                                    const BubBootImageLayout* layout,
+                                    BubSha256Ctx* sha256,
+                                    BubKernelPlacement* placement,
+                                    int* have_placement,
+                                    EFI_HANDLE* kernel_image) {
+  EFI_STATUS err;
+  EFI_STATUS uninstall_err;
+  EFI_GUID load_file2_protocol = EFI_LOAD_FILE2_PROTOCOL_GUID;
+  EFI_HANDLE handle = NULL;
+
+  kernel_load_file2.LoadFile = kernel_load_file;
+  kernel_load_file2.bub = bub;
+  kernel_load_file2.partition_name = partition_name;
+  kernel_load_file2.kernel_offset = layout->kernel_offset;
+  kernel_load_file2.kernel_size = layout->kernel_size;
+  kernel_load_file2.sha256 = sha256;
+  if (sha256 != NULL)
+    kernel_load_file2.sha256_start = *sha256;
+  kernel_load_file2.have_placement = 0;
+
+  err = uefi_call_wrapper(BS->InstallMultipleProtocolInterfaces,
+                          NUM_ARGS_INSTALL_KERNEL,
+                          &handle,
+                          &DevicePathProtocol,
+                          &kernel_device_path,
+                          &load_file2_protocol,
+                          &kernel_load_file2,
+                          NULL);
+  if (EFI_ERROR(err)) {
+    bub_warning("Could not install kernel LoadFile2 protocol.\n");
+    return err;
+  }
 
-    err = uefi_call_wrapper((*block_io)->ReadBlocks, NUM_ARGS_READ_BLOCKS,
-                            (*block_io),
-                            (*block_io)->Media->MediaId,
-                            1,
-                            sizeof(GPTHeader),
-                            &gpt_header);
+  err = uefi_call_wrapper(BS->LoadImage, NUM_ARGS_LOAD_IMAGE,
+                          FALSE,
+                          bub->efi_image_handle,
+                          (EFI_DEVICE_PATH*)&kernel_device_path,
+                          NULL,
+                          0,
+                          kernel_image);
+
+  uninstall_err = uefi_call_wrapper(BS->UninstallMultipleProtocolInterfaces,
+                                    NUM_ARGS_UNINSTALL_KERNEL,
+                                    handle,
+                                    &DevicePathProtocol,
+                                    &kernel_device_path,
+                                    &load_file2_protocol,
+                                    &kernel_load_file2,
+                                    NULL);
+  if (EFI_ERROR(uninstall_err))
+    bub_warning("Could not uninstall kernel LoadFile2 protocol.\n");
+
+  *placement = kernel_load_file2.placement;
+  *have_placement = kernel_load_file2.have_placement;
+  return err;
+}
 
-    if (EFI_ERROR(err)) {
-      bub_warning("ReadBlocks, Block Media error.\n");
-      bub_free(*io_path);
-      bub_free(disk_path);
-      continue;
-    }
+/* Returns non-zero if |image_path| lies on the disk at |disk_path|, that is
+ * if all nodes of |disk_path| but its end node start |image_path|.
+ */
+static int disk_contains_path(EFI_DEVICE_PATH* disk_path,
+                              EFI_DEVICE_PATH* image_path) {
+  UINTN disk_bytes = DevicePathSize(disk_path) - sizeof(EFI_DEVICE_PATH);
+  UINTN image_bytes = DevicePathSize(image_path) - sizeof(EFI_DEVICE_PATH);
 
-    err = validate_gpt(&gpt_header);
-    if (EFI_ERROR(err)) {
-      bub_warning("Invalid GPTHeader\n");
-      bub_free(*io_path);
-      bub_free(disk_path);
-      continue;
-    }
+  return disk_bytes <= image_bytes &&
+         bub_memcmp(disk_path, image_path, disk_bytes) == 0;
+}
 
-#ifdef BUB_ENABLE_DEBUG
-    Print(L"Walking Device Path3   : %s\n", DevicePathToStr(disk_path));
-    Print(L"Validated GPT\n");
-#endif
-    return EFI_SUCCESS;
-  }
+static BubIOResult efi_block_dev_read(BubBlockDev* dev, uint64_t offset,
+                                      void* buf, size_t num_bytes) {
+  EfiBlockDev* efi_dev = (EfiBlockDev*)dev;
+  EFI_STATUS err;
 
-  (*block_io) = NULL;
-  return EFI_NOT_FOUND;
+  err = uefi_call_wrapper(efi_dev->disk_io->ReadDisk, NUM_ARGS_READ_DISK,
+                          efi_dev->disk_io,
+                          efi_dev->block_io->Media->MediaId,
+                          offset,
+                          num_bytes,
+                          buf);
+  if (EFI_ERROR(err))
+    return BUB_IO_RESULT_ERROR_IO;
+  return BUB_IO_RESULT_OK;
 }
 
-EFI_STATUS bub_partition_entry_by_name(IN EFI_BLOCK_IO *block_io,
-                                       const char* partition_name,
-                                       GPTEntry** entry_buf) {
+static BubIOResult efi_block_dev_write(BubBlockDev* dev, uint64_t offset,
+                                       const void* buf, size_t num_bytes) {
+  EfiBlockDev* efi_dev = (EfiBlockDev*)dev;
   EFI_STATUS err;
-  GPTHeader* gpt_header = NULL;
-  GPTEntry all_gpt_entries[MAX_GPT_ENTRIES];
-  CHAR16* partition_name_ucs2 = NULL;
-  UINTN partition_name_bytes;
-
-  gpt_header = (GPTHeader*)bub_malloc_(sizeof(GPTHeader));
-  if (gpt_header == NULL) {
-    bub_warning("Could not allocate for GPT header\n");
+
+  err = uefi_call_wrapper(efi_dev->disk_io->WriteDisk, NUM_ARGS_WRITE_DISK,
+                          efi_dev->disk_io,
+                          efi_dev->block_io->Media->MediaId,
+                          offset,
+                          num_bytes,
+                          buf);
+  if (EFI_ERROR(err))
+    return BUB_IO_RESULT_ERROR_IO;
+  return BUB_IO_RESULT_OK;
+}
+
+/* Sets up |dev| for I/O on the disk behind |block_io| and |disk_io|. */
+static void init_efi_block_dev(EfiBlockDev* dev,
+                               EFI_BLOCK_IO* block_io,
+                               EFI_DISK_IO* disk_io) {
+  dev->parent.read = efi_block_dev_read;
+  dev->parent.write = efi_block_dev_write;
+  dev->parent.block_size = block_io->Media->BlockSize;
+  dev->parent.num_blocks = block_io->Media->LastBlock + 1;
+  dev->block_io = block_io;
+  dev->disk_io = disk_io;
+}
+
+/* Opens |disk_handle| for block and disk I/O and reads its GPT header into
+ * |gpt_header|, see bub_gpt_read_header().
+ *
+ * @return EFI_NOT_FOUND if |disk_handle| is a partition, has no media or
+ *         does not carry a valid GPT, EFI_SUCCESS otherwise.
+ */
+static EFI_STATUS open_gpt_disk(EFI_HANDLE disk_handle,
+                                OUT EFI_BLOCK_IO** block_io,
+                                OUT EFI_DISK_IO** disk_io,
+                                OUT GPTHeader* gpt_header) {
+  EFI_STATUS err;
+  EfiBlockDev dev;
+
+  err = uefi_call_wrapper(BS->HandleProtocol, NUM_ARGS_HANDLE_PROTOCOL,
+                          disk_handle,
+                          &BlockIoProtocol,
+                          (VOID **)&(*block_io));
+  if (EFI_ERROR(err))
     return EFI_NOT_FOUND;
-  }
 
-  *entry_buf = (GPTEntry*)bub_malloc_(sizeof(GPTEntry) * ENTRIES_PER_BLOCK);
-  if (entry_buf == NULL) {
-    bub_warning("Could not allocate for partition entry\n");
-    bub_free(gpt_header);
+  if ((*block_io)->Media->LogicalPartition ||
+      !(*block_io)->Media->MediaPresent)
     return EFI_NOT_FOUND;
-  }
 
-  err = uefi_call_wrapper(block_io->ReadBlocks, NUM_ARGS_READ_BLOCKS,
-                          block_io,
-                          block_io->Media->MediaId,
-                          1,
-                          sizeof(GPTHeader),
-                          gpt_header);
+  err = uefi_call_wrapper(BS->HandleProtocol, NUM_ARGS_HANDLE_PROTOCOL,
+                          disk_handle,
+                          &DiskIoProtocol,
+                          (VOID **)&(*disk_io));
   if (EFI_ERROR(err)) {
-    bub_warning("Could not ReadBlocks for gpt header\n");
-    bub_free(gpt_header);
-    bub_free(*entry_buf);
-    *entry_buf = NULL;
+    bub_warning("Cannot get handle on disk device.\n");
     return EFI_NOT_FOUND;
   }
 
-  partition_name_bytes = bub_strlen(partition_name) + 1;
-  partition_name_ucs2 =
-    bub_calloc(sizeof(CHAR16) * partition_name_bytes);
-  if (partition_name_ucs2 == NULL) {
-    bub_warning ("Could not allocate for ucs2 partition name\n");
-    bub_free(gpt_header);
-    bub_free(*entry_buf);
-    *entry_buf = NULL;
+  // Byte-addressed reads work for any block size, unlike a ReadBlocks() of
+  // sizeof(GPTHeader) bytes on 4K-sector media.
+  init_efi_block_dev(&dev, *block_io, *disk_io);
+  if (bub_gpt_read_header(&dev.parent, gpt_header) != BUB_IO_RESULT_OK) {
+    bub_warning("Invalid GPTHeader\n");
     return EFI_NOT_FOUND;
   }
-  if (utf8_to_ucs2(partition_name,
-                   partition_name_bytes,
-                   partition_name_ucs2,
-                   sizeof(CHAR16) * partition_name_bytes)) {
-    bub_warning("Could not convert partition name to UCS-2\n");
-    bub_free(gpt_header);
-    bub_free(partition_name_ucs2);
-    bub_free(*entry_buf);
-    *entry_buf = NULL;
+  return EFI_SUCCESS;
+}
+
+/* Resolves the boot disk hint saved by a previous boot. The hint is used
+ * only if |image_path| lies on the hinted disk and the GPT there still has
+ * the disk GUID of the hint, which costs a single block read.
+ *
+ * @return EFI_NOT_FOUND if there is no usable hint, EFI_SUCCESS otherwise.
+ */
+static EFI_STATUS find_disk_from_hint(EFI_DEVICE_PATH* image_path,
+                                      OUT EFI_HANDLE* disk_handle,
+                                      OUT EFI_BLOCK_IO** block_io,
+                                      OUT EFI_DISK_IO** disk_io) {
+  EFI_STATUS err;
+  EFI_GUID vendor_guid = BUB_BOOT_DISK_HINT_VENDOR_GUID;
+  UINT8 hint_buf[BUB_BOOT_DISK_HINT_MAX_SIZE];
+  UINTN hint_size = sizeof(hint_buf);
+  BubBootDiskHint hint;
+  EFI_DEVICE_PATH* hint_path;
+  GPTHeader gpt_header = {{0}};
+
+  err = uefi_call_wrapper(RT->GetVariable, NUM_ARGS_GET_VARIABLE,
+                          boot_disk_hint_variable,
+                          &vendor_guid,
+                          NULL,
+                          &hint_size,
+                          hint_buf);
+  if (EFI_ERROR(err))
+    return EFI_NOT_FOUND;
+
+  if (!bub_boot_disk_hint_validate(hint_buf, hint_size)) {
+    bub_warning("Ignoring malformed boot disk hint.\n");
     return EFI_NOT_FOUND;
   }
+  bub_memcpy(&hint, hint_buf, sizeof(hint));
+  hint_path = (EFI_DEVICE_PATH*)(hint_buf + sizeof(hint));
 
-#ifdef BUB_ENABLE_DEBUG
-  Print(L"\nENTRY: %d, BLOCKSIZE: %d, GPTEntry: %d\n",
-            gpt_header->entry_count,
-            block_io->Media->BlockSize,
-            sizeof(GPTEntry));
-#endif
+  if (!disk_contains_path(hint_path, image_path))
+    return EFI_NOT_FOUND;
+
+  // The hint must name a block device exactly, not one of its children.
+  err = uefi_call_wrapper(BS->LocateDevicePath, NUM_ARGS_LOCATE_DEVICE_PATH,
+                          &BlockIoProtocol,
+                          &hint_path,
+                          disk_handle);
+  if (EFI_ERROR(err) || !IsDevicePathEnd(hint_path))
+    return EFI_NOT_FOUND;
+
+  err = open_gpt_disk(*disk_handle, block_io, disk_io, &gpt_header);
+  if (EFI_ERROR(err))
+    return EFI_NOT_FOUND;
 
-  // Block-aligned bytes for entries.
-  UINTN entries_num_bytes = block_io->Media->BlockSize *
-                            (MAX_GPT_ENTRIES / ENTRIES_PER_BLOCK);
+  if (bub_memcmp(gpt_header.disk_guid, hint.disk_guid,
+                 sizeof(hint.disk_guid)) != 0)
+    return EFI_NOT_FOUND;
+  return EFI_SUCCESS;
+}
 
-  err = uefi_call_wrapper(block_io->ReadBlocks, NUM_ARGS_READ_BLOCKS,
-                          block_io,
-                          block_io->Media->MediaId,
-                          GPT_ENTRIES_LBA,
-                          entries_num_bytes,
-                          &all_gpt_entries);
+/* Finds the whole disk holding |image_path| in a single pass over all block
+ * devices. Candidates are matched on their device path first, so only the
+ * disk holding the image is read.
+ *
+ * @return EFI_NOT_FOUND on fail, EFI_SUCCESS otherwise.
+ */
+static EFI_STATUS find_disk(EFI_DEVICE_PATH* image_path,
+                            OUT EFI_HANDLE* disk_handle,
+                            OUT EFI_BLOCK_IO** block_io,
+                            OUT EFI_DISK_IO** disk_io,
+                            OUT GPTHeader* gpt_header) {
+  EFI_STATUS err;
+  EFI_HANDLE* handles;
+  EFI_DEVICE_PATH* disk_path;
+  UINTN num_handles;
+  UINTN n;
+
+  err = uefi_call_wrapper(BS->LocateHandleBuffer,
+                          NUM_ARGS_LOCATE_HANDLE_BUFFER,
+                          ByProtocol,
+                          &BlockIoProtocol,
+                          NULL,
+                          &num_handles,
+                          &handles);
   if (EFI_ERROR(err)) {
-    bub_warning("Could not ReadBlocks for GPT header\n");
-    bub_free(gpt_header);
-    bub_free(partition_name_ucs2);
-    bub_free(*entry_buf);
-    *entry_buf = NULL;
+    bub_warning("LocateHandleBuffer, BLOCK_IO_PROTOCOL.\n");
     return EFI_NOT_FOUND;
   }
 
-  // Find matching partition name.
-  UINT8 i;
-  for (i = 0; i < gpt_header->entry_count; ++i)
-    if ((StrLen(partition_name_ucs2) ==
-         StrLen(all_gpt_entries[i].name)) &&
-        !bub_memcmp(all_gpt_entries[i].name,
-                    partition_name_ucs2,
-                    sizeof(CHAR16) * bub_strlen(partition_name))) {
-#ifdef BUB_ENABLE_DEBUG
-      Print(L"Requested Partition: %s\n", partition_name_ucs2);
-      Print(L"Found Partition Name is: %s\n", all_gpt_entries[i].name);
-      Print(L"Found Partition LBA is: %d\n", all_gpt_entries[i].first_lba);
+  err = EFI_NOT_FOUND;
+  for (n = 0; n < num_handles; ++n) {
+    disk_path = DevicePathFromHandle(handles[n]);
+    if (disk_path == NULL || !disk_contains_path(disk_path, image_path))
+      continue;
+
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
+    Print(L"Candidate Device Path: %s\n", DevicePathToStr(disk_path));
 #endif
-      bub_memcpy((*entry_buf), &all_gpt_entries[i], sizeof(GPTEntry));
-      bub_free(partition_name_ucs2);
-      bub_free(gpt_header);
-      return EFI_SUCCESS;
+
+    err = open_gpt_disk(handles[n], block_io, disk_io, gpt_header);
+    if (!EFI_ERROR(err)) {
+      *disk_handle = handles[n];
+      break;
+    }
+  }
+
+  bub_free(handles);
+  return err;
+}
+
+/* Saves |disk_path| and the disk GUID from |gpt_header| as the boot disk
+ * hint for the next boot. Failing to do so only costs that boot the
+ * find_disk() pass.
+ */
+static void save_disk_hint(EFI_DEVICE_PATH* disk_path,
+                           const GPTHeader* gpt_header) {
+  EFI_STATUS err;
+  EFI_GUID vendor_guid = BUB_BOOT_DISK_HINT_VENDOR_GUID;
+  UINT8 hint_buf[BUB_BOOT_DISK_HINT_MAX_SIZE];
+  UINTN hint_size;
+
+  hint_size = bub_boot_disk_hint_pack(gpt_header->disk_guid,
+                                      disk_path,
+                                      DevicePathSize(disk_path),
+                                      hint_buf,
+                                      sizeof(hint_buf));
+  if (hint_size == 0) {
+    bub_warning("Boot disk path too long for a hint.\n");
+    return;
+  }
+
+  err = uefi_call_wrapper(RT->SetVariable, NUM_ARGS_SET_VARIABLE,
+                          boot_disk_hint_variable,
+                          &vendor_guid,
+                          EFI_VARIABLE_NON_VOLATILE |
+                            EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                          hint_size,
+                          hint_buf);
+  if (EFI_ERROR(err))
+    bub_warning("Could not save boot disk hint.\n");
+}
+
+/* Finds the whole disk holding |device_handle|, the device of the running
+ * image, and returns its |block_io| and |disk_io| interfaces and device
+ * path, |io_path|. The disk must carry a valid GPT. The disk found on a
+ * previous boot is tried first, see find_disk_from_hint(). |block_io2| is
+ * set to the asynchronous block I/O interface of the same device, or NULL
+ * if the firmware does not provide one.
+ *
+ * @return EFI_STATUS EFI_NOT_FOUND on fail, EFI_SUCCESS otherwise.
+ */
+static EFI_STATUS getDiskBlockIo(IN EFI_HANDLE device_handle,
+                                 OUT EFI_BLOCK_IO** block_io,
+                                 OUT EFI_BLOCK_IO2_PROTOCOL** block_io2,
+                                 OUT EFI_DISK_IO** disk_io,
+                                 OUT EFI_DEVICE_PATH** io_path) {
+  EFI_STATUS err;
+  EFI_HANDLE disk_handle = NULL;
+  EFI_DEVICE_PATH *image_path;
+  GPTHeader gpt_header = {{0}};
+  EFI_GUID block_io2_protocol = EFI_BLOCK_IO2_PROTOCOL_GUID;
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
+  int hint_used = 1;
+#endif
+
+  image_path = DevicePathFromHandle(device_handle);
+  if (!image_path)
+    return EFI_NOT_FOUND;
+
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
+  Print(L"Initial Device Path: %s\n", DevicePathToStr(image_path));
+#endif
+
+  err = find_disk_from_hint(image_path, &disk_handle, block_io, disk_io);
+  if (EFI_ERROR(err)) {
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
+    hint_used = 0;
+#endif
+    err = find_disk(image_path, &disk_handle, block_io, disk_io,
+                    &gpt_header);
+    if (EFI_ERROR(err)) {
+      (*block_io) = NULL;
+      return EFI_NOT_FOUND;
     }
+    save_disk_hint(DevicePathFromHandle(disk_handle), &gpt_header);
+  }
+  (*io_path) = DevicePathFromHandle(disk_handle);
 
-  bub_free(partition_name_ucs2);
-  bub_free(gpt_header);
-  bub_free(*entry_buf);
-  *entry_buf = NULL;
-  return EFI_NOT_FOUND;
+  // EFI_BLOCK_IO2 is optional, reads fall back to EFI_BLOCK_IO without it.
+  err = uefi_call_wrapper(BS->HandleProtocol, NUM_ARGS_HANDLE_PROTOCOL,
+                          disk_handle,
+                          &block_io2_protocol,
+                          (VOID **)&(*block_io2));
+  if (EFI_ERROR(err))
+    (*block_io2) = NULL;
+
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
+  Print(L"Disk Device Path   : %s\n", DevicePathToStr(*io_path));
+  Print(L"Boot disk hint used: %d\n", hint_used);
+  Print(L"Block IO2 supported: %d\n", (*block_io2) != NULL);
+#endif
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS bub_partition_index_build(MyBubOps* bub) {
+  if (bub->partition_index == NULL) {
+    bub->partition_index =
+      (BubPartitionIndex*)bub_malloc_(sizeof(BubPartitionIndex));
+    if (bub->partition_index == NULL) {
+      bub_warning("Could not allocate for partition index\n");
+      return EFI_NOT_FOUND;
+    }
+  }
+
+  if (bub_partition_index_build_from_disk(bub->partition_index,
+                                          &bub->block_dev.parent) !=
+      BUB_IO_RESULT_OK)
+    return EFI_NOT_FOUND;
+
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
+  Print(L"Indexed %d GPT entries\n", bub->partition_index->num_entries);
+#endif
+  return EFI_SUCCESS;
+}
+
+void bub_partition_index_invalidate(MyBubOps* bub) {
+  if (bub->partition_index != NULL)
+    bub->partition_index->valid = 0;
+}
+
+EFI_STATUS bub_partition_index_lookup(MyBubOps* bub,
+                                      const char* partition_name,
+                                      const BubPartitionIndexEntry** out_entry) {
+  EFI_STATUS err;
+
+  *out_entry = NULL;
+
+  if (bub->partition_index == NULL || !bub->partition_index->valid) {
+    err = bub_partition_index_build(bub);
+    if (EFI_ERROR(err))
+      return EFI_NOT_FOUND;
+  }
+
+  if (!bub_partition_index_find(bub->partition_index,
+                                partition_name,
+                                out_entry))
+    return EFI_NOT_FOUND;
+
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
+  Print(L"Requested Partition: %s\n", (*out_entry)->name);
+  Print(L"Found Partition LBA is: %d\n", (*out_entry)->first_lba);
+#endif
+  return EFI_SUCCESS;
 }
 
 int bub_init(MyBubOps* bub, EFI_HANDLE app_image) {
   EFI_STATUS err;
+  EFI_PHYSICAL_ADDRESS arena_addr;
   EFI_LOADED_IMAGE *loaded_app_image = NULL;
   EFI_GUID loaded_image_protocol = LOADED_IMAGE_PROTOCOL;
 
+  // One page allocation for the small short-lived buffers of the boot flow,
+  // instead of a firmware pool call for each.
+  err = uefi_call_wrapper(BS->AllocatePages, NUM_ARGS_ALLOCATE_PAGES,
+                          AllocateAnyPages,
+                          EfiBootServicesData,
+                          EFI_SIZE_TO_PAGES(BUB_ARENA_SIZE),
+                          &arena_addr);
+  if (EFI_ERROR(err)) {
+    bub_warning("Could not allocate arena.\n");
+    return 0;
+  }
+  bub_arena_init(&bub->arena, (void*)(UINTN)arena_addr, BUB_ARENA_SIZE);
+  bub_arena_set_default(&bub->arena);
+
   bub->efi_image_handle = app_image;
   err = uefi_call_wrapper(BS->HandleProtocol, NUM_ARGS_HANDLE_PROTOCOL,
                           app_image,
@@ -494,7 +773,7 @@ int bub_init(MyBubOps* bub, EFI_HANDLE app_image) {
     return 0;
   }
 
-#ifdef BUB_ENABLE_DEBUG
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
   Print(L"Image base        : %lx\n", loaded_app_image->ImageBase);
   Print(L"Image size        : %lx\n", loaded_app_image->ImageSize);
   Print(L"Image file        : %s\n",
@@ -507,47 +786,293 @@ int bub_init(MyBubOps* bub, EFI_HANDLE app_image) {
   // Get parent device disk and block i/o.
   err = getDiskBlockIo(loaded_app_image->DeviceHandle,
                        &bub->block_io,
+                       &bub->block_io2,
                        &bub->disk_io,
                        &bub->path);
   if (EFI_ERROR(err)) {
     bub_warning("Could not acquire block or disk device handle.\n");
     return 0;
   }
+  bub_timing_mark(BUB_STAGE_DISK_IO);
+
+  init_efi_block_dev(&bub->block_dev, bub->block_io, bub->disk_io);
+
+  bub->partition_index = NULL;
+  err = bub_partition_index_build(bub);
+  if (EFI_ERROR(err)) {
+    bub_warning("Could not build partition index.\n");
+    return 0;
+  }
 
   bub->parent.read_from_partition = bub_read_from_partition;
   bub->parent.write_to_partition = bub_write_to_partition;
+  bub->parent.read_from_partition_async = bub_read_from_partition_async;
+  bub->parent.poll_completion = bub_poll_completion;
+  bub->parent.get_unique_guid_for_partition =
+    bub_get_unique_guid_for_partition;
+
+  bub_timing_mark(BUB_STAGE_INIT);
+  return 1;
+}
+
+/* State shared with load_chunk() while kernel and ramdisk are streamed in. */
+typedef struct {
+  const UINT8* image_buf;
+  UINT64 ramdisk_offset;
+  // Only run for payloads that are stored compressed.
+  BubDecompressor kernel;
+  BubDecompressor ramdisk;
+  int decompress_kernel;
+  int decompress_ramdisk;
+  int format_error;
+#ifdef BUB_ENABLE_VERIFY
+  BubSha256Ctx sha256;
+  int hash_chunks;
+#endif
+} LoadContext;
+
+/* Feeds the first |received| bytes of a payload to |d|.
+ *
+ * @return zero if the payload is corrupt.
+ */
+static int decompress_received(BubDecompressor* d, UINT64 received) {
+  BubDecompressResult result = bub_decompressor_run(d, received);
+  return result == BUB_DECOMPRESS_RESULT_OK ||
+         result == BUB_DECOMPRESS_RESULT_NEED_INPUT;
+}
 
+/* BubChunkFn for the LoadContext at |user_data|. Chunks arrive in order, so
+ * everything up to the end of |chunk| is in the image buffer. Hashing and
+ * decompression of a chunk overlap the read of the next one.
+ */
+static int load_chunk(void* user_data, const UINT8* chunk, UINTN num_bytes) {
+  LoadContext* ctx = (LoadContext*)user_data;
+  UINT64 received = (UINT64)(chunk + num_bytes - ctx->image_buf);
+
+#ifdef BUB_ENABLE_VERIFY
+  if (ctx->hash_chunks)
+    bub_sha256_update(&ctx->sha256, chunk, num_bytes);
+#endif
+
+  if (ctx->decompress_kernel &&
+      !decompress_received(&ctx->kernel, received)) {
+    bub_warning("Could not decompress kernel.\n");
+    ctx->format_error = 1;
+    return 0;
+  }
+  if (ctx->decompress_ramdisk && received > ctx->ramdisk_offset &&
+      !decompress_received(&ctx->ramdisk, received - ctx->ramdisk_offset)) {
+    bub_warning("Could not decompress ramdisk.\n");
+    ctx->format_error = 1;
+    return 0;
+  }
   return 1;
 }
 
-BubBootResult bub_boot_kernel(MyBubOps* bub, const char* boot_partition_name) {
+/* Allocates whole pages for |num_bytes| and stores their address in |buf|.
+ * Page allocation keeps the buffer aligned for direct block reads.
+ *
+ * @return EFI_STATUS Standard UEFI error code, EFI_SUCCESS on success.
+ */
+static EFI_STATUS allocate_image_pages(UINT64 num_bytes, UINT8** buf) {
+  EFI_PHYSICAL_ADDRESS addr;
   EFI_STATUS err;
-  GPTEntry* partition_entry;
-  UINT8* kernel_buf = NULL;
+
+  err = uefi_call_wrapper(BS->AllocatePages, NUM_ARGS_ALLOCATE_PAGES,
+                          AllocateAnyPages,
+                          EfiLoaderCode,
+                          EFI_SIZE_TO_PAGES(num_bytes),
+                          &addr);
+  if (EFI_ERROR(err))
+    return err;
+  *buf = (UINT8*)(UINTN)addr;
+  return EFI_SUCCESS;
+}
+
+#ifdef BUB_ENABLE_VERIFY
+/* Hashes the header page of the boot image in |partition_name| into |sha256|
+ * with bub_boot_image_hash_header(). The page must start with |head_buf|, the
+ * header the boot loader acts on, or the image fails verification.
+ *
+ * @return BUB_BOOT_RESULT_OK on success.
+ */
+static BubBootResult hash_header_page(MyBubOps* bub,
+                                      const char* partition_name,
+                                      const boot_img_hdr* head_buf,
+                                      BubSha256Ctx* sha256) {
+  UINT32 page_size = head_buf->page_size;
+  UINT32 compare_size = page_size < BUB_BOOT_IMAGE_HEADER_SIZE ?
+                        page_size : BUB_BOOT_IMAGE_HEADER_SIZE;
+  UINT8* page;
+  size_t num_bytes_read;
+  BubBootResult result = BUB_BOOT_RESULT_OK;
+
+  page = (UINT8*)bub_malloc_(page_size);
+  if (page == NULL)
+    return BUB_BOOT_ERROR_OOM;
+  if (bub->parent.read_from_partition((BubOps*)bub,
+                                      partition_name,
+                                      page,
+                                      0,
+                                      page_size,
+                                      &num_bytes_read) != BUB_IO_RESULT_OK ||
+      num_bytes_read != page_size) {
+    bub_warning("Could not read boot image header page.\n");
+    result = BUB_BOOT_ERROR_IO;
+  } else if (bub_memcmp(page, head_buf, compare_size) ||
+             !bub_boot_image_hash_header(sha256, page, page_size)) {
+    bub_warning("Boot image header cannot be verified.\n");
+    result = BUB_BOOT_ERROR_VERIFICATION;
+  }
+  bub_free(page);
+  return result;
+}
+
+/* Hashes the padding between the end of the kernel and the ramdisk of
+ * |layout| into |sha256|, for when the kernel was read by the firmware.
+ *
+ * @return zero if the padding could not be read.
+ */
+static int hash_kernel_padding(MyBubOps* bub,
+                               const char* partition_name,
+                               const BubBootImageLayout* layout,
+                               BubSha256Ctx* sha256) {
+  UINT64 padding_size = layout->ramdisk_offset - layout->kernel_size;
+  UINT8* padding;
+  size_t num_bytes_read;
+  int ok;
+
+  if (padding_size == 0)
+    return 1;
+
+  padding = (UINT8*)bub_malloc_(padding_size);
+  if (padding == NULL)
+    return 0;
+  ok = bub->parent.read_from_partition((BubOps*)bub,
+                                       partition_name,
+                                       padding,
+                                       layout->kernel_offset +
+                                           layout->kernel_size,
+                                       padding_size,
+                                       &num_bytes_read) == BUB_IO_RESULT_OK &&
+       num_bytes_read == padding_size;
+  if (ok)
+    bub_sha256_update(sha256, padding, padding_size);
+  bub_free(padding);
+  return ok;
+}
+#endif
+
+/* Records in the boot timings whether |kernel_image| was loaded where a
+ * kernel of |placement| runs without the EFI stub relocating it.
+ */
+static void record_kernel_placement(EFI_HANDLE kernel_image,
+                                    const BubKernelPlacement* placement) {
+  EFI_LOADED_IMAGE* loaded_image = NULL;
+  EFI_GUID loaded_image_protocol = LOADED_IMAGE_PROTOCOL;
+  EFI_STATUS err;
+  int in_place;
+
+  err = uefi_call_wrapper(BS->HandleProtocol, NUM_ARGS_HANDLE_PROTOCOL,
+                          kernel_image,
+                          &loaded_image_protocol,
+                          (VOID**)&loaded_image);
+  if (EFI_ERROR(err))
+    return;
+
+  in_place = bub_boot_image_kernel_runs_in_place(
+      placement, (UINT64)(UINTN)loaded_image->ImageBase);
+  bub_timing_set_kernel_in_place(in_place);
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
+  Print(L"Kernel image base: %lx (%s)\n", loaded_image->ImageBase,
+        in_place ? L"in place" : L"EFI stub relocates");
+#endif
+}
+
+/* Page buffers and handles a boot attempt holds until the kernel starts. */
+typedef struct {
+  // Read buffer for kernel and ramdisk as stored.
+  UINT8* image_buf;
+  UINT64 image_size;
+  // Decompressed payloads, if stored compressed.
+  UINT8* kernel_buf;
+  UINT64 kernel_size;
+  UINT8* ramdisk_buf;
+  UINT64 ramdisk_size;
+  int initrd_installed;
+  EFI_HANDLE kernel_image;
+} BootResources;
+
+static void free_pages(UINT8* buf, UINT64 num_bytes) {
+  if (buf != NULL)
+    uefi_call_wrapper(BS->FreePages, NUM_ARGS_FREE_PAGES,
+                      (EFI_PHYSICAL_ADDRESS)(UINTN)buf,
+                      EFI_SIZE_TO_PAGES(num_bytes));
+}
+
+/* Gives back everything a failed boot attempt left in |res|, so falling back
+ * to another slot starts from the same free memory.
+ */
+static void release_boot_resources(BootResources* res) {
+  if (res->kernel_image != NULL)
+    uefi_call_wrapper(BS->UnloadImage, NUM_ARGS_UNLOAD_IMAGE,
+                      res->kernel_image);
+  // The initrd protocol must not outlive the ramdisk it serves.
+  if (res->initrd_installed)
+    InstallInitrd(NULL, 0);
+  free_pages(res->ramdisk_buf, res->ramdisk_size);
+  free_pages(res->kernel_buf, res->kernel_size);
+  free_pages(res->image_buf, res->image_size);
+}
+
+/* Does the work of bub_boot_kernel(), recording in |res| what has to be
+ * released if the attempt fails.
+ */
+static BubBootResult boot_kernel(MyBubOps* bub,
+                                 BubAbSession* ab_session,
+                                 const char* boot_partition_name,
+                                 BootResources* res) {
+  EFI_STATUS err;
+  const BubPartitionIndexEntry* partition_entry;
+  UINT8* image_buf = NULL;
+  UINT8* kernel_buf;
+  UINT8* ramdisk_buf;
+  BubBootImageLayout layout;
   boot_img_hdr* head_buf = NULL;
   UINTN num_bytes_read;
   EFI_HANDLE kernel_image;
   EFI_LOADED_IMAGE *loaded_kernel_image = NULL;
+  BubChunkFn chunk_fn = NULL;
+  LoadContext load;
+  // Non-zero if LoadImage() reads the kernel from disk itself.
+  int load_kernel_from_disk = 0;
+  // Offset from the kernel of the part of the image the boot loader reads.
+  UINT64 read_offset = 0;
+  BubKernelPlacement placement;
+  int have_placement = 0;
+#ifdef BUB_ENABLE_VERIFY
+  uint8_t digest[BUB_SHA256_DIGEST_SIZE];
+  BubBootResult result;
+#endif
 
-  err = uefi_call_wrapper(BS->AllocatePool, NUM_ARGS_ALLOCATE_POOL,
-                          EfiLoaderCode,
-                          sizeof(boot_img_hdr),
-                          &head_buf);
-  if (EFI_ERROR(err)) {
+  head_buf = (boot_img_hdr*)bub_malloc_(BUB_BOOT_IMAGE_HEADER_SIZE);
+  if (head_buf == NULL) {
     bub_warning("Could not allocate for kernel buffer.\n");
     return BUB_BOOT_ERROR_OOM;
   }
 
+  // Also reads the BubBootImageExt of compressed images.
   if (bub->parent.read_from_partition((BubOps *)bub,
                                       boot_partition_name,
                                       head_buf,
                                       0,
-                                      sizeof(boot_img_hdr), &num_bytes_read)) {
+                                      BUB_BOOT_IMAGE_HEADER_SIZE,
+                                      &num_bytes_read)) {
     bub_warning("Could not read boot image header.\n");
     return BUB_BOOT_ERROR_IO;
   }
-
-#ifdef BUB_ENABLE_DEBUG
+  bub_timing_mark(BUB_STAGE_HEADER_READ);
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
   // Print Header info
   UINT8 i = 0;
   Print(L"magic:              %c", head_buf->magic[0]);
@@ -567,76 +1092,202 @@ BubBootResult bub_boot_kernel(MyBubOps* bub, const char* boot_partition_name) {
 #endif
 
   // Retrieve Gpt partition data to check address boundaries.
-  err = bub_partition_entry_by_name(bub->block_io,
-                                    boot_partition_name,
-                                    &partition_entry);
+  err = bub_partition_index_lookup(bub,
+                                   boot_partition_name,
+                                   &partition_entry);
   if (EFI_ERROR(err)) {
     bub_warning("Could not find boot partition GPT entry.\n");
     return BUB_BOOT_ERROR_IO;
   }
 
-#ifdef BUB_ENABLE_DEBUG
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
   Print(L"Block IO media block size: %d\n", bub->block_io->Media->BlockSize);
   Print(L"Kernel Image LBA: 0x%x\n", partition_entry->first_lba);
   Print(L"Kernel size:  0x%x\n", IMG_SIZE(partition_entry,bub->block_io));
 #endif
 
-  // Check boot image header magic field.
-  if (bub_memcmp((UINT8[8])BOOT_MAGIC, head_buf->magic, 8)) {
-    bub_warning("Wrong boot image header magic.\n");
+  if (bub_boot_image_get_layout(head_buf,
+                                IMG_SIZE(partition_entry, bub->block_io),
+                                &layout) != BUB_BOOT_IMAGE_RESULT_OK)
     return BUB_BOOT_ERROR_PARTITION_INVALID_FORMAT;
-  }
 
-  // Checks on buffer overflow.
-  if (head_buf->kernel_size > IMG_SIZE(partition_entry, bub->block_io)) {
-    bub_warning("Kernel size beyond allowed boundary.\n");
-    return BUB_BOOT_ERROR_PARTITION_INVALID_FORMAT;
-  }
-  if (head_buf->page_size >
-      (IMG_SIZE(partition_entry, bub->block_io) - sizeof(boot_img_hdr))) {
-    bub_warning("Page size too big.\n");
-    return BUB_BOOT_ERROR_PARTITION_INVALID_FORMAT;
+#ifdef BUB_ENABLE_KERNEL_LOAD_FILE2
+  // Only the ramdisk is read into pages of our own, see load_kernel_image().
+  // A compressed kernel still has to pass through memory to be expanded.
+  if (layout.kernel_compression == BUB_COMPRESSION_NONE) {
+    load_kernel_from_disk = 1;
+    read_offset = layout.ramdisk_offset;
   }
+#endif
 
-  err = uefi_call_wrapper(BS->AllocatePool, NUM_ARGS_ALLOCATE_POOL,
-                          EfiLoaderCode,
-                          head_buf->kernel_size,
-                          &kernel_buf);
+  err = allocate_image_pages(layout.load_size - read_offset, &image_buf);
   if (EFI_ERROR(err)) {
     bub_warning("Could not allocate for kernel buffer.\n");
     return BUB_BOOT_ERROR_OOM;
   }
+  res->image_buf = image_buf;
+  res->image_size = layout.load_size - read_offset;
+  kernel_buf = image_buf;
+  ramdisk_buf = image_buf + layout.ramdisk_offset - read_offset;
+
+  bub_memset(&load, 0, sizeof(load));
+  load.image_buf = image_buf;
+  load.ramdisk_offset = layout.ramdisk_offset - read_offset;
+
+  // Compressed payloads are decompressed out of the read buffer into their
+  // own pages, a chunk at a time as the read progresses.
+  if (layout.kernel_compression != BUB_COMPRESSION_NONE) {
+    err = allocate_image_pages(layout.kernel_decompressed_size, &kernel_buf);
+    if (EFI_ERROR(err)) {
+      bub_warning("Could not allocate for decompressed kernel.\n");
+      return BUB_BOOT_ERROR_OOM;
+    }
+    res->kernel_buf = kernel_buf;
+    res->kernel_size = layout.kernel_decompressed_size;
+    bub_decompressor_init(&load.kernel, layout.kernel_compression,
+                          image_buf, layout.kernel_size,
+                          kernel_buf, layout.kernel_decompressed_size);
+    load.decompress_kernel = 1;
+    chunk_fn = load_chunk;
+  }
+  if (layout.ramdisk_compression != BUB_COMPRESSION_NONE) {
+    err = allocate_image_pages(layout.ramdisk_decompressed_size, &ramdisk_buf);
+    if (EFI_ERROR(err)) {
+      bub_warning("Could not allocate for decompressed ramdisk.\n");
+      return BUB_BOOT_ERROR_OOM;
+    }
+    res->ramdisk_buf = ramdisk_buf;
+    res->ramdisk_size = layout.ramdisk_decompressed_size;
+    bub_decompressor_init(&load.ramdisk, layout.ramdisk_compression,
+                          image_buf + load.ramdisk_offset,
+                          layout.ramdisk_size,
+                          ramdisk_buf, layout.ramdisk_decompressed_size);
+    load.decompress_ramdisk = 1;
+    chunk_fn = load_chunk;
+  }
 
-  bub_debug("Reading kernel image.\n");
-  if (bub->parent.read_from_partition((BubOps *)bub,
-                                      boot_partition_name,
-                                      kernel_buf,
-                                      head_buf->page_size,
-                                      head_buf->kernel_size,
-                                      &num_bytes_read)) {
+#ifdef BUB_ENABLE_VERIFY
+  // Each chunk is hashed while the next one is still being read, so
+  // verification does not take a second pass over the image. The digest
+  // covers the payloads as stored. If the firmware reads the kernel, the
+  // kernel is hashed as it does and the ramdisk is hashed after it. The
+  // header page comes first, so the command line is covered as well.
+  bub_sha256_init(&load.sha256);
+  result = hash_header_page(bub, boot_partition_name, head_buf, &load.sha256);
+  if (result != BUB_BOOT_RESULT_OK)
+    return result;
+  if (!load_kernel_from_disk) {
+    load.hash_chunks = 1;
+    chunk_fn = load_chunk;
+  }
+#endif
+
+  // The second stage image is not used on this platform and is not read.
+  bub_debug("Reading kernel and ramdisk.\n");
+  if (bub_stream_from_partition(bub,
+                                boot_partition_name,
+                                image_buf,
+                                layout.kernel_offset + read_offset,
+                                layout.load_size - read_offset,
+                                chunk_fn,
+                                &load)) {
+    if (load.format_error)
+      return BUB_BOOT_ERROR_PARTITION_INVALID_FORMAT;
     bub_warning("Could not read kernel image.\n");
     return BUB_BOOT_ERROR_IO;
   }
+  bub_timing_mark(BUB_STAGE_KERNEL_READ);
+
+#ifdef BUB_ENABLE_VERIFY
+  if (!load_kernel_from_disk) {
+    bub_sha256_final(&load.sha256, digest);
+    if (!bub_boot_image_verify_digest(head_buf, digest))
+      return BUB_BOOT_ERROR_VERIFICATION;
+  }
+#endif
+
+  // The last chunk covers all of both payloads, so each decompressor has
+  // either finished or failed by now.
+  if ((load.decompress_kernel && !load.kernel.done) ||
+      (load.decompress_ramdisk && !load.ramdisk.done)) {
+    bub_warning("Compressed payload incomplete.\n");
+    return BUB_BOOT_ERROR_PARTITION_INVALID_FORMAT;
+  }
+
+  if (!load_kernel_from_disk)
+    have_placement = bub_boot_image_get_kernel_placement(
+        kernel_buf, layout.kernel_decompressed_size, &placement);
+
+  err = InstallInitrd(ramdisk_buf, layout.ramdisk_decompressed_size);
+  if (EFI_ERROR(err))
+    return BUB_BOOT_ERROR_PARAMETER_LOAD;
+  res->initrd_installed = 1;
 
   bub_debug("Loading kernel image.\n");
-  err = uefi_call_wrapper(BS->LoadImage, NUM_ARGS_LOAD_IMAGE,
-                          FALSE,
-                          bub->efi_image_handle,
-                          bub->path,
-                          (void *)(kernel_buf),
-                          head_buf->kernel_size,
-                          &kernel_image);
+  if (load_kernel_from_disk) {
+#ifdef BUB_ENABLE_VERIFY
+    err = load_kernel_image(bub, boot_partition_name, &layout, &load.sha256,
+                            &placement, &have_placement, &kernel_image);
+#else
+    err = load_kernel_image(bub, boot_partition_name, &layout, NULL,
+                            &placement, &have_placement, &kernel_image);
+#endif
+  } else {
+    err = uefi_call_wrapper(BS->LoadImage, NUM_ARGS_LOAD_IMAGE,
+                            FALSE,
+                            bub->efi_image_handle,
+                            bub->path,
+                            (void *)(kernel_buf),
+                            layout.kernel_decompressed_size,
+                            &kernel_image);
+  }
   if (EFI_ERROR(err)) {
     bub_warning("Could not load kernel image.\n");
     return BUB_BOOT_ERROR_LOAD_KERNEL;
   }
+  res->kernel_image = kernel_image;
   bub_debug("Loaded kernel image.\n");
 
+#ifdef BUB_ENABLE_VERIFY
+  // The loaded kernel has not run yet; it is unloaded again on a mismatch.
+  if (load_kernel_from_disk) {
+    if (!hash_kernel_padding(bub, boot_partition_name, &layout,
+                             &load.sha256)) {
+      bub_warning("Could not read kernel padding.\n");
+      return BUB_BOOT_ERROR_IO;
+    }
+    bub_sha256_update(&load.sha256, image_buf, layout.load_size - read_offset);
+    bub_sha256_final(&load.sha256, digest);
+    if (!bub_boot_image_verify_digest(head_buf, digest))
+      return BUB_BOOT_ERROR_VERIFICATION;
+  }
+#endif
+  bub_timing_mark(BUB_STAGE_LOAD_IMAGE);
+
+  if (have_placement)
+    record_kernel_placement(kernel_image, &placement);
+
   // Load parameters
   err = LoadParameters(kernel_image, head_buf, &loaded_kernel_image);
   if (EFI_ERROR(err))
     return BUB_BOOT_ERROR_PARAMETER_LOAD;
 
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
+  Print(L"Arena: %d allocs, %d frees, %d to pool, peak %d of %d bytes\n",
+        bub->arena.num_allocs, bub->arena.num_frees, bub->arena.num_failed,
+        (UINT32)bub->arena.peak_used, (UINT32)bub->arena.size);
+#endif
+
+  if (!bub_ab_session_flush(ab_session)) {
+    bub_warning("Could not write A/B metadata.\n");
+    return BUB_BOOT_ERROR_IO;
+  }
+
+  // Last chance to hand the warnings of this boot to the OS.
+  bub_log_flush();
+
+  // The firmware unloads the kernel image once it returns from StartImage().
+  res->kernel_image = NULL;
   err = uefi_call_wrapper(BS->StartImage, 3, kernel_image, NULL, NULL);
   if (EFI_ERROR(err)) {
     bub_warning("Could not start kernel image.\n");
@@ -644,4 +1295,17 @@ BubBootResult bub_boot_kernel(MyBubOps* bub, const char* boot_partition_name) {
   }
 
   return BUB_BOOT_RESULT_OK;
+}
+
+BubBootResult bub_boot_kernel(MyBubOps* bub,
+                              BubAbSession* ab_session,
+                              const char* boot_partition_name) {
+  BootResources res;
+  BubBootResult result;
+
+  bub_memset(&res, 0, sizeof(res));
+  result = boot_kernel(bub, ab_session, boot_partition_name, &res);
+  if (result != BUB_BOOT_RESULT_OK)
+    release_boot_resources(&res);
+  return result;
 }
\ No newline at end of file
@@ -26,11 +26,12 @@
 
 #include <efi.h>
 #include <efilib.h>
+#include "bub_ab_flow.h"
+#include "bub_arena.h"
+#include "bub_boot_image.h"
+#include "bub_disk.h"
 #include "bub_ops.h"
 
-// For printing debug statements.
-#define BUB_ENABLE_DEBUG
-
 typedef enum {
   BUB_BOOT_RESULT_OK,
   BUB_BOOT_ERROR_OOM,
@@ -39,48 +40,11 @@ typedef enum {
   BUB_BOOT_ERROR_LOAD_KERNEL,
   BUB_BOOT_ERROR_PARAMETER_LOAD,
   BUB_BOOT_ERROR_START_KERNEL,
+  BUB_BOOT_ERROR_VERIFICATION,
 } BubBootResult;
 
-// GPT related constants
-#define GPT_REVISION 0x00010000
-#define GPT_MAGIC "EFI PART"
-#define GPT_MIN_SIZE 92
-#define GPT_ENTRIES_LBA 2
-#define BUB_BLOCK_SIZE 512
-#define ENTRIES_PER_BLOCK 4
-#define ENTRY_NAME_LEN 36
-#define MAX_GPT_ENTRIES 128
-
-typedef struct {
-  UINT8   signature[8];
-  UINT32  revision;
-  UINT32  header_size;
-  UINT32  header_crc32;
-  UINT32  reserved;
-  UINT64  header_lba;
-  UINT64  alternate_header_lba;
-  UINT64  first_usable_lba;
-  UINT64  last_usable_lba;
-  UINT8   disk_guid[16];
-  UINT64  entry_lba;
-  UINT32  entry_count;
-  UINT32  entry_size;
-  UINT32  entry_crc32;
-  UINT8   reserved2[420];
-} GPTHeader;
-
-typedef struct {
-  UINT8   type_GUID[16];
-  UINT8   unique_GUID[16];
-  UINT64  first_lba;
-  UINT64  last_lba;
-  UINT64  flags;
-  CHAR16  name[ENTRY_NAME_LEN];
-} GPTEntry;
-
-
 #define IMG_SIZE(entry, block) \
-  (entry->last_lba - entry->first_lba) * block->Media->BlockSize
+  bub_partition_size(entry, block->Media->BlockSize)
 
 #define SIZE_BLOCK_ALIGN(bytes, BUB_BLOCK_SIZE) \
   ((bytes + BUB_BLOCK_SIZE - 1) / BUB_BLOCK_SIZE) * BUB_BLOCK_SIZE
@@ -88,12 +52,38 @@ typedef struct {
 #define OFFSET_BLOCK_ALIGN(bytes, BUB_BLOCK_SIZE) \
   (bytes / BUB_BLOCK_SIZE) * BUB_BLOCK_SIZE
 
+// Size of a single read issued by bub_stream_from_partition(). Must be a
+// multiple of every supported block size.
+#define BUB_STREAM_CHUNK_SIZE (1024 * 1024)
+
+/* Called by bub_stream_from_partition() once the |num_bytes| bytes at |chunk|
+ * have landed in the destination buffer, while the next chunk is still being
+ * read. |user_data| is passed through unchanged.
+ *
+ * @return non-zero to continue streaming, zero to abort.
+ */
+typedef int (*BubChunkFn)(void* user_data, const UINT8* chunk,
+                          UINTN num_bytes);
+
+/* BubBlockDev backed by the firmware's disk I/O on the boot disk. */
+typedef struct {
+  BubBlockDev parent;
+  EFI_BLOCK_IO* block_io;
+  EFI_DISK_IO* disk_io;
+} EfiBlockDev;
+
 typedef struct {
   BubOps parent;
   EFI_HANDLE efi_image_handle;
   EFI_DEVICE_PATH* path;
   EFI_BLOCK_IO* block_io;
+  // NULL if the device does not support asynchronous block I/O.
+  EFI_BLOCK_IO2_PROTOCOL* block_io2;
   EFI_DISK_IO* disk_io;
+  EfiBlockDev block_dev;
+  BubPartitionIndex* partition_index;
+  // Backs bub_malloc_() from bub_init() on.
+  BubArena arena;
   // EFI_STATUS (*PopulateMiscPartition)(MyBubOps* self);
 } MyBubOps;
 
@@ -104,15 +94,54 @@ BubIOResult bub_read_from_partition(BubOps* ops,
                                     size_t num_bytes,
                                     size_t* out_num_read);
 
+/* BubOps read_from_partition_async and poll_completion. Reads of whole,
+ * aligned blocks go through EFI_BLOCK_IO2 if the disk has it; all others
+ * complete before bub_read_from_partition_async() returns.
+ */
+BubIOResult bub_read_from_partition_async(BubOps* ops,
+                                          const char* partition_name,
+                                          void* buf,
+                                          int64_t offset_from_partition,
+                                          size_t num_bytes,
+                                          BubIORequest* request);
+
+int bub_poll_completion(BubOps* ops, BubIORequest* request, int wait);
+
 BubIOResult bub_write_to_partition(BubOps* ops,
                                    const char* partition_name,
                                    const void* buf,
                                    int64_t offset_from_partition,
                                    size_t num_bytes);
 
+/* Reads |num_bytes| at |offset_from_partition| from partition
+ * |partition_name| into |buf| in BUB_STREAM_CHUNK_SIZE chunks, calling
+ * |chunk_fn| (if not NULL) on each chunk as it completes. With
+ * EFI_BLOCK_IO2 and a block-aligned range, two reads are kept in flight so
+ * that |chunk_fn| on chunk N overlaps the read of chunk N + 1. Otherwise the
+ * chunks are read synchronously through EFI_BLOCK_IO or EFI_DISK_IO.
+ *
+ * Unlike read_from_partition, this never does partial I/O.
+ *
+ * @return BUB_IO_RESULT_OK on success, or the BubIOResult error code. An
+ *         abort requested by |chunk_fn| is reported as BUB_IO_RESULT_ERROR_IO.
+ */
+BubIOResult bub_stream_from_partition(MyBubOps* bub,
+                                      const char* partition_name,
+                                      void* buf,
+                                      UINT64 offset_from_partition,
+                                      UINT64 num_bytes,
+                                      BubChunkFn chunk_fn,
+                                      void* user_data);
+
+int bub_get_unique_guid_for_partition(BubOps* ops,
+                                      const char* partition_name,
+                                      char* guid_buf,
+                                      size_t guid_buf_size);
+
 /* Allocates memory for and assigns to member variables of |bub|. Also assigns
  * the Brillo Uefi-specific read_from_partition and write_to_partition
- * functions to its BubOps parent. |app_image| must be the EFI main-specific
+ * functions to its BubOps parent. The BUB_ARENA_SIZE arena of |bub| is set up
+ * first and serves bub_malloc_() from then on; |bub| must outlive its use. |app_image| must be the EFI main-specific
  * (the current currently running program) handle.
  *
  * @return int 0 on failure. non-zero on success.
@@ -122,28 +151,49 @@ int bub_init(MyBubOps* bub, EFI_HANDLE app_image);
 /* Boots a UEFI kernel image given a |boot_partition_name| string belonging to a
  * bootable partition entry. The partition must be on the same block device as
  * the current UEFI application, |app_image|. |app_image| is given at the entry
- * point, efi_main(), of the UEFI application.
+ * point, efi_main(), of the UEFI application. |ab_session| is flushed right
+ * before the kernel is started, so the A/B metadata of this boot attempt is
+ * written exactly when control is handed over. If the attempt fails, the
+ * pages it allocated are freed and its kernel image is unloaded again.
  *
  * @return BUB_BOOT_ERROR_OOM on allocation,
- *         BUB_BOOT_ERROR_IO on read/write error,
- *         BUB_BOOT_ERROR_PARTITION_INVALID_FORMAT on bad magic or bad size
- *           boundaries,
+ *         BUB_BOOT_ERROR_IO on read/write error, including the flush of
+ *           |ab_session|,
+ *         BUB_BOOT_ERROR_PARTITION_INVALID_FORMAT on bad magic, bad size
+ *           boundaries or a corrupt compressed kernel or ramdisk,
  *         BUB_BOOT_ERROR_LOAD_KERNEL if unable to load kernel into memory
  *         BUB_BOOT_ERROR_PARAMETER_LOAD if unable to load kernel parameters to
  *          the EFI_STUB,
  *         BUB_BOOT_ERROR_START_KERNEL if unable to execute kernel,
+ *         BUB_BOOT_ERROR_VERIFICATION if built with BUB_ENABLE_VERIFY and the
+ *           header page, kernel and ramdisk do not match the digest in the
+ *           header,
  *         BUB_BOOT_RESULT_OK on success.
  */
-BubBootResult bub_boot_kernel(MyBubOps* bub, const char* boot_partition_name);
+BubBootResult bub_boot_kernel(MyBubOps* bub,
+                              BubAbSession* ab_session,
+                              const char* boot_partition_name);
+
+/* Reads the GPT of |bub|'s block device and (re)builds its partition index.
+ * Any previously built index is discarded.
+ *
+ * @return EFI_NOT_FOUND on error, EFI_SUCCESS on success.
+ */
+EFI_STATUS bub_partition_index_build(MyBubOps* bub);
+
+/* Marks the partition index of |bub| stale. Must be called whenever the
+ * partition table on disk is rewritten; the next lookup rebuilds the index.
+ */
+void bub_partition_index_invalidate(MyBubOps* bub);
 
-/* Looks through |block_io| to search for a GPT entry named |partition_name|, a
- * NULL-terminated string. Allocates a GPTEntry struct for |entry_buf|. Caller
- * is responsible for freeing |entry_buf|.
+/* Resolves |partition_name|, a NUL-terminated UTF-8 string, against the
+ * partition index of |bub|, building the index first if it is stale. On
+ * success |out_entry| points into the index and must not be freed.
  *
- * @return EFI_NOT_FOUND on error, EFI SUCCESS on success.
+ * @return EFI_NOT_FOUND on error, EFI_SUCCESS on success.
  */
-EFI_STATUS bub_partition_entry_by_name(IN EFI_BLOCK_IO *block_io,
-                                       const char* partition_name,
-                                       GPTEntry** entry_buf);
+EFI_STATUS bub_partition_index_lookup(MyBubOps* bub,
+                                      const char* partition_name,
+                                      const BubPartitionIndexEntry** out_entry);
 
 #endif /* BUB_BOOT_KERNEL_H_ */
\ No newline at end of file
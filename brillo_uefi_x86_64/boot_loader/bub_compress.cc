@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bub_compress.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+
+namespace {
+
+const uint32_t kLz4Magic = 0x184D2204;
+// Version 01, independent blocks, content size present.
+const uint8_t kLz4Flags = 0x68;
+// 4 MiB maximum block size.
+const uint8_t kLz4BlockDescriptor = 0x70;
+const size_t kLz4BlockSize = 4 * 1024 * 1024;
+const uint32_t kLz4BlockUncompressed = 0x80000000U;
+
+// Block format end conditions: the last 5 bytes are always literals and the
+// last match starts at least 12 bytes before the end.
+const size_t kLz4LastLiterals = 5;
+const size_t kLz4MatchLimit = 12;
+const size_t kLz4MinMatch = 4;
+const size_t kLz4MaxOffset = 65535;
+const int kLz4HashBits = 16;
+
+void put_le32(std::vector<uint8_t>* out, uint32_t value) {
+  for (int n = 0; n < 4; ++n)
+    out->push_back((uint8_t)(value >> (8 * n)));
+}
+
+void put_le64(std::vector<uint8_t>* out, uint64_t value) {
+  put_le32(out, (uint32_t)value);
+  put_le32(out, (uint32_t)(value >> 32));
+}
+
+uint32_t read_le32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t rotl32(uint32_t x, int r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+// xxHash32, used for the LZ4 frame header checksum only.
+uint32_t xxh32(const uint8_t* p, size_t len, uint32_t seed) {
+  const uint32_t kPrime1 = 2654435761U, kPrime2 = 2246822519U,
+                 kPrime3 = 3266489917U, kPrime4 = 668265263U,
+                 kPrime5 = 374761393U;
+  const uint8_t* end = p + len;
+  uint32_t h;
+
+  if (len >= 16) {
+    uint32_t v[4] = {seed + kPrime1 + kPrime2, seed + kPrime2, seed,
+                     seed - kPrime1};
+    for (; end - p >= 16; p += 16) {
+      for (int n = 0; n < 4; ++n)
+        v[n] = rotl32(v[n] + read_le32(p + 4 * n) * kPrime2, 13) * kPrime1;
+    }
+    h = rotl32(v[0], 1) + rotl32(v[1], 7) + rotl32(v[2], 12) +
+        rotl32(v[3], 18);
+  } else {
+    h = seed + kPrime5;
+  }
+  h += (uint32_t)len;
+
+  for (; end - p >= 4; p += 4)
+    h = rotl32(h + read_le32(p) * kPrime3, 17) * kPrime4;
+  for (; p < end; ++p)
+    h = rotl32(h + *p * kPrime5, 11) * kPrime1;
+
+  h ^= h >> 15;
+  h *= kPrime2;
+  h ^= h >> 13;
+  h *= kPrime3;
+  h ^= h >> 16;
+  return h;
+}
+
+void put_lz4_length(std::vector<uint8_t>* out, size_t len) {
+  for (; len >= 255; len -= 255)
+    out->push_back(255);
+  out->push_back((uint8_t)len);
+}
+
+// Appends one LZ4 sequence. |match_len| of zero ends the block.
+void put_lz4_sequence(std::vector<uint8_t>* out, const uint8_t* literals,
+                      size_t num_literals, size_t offset, size_t match_len) {
+  size_t match_code = match_len > 0 ? match_len - kLz4MinMatch : 0;
+
+  out->push_back((uint8_t)((std::min<size_t>(num_literals, 15) << 4) |
+                           std::min<size_t>(match_code, 15)));
+  if (num_literals >= 15)
+    put_lz4_length(out, num_literals - 15);
+  out->insert(out->end(), literals, literals + num_literals);
+  if (match_len == 0)
+    return;
+  out->push_back((uint8_t)offset);
+  out->push_back((uint8_t)(offset >> 8));
+  if (match_code >= 15)
+    put_lz4_length(out, match_code - 15);
+}
+
+// Greedy single-probe LZ4 block compressor.
+void lz4_compress_block(const uint8_t* src, size_t size,
+                        std::vector<uint8_t>* out) {
+  std::vector<uint32_t> table(1 << kLz4HashBits, UINT32_MAX);
+  size_t anchor = 0;
+  size_t pos = 0;
+
+  while (size > kLz4MatchLimit && pos < size - kLz4MatchLimit) {
+    uint32_t sequence = read_le32(src + pos);
+    uint32_t hash = (sequence * 2654435761U) >> (32 - kLz4HashBits);
+    uint32_t candidate = table[hash];
+    table[hash] = (uint32_t)pos;
+
+    if (candidate == UINT32_MAX || pos - candidate > kLz4MaxOffset ||
+        read_le32(src + candidate) != sequence) {
+      pos++;
+      continue;
+    }
+
+    size_t len = kLz4MinMatch;
+    while (pos + len < size - kLz4LastLiterals &&
+           src[candidate + len] == src[pos + len])
+      len++;
+    put_lz4_sequence(out, src + anchor, pos - anchor, pos - candidate, len);
+    pos += len;
+    anchor = pos;
+  }
+
+  put_lz4_sequence(out, src + anchor, size - anchor, 0, 0);
+}
+
+bool lz4_compress(const std::vector<uint8_t>& in, std::vector<uint8_t>* out) {
+  std::vector<uint8_t> block;
+
+  out->clear();
+  put_le32(out, kLz4Magic);
+  out->push_back(kLz4Flags);
+  out->push_back(kLz4BlockDescriptor);
+  put_le64(out, in.size());
+  out->push_back((uint8_t)(xxh32(out->data() + 4, out->size() - 4, 0) >> 8));
+
+  for (size_t offset = 0; offset < in.size(); offset += kLz4BlockSize) {
+    size_t size = std::min(kLz4BlockSize, in.size() - offset);
+    block.clear();
+    lz4_compress_block(in.data() + offset, size, &block);
+    if (block.size() < size) {
+      put_le32(out, (uint32_t)block.size());
+      out->insert(out->end(), block.begin(), block.end());
+    } else {
+      put_le32(out, (uint32_t)size | kLz4BlockUncompressed);
+      out->insert(out->end(), in.begin() + offset,
+                  in.begin() + offset + size);
+    }
+  }
+
+  put_le32(out, 0);
+  return true;
+}
+
+bool gzip_compress(const std::vector<uint8_t>& in, std::vector<uint8_t>* out) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // A window size of 15 + 16 selects the gzip wrapper. zlib writes a zero
+  // modification time, so the output only depends on the input.
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+
+  out->resize(deflateBound(&stream, in.size()));
+  stream.next_in = const_cast<uint8_t*>(in.data());
+  stream.avail_in = in.size();
+  stream.next_out = out->data();
+  stream.avail_out = out->size();
+  int result = deflate(&stream, Z_FINISH);
+  out->resize(stream.total_out);
+  deflateEnd(&stream);
+  return result == Z_STREAM_END;
+}
+
+}  // namespace
+
+bool bub_compress(BubCompression compression,
+                  const std::vector<uint8_t>& in,
+                  std::vector<uint8_t>* out) {
+  switch (compression) {
+    case BUB_COMPRESSION_NONE:
+      *out = in;
+      return true;
+    case BUB_COMPRESSION_LZ4:
+      return lz4_compress(in, out);
+    case BUB_COMPRESSION_GZIP:
+      return gzip_compress(in, out);
+  }
+  return false;
+}
+
+const char* bub_compression_name(BubCompression compression) {
+  switch (compression) {
+    case BUB_COMPRESSION_NONE:
+      return "none";
+    case BUB_COMPRESSION_LZ4:
+      return "lz4";
+    case BUB_COMPRESSION_GZIP:
+      return "gzip";
+  }
+  return NULL;
+}
+
+bool bub_compression_from_name(const char* name, BubCompression* out) {
+  const BubCompression all[] = {BUB_COMPRESSION_NONE, BUB_COMPRESSION_LZ4,
+                                BUB_COMPRESSION_GZIP};
+  for (BubCompression compression : all) {
+    if (strcmp(name, bub_compression_name(compression)) == 0) {
+      *out = compression;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUB_COMPRESS_H_
+#define BUB_COMPRESS_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "bub_decompress.h"
+
+// Host-side compressors for boot image payloads. The output is what
+// bub_decompressor_run() accepts and is deterministic for a given input.
+//
+// LZ4 output is a frame of independent 4 MiB blocks with the content size
+// recorded, compressed greedily; blocks that do not shrink are stored.
+// gzip output is produced by zlib at its best compression level.
+
+// Compresses |in| with |compression| into |out|.
+//
+// Returns false on failure or for an unknown |compression|.
+bool bub_compress(BubCompression compression,
+                  const std::vector<uint8_t>& in,
+                  std::vector<uint8_t>* out);
+
+// Returns the name used for |compression| on command lines, or NULL.
+const char* bub_compression_name(BubCompression compression);
+
+// Parses a name returned by bub_compression_name().
+//
+// Returns false if |name| is not known.
+bool bub_compression_from_name(const char* name, BubCompression* out);
+
+#endif /* BUB_COMPRESS_H_ */
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include "bub_cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#endif
+
+#define FEATURES_PROBED (1U << 31)
+
+static uint32_t cpu_features;
+
+static uint32_t probe_features(void) {
+  uint32_t features = FEATURES_PROBED;
+
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+
+  unsigned int max_leaf = __get_cpuid_max(0, 0);
+  int has_sse41 = 0;
+
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    if (ecx & bit_PCLMUL)
+      features |= 1U << BUB_CPU_FEATURE_PCLMUL;
+    has_sse41 = (ecx & bit_SSSE3) && (ecx & bit_SSE4_1);
+  }
+  if (max_leaf >= 7) {
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if ((ebx & bit_SHA) && has_sse41)
+      features |= 1U << BUB_CPU_FEATURE_SHA_NI;
+  }
+#elif defined(__aarch64__) && defined(__linux__)
+  unsigned long hwcap = getauxval(AT_HWCAP);
+
+  // HWCAP_SHA2 and HWCAP_CRC32 from <asm/hwcap.h>.
+  if (hwcap & (1UL << 6))
+    features |= 1U << BUB_CPU_FEATURE_ARMV8_SHA2;
+  if (hwcap & (1UL << 7))
+    features |= 1U << BUB_CPU_FEATURE_ARMV8_CRC32;
+#elif defined(__aarch64__)
+  uint64_t isar0;
+
+  // Firmware runs at EL1 or above, so the ID register is readable directly.
+  __asm__("mrs %0, ID_AA64ISAR0_EL1" : "=r"(isar0));
+  if (((isar0 >> 12) & 0xF) >= 1)
+    features |= 1U << BUB_CPU_FEATURE_ARMV8_SHA2;
+  if (((isar0 >> 16) & 0xF) >= 1)
+    features |= 1U << BUB_CPU_FEATURE_ARMV8_CRC32;
+#endif
+
+  return features;
+}
+
+int bub_cpu_has_feature(BubCpuFeature feature) {
+  // Probing is idempotent, so racing callers at worst probe twice.
+  if (!(cpu_features & FEATURES_PROBED))
+    cpu_features = probe_features();
+
+  return (cpu_features >> feature) & 1;
+}
\ No newline at end of file
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUB_CPU_H_
+#define BUB_CPU_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Optional instruction set extensions the boot loader can make use of. */
+typedef enum {
+  // x86_64 carry-less multiplication (PCLMULQDQ).
+  BUB_CPU_FEATURE_PCLMUL,
+  // ARMv8 CRC32 instructions.
+  BUB_CPU_FEATURE_ARMV8_CRC32,
+  // x86_64 SHA extensions, along with the SSSE3/SSE4.1 they are used with.
+  BUB_CPU_FEATURE_SHA_NI,
+  // ARMv8 SHA-256 crypto extensions.
+  BUB_CPU_FEATURE_ARMV8_SHA2,
+} BubCpuFeature;
+
+/* Queries the CPU the program is running on for |feature|. The result is
+ * probed once and cached.
+ *
+ * @return: non-zero if |feature| is available, zero otherwise.
+ */
+int bub_cpu_has_feature(BubCpuFeature feature);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUB_CPU_H_ */
\ No newline at end of file
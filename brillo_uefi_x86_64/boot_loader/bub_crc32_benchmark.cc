@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host benchmark for the libbub crc32 implementations. Reports throughput in
+// GB/s for buffer sizes from 64 B to 64 MiB.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <vector>
+
+#include "bub_sysdeps.h"
+#include "bub_util.h"
+
+// Minimum number of bytes hashed per measurement, to keep timer resolution
+// and warm-up effects negligible for small buffers.
+#define MIN_BYTES_PER_RUN (256ULL * 1024 * 1024)
+
+struct Crc32Impl {
+  const char* name;
+  BubCrc32Fn fn;
+};
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void format_size(size_t size, char* buf, size_t buf_size) {
+  if (size >= 1024 * 1024)
+    snprintf(buf, buf_size, "%zu MiB", size >> 20);
+  else if (size >= 1024)
+    snprintf(buf, buf_size, "%zu KiB", size >> 10);
+  else
+    snprintf(buf, buf_size, "%zu B", size);
+}
+
+int main(int argc, char* argv[]) {
+  std::vector<Crc32Impl> impls;
+  impls.push_back({"reference", bub_crc32_reference});
+  impls.push_back({"slice8", bub_crc32_slice8});
+  if (bub_crc32_hw() != NULL)
+    impls.push_back({bub_crc32_hw_name(), bub_crc32_hw()});
+  else
+    fprintf(stderr, "No %s support on this CPU.\n", bub_crc32_hw_name());
+
+  const size_t max_size = 64 * 1024 * 1024;
+  std::vector<uint8_t> buf(max_size);
+  for (size_t n = 0; n < buf.size(); ++n)
+    buf[n] = (uint8_t)(n * 131 + (n >> 11));
+
+  printf("%-10s", "size");
+  for (const Crc32Impl& impl : impls)
+    printf(" %12s", impl.name);
+  printf("    (GB/s)\n");
+
+  for (size_t size = 64; size <= max_size; size *= 4) {
+    char size_str[16];
+    uint64_t iterations = (MIN_BYTES_PER_RUN + size - 1) / size;
+    // Keep the slow reference implementation from dominating the run time.
+    if (iterations < 4)
+      iterations = 4;
+
+    format_size(size, size_str, sizeof(size_str));
+    printf("%-10s", size_str);
+    for (const Crc32Impl& impl : impls) {
+      uint32_t crc = 0;
+      double start = now_seconds();
+      for (uint64_t i = 0; i < iterations; ++i)
+        crc = impl.fn(crc, buf.data(), size);
+      double elapsed = now_seconds() - start;
+      // Print the result so the loop cannot be optimized out.
+      if (crc == 0x1)
+        fprintf(stderr, " ");
+      printf(" %12.2f", (double)size * iterations / elapsed / 1e9);
+    }
+    printf("\n");
+  }
+
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "bub_sysdeps.h"
+#include "bub_util.h"
+
+// Fills |buf| with a fixed pseudo-random byte pattern.
+static void fill_pattern(std::vector<uint8_t>* buf) {
+  uint32_t x = 0x12345678;
+  for (size_t n = 0; n < buf->size(); ++n) {
+    x = x * 1103515245 + 12345;
+    (*buf)[n] = (uint8_t)(x >> 16);
+  }
+}
+
+// Checks |impl| against the reference for every length up to |max_size| at
+// every alignment within a 16-byte window, with and without a running crc.
+static void check_against_reference(BubCrc32Fn impl, size_t max_size) {
+  std::vector<uint8_t> buf(max_size + 16);
+  fill_pattern(&buf);
+
+  for (size_t align = 0; align < 16; ++align) {
+    for (size_t size = 0; size <= max_size; ++size) {
+      const uint8_t* p = buf.data() + align;
+      ASSERT_EQ(bub_crc32_reference(0, p, size), impl(0, p, size))
+          << "size " << size << " align " << align;
+      ASSERT_EQ(bub_crc32_reference(0xdeadbeef, p, size),
+                impl(0xdeadbeef, p, size))
+          << "size " << size << " align " << align;
+    }
+  }
+}
+
+TEST(Crc32Test, KnownValue) {
+  const char* check = "123456789";
+  EXPECT_EQ(0xcbf43926U, bub_crc32_reference(0, check, 9));
+  EXPECT_EQ(0xcbf43926U, bub_crc32_slice8(0, check, 9));
+  EXPECT_EQ(0xcbf43926U, bub_crc32(0, check, 9));
+  EXPECT_EQ(0U, bub_crc32(0, check, 0));
+}
+
+TEST(Crc32Test, Slice8MatchesReference) {
+  check_against_reference(bub_crc32_slice8, 300);
+}
+
+TEST(Crc32Test, HardwareMatchesReference) {
+  BubCrc32Fn hw = bub_crc32_hw();
+  if (hw == NULL) {
+    fprintf(stderr, "No %s support on this CPU, skipping.\n",
+            bub_crc32_hw_name());
+    return;
+  }
+  check_against_reference(hw, 300);
+}
+
+TEST(Crc32Test, ChainedMatchesSingleShot) {
+  std::vector<uint8_t> buf(1 << 20);
+  fill_pattern(&buf);
+  uint32_t expected = bub_crc32_reference(0, buf.data(), buf.size());
+
+  // Split at uneven points so every implementation sees unaligned chunks.
+  uint32_t crc = 0;
+  size_t offset = 0;
+  for (size_t chunk = 1; offset < buf.size(); chunk = chunk * 3 + 1) {
+    size_t n = std::min(chunk, buf.size() - offset);
+    crc = bub_crc32(crc, buf.data() + offset, (int)n);
+    offset += n;
+  }
+  EXPECT_EQ(expected, crc);
+}
\ No newline at end of file
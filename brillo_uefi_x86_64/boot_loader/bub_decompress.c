@@ -0,0 +1,714 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bub_decompress.h"
+#include "bub_util.h"
+
+// LZ4 frame format, see lz4_Frame_format.md in the LZ4 sources.
+#define LZ4_MAGIC 0x184D2204U
+#define LZ4_FLG_VERSION_MASK 0xC0
+#define LZ4_FLG_VERSION 0x40
+#define LZ4_FLG_BLOCK_CHECKSUM 0x10
+#define LZ4_FLG_CONTENT_SIZE 0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_RESERVED 0x02
+#define LZ4_FLG_DICT_ID 0x01
+#define LZ4_BD_RESERVED 0x8F
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000U
+#define LZ4_MIN_MATCH 4
+
+// gzip member header, RFC 1952.
+#define GZIP_FLG_FHCRC 0x02
+#define GZIP_FLG_FEXTRA 0x04
+#define GZIP_FLG_FNAME 0x08
+#define GZIP_FLG_FCOMMENT 0x10
+#define GZIP_FLG_RESERVED 0xE0
+
+// Deflate, RFC 1951.
+#define DEFLATE_MAX_BITS 15
+#define DEFLATE_MAX_LCODES 286
+#define DEFLATE_MAX_DCODES 30
+#define DEFLATE_FIXED_LCODES 288
+
+/* Number of bits resolved by a single Huffman table lookup. Longer codes
+ * fall back to canonical decoding one bit at a time.
+ */
+#define HUFFMAN_FAST_BITS 10
+#define HUFFMAN_FAST_MASK ((1U << HUFFMAN_FAST_BITS) - 1)
+
+static inline uint32_t load_le16(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static inline uint32_t load_le32(const uint8_t* p) {
+  return load_le16(p) | (load_le16(p + 2) << 16);
+}
+
+static inline uint64_t load_le64(const uint8_t* p) {
+  return (uint64_t)load_le32(p) | ((uint64_t)load_le32(p + 4) << 32);
+}
+
+/* Copies a |len| byte back-reference |dist| bytes behind |dest|. The source
+ * repeats with period |dist|, so it is copied in growing non-overlapping
+ * pieces rather than byte by byte.
+ */
+static void copy_match(uint8_t* dest, size_t dist, size_t len) {
+  size_t n;
+
+  while (len > 0) {
+    n = len < dist ? len : dist;
+    bub_memcpy(dest, dest - dist, n);
+    dest += n;
+    len -= n;
+    dist += dist;
+  }
+}
+
+/* Copies at least |len| bytes in 16 byte pieces, so up to 15 bytes past
+ * |src| + |len| are read and past |dest| + |len| are written. The pieces
+ * must not overlap, i.e. |dest| - |src| is either negative or at least 16.
+ * This keeps the common short literal runs and matches out of bub_memcpy().
+ */
+static inline void wild_copy(uint8_t* dest, const uint8_t* src, size_t len) {
+  uint8_t* end = dest + len;
+
+  do {
+    __builtin_memcpy(dest, src, 16);
+    dest += 16;
+    src += 16;
+  } while (dest < end);
+}
+
+static BubDecompressResult copy_run(BubDecompressor* d, size_t in_avail) {
+  size_t n = in_avail - d->in_pos;
+
+  bub_memcpy(d->out + d->out_pos, d->in + d->in_pos, n);
+  d->in_pos += n;
+  d->out_pos += n;
+  return d->in_pos == d->in_size ? BUB_DECOMPRESS_RESULT_OK
+                                  : BUB_DECOMPRESS_RESULT_NEED_INPUT;
+}
+
+/* Reads a run of 255-terminated length bytes as used by LZ4 sequences.
+ *
+ * @return zero if the input ends before the run does.
+ */
+static int lz4_read_length(const uint8_t** ip, const uint8_t* iend,
+                           size_t* len) {
+  unsigned int b;
+
+  do {
+    if (*ip >= iend)
+      return 0;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 1;
+}
+
+/* Decodes the LZ4 block of |src_size| bytes at |src| to the output of |d|.
+ *
+ * @return zero on malformed input or output overflow.
+ */
+static int lz4_decode_block(BubDecompressor* d, const uint8_t* src,
+                            size_t src_size) {
+  const uint8_t* ip = src;
+  const uint8_t* iend = src + src_size;
+  size_t op = d->out_pos;
+  size_t len, offset;
+  unsigned int token;
+
+  for (;;) {
+    if (ip >= iend)
+      return 0;
+    token = *ip++;
+
+    len = token >> 4;
+    if (len == 15 && !lz4_read_length(&ip, iend, &len))
+      return 0;
+    if (len > (size_t)(iend - ip) || len > d->out_size - op)
+      return 0;
+    if (len <= 64 && (size_t)(iend - ip) - len >= 16 &&
+        d->out_size - op - len >= 16)
+      wild_copy(d->out + op, ip, len);
+    else
+      bub_memcpy(d->out + op, ip, len);
+    ip += len;
+    op += len;
+
+    // The last sequence of a block has literals only.
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return 0;
+    offset = load_le16(ip);
+    ip += 2;
+    if (offset == 0 || offset > op)
+      return 0;
+
+    len = token & 15;
+    if (len == 15 && !lz4_read_length(&ip, iend, &len))
+      return 0;
+    len += LZ4_MIN_MATCH;
+    if (len > d->out_size - op)
+      return 0;
+    if (offset >= 16 && len <= 64 && d->out_size - op - len >= 16)
+      wild_copy(d->out + op, d->out + op - offset, len);
+    else
+      copy_match(d->out + op, offset, len);
+    op += len;
+  }
+
+  d->out_pos = op;
+  return 1;
+}
+
+static BubDecompressResult lz4_run(BubDecompressor* d, size_t in_avail) {
+  const uint8_t* in = d->in;
+  size_t header_size = 7;
+  size_t block_size;
+  size_t need;
+  uint32_t block_word;
+  uint8_t flg;
+
+  if (!d->header_done) {
+    // Magic, FLG, BD and header checksum, plus the optional fields.
+    if (in_avail < header_size)
+      return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+    flg = in[4];
+    if (load_le32(in) != LZ4_MAGIC ||
+        (flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION ||
+        (flg & (LZ4_FLG_RESERVED | LZ4_FLG_DICT_ID)) ||
+        (in[5] & LZ4_BD_RESERVED)) {
+      bub_warning("Unsupported LZ4 frame header.\n");
+      return BUB_DECOMPRESS_ERROR_FORMAT;
+    }
+    if (flg & LZ4_FLG_CONTENT_SIZE)
+      header_size += 8;
+    if (in_avail < header_size)
+      return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+    if ((flg & LZ4_FLG_CONTENT_SIZE) && load_le64(in + 6) != d->out_size)
+      return BUB_DECOMPRESS_ERROR_OUTPUT_SIZE;
+
+    d->lz4_block_checksum = (flg & LZ4_FLG_BLOCK_CHECKSUM) != 0;
+    d->lz4_content_checksum = (flg & LZ4_FLG_CONTENT_CHECKSUM) != 0;
+    d->in_pos = header_size;
+    d->header_done = 1;
+  }
+
+  for (;;) {
+    if (in_avail - d->in_pos < 4)
+      return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+    block_word = load_le32(in + d->in_pos);
+
+    // End mark, followed by the optional content checksum.
+    if (block_word == 0) {
+      need = 4 + (d->lz4_content_checksum ? 4 : 0);
+      if (in_avail - d->in_pos < need)
+        return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+      if (d->in_pos + need != d->in_size)
+        return BUB_DECOMPRESS_ERROR_FORMAT;
+      if (d->out_pos != d->out_size)
+        return BUB_DECOMPRESS_ERROR_OUTPUT_SIZE;
+      d->in_pos += need;
+      return BUB_DECOMPRESS_RESULT_OK;
+    }
+
+    block_size = block_word & ~LZ4_BLOCK_UNCOMPRESSED;
+    need = 4 + block_size + (d->lz4_block_checksum ? 4 : 0);
+    if (need > d->in_size - d->in_pos)
+      return BUB_DECOMPRESS_ERROR_FORMAT;
+    // Blocks are only decoded once all of them has arrived.
+    if (in_avail - d->in_pos < need)
+      return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+
+    if (block_word & LZ4_BLOCK_UNCOMPRESSED) {
+      if (block_size > d->out_size - d->out_pos)
+        return BUB_DECOMPRESS_ERROR_OUTPUT_SIZE;
+      bub_memcpy(d->out + d->out_pos, in + d->in_pos + 4, block_size);
+      d->out_pos += block_size;
+    } else if (!lz4_decode_block(d, in + d->in_pos + 4, block_size)) {
+      bub_warning("Corrupt LZ4 block.\n");
+      return BUB_DECOMPRESS_ERROR_FORMAT;
+    }
+    d->in_pos += need;
+  }
+}
+
+/* Canonical Huffman code. |fast| maps the next HUFFMAN_FAST_BITS input bits
+ * to (code length << 9 | symbol), or zero for codes longer than that.
+ * |count| and |symbol| drive the bit-by-bit fallback as in zlib's puff.c.
+ */
+typedef struct {
+  uint16_t fast[1 << HUFFMAN_FAST_BITS];
+  uint16_t count[DEFLATE_MAX_BITS + 1];
+  uint16_t symbol[DEFLATE_FIXED_LCODES];
+} Huffman;
+
+/* Bit reader and output position while a single deflate block is decoded.
+ * Only copied back to the BubDecompressor once the block is complete.
+ */
+typedef struct {
+  const uint8_t* in;
+  size_t in_avail;
+  size_t in_pos;
+  uint64_t bit_buf;
+  unsigned int bit_count;
+  uint8_t* out;
+  size_t out_size;
+  size_t out_pos;
+  int overrun;
+} Inflate;
+
+static void refill(Inflate* s) {
+  while (s->bit_count <= 56 && s->in_pos < s->in_avail) {
+    s->bit_buf |= (uint64_t)s->in[s->in_pos++] << s->bit_count;
+    s->bit_count += 8;
+  }
+}
+
+/* Returns the next |n| bits, n <= 32. Running out of input sets |overrun|
+ * and returns zero.
+ */
+static uint32_t get_bits(Inflate* s, unsigned int n) {
+  uint32_t value;
+
+  if (s->bit_count < n) {
+    refill(s);
+    if (s->bit_count < n) {
+      s->overrun = 1;
+      return 0;
+    }
+  }
+  value = (uint32_t)(s->bit_buf & ((1ULL << n) - 1));
+  s->bit_buf >>= n;
+  s->bit_count -= n;
+  return value;
+}
+
+/* Builds |h| from the code lengths of |n| symbols.
+ *
+ * @return zero if the lengths over-subscribe the code space.
+ */
+static int huffman_build(Huffman* h, const uint8_t* lengths, int n) {
+  uint16_t offsets[DEFLATE_MAX_BITS + 2];
+  uint16_t next_code[DEFLATE_MAX_BITS + 1];
+  uint32_t code, reversed;
+  int left, len, sym, i;
+
+  bub_memset(h->count, 0, sizeof(h->count));
+  for (sym = 0; sym < n; ++sym)
+    h->count[lengths[sym]]++;
+  h->count[0] = 0;
+
+  left = 1;
+  for (len = 1; len <= DEFLATE_MAX_BITS; ++len) {
+    left <<= 1;
+    left -= h->count[len];
+    if (left < 0)
+      return 0;
+  }
+
+  offsets[1] = 0;
+  for (len = 1; len <= DEFLATE_MAX_BITS; ++len)
+    offsets[len + 1] = offsets[len] + h->count[len];
+  for (sym = 0; sym < n; ++sym) {
+    if (lengths[sym] != 0)
+      h->symbol[offsets[lengths[sym]]++] = (uint16_t)sym;
+  }
+
+  code = 0;
+  next_code[0] = 0;
+  for (len = 1; len <= DEFLATE_MAX_BITS; ++len) {
+    code = (code + h->count[len - 1]) << 1;
+    next_code[len] = (uint16_t)code;
+  }
+
+  // Deflate sends codes most significant bit first, so the table is indexed
+  // by the bit-reversed code.
+  bub_memset(h->fast, 0, sizeof(h->fast));
+  for (sym = 0; sym < n; ++sym) {
+    len = lengths[sym];
+    if (len == 0 || len > HUFFMAN_FAST_BITS)
+      continue;
+    code = next_code[len]++;
+    reversed = 0;
+    for (i = 0; i < len; ++i)
+      reversed |= ((code >> i) & 1) << (len - 1 - i);
+    for (i = (int)reversed; i < (1 << HUFFMAN_FAST_BITS); i += 1 << len)
+      h->fast[i] = (uint16_t)((len << 9) | sym);
+  }
+
+  return 1;
+}
+
+/* Decodes a symbol with |h|.
+ *
+ * @return the symbol, or a negative value on overrun or an invalid code.
+ */
+static int huffman_decode(Inflate* s, const Huffman* h) {
+  int code = 0, first = 0, index = 0, count, len;
+  unsigned int entry;
+
+  if (s->bit_count < DEFLATE_MAX_BITS)
+    refill(s);
+  entry = h->fast[s->bit_buf & HUFFMAN_FAST_MASK];
+  len = entry >> 9;
+  if (len != 0 && (unsigned int)len <= s->bit_count) {
+    s->bit_buf >>= len;
+    s->bit_count -= len;
+    return entry & 0x1FF;
+  }
+
+  for (len = 1; len <= DEFLATE_MAX_BITS; ++len) {
+    code |= (int)get_bits(s, 1);
+    if (s->overrun)
+      return -1;
+    count = h->count[len];
+    if (code - count < first)
+      return h->symbol[index + (code - first)];
+    index += count;
+    first += count;
+    first <<= 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+static BubDecompressResult inflate_codes(Inflate* s, const Huffman* lencode,
+                                         const Huffman* distcode) {
+  static const uint16_t len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+  static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+  static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+  int sym;
+  size_t len, dist;
+
+  for (;;) {
+    sym = huffman_decode(s, lencode);
+    if (s->overrun)
+      return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+    if (sym < 0)
+      return BUB_DECOMPRESS_ERROR_FORMAT;
+
+    if (sym < 256) {
+      if (s->out_pos >= s->out_size)
+        return BUB_DECOMPRESS_ERROR_OUTPUT_SIZE;
+      s->out[s->out_pos++] = (uint8_t)sym;
+    } else if (sym == 256) {
+      return BUB_DECOMPRESS_RESULT_OK;
+    } else {
+      sym -= 257;
+      if (sym >= 29)
+        return BUB_DECOMPRESS_ERROR_FORMAT;
+      len = len_base[sym] + get_bits(s, len_extra[sym]);
+
+      sym = huffman_decode(s, distcode);
+      if (s->overrun)
+        return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+      if (sym < 0 || sym >= 30)
+        return BUB_DECOMPRESS_ERROR_FORMAT;
+      dist = dist_base[sym] + get_bits(s, dist_extra[sym]);
+      if (s->overrun)
+        return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+
+      if (dist > s->out_pos)
+        return BUB_DECOMPRESS_ERROR_FORMAT;
+      if (len > s->out_size - s->out_pos)
+        return BUB_DECOMPRESS_ERROR_OUTPUT_SIZE;
+      if (dist >= 16 && s->out_size - s->out_pos - len >= 16)
+        wild_copy(s->out + s->out_pos, s->out + s->out_pos - dist, len);
+      else
+        copy_match(s->out + s->out_pos, dist, len);
+      s->out_pos += len;
+    }
+  }
+}
+
+static BubDecompressResult inflate_stored(Inflate* s) {
+  size_t len;
+
+  // Go back to a byte boundary and hand unused whole bytes back to the input.
+  get_bits(s, s->bit_count & 7);
+  s->in_pos -= s->bit_count / 8;
+  s->bit_buf = 0;
+  s->bit_count = 0;
+
+  if (s->in_avail - s->in_pos < 4)
+    return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+  len = load_le16(s->in + s->in_pos);
+  if ((load_le16(s->in + s->in_pos + 2) ^ 0xFFFF) != len)
+    return BUB_DECOMPRESS_ERROR_FORMAT;
+  s->in_pos += 4;
+
+  if (s->in_avail - s->in_pos < len)
+    return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+  if (len > s->out_size - s->out_pos)
+    return BUB_DECOMPRESS_ERROR_OUTPUT_SIZE;
+  bub_memcpy(s->out + s->out_pos, s->in + s->in_pos, len);
+  s->in_pos += len;
+  s->out_pos += len;
+  return BUB_DECOMPRESS_RESULT_OK;
+}
+
+static BubDecompressResult inflate_fixed(Inflate* s) {
+  Huffman lencode, distcode;
+  uint8_t lengths[DEFLATE_FIXED_LCODES];
+  int sym;
+
+  for (sym = 0; sym < 144; ++sym)
+    lengths[sym] = 8;
+  for (; sym < 256; ++sym)
+    lengths[sym] = 9;
+  for (; sym < 280; ++sym)
+    lengths[sym] = 7;
+  for (; sym < DEFLATE_FIXED_LCODES; ++sym)
+    lengths[sym] = 8;
+  huffman_build(&lencode, lengths, DEFLATE_FIXED_LCODES);
+
+  for (sym = 0; sym < DEFLATE_MAX_DCODES; ++sym)
+    lengths[sym] = 5;
+  huffman_build(&distcode, lengths, DEFLATE_MAX_DCODES);
+
+  return inflate_codes(s, &lencode, &distcode);
+}
+
+static BubDecompressResult inflate_dynamic(Inflate* s) {
+  static const uint8_t order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+  Huffman lencode, distcode;
+  uint8_t lengths[DEFLATE_MAX_LCODES + DEFLATE_MAX_DCODES];
+  int nlen, ndist, ncode, index, sym, len, repeat;
+
+  nlen = (int)get_bits(s, 5) + 257;
+  ndist = (int)get_bits(s, 5) + 1;
+  ncode = (int)get_bits(s, 4) + 4;
+  if (s->overrun)
+    return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+  if (nlen > DEFLATE_MAX_LCODES || ndist > DEFLATE_MAX_DCODES)
+    return BUB_DECOMPRESS_ERROR_FORMAT;
+
+  bub_memset(lengths, 0, sizeof(lengths));
+  for (index = 0; index < ncode; ++index)
+    lengths[order[index]] = (uint8_t)get_bits(s, 3);
+  if (s->overrun)
+    return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+  if (!huffman_build(&lencode, lengths, 19))
+    return BUB_DECOMPRESS_ERROR_FORMAT;
+
+  index = 0;
+  while (index < nlen + ndist) {
+    sym = huffman_decode(s, &lencode);
+    if (s->overrun)
+      return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+    if (sym < 0)
+      return BUB_DECOMPRESS_ERROR_FORMAT;
+    if (sym < 16) {
+      lengths[index++] = (uint8_t)sym;
+      continue;
+    }
+
+    len = 0;
+    if (sym == 16) {
+      if (index == 0)
+        return BUB_DECOMPRESS_ERROR_FORMAT;
+      len = lengths[index - 1];
+      repeat = 3 + (int)get_bits(s, 2);
+    } else if (sym == 17) {
+      repeat = 3 + (int)get_bits(s, 3);
+    } else {
+      repeat = 11 + (int)get_bits(s, 7);
+    }
+    if (s->overrun)
+      return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+    if (index + repeat > nlen + ndist)
+      return BUB_DECOMPRESS_ERROR_FORMAT;
+    while (repeat--)
+      lengths[index++] = (uint8_t)len;
+  }
+
+  // A block without an end-of-block code cannot be decoded.
+  if (lengths[256] == 0)
+    return BUB_DECOMPRESS_ERROR_FORMAT;
+  if (!huffman_build(&lencode, lengths, nlen) ||
+      !huffman_build(&distcode, lengths + nlen, ndist))
+    return BUB_DECOMPRESS_ERROR_FORMAT;
+
+  return inflate_codes(s, &lencode, &distcode);
+}
+
+static BubDecompressResult gzip_header(BubDecompressor* d, size_t in_avail) {
+  const uint8_t* in = d->in;
+  size_t pos = 10;
+  uint8_t flg;
+
+  if (in_avail < pos)
+    return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+  flg = in[3];
+  if (in[0] != 0x1f || in[1] != 0x8b || in[2] != 8 ||
+      (flg & GZIP_FLG_RESERVED)) {
+    bub_warning("Unsupported gzip header.\n");
+    return BUB_DECOMPRESS_ERROR_FORMAT;
+  }
+
+  if (flg & GZIP_FLG_FEXTRA) {
+    if (in_avail < pos + 2)
+      return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+    pos += 2 + load_le16(in + pos);
+  }
+  if (flg & GZIP_FLG_FNAME) {
+    do {
+      if (pos >= in_avail)
+        return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+    } while (in[pos++] != 0);
+  }
+  if (flg & GZIP_FLG_FCOMMENT) {
+    do {
+      if (pos >= in_avail)
+        return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+    } while (in[pos++] != 0);
+  }
+  if (flg & GZIP_FLG_FHCRC)
+    pos += 2;
+  if (pos > in_avail)
+    return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+
+  d->in_pos = pos;
+  d->header_done = 1;
+  return BUB_DECOMPRESS_RESULT_OK;
+}
+
+static BubDecompressResult gzip_run(BubDecompressor* d, size_t in_avail) {
+  BubDecompressResult result;
+  Inflate s;
+  uint32_t last, type;
+
+  if (!d->header_done) {
+    result = gzip_header(d, in_avail);
+    if (result != BUB_DECOMPRESS_RESULT_OK)
+      return result;
+  }
+
+  while (!d->last_block_done) {
+    s.in = d->in;
+    s.in_avail = in_avail;
+    s.in_pos = d->in_pos;
+    s.bit_buf = d->bit_buf;
+    s.bit_count = d->bit_count;
+    s.out = d->out;
+    s.out_size = d->out_size;
+    s.out_pos = d->out_pos;
+    s.overrun = 0;
+
+    last = get_bits(&s, 1);
+    type = get_bits(&s, 2);
+    if (s.overrun)
+      return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+    if (type == 0)
+      result = inflate_stored(&s);
+    else if (type == 1)
+      result = inflate_fixed(&s);
+    else if (type == 2)
+      result = inflate_dynamic(&s);
+    else
+      result = BUB_DECOMPRESS_ERROR_FORMAT;
+    // On NEED_INPUT nothing is committed, so the block is decoded again from
+    // its start once more input has arrived.
+    if (result != BUB_DECOMPRESS_RESULT_OK)
+      return result;
+
+    d->in_pos = s.in_pos;
+    d->bit_buf = s.bit_buf;
+    d->bit_count = s.bit_count;
+    d->out_pos = s.out_pos;
+    d->last_block_done = last;
+  }
+
+  // The CRC-32 and size trailer starts at the next byte boundary.
+  d->in_pos -= d->bit_count / 8;
+  d->bit_buf = 0;
+  d->bit_count = 0;
+  if (in_avail - d->in_pos < 8)
+    return BUB_DECOMPRESS_RESULT_NEED_INPUT;
+  if (d->in_pos + 8 != d->in_size)
+    return BUB_DECOMPRESS_ERROR_FORMAT;
+  if (d->out_pos != d->out_size ||
+      load_le32(d->in + d->in_pos + 4) != (uint32_t)d->out_size)
+    return BUB_DECOMPRESS_ERROR_OUTPUT_SIZE;
+  if (load_le32(d->in + d->in_pos) != bub_crc32(0, d->out, (int)d->out_size)) {
+    bub_warning("gzip CRC-32 mismatch.\n");
+    return BUB_DECOMPRESS_ERROR_FORMAT;
+  }
+  d->in_pos += 8;
+  return BUB_DECOMPRESS_RESULT_OK;
+}
+
+void bub_decompressor_init(BubDecompressor* d,
+                           BubCompression compression,
+                           const uint8_t* in,
+                           size_t in_size,
+                           uint8_t* out,
+                           size_t out_size) {
+  bub_memset(d, 0, sizeof(BubDecompressor));
+  d->compression = compression;
+  d->in = in;
+  d->in_size = in_size;
+  d->out = out;
+  d->out_size = out_size;
+}
+
+BubDecompressResult bub_decompressor_run(BubDecompressor* d, size_t in_avail) {
+  BubDecompressResult result;
+
+  if (d->done)
+    return BUB_DECOMPRESS_RESULT_OK;
+  if (in_avail > d->in_size)
+    in_avail = d->in_size;
+
+  switch (d->compression) {
+    case BUB_COMPRESSION_NONE:
+      if (d->in_size != d->out_size)
+        return BUB_DECOMPRESS_ERROR_OUTPUT_SIZE;
+      result = copy_run(d, in_avail);
+      break;
+    case BUB_COMPRESSION_LZ4:
+      result = lz4_run(d, in_avail);
+      break;
+    case BUB_COMPRESSION_GZIP:
+      result = gzip_run(d, in_avail);
+      break;
+    default:
+      bub_warning("Unknown compression.\n");
+      return BUB_DECOMPRESS_ERROR_FORMAT;
+  }
+
+  // Out of input with all of it received means the payload is truncated.
+  if (result == BUB_DECOMPRESS_RESULT_NEED_INPUT && in_avail == d->in_size)
+    result = BUB_DECOMPRESS_ERROR_FORMAT;
+  if (result == BUB_DECOMPRESS_RESULT_OK)
+    d->done = 1;
+  return result;
+}
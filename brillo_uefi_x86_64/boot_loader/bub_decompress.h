@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUB_DECOMPRESS_H_
+#define BUB_DECOMPRESS_H_
+
+#include "bub_sysdeps.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Compression of a boot image payload. The values are stored in the boot
+ * image header and must not change.
+ */
+typedef enum {
+  BUB_COMPRESSION_NONE = 0,
+  // LZ4 frame format, as written by lz4(1).
+  BUB_COMPRESSION_LZ4 = 1,
+  // gzip (RFC 1952) with a single deflate member.
+  BUB_COMPRESSION_GZIP = 2,
+} BubCompression;
+
+/* Return codes of bub_decompressor_run().
+ *
+ * BUB_DECOMPRESS_RESULT_OK is returned once the whole payload has been
+ * decompressed and exactly fills the output buffer.
+ *
+ * BUB_DECOMPRESS_RESULT_NEED_INPUT is returned if all input received so far
+ * has been used and more is needed to make progress.
+ *
+ * BUB_DECOMPRESS_ERROR_FORMAT is returned for corrupt or truncated input.
+ *
+ * BUB_DECOMPRESS_ERROR_OUTPUT_SIZE is returned if the payload does not
+ * decompress to exactly the size of the output buffer.
+ */
+typedef enum {
+  BUB_DECOMPRESS_RESULT_OK,
+  BUB_DECOMPRESS_RESULT_NEED_INPUT,
+  BUB_DECOMPRESS_ERROR_FORMAT,
+  BUB_DECOMPRESS_ERROR_OUTPUT_SIZE,
+} BubDecompressResult;
+
+/* Decompresses a payload into a contiguous output buffer while the payload
+ * itself is still arriving in a contiguous input buffer, e.g. as chunks of a
+ * disk read land.
+ *
+ * Work is resumed at LZ4 block and deflate block boundaries: a block is only
+ * consumed once all of it has arrived, and a partially decoded deflate block
+ * is decoded again from its start on the next call. Back-references are
+ * resolved against the output buffer, so no separate window is kept.
+ *
+ * Checksums inside the payload (LZ4 block and content checksums, the gzip
+ * CRC-32) are not used for integrity; see BUB_ENABLE_VERIFY for that. The
+ * gzip CRC-32 and size are still checked to catch packing errors.
+ */
+typedef struct {
+  BubCompression compression;
+  const uint8_t* in;
+  size_t in_size;
+  uint8_t* out;
+  size_t out_size;
+
+  // Position the next call resumes from.
+  size_t in_pos;
+  size_t out_pos;
+  uint64_t bit_buf;
+  unsigned int bit_count;
+
+  int header_done;
+  int last_block_done;
+  int done;
+  // LZ4 frame flags.
+  int lz4_block_checksum;
+  int lz4_content_checksum;
+} BubDecompressor;
+
+/* Sets up |d| to decompress the |in_size| byte |compression| payload at |in|
+ * into the |out_size| bytes at |out|. Nothing is read from |in| yet.
+ */
+void bub_decompressor_init(BubDecompressor* d,
+                           BubCompression compression,
+                           const uint8_t* in,
+                           size_t in_size,
+                           uint8_t* out,
+                           size_t out_size);
+
+/* Continues decompression with the first |in_avail| bytes of the input
+ * available. |in_avail| must not decrease between calls. Once it equals the
+ * input size, any result other than BUB_DECOMPRESS_RESULT_OK is final.
+ */
+BubDecompressResult bub_decompressor_run(BubDecompressor* d, size_t in_avail);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUB_DECOMPRESS_H_ */
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host benchmark comparing the load time of a raw payload with loading it
+// LZ4 or gzip compressed and decompressing each 1 MiB chunk as it lands, the
+// way the boot loader streams compressed kernels and ramdisks.
+//
+// Usage: bub_decompress_benchmark [--read_mbps=N] [payload]
+//
+// The payload should be an uncompressed kernel (e.g. arch/x86/boot/
+// compressed/vmlinux.bin or an uncompressed Image) or ramdisk cpio; without
+// one, 32 MiB of generated data is used, whose compression ratio says little
+// about real payloads. As in bub_sha256_benchmark, files in the page cache
+// read at memory speed; --read_mbps models a disk reading N MB/s instead,
+// which is where compression pays off.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "bub_compress.h"
+#include "bub_decompress.h"
+
+// Read size of the load simulation, BUB_STREAM_CHUNK_SIZE in
+// bub_boot_kernel.h.
+#define CHUNK_SIZE (1024 * 1024)
+
+#define GENERATED_PAYLOAD_SIZE (32 * 1024 * 1024)
+
+// Number of simulated loads; the median is reported.
+#define LOAD_RUNS 9
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+static double sum(const std::vector<double>& values) {
+  double total = 0;
+  for (double v : values)
+    total += v;
+  return total;
+}
+
+// Per-chunk read and decompression times of one simulated load, in seconds.
+struct LoadTimes {
+  std::vector<double> read;
+  std::vector<double> decompress;
+};
+
+// Returns the load time if chunk N is decompressed while chunk N + 1 is
+// read, as the UEFI loader does with EFI_BLOCK_IO2.
+static double pipelined_time(const LoadTimes& times) {
+  double total = times.read[0];
+  for (size_t n = 1; n < times.read.size(); ++n)
+    total += std::max(times.read[n], times.decompress[n - 1]);
+  return total + times.decompress.back();
+}
+
+// Reads the |stored_size| bytes of |fd| into |in| in CHUNK_SIZE pieces,
+// decompressing into |out| after each piece.
+static bool simulate_load(int fd, size_t stored_size, BubCompression compression,
+                          std::vector<uint8_t>* in, std::vector<uint8_t>* out,
+                          double read_mbps, LoadTimes* times) {
+  BubDecompressor d;
+  BubDecompressResult result = BUB_DECOMPRESS_RESULT_NEED_INPUT;
+
+  bub_decompressor_init(&d, compression, in->data(), stored_size, out->data(),
+                        out->size());
+  for (size_t offset = 0; offset < stored_size; offset += CHUNK_SIZE) {
+    size_t size = std::min((size_t)CHUNK_SIZE, stored_size - offset);
+    double start = now_seconds();
+    if (pread(fd, in->data() + offset, size, offset) != (ssize_t)size) {
+      perror("pread");
+      return false;
+    }
+    double end = now_seconds();
+    times->read.push_back(read_mbps > 0 ? size / (read_mbps * 1e6)
+                                        : end - start);
+    start = now_seconds();
+    if (compression != BUB_COMPRESSION_NONE)
+      result = bub_decompressor_run(&d, offset + size);
+    times->decompress.push_back(now_seconds() - start);
+  }
+  if (compression != BUB_COMPRESSION_NONE &&
+      result != BUB_DECOMPRESS_RESULT_OK) {
+    fprintf(stderr, "Decompression failed: %d\n", result);
+    return false;
+  }
+  return true;
+}
+
+static bool write_temp_file(const std::vector<uint8_t>& data,
+                            std::string* path) {
+  char tmp_path[] = "/tmp/bub_decompress_benchmark.XXXXXX";
+  int fd = mkstemp(tmp_path);
+  if (fd < 0 || write(fd, data.data(), data.size()) != (ssize_t)data.size()) {
+    perror("Could not write temporary payload");
+    return false;
+  }
+  close(fd);
+  *path = tmp_path;
+  return true;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: bub_decompress_benchmark [--read_mbps=N] [payload]\n");
+}
+
+int main(int argc, char* argv[]) {
+  double read_mbps = 0;
+  const char* payload_path = NULL;
+
+  for (int n = 1; n < argc; ++n) {
+    if (strncmp(argv[n], "--read_mbps=", 12) == 0) {
+      read_mbps = atof(argv[n] + 12);
+      if (read_mbps <= 0) {
+        usage();
+        return 1;
+      }
+    } else if (payload_path == NULL) {
+      payload_path = argv[n];
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  std::vector<uint8_t> payload;
+  if (payload_path != NULL) {
+    FILE* file = fopen(payload_path, "rb");
+    if (file == NULL) {
+      perror(payload_path);
+      return 1;
+    }
+    uint8_t buf[65536];
+    size_t num_read;
+    while ((num_read = fread(buf, 1, sizeof(buf), file)) > 0)
+      payload.insert(payload.end(), buf, buf + num_read);
+    fclose(file);
+  } else {
+    // Text-like records interleaved with noise, roughly 2:1 compressible.
+    uint32_t seed = 1;
+    payload.resize(GENERATED_PAYLOAD_SIZE);
+    for (size_t n = 0; n < payload.size(); ++n) {
+      if ((n >> 6) % 3 == 0) {
+        seed = seed * 1103515245 + 12345;
+        payload[n] = (uint8_t)(seed >> 24);
+      } else {
+        payload[n] = "bub_decompress "[n % 15] ^ (uint8_t)((n >> 12) & 3);
+      }
+    }
+  }
+  if (payload.empty()) {
+    fprintf(stderr, "Empty payload.\n");
+    return 1;
+  }
+
+  printf("%.1f MiB %s payload in %d KiB chunks, %s, median of %d:\n",
+         payload.size() / 1048576.0,
+         payload_path != NULL ? "given" : "generated", CHUNK_SIZE / 1024,
+         read_mbps > 0 ? "modeled read speed" : "measured read speed",
+         LOAD_RUNS);
+  printf("%-6s %10s %10s %12s %10s %10s %10s\n", "", "stored MiB",
+         "read (ms)", "inflate (ms)", "serial", "pipelined", "vs raw");
+
+  const BubCompression all[] = {BUB_COMPRESSION_NONE, BUB_COMPRESSION_LZ4,
+                                BUB_COMPRESSION_GZIP};
+  std::vector<uint8_t> out(payload.size());
+  double raw = 0;
+  int result = 0;
+  for (BubCompression compression : all) {
+    std::vector<uint8_t> stored;
+    std::string path;
+    if (!bub_compress(compression, payload, &stored) ||
+        !write_temp_file(stored, &path)) {
+      result = 1;
+      break;
+    }
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      perror(path.c_str());
+      result = 1;
+      break;
+    }
+
+    std::vector<uint8_t> in(stored.size());
+    std::vector<double> read_runs, decompress_runs, serial_runs,
+        pipelined_runs;
+    for (int run = 0; run < LOAD_RUNS; ++run) {
+      LoadTimes times;
+      if (!simulate_load(fd, stored.size(), compression, &in, &out,
+                         read_mbps, &times)) {
+        result = 1;
+        break;
+      }
+      read_runs.push_back(sum(times.read));
+      decompress_runs.push_back(sum(times.decompress));
+      serial_runs.push_back(sum(times.read) + sum(times.decompress));
+      pipelined_runs.push_back(pipelined_time(times));
+    }
+    close(fd);
+    unlink(path.c_str());
+    if (result != 0)
+      break;
+    if (compression != BUB_COMPRESSION_NONE && out != payload) {
+      fprintf(stderr, "%s: output does not match payload.\n",
+              bub_compression_name(compression));
+      result = 1;
+      break;
+    }
+
+    // Compressed loads are compared against the pipelined raw load.
+    double pipelined = median(pipelined_runs);
+    if (compression == BUB_COMPRESSION_NONE)
+      raw = pipelined;
+    printf("%-6s %10.2f %10.2f %12.2f %10.2f %10.2f %9.1f%%\n",
+           bub_compression_name(compression), stored.size() / 1048576.0,
+           median(read_runs) * 1e3, median(decompress_runs) * 1e3,
+           median(serial_runs) * 1e3, pipelined * 1e3,
+           (pipelined / raw - 1) * 100);
+  }
+
+  return result;
+}
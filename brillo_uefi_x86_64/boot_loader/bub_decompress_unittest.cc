@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+#include <zlib.h>
+
+#include <vector>
+
+#include "bub_compress.h"
+#include "bub_decompress.h"
+
+namespace {
+
+// Returns |size| bytes mixing repeated text, runs and noise, so that all of
+// literals, short and long matches and overlapping copies are exercised.
+std::vector<uint8_t> make_payload(size_t size) {
+  static const char kText[] = "console=ttyS0 androidboot.hardware=uefi ";
+  std::vector<uint8_t> data;
+  uint32_t seed = 12345;
+
+  while (data.size() < size) {
+    seed = seed * 1103515245 + 12345;
+    switch ((seed >> 16) % 4) {
+      case 0:
+        data.insert(data.end(), kText, kText + sizeof(kText) - 1);
+        break;
+      case 1:
+        data.insert(data.end(), (seed >> 8) % 300, (uint8_t)seed);
+        break;
+      default:
+        for (int n = 0; n < 64; ++n) {
+          seed = seed * 1103515245 + 12345;
+          data.push_back((uint8_t)(seed >> 24));
+        }
+        break;
+    }
+  }
+  data.resize(size);
+  return data;
+}
+
+std::vector<uint8_t> zlib_gzip(const std::vector<uint8_t>& in, int level,
+                               int strategy) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  EXPECT_EQ(Z_OK, deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+                               strategy));
+  std::vector<uint8_t> out(deflateBound(&stream, in.size()));
+  stream.next_in = const_cast<uint8_t*>(in.data());
+  stream.avail_in = in.size();
+  stream.next_out = out.data();
+  stream.avail_out = out.size();
+  EXPECT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+// Decompresses |in| handing it over |step| bytes at a time.
+BubDecompressResult decompress(BubCompression compression,
+                               const std::vector<uint8_t>& in,
+                               size_t out_size, size_t step,
+                               std::vector<uint8_t>* out) {
+  BubDecompressor d;
+  BubDecompressResult result = BUB_DECOMPRESS_RESULT_NEED_INPUT;
+
+  out->assign(out_size, 0);
+  bub_decompressor_init(&d, compression, in.data(), in.size(), out->data(),
+                        out->size());
+  for (size_t avail = std::min(step, in.size());;
+       avail = std::min(avail + step, in.size())) {
+    result = bub_decompressor_run(&d, avail);
+    if (result != BUB_DECOMPRESS_RESULT_NEED_INPUT)
+      break;
+    EXPECT_LT(avail, in.size());
+  }
+  return result;
+}
+
+}  // namespace
+
+TEST(DecompressTest, RoundTrip) {
+  const BubCompression all[] = {BUB_COMPRESSION_NONE, BUB_COMPRESSION_LZ4,
+                                BUB_COMPRESSION_GZIP};
+  // 9 MiB spans several 4 MiB LZ4 blocks.
+  std::vector<uint8_t> payload = make_payload(9 * 1024 * 1024 + 123);
+
+  for (BubCompression compression : all) {
+    std::vector<uint8_t> packed, out;
+    ASSERT_TRUE(bub_compress(compression, payload, &packed));
+    if (compression != BUB_COMPRESSION_NONE) {
+      EXPECT_LT(packed.size(), payload.size());
+    }
+    EXPECT_EQ(BUB_DECOMPRESS_RESULT_OK,
+              decompress(compression, packed, payload.size(), packed.size(),
+                         &out))
+        << bub_compression_name(compression);
+    EXPECT_TRUE(out == payload) << bub_compression_name(compression);
+  }
+}
+
+TEST(DecompressTest, Chunked) {
+  const BubCompression all[] = {BUB_COMPRESSION_NONE, BUB_COMPRESSION_LZ4,
+                                BUB_COMPRESSION_GZIP};
+  std::vector<uint8_t> payload = make_payload(5 * 1024 * 1024);
+
+  for (BubCompression compression : all) {
+    std::vector<uint8_t> packed, out;
+    ASSERT_TRUE(bub_compress(compression, payload, &packed));
+    for (size_t step : {4096, 65536 + 7, 1024 * 1024}) {
+      EXPECT_EQ(BUB_DECOMPRESS_RESULT_OK,
+                decompress(compression, packed, payload.size(), step, &out))
+          << bub_compression_name(compression) << " step " << step;
+      EXPECT_TRUE(out == payload);
+    }
+  }
+}
+
+TEST(DecompressTest, ByteAtATime) {
+  std::vector<uint8_t> payload = make_payload(20000);
+  std::vector<uint8_t> packed, out;
+
+  ASSERT_TRUE(bub_compress(BUB_COMPRESSION_LZ4, payload, &packed));
+  EXPECT_EQ(BUB_DECOMPRESS_RESULT_OK,
+            decompress(BUB_COMPRESSION_LZ4, packed, payload.size(), 1, &out));
+  EXPECT_TRUE(out == payload);
+
+  ASSERT_TRUE(bub_compress(BUB_COMPRESSION_GZIP, payload, &packed));
+  EXPECT_EQ(BUB_DECOMPRESS_RESULT_OK,
+            decompress(BUB_COMPRESSION_GZIP, packed, payload.size(), 1, &out));
+  EXPECT_TRUE(out == payload);
+}
+
+TEST(DecompressTest, DeflateBlockTypes) {
+  std::vector<uint8_t> payload = make_payload(300000);
+  std::vector<uint8_t> out;
+
+  // Level 0 only emits stored blocks, Z_FIXED only fixed Huffman blocks.
+  std::vector<uint8_t> stored = zlib_gzip(payload, 0, Z_DEFAULT_STRATEGY);
+  EXPECT_EQ(BUB_DECOMPRESS_RESULT_OK,
+            decompress(BUB_COMPRESSION_GZIP, stored, payload.size(), 1000,
+                       &out));
+  EXPECT_TRUE(out == payload);
+
+  std::vector<uint8_t> fixed = zlib_gzip(payload, 6, Z_FIXED);
+  EXPECT_EQ(BUB_DECOMPRESS_RESULT_OK,
+            decompress(BUB_COMPRESSION_GZIP, fixed, payload.size(), 1000,
+                       &out));
+  EXPECT_TRUE(out == payload);
+
+  std::vector<uint8_t> rle = zlib_gzip(payload, 9, Z_RLE);
+  EXPECT_EQ(BUB_DECOMPRESS_RESULT_OK,
+            decompress(BUB_COMPRESSION_GZIP, rle, payload.size(), 1000, &out));
+  EXPECT_TRUE(out == payload);
+}
+
+TEST(DecompressTest, Lz4FrameOptions) {
+  // Block and content checksums, no content size, one stored block. The
+  // checksums are skipped, not verified.
+  const uint8_t frame[] = {
+    0x04, 0x22, 0x4d, 0x18, 0x54, 0x70, 0x00,
+    0x05, 0x00, 0x00, 0x80, 'h', 'e', 'l', 'l', 'o',
+    0xaa, 0xbb, 0xcc, 0xdd,
+    0x00, 0x00, 0x00, 0x00,
+    0x11, 0x22, 0x33, 0x44};
+  std::vector<uint8_t> in(frame, frame + sizeof(frame));
+  std::vector<uint8_t> out;
+
+  EXPECT_EQ(BUB_DECOMPRESS_RESULT_OK,
+            decompress(BUB_COMPRESSION_LZ4, in, 5, 3, &out));
+  EXPECT_EQ(0, memcmp(out.data(), "hello", 5));
+
+  // Dictionary IDs are not supported.
+  in[4] |= 0x01;
+  EXPECT_EQ(BUB_DECOMPRESS_ERROR_FORMAT,
+            decompress(BUB_COMPRESSION_LZ4, in, 5, in.size(), &out));
+}
+
+TEST(DecompressTest, OutputSizeMismatch) {
+  const BubCompression all[] = {BUB_COMPRESSION_NONE, BUB_COMPRESSION_LZ4,
+                                BUB_COMPRESSION_GZIP};
+  std::vector<uint8_t> payload = make_payload(100000);
+
+  for (BubCompression compression : all) {
+    std::vector<uint8_t> packed, out;
+    ASSERT_TRUE(bub_compress(compression, payload, &packed));
+    EXPECT_EQ(BUB_DECOMPRESS_ERROR_OUTPUT_SIZE,
+              decompress(compression, packed, payload.size() - 1,
+                         packed.size(), &out))
+        << bub_compression_name(compression);
+    EXPECT_EQ(BUB_DECOMPRESS_ERROR_OUTPUT_SIZE,
+              decompress(compression, packed, payload.size() + 1,
+                         packed.size(), &out))
+        << bub_compression_name(compression);
+  }
+}
+
+TEST(DecompressTest, Truncated) {
+  std::vector<uint8_t> payload = make_payload(100000);
+  const BubCompression all[] = {BUB_COMPRESSION_LZ4, BUB_COMPRESSION_GZIP};
+
+  for (BubCompression compression : all) {
+    std::vector<uint8_t> packed, out;
+    ASSERT_TRUE(bub_compress(compression, payload, &packed));
+    for (size_t size : {(size_t)0, (size_t)5, packed.size() / 2,
+                        packed.size() - 1}) {
+      std::vector<uint8_t> truncated(packed.begin(), packed.begin() + size);
+      EXPECT_EQ(BUB_DECOMPRESS_ERROR_FORMAT,
+                decompress(compression, truncated, payload.size(), 4096,
+                           &out))
+          << bub_compression_name(compression) << " size " << size;
+    }
+  }
+}
+
+TEST(DecompressTest, Corrupt) {
+  std::vector<uint8_t> payload = make_payload(100000);
+  std::vector<uint8_t> packed, out;
+
+  ASSERT_TRUE(bub_compress(BUB_COMPRESSION_GZIP, payload, &packed));
+  packed[0] ^= 1;
+  EXPECT_EQ(BUB_DECOMPRESS_ERROR_FORMAT,
+            decompress(BUB_COMPRESSION_GZIP, packed, payload.size(),
+                       packed.size(), &out));
+  packed[0] ^= 1;
+  // CRC-32 of the trailer.
+  packed[packed.size() - 8] ^= 1;
+  EXPECT_EQ(BUB_DECOMPRESS_ERROR_FORMAT,
+            decompress(BUB_COMPRESSION_GZIP, packed, payload.size(),
+                       packed.size(), &out));
+
+  ASSERT_TRUE(bub_compress(BUB_COMPRESSION_LZ4, payload, &packed));
+  packed[0] ^= 1;
+  EXPECT_EQ(BUB_DECOMPRESS_ERROR_FORMAT,
+            decompress(BUB_COMPRESSION_LZ4, packed, payload.size(),
+                       packed.size(), &out));
+}
+
+TEST(DecompressTest, RandomCorruptionIsContained) {
+  std::vector<uint8_t> payload = make_payload(50000);
+  const BubCompression all[] = {BUB_COMPRESSION_LZ4, BUB_COMPRESSION_GZIP};
+  uint32_t seed = 1;
+
+  for (BubCompression compression : all) {
+    std::vector<uint8_t> packed, out;
+    ASSERT_TRUE(bub_compress(compression, payload, &packed));
+    for (int run = 0; run < 200; ++run) {
+      std::vector<uint8_t> corrupt = packed;
+      for (int n = 0; n < 4; ++n) {
+        seed = seed * 1103515245 + 12345;
+        corrupt[(seed >> 8) % corrupt.size()] ^= (uint8_t)(seed >> 24) | 1;
+      }
+      // Anything but a crash or an out of bounds access is fine; a corrupt
+      // payload may still happen to decode.
+      decompress(compression, corrupt, payload.size(), 8192, &out);
+    }
+  }
+}
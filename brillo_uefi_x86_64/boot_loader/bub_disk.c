@@ -0,0 +1,517 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bub_disk.h"
+
+int bub_gpt_header_validate(const GPTHeader* gpth) {
+  GPTHeader gpth_tmp;
+  uint32_t gpt_header_crc;
+
+  if (bub_memcmp(gpth->signature, GPT_MAGIC, sizeof(gpth->signature))
+      != 0) {
+    bub_warning("GPT signature does not match.\n");
+    return 0;
+  }
+  // Make sure GPT header bytes are within minimun and block size.
+  if (gpth->header_size < GPT_MIN_SIZE) {
+    bub_warning("GPT header too small.\n");
+    return 0;
+  }
+  if (gpth->header_size > sizeof(GPTHeader)) {
+    bub_warning("GPT header too big.\n");
+    return 0;
+  }
+
+  bub_memcpy(&gpth_tmp, gpth, sizeof(GPTHeader));
+  gpt_header_crc = gpth_tmp.header_crc32;
+  gpth_tmp.header_crc32 = 0;
+  if (gpt_header_crc != bub_crc32(0, &gpth_tmp, gpth_tmp.header_size)) {
+    bub_warning("GPT header crc invalid.\n");
+    return 0;
+  }
+
+  if (gpth->revision != GPT_REVISION) {
+    bub_warning("GPT header wrong revision.\n");
+    return 0;
+  }
+
+  return 1;
+}
+
+uint64_t bub_partition_size(const BubPartitionIndexEntry* entry,
+                            uint32_t block_size) {
+  return (entry->last_lba - entry->first_lba) * block_size;
+}
+
+/* Hashes the UCS-2 partition |name| of at most ENTRY_NAME_LEN characters
+ * using 32-bit FNV-1a.
+ */
+static uint32_t partition_name_hash(const uint16_t* name) {
+  uint32_t hash = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < ENTRY_NAME_LEN && name[i] != 0; ++i) {
+    hash ^= (uint32_t)name[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+/* Adds |gpt_entry| to |index| unless it is unused or its name is taken. */
+static void index_add_entry(BubPartitionIndex* index,
+                            const GPTEntry* gpt_entry) {
+  BubPartitionIndexEntry* entry;
+  uint32_t bucket;
+  size_t n;
+
+  // Unused entries have an all-zero partition type GUID.
+  for (n = 0; n < sizeof(gpt_entry->type_GUID); ++n)
+    if (gpt_entry->type_GUID[n] != 0)
+      break;
+  if (n == sizeof(gpt_entry->type_GUID))
+    return;
+
+  entry = &index->entries[index->num_entries];
+  for (n = 0; n < ENTRY_NAME_LEN && gpt_entry->name[n] != 0; ++n)
+    entry->name[n] = gpt_entry->name[n];
+  entry->hash = partition_name_hash(entry->name);
+  entry->first_lba = gpt_entry->first_lba;
+  entry->last_lba = gpt_entry->last_lba;
+  bub_memcpy(entry->unique_GUID, gpt_entry->unique_GUID,
+             sizeof(entry->unique_GUID));
+
+  // Linear probing. On duplicate names the first entry in table order wins,
+  // as it did with a linear scan of the table.
+  bucket = entry->hash & (PARTITION_INDEX_BUCKETS - 1);
+  while (index->buckets[bucket] != 0) {
+    const BubPartitionIndexEntry* other =
+      &index->entries[index->buckets[bucket] - 1];
+    if (other->hash == entry->hash &&
+        !bub_memcmp(other->name, entry->name, sizeof(entry->name)))
+      break;
+    bucket = (bucket + 1) & (PARTITION_INDEX_BUCKETS - 1);
+  }
+  if (index->buckets[bucket] != 0) {
+    bub_memset(entry, 0, sizeof(BubPartitionIndexEntry));
+    return;
+  }
+  index->buckets[bucket] = (uint8_t)(++index->num_entries);
+}
+
+/* Reads the GPT header at |lba| of |dev| into |header| and checks it.
+ *
+ * @return non-zero if the header is valid, describes itself as being at |lba|
+ *         and has an entry size this code handles.
+ */
+static int read_gpt_header(BubBlockDev* dev, uint64_t lba,
+                           GPTHeader* header) {
+  if (dev->read(dev, lba * dev->block_size, header, sizeof(GPTHeader)) !=
+      BUB_IO_RESULT_OK) {
+    bub_warning("Could not read GPT header.\n");
+    return 0;
+  }
+  if (!bub_gpt_header_validate(header))
+    return 0;
+
+  if (header->header_lba != lba) {
+    bub_warning("GPT header at wrong LBA.\n");
+    return 0;
+  }
+  if (header->entry_size < sizeof(GPTEntry) ||
+      header->entry_size % 8 != 0 ||
+      header->entry_size > GPT_ENTRY_READ_SIZE) {
+    bub_warning("Unsupported GPT entry size.\n");
+    return 0;
+  }
+  return 1;
+}
+
+/* Returns the LBA of the backup GPT header for a disk whose primary header
+ * could not be used at all, or zero if the disk size is unknown.
+ */
+static uint64_t last_lba(const BubBlockDev* dev) {
+  return dev->num_blocks > 2 ? dev->num_blocks - 1 : 0;
+}
+
+BubIOResult bub_gpt_read_header(BubBlockDev* dev, GPTHeader* out_header) {
+  if (read_gpt_header(dev, 1, out_header))
+    return BUB_IO_RESULT_OK;
+  if (last_lba(dev) != 0 && read_gpt_header(dev, last_lba(dev), out_header)) {
+    bub_warning("Using backup GPT header.\n");
+    return BUB_IO_RESULT_OK;
+  }
+  return BUB_IO_RESULT_ERROR_IO;
+}
+
+/* Reads the entry array described by |header|, checks it against
+ * entry_crc32 and adds its entries to |index|, which must be empty. On
+ * failure |index| is cleared again.
+ *
+ * The array is read in pieces of whole entries up to GPT_ENTRY_READ_SIZE
+ * bytes, a single read for the usual 128 entries of 128 bytes.
+ */
+static BubIOResult index_gpt_entries(BubPartitionIndex* index,
+                                     BubBlockDev* dev,
+                                     const GPTHeader* header) {
+  uint32_t entries_per_read = GPT_ENTRY_READ_SIZE / header->entry_size;
+  uint64_t offset = header->entry_lba * dev->block_size;
+  uint32_t crc = 0;
+  uint32_t done = 0;
+  uint8_t* entries;
+  int skipped = 0;
+
+  entries = (uint8_t*)bub_malloc_(
+      (size_t)entries_per_read * header->entry_size);
+  if (entries == NULL) {
+    bub_warning("Could not allocate for GPT entries.\n");
+    return BUB_IO_RESULT_ERROR_IO;
+  }
+
+  while (done < header->entry_count) {
+    uint32_t count = header->entry_count - done;
+    size_t num_bytes;
+    uint32_t i;
+
+    if (count > entries_per_read)
+      count = entries_per_read;
+    num_bytes = (size_t)count * header->entry_size;
+
+    if (dev->read(dev, offset, entries, num_bytes) != BUB_IO_RESULT_OK) {
+      bub_warning("Could not read GPT entries.\n");
+      break;
+    }
+    crc = bub_crc32(crc, entries, (int)num_bytes);
+
+    for (i = 0; i < count; ++i) {
+      if (index->num_entries == MAX_GPT_ENTRIES) {
+        skipped = 1;
+        break;
+      }
+      index_add_entry(index,
+                      (const GPTEntry*)(entries + i * header->entry_size));
+    }
+    offset += num_bytes;
+    done += count;
+  }
+  bub_free(entries);
+
+  if (done < header->entry_count || crc != header->entry_crc32) {
+    if (done == header->entry_count)
+      bub_warning("GPT entries crc invalid.\n");
+    bub_memset(index, 0, sizeof(BubPartitionIndex));
+    return BUB_IO_RESULT_ERROR_IO;
+  }
+  if (skipped)
+    bub_warning("Too many GPT entries, some were ignored.\n");
+
+  index->valid = 1;
+  return BUB_IO_RESULT_OK;
+}
+
+BubIOResult bub_partition_index_build_from_disk(BubPartitionIndex* index,
+                                                BubBlockDev* dev) {
+  GPTHeader gpt_header;
+  uint64_t backup_lba;
+
+  bub_memset(index, 0, sizeof(BubPartitionIndex));
+
+  if (read_gpt_header(dev, 1, &gpt_header)) {
+    if (index_gpt_entries(index, dev, &gpt_header) == BUB_IO_RESULT_OK)
+      return BUB_IO_RESULT_OK;
+    backup_lba = gpt_header.alternate_header_lba;
+  } else {
+    backup_lba = last_lba(dev);
+  }
+
+  if (backup_lba <= 1 ||
+      (dev->num_blocks != 0 && backup_lba >= dev->num_blocks))
+    return BUB_IO_RESULT_ERROR_IO;
+
+  bub_warning("Primary GPT unusable, trying backup GPT.\n");
+  if (!read_gpt_header(dev, backup_lba, &gpt_header))
+    return BUB_IO_RESULT_ERROR_IO;
+  return index_gpt_entries(index, dev, &gpt_header);
+}
+
+int bub_partition_index_find(const BubPartitionIndex* index,
+                             const char* partition_name,
+                             const BubPartitionIndexEntry** out_entry) {
+  uint16_t partition_name_ucs2[ENTRY_NAME_LEN + 1];
+  size_t partition_name_bytes;
+  size_t num_chars;
+  size_t i;
+  uint32_t hash;
+  uint32_t bucket;
+
+  *out_entry = NULL;
+
+  // GPT entry names hold at most ENTRY_NAME_LEN characters, so longer names
+  // cannot match. Count characters by skipping UTF-8 continuation bytes.
+  partition_name_bytes = bub_strlen(partition_name) + 1;
+  for (i = 0, num_chars = 0; i < partition_name_bytes - 1; ++i)
+    if ((((const uint8_t*)partition_name)[i] & 0xC0) != 0x80)
+      num_chars++;
+  if (num_chars > ENTRY_NAME_LEN)
+    return 0;
+
+  bub_memset(partition_name_ucs2, 0, sizeof(partition_name_ucs2));
+  if (utf8_to_ucs2((const uint8_t*)partition_name,
+                   partition_name_bytes,
+                   partition_name_ucs2,
+                   sizeof(partition_name_ucs2))) {
+    bub_warning("Could not convert partition name to UCS-2\n");
+    return 0;
+  }
+
+  hash = partition_name_hash(partition_name_ucs2);
+  bucket = hash & (PARTITION_INDEX_BUCKETS - 1);
+  while (index->buckets[bucket] != 0) {
+    const BubPartitionIndexEntry* entry =
+      &index->entries[index->buckets[bucket] - 1];
+    if (entry->hash == hash &&
+        !bub_memcmp(entry->name,
+                    partition_name_ucs2,
+                    sizeof(entry->name))) {
+      *out_entry = entry;
+      return 1;
+    }
+    bucket = (bucket + 1) & (PARTITION_INDEX_BUCKETS - 1);
+  }
+
+  return 0;
+}
+
+/* Resolves |partition_name| and a possibly negative |offset_from_partition|
+ * into the partition entry, its size and a non-negative offset.
+ */
+static BubIOResult resolve_range(const BubBlockDev* dev,
+                                 const BubPartitionIndex* index,
+                                 const char* partition_name,
+                                 int64_t offset_from_partition,
+                                 const BubPartitionIndexEntry** out_entry,
+                                 uint64_t* out_partition_size,
+                                 uint64_t* out_offset) {
+  uint64_t partition_size;
+
+  if (!bub_partition_index_find(index, partition_name, out_entry))
+    return BUB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
+
+  partition_size = bub_partition_size(*out_entry, dev->block_size);
+  if (offset_from_partition < 0) {
+    if ((uint64_t)(-offset_from_partition) > partition_size) {
+      bub_warning("Offset outside range.\n");
+      return BUB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
+    }
+    offset_from_partition = partition_size - (-offset_from_partition);
+  }
+  if ((uint64_t)offset_from_partition > partition_size) {
+    bub_warning("Offset outside range.\n");
+    return BUB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
+  }
+
+  *out_partition_size = partition_size;
+  *out_offset = offset_from_partition;
+  return BUB_IO_RESULT_OK;
+}
+
+BubIOResult bub_disk_resolve_read(const BubBlockDev* dev,
+                                  const BubPartitionIndex* index,
+                                  const char* partition_name,
+                                  int64_t offset_from_partition,
+                                  size_t num_bytes,
+                                  uint64_t* out_disk_offset,
+                                  size_t* out_num_bytes) {
+  const BubPartitionIndexEntry* entry;
+  uint64_t partition_size;
+  uint64_t offset;
+  BubIOResult result;
+
+  result = resolve_range(dev, index, partition_name, offset_from_partition,
+                         &entry, &partition_size, &offset);
+  if (result != BUB_IO_RESULT_OK)
+    return result;
+
+  // Check if num_bytes goes beyond partition end. If so, don't read beyond
+  // this boundary -- do a partial I/O instead.
+  if (num_bytes > partition_size - offset)
+    num_bytes = partition_size - offset;
+
+  *out_disk_offset = entry->first_lba * dev->block_size + offset;
+  *out_num_bytes = num_bytes;
+  return BUB_IO_RESULT_OK;
+}
+
+BubIOResult bub_disk_read_from_partition(BubBlockDev* dev,
+                                         const BubPartitionIndex* index,
+                                         const char* partition_name,
+                                         void* buf,
+                                         int64_t offset_from_partition,
+                                         size_t num_bytes,
+                                         size_t* out_num_read) {
+  bub_assert(partition_name != NULL);
+  bub_assert(buf != NULL);
+  bub_assert(out_num_read != NULL);
+
+  uint64_t disk_offset;
+  BubIOResult result;
+
+  *out_num_read = 0;
+  result = bub_disk_resolve_read(dev, index, partition_name,
+                                 offset_from_partition, num_bytes,
+                                 &disk_offset, &num_bytes);
+  if (result != BUB_IO_RESULT_OK)
+    return result;
+
+  result = dev->read(dev, disk_offset, buf, num_bytes);
+  if (result != BUB_IO_RESULT_OK) {
+    bub_warning("Could not read from disk.\n");
+    return BUB_IO_RESULT_ERROR_IO;
+  }
+
+  *out_num_read = num_bytes;
+  return BUB_IO_RESULT_OK;
+}
+
+BubIOResult bub_disk_write_to_partition(BubBlockDev* dev,
+                                        const BubPartitionIndex* index,
+                                        const char* partition_name,
+                                        const void* buf,
+                                        int64_t offset_from_partition,
+                                        size_t num_bytes) {
+  bub_assert(partition_name != NULL);
+  bub_assert(buf != NULL);
+
+  const BubPartitionIndexEntry* entry;
+  uint64_t partition_size;
+  uint64_t offset;
+  BubIOResult result;
+
+  result = resolve_range(dev, index, partition_name, offset_from_partition,
+                         &entry, &partition_size, &offset);
+  if (result != BUB_IO_RESULT_OK)
+    return result;
+
+  // Check if num_bytes goes beyond partition end. If so, error out -- no
+  // partial I/O.
+  if (num_bytes > partition_size - offset) {
+    bub_warning("Cannot write beyond partition boundary.\n");
+    return BUB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
+  }
+
+  result = dev->write(dev, entry->first_lba * dev->block_size + offset, buf,
+                      num_bytes);
+  if (result != BUB_IO_RESULT_OK) {
+    bub_warning("Could not write to disk.\n");
+    return BUB_IO_RESULT_ERROR_IO;
+  }
+
+  return BUB_IO_RESULT_OK;
+}
+
+int bub_disk_get_unique_guid(const BubPartitionIndex* index,
+                             const char* partition_name,
+                             char* guid_buf,
+                             size_t guid_buf_size) {
+  bub_assert(partition_name != NULL);
+  bub_assert(guid_buf != NULL);
+
+  // Byte order of the GUID fields as stored on disk. The first three fields
+  // are little-endian, the rest is a plain byte sequence.
+  static const uint8_t guid_byte_order[16] = {3, 2, 1, 0, 5, 4, 7, 6,
+                                              8, 9, 10, 11, 12, 13, 14, 15};
+  static const char hex_digits[] = "0123456789abcdef";
+  const BubPartitionIndexEntry* entry;
+  size_t i;
+  size_t n = 0;
+
+  if (guid_buf_size < BUB_GUID_STRING_SIZE)
+    return 0;
+
+  if (!bub_partition_index_find(index, partition_name, &entry))
+    return 0;
+
+  for (i = 0; i < 16; ++i) {
+    uint8_t byte = entry->unique_GUID[guid_byte_order[i]];
+    if (i == 4 || i == 6 || i == 8 || i == 10)
+      guid_buf[n++] = '-';
+    guid_buf[n++] = hex_digits[byte >> 4];
+    guid_buf[n++] = hex_digits[byte & 0x0F];
+  }
+  guid_buf[n] = '\0';
+
+  return 1;
+}
+
+// UEFI device path node header: type, subtype and a little-endian length
+// that includes the header.
+#define DEVICE_PATH_NODE_HEADER_SIZE 4
+#define DEVICE_PATH_END_TYPE 0x7F
+#define DEVICE_PATH_END_ENTIRE_SUBTYPE 0xFF
+
+size_t bub_device_path_size(const void* path, size_t max_size) {
+  const uint8_t* node = (const uint8_t*)path;
+  size_t offset = 0;
+
+  while (max_size - offset >= DEVICE_PATH_NODE_HEADER_SIZE) {
+    size_t node_size = node[offset + 2] | (node[offset + 3] << 8);
+
+    if (node_size < DEVICE_PATH_NODE_HEADER_SIZE ||
+        node_size > max_size - offset)
+      return 0;
+    if (node[offset] == DEVICE_PATH_END_TYPE &&
+        node[offset + 1] == DEVICE_PATH_END_ENTIRE_SUBTYPE)
+      return offset + node_size;
+    offset += node_size;
+  }
+  return 0;
+}
+
+size_t bub_boot_disk_hint_pack(const uint8_t* disk_guid,
+                               const void* path,
+                               size_t path_size,
+                               void* buf,
+                               size_t buf_size) {
+  BubBootDiskHint hint;
+
+  if (path_size > BUB_BOOT_DISK_HINT_MAX_PATH_SIZE ||
+      bub_device_path_size(path, path_size) != path_size)
+    return 0;
+  if (buf_size < sizeof(BubBootDiskHint) + path_size)
+    return 0;
+
+  bub_memcpy(hint.magic, BUB_BOOT_DISK_HINT_MAGIC, sizeof(hint.magic));
+  hint.path_size = (uint32_t)path_size;
+  bub_memcpy(hint.disk_guid, disk_guid, sizeof(hint.disk_guid));
+  bub_memcpy(buf, &hint, sizeof(BubBootDiskHint));
+  bub_memcpy((uint8_t*)buf + sizeof(BubBootDiskHint), path, path_size);
+  return sizeof(BubBootDiskHint) + path_size;
+}
+
+int bub_boot_disk_hint_validate(const void* buf, size_t size) {
+  BubBootDiskHint hint;
+  const uint8_t* path = (const uint8_t*)buf + sizeof(BubBootDiskHint);
+
+  if (size < sizeof(BubBootDiskHint))
+    return 0;
+  bub_memcpy(&hint, buf, sizeof(BubBootDiskHint));
+  if (bub_memcmp(hint.magic, BUB_BOOT_DISK_HINT_MAGIC, sizeof(hint.magic)) !=
+      0)
+    return 0;
+  if (hint.path_size > BUB_BOOT_DISK_HINT_MAX_PATH_SIZE ||
+      hint.path_size != size - sizeof(BubBootDiskHint))
+    return 0;
+  return bub_device_path_size(path, hint.path_size) == hint.path_size;
+}
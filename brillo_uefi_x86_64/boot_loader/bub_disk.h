@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUB_DISK_H_
+#define BUB_DISK_H_
+
+#include "bub_ops.h"
+#include "bub_sysdeps.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// GPT related constants
+#define GPT_REVISION 0x00010000
+#define GPT_MAGIC "EFI PART"
+#define GPT_MIN_SIZE 92
+#define GPT_ENTRIES_LBA 2
+#define BUB_BLOCK_SIZE 512
+#define ENTRY_NAME_LEN 36
+// Most partitions the index holds. The GPT itself may declare more entries.
+#define MAX_GPT_ENTRIES 128
+// The partition entry array is read and checksummed in pieces of at most
+// this many bytes. Entries may not be larger.
+#define GPT_ENTRY_READ_SIZE (16 * 1024)
+
+// Number of hash buckets in the partition index. Must be a power of two and
+// larger than MAX_GPT_ENTRIES so that open addressing always terminates.
+#define PARTITION_INDEX_BUCKETS 256
+
+// Size of the buffer bub_disk_get_unique_guid() needs: 32 hex digits,
+// 4 hyphens and the terminating NUL-byte.
+#define BUB_GUID_STRING_SIZE 37
+
+// Boot disk hint constants, see BubBootDiskHint.
+#define BUB_BOOT_DISK_HINT_MAGIC "BUBD"
+#define BUB_BOOT_DISK_HINT_MAX_PATH_SIZE 512
+#define BUB_BOOT_DISK_HINT_MAX_SIZE \
+  (sizeof(BubBootDiskHint) + BUB_BOOT_DISK_HINT_MAX_PATH_SIZE)
+
+typedef struct {
+  uint8_t   signature[8];
+  uint32_t  revision;
+  uint32_t  header_size;
+  uint32_t  header_crc32;
+  uint32_t  reserved;
+  uint64_t  header_lba;
+  uint64_t  alternate_header_lba;
+  uint64_t  first_usable_lba;
+  uint64_t  last_usable_lba;
+  uint8_t   disk_guid[16];
+  uint64_t  entry_lba;
+  uint32_t  entry_count;
+  uint32_t  entry_size;
+  uint32_t  entry_crc32;
+  uint8_t   reserved2[420];
+} GPTHeader;
+
+typedef struct {
+  uint8_t   type_GUID[16];
+  uint8_t   unique_GUID[16];
+  uint64_t  first_lba;
+  uint64_t  last_lba;
+  uint64_t  flags;
+  uint16_t  name[ENTRY_NAME_LEN];
+} GPTEntry;
+
+/* Per-boot lookup record for a single GPT entry. |name| is the UCS-2 entry
+ * name, zero-padded past its terminator so that lookups can compare the whole
+ * array.
+ */
+typedef struct {
+  uint32_t  hash;
+  uint8_t   unique_GUID[16];
+  uint64_t  first_lba;
+  uint64_t  last_lba;
+  uint16_t  name[ENTRY_NAME_LEN];
+} BubPartitionIndexEntry;
+
+/* Name-hashed index of the GPT partition entries on a disk. Built once per
+ * boot so that partition I/O does not re-read the GPT on every call.
+ * |buckets| holds 1-based positions into |entries|, zero marks an empty
+ * bucket.
+ */
+typedef struct {
+  int       valid;
+  uint32_t  num_entries;
+  uint8_t   buckets[PARTITION_INDEX_BUCKETS];
+  BubPartitionIndexEntry entries[MAX_GPT_ENTRIES];
+} BubPartitionIndex;
+
+/* Boot disk found on a previous boot. Followed by |path_size| bytes of UEFI
+ * device path to the whole disk, including the end-of-path node. The UEFI
+ * loader keeps this in a non-volatile variable and trusts it only while the
+ * GPT on the disk still carries |disk_guid|.
+ */
+typedef struct {
+  uint8_t   magic[4];
+  uint32_t  path_size;
+  uint8_t   disk_guid[16];
+} BubBootDiskHint;
+
+struct BubBlockDev;
+typedef struct BubBlockDev BubBlockDev;
+
+/* Byte-addressed view of a whole disk. Implementations embed this struct as
+ * their first member, see EfiBlockDev for the UEFI one.
+ */
+struct BubBlockDev {
+  /* Reads |num_bytes| at byte |offset| from the start of the disk into |buf|.
+   *
+   * @return BUB_IO_RESULT_OK on success, BUB_IO_RESULT_ERROR_IO otherwise.
+   */
+  BubIOResult (*read)(BubBlockDev* dev, uint64_t offset, void* buf,
+                      size_t num_bytes);
+
+  /* Writes |num_bytes| from |buf| at byte |offset| from the start of the
+   * disk.
+   *
+   * @return BUB_IO_RESULT_OK on success, BUB_IO_RESULT_ERROR_IO otherwise.
+   */
+  BubIOResult (*write)(BubBlockDev* dev, uint64_t offset, const void* buf,
+                       size_t num_bytes);
+
+  // Logical block size of the disk in bytes.
+  uint32_t block_size;
+
+  // Number of blocks on the disk, or zero if unknown. Used to find the backup
+  // GPT when the primary GPT header is unusable.
+  uint64_t num_blocks;
+};
+
+/* Checks the signature, size, crc32 and revision of |gpth|.
+ *
+ * @return non-zero if |gpth| is a valid GPT header, zero otherwise.
+ */
+int bub_gpt_header_validate(const GPTHeader* gpth);
+
+/* Returns the size in bytes of the partition described by |entry| on a disk
+ * with |block_size| byte blocks.
+ */
+uint64_t bub_partition_size(const BubPartitionIndexEntry* entry,
+                            uint32_t block_size);
+
+/* Reads the primary GPT header of |dev| into |out_header|, or the backup
+ * header at the last block of the disk if the primary one is unreadable or
+ * invalid. The partition entries are not read.
+ *
+ * @return BUB_IO_RESULT_OK on success, BUB_IO_RESULT_ERROR_IO if neither
+ *         header is valid.
+ */
+BubIOResult bub_gpt_read_header(BubBlockDev* dev, GPTHeader* out_header);
+
+/* Reads the GPT of |dev| and builds |index| from it. Any previous content of
+ * |index| is discarded.
+ *
+ * The geometry comes from the GPT header: the entry array is read from
+ * entry_lba in units of dev->block_size, and exactly entry_count entries of
+ * entry_size bytes are read and checked against entry_crc32. If the primary
+ * header or its entries fail their checks, the backup GPT at
+ * alternate_header_lba (or the last block, if the primary header is unusable)
+ * is used instead. Entries past the first MAX_GPT_ENTRIES used ones are
+ * ignored.
+ *
+ * @return BUB_IO_RESULT_OK on success, BUB_IO_RESULT_ERROR_IO on read errors
+ *         or if neither GPT is valid.
+ */
+BubIOResult bub_partition_index_build_from_disk(BubPartitionIndex* index,
+                                                BubBlockDev* dev);
+
+/* Resolves |partition_name|, a NUL-terminated UTF-8 string, against |index|.
+ * On success |out_entry| points into |index| and must not be freed.
+ *
+ * @return non-zero if the partition was found, zero otherwise.
+ */
+int bub_partition_index_find(const BubPartitionIndex* index,
+                             const char* partition_name,
+                             const BubPartitionIndexEntry** out_entry);
+
+/* Maps a read of |num_bytes| at |offset_from_partition| of |partition_name|
+ * to |dev| the way bub_disk_read_from_partition() does, storing the byte
+ * offset on |dev| in |out_disk_offset| and the number of bytes within the
+ * partition in |out_num_bytes|.
+ */
+BubIOResult bub_disk_resolve_read(const BubBlockDev* dev,
+                                  const BubPartitionIndex* index,
+                                  const char* partition_name,
+                                  int64_t offset_from_partition,
+                                  size_t num_bytes,
+                                  uint64_t* out_disk_offset,
+                                  size_t* out_num_bytes);
+
+/* BubOps read_from_partition semantics on top of |dev| and |index|: negative
+ * offsets count from the partition end and reads are truncated at the
+ * partition end.
+ */
+BubIOResult bub_disk_read_from_partition(BubBlockDev* dev,
+                                         const BubPartitionIndex* index,
+                                         const char* partition_name,
+                                         void* buf,
+                                         int64_t offset_from_partition,
+                                         size_t num_bytes,
+                                         size_t* out_num_read);
+
+/* BubOps write_to_partition semantics on top of |dev| and |index|: negative
+ * offsets count from the partition end and writes beyond the partition end
+ * fail without partial I/O.
+ */
+BubIOResult bub_disk_write_to_partition(BubBlockDev* dev,
+                                        const BubPartitionIndex* index,
+                                        const char* partition_name,
+                                        const void* buf,
+                                        int64_t offset_from_partition,
+                                        size_t num_bytes);
+
+/* BubOps get_unique_guid_for_partition semantics on top of |index|.
+ * |guid_buf| must hold at least BUB_GUID_STRING_SIZE bytes.
+ *
+ * @return non-zero on success, zero otherwise.
+ */
+int bub_disk_get_unique_guid(const BubPartitionIndex* index,
+                             const char* partition_name,
+                             char* guid_buf,
+                             size_t guid_buf_size);
+
+/* Returns the size in bytes of the UEFI device path at |path|, including its
+ * end-of-path node, or zero if no well-formed path ends within the first
+ * |max_size| bytes.
+ */
+size_t bub_device_path_size(const void* path, size_t max_size);
+
+/* Writes a BubBootDiskHint for the disk with GPT |disk_guid| at the
+ * |path_size| byte device path |path| to |buf|.
+ *
+ * @return the number of bytes written, or zero if |path| is malformed or
+ *         does not fit in |buf_size| bytes.
+ */
+size_t bub_boot_disk_hint_pack(const uint8_t* disk_guid,
+                               const void* path,
+                               size_t path_size,
+                               void* buf,
+                               size_t buf_size);
+
+/* Checks the magic and sizes of the |size| byte hint at |buf| and that it
+ * holds exactly one well-formed device path.
+ *
+ * @return non-zero if |buf| is a valid hint, zero otherwise.
+ */
+int bub_boot_disk_hint_validate(const void* buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUB_DISK_H_ */
@@ -0,0 +1,548 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "bub_boot_image.h"
+#include "bub_disk.h"
+
+namespace {
+
+// Disk size used by the tests, in blocks.
+const uint64_t kDiskBlocks = 256;
+
+// BubBlockDev backed by a byte vector.
+struct MemBlockDev {
+  BubBlockDev parent;
+  std::vector<uint8_t>* data;
+  int num_reads;
+};
+
+BubIOResult mem_read(BubBlockDev* dev, uint64_t offset, void* buf,
+                     size_t num_bytes) {
+  MemBlockDev* mem = reinterpret_cast<MemBlockDev*>(dev);
+  if (offset + num_bytes > mem->data->size())
+    return BUB_IO_RESULT_ERROR_IO;
+  memcpy(buf, mem->data->data() + offset, num_bytes);
+  mem->num_reads++;
+  return BUB_IO_RESULT_OK;
+}
+
+BubIOResult mem_write(BubBlockDev* dev, uint64_t offset, const void* buf,
+                      size_t num_bytes) {
+  MemBlockDev* mem = reinterpret_cast<MemBlockDev*>(dev);
+  if (offset + num_bytes > mem->data->size())
+    return BUB_IO_RESULT_ERROR_IO;
+  memcpy(mem->data->data() + offset, buf, num_bytes);
+  return BUB_IO_RESULT_OK;
+}
+
+}  // namespace
+
+class DiskTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    memset(&dev_, 0, sizeof(dev_));
+    dev_.parent.read = mem_read;
+    dev_.parent.write = mem_write;
+    dev_.parent.num_blocks = kDiskBlocks;
+    dev_.data = &disk_;
+    set_block_size(BUB_BLOCK_SIZE);
+  }
+
+  // Resizes the disk to kDiskBlocks blocks of |block_size| bytes.
+  void set_block_size(uint32_t block_size) {
+    disk_.assign(kDiskBlocks * block_size, 0);
+    dev_.parent.block_size = block_size;
+  }
+
+  // Adds a partition named |name| spanning LBAs [first_lba, last_lba] with
+  // unique GUID bytes 0..15 offset by |guid_seed|.
+  void add_partition(const char* name, uint64_t first_lba, uint64_t last_lba,
+                     uint8_t guid_seed) {
+    GPTEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.type_GUID[0] = 1;
+    for (int n = 0; n < 16; ++n)
+      entry.unique_GUID[n] = (uint8_t)(guid_seed + n);
+    entry.first_lba = first_lba;
+    entry.last_lba = last_lba;
+    for (int n = 0; name[n] != '\0'; ++n)
+      entry.name[n] = (uint16_t)name[n];
+    entries_.push_back(entry);
+  }
+
+  // Writes the primary and backup GPT for the partitions added so far, with
+  // a table of |entry_count| entries.
+  void write_gpt(uint32_t entry_count = MAX_GPT_ENTRIES) {
+    uint32_t block_size = dev_.parent.block_size;
+    std::vector<GPTEntry> table(std::max<size_t>(entry_count,
+                                                 entries_.size()));
+    memset(table.data(), 0, table.size() * sizeof(GPTEntry));
+    std::copy(entries_.begin(), entries_.end(), table.begin());
+    uint64_t table_blocks =
+      (table.size() * sizeof(GPTEntry) + block_size - 1) / block_size;
+
+    write_gpt_copy(table, 1, GPT_ENTRIES_LBA, kDiskBlocks - 1);
+    write_gpt_copy(table, kDiskBlocks - 1, kDiskBlocks - 1 - table_blocks, 1);
+  }
+
+  void write_gpt_copy(const std::vector<GPTEntry>& table, uint64_t header_lba,
+                      uint64_t entry_lba, uint64_t alternate_lba) {
+    uint32_t block_size = dev_.parent.block_size;
+    memcpy(disk_.data() + entry_lba * block_size, table.data(),
+           table.size() * sizeof(GPTEntry));
+
+    GPTHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.signature, GPT_MAGIC, sizeof(header.signature));
+    header.revision = GPT_REVISION;
+    header.header_size = GPT_MIN_SIZE;
+    header.header_lba = header_lba;
+    header.alternate_header_lba = alternate_lba;
+    header.first_usable_lba = 34;
+    header.last_usable_lba = kDiskBlocks - 34;
+    header.entry_lba = entry_lba;
+    header.entry_count = table.size();
+    header.entry_size = sizeof(GPTEntry);
+    header.entry_crc32 =
+      bub_crc32(0, table.data(), table.size() * sizeof(GPTEntry));
+    header.header_crc32 = bub_crc32(0, &header, header.header_size);
+    memcpy(disk_.data() + header_lba * block_size, &header, sizeof(header));
+  }
+
+  std::vector<uint8_t> disk_;
+  MemBlockDev dev_;
+  std::vector<GPTEntry> entries_;
+  BubPartitionIndex index_;
+};
+
+TEST_F(DiskTest, BuildAndFind) {
+  add_partition("boot_a", 40, 60, 0x10);
+  add_partition("boot_b", 60, 80, 0x20);
+  add_partition("misc", 80, 90, 0x30);
+  write_gpt();
+
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+  EXPECT_EQ(3U, index_.num_entries);
+  // Header and entry table.
+  EXPECT_EQ(2, dev_.num_reads);
+
+  const BubPartitionIndexEntry* entry;
+  ASSERT_TRUE(bub_partition_index_find(&index_, "boot_b", &entry));
+  EXPECT_EQ(60U, entry->first_lba);
+  EXPECT_EQ(20U * BUB_BLOCK_SIZE, bub_partition_size(entry, BUB_BLOCK_SIZE));
+  EXPECT_FALSE(bub_partition_index_find(&index_, "boot_c", &entry));
+  EXPECT_EQ(NULL, entry);
+  EXPECT_FALSE(bub_partition_index_find(
+      &index_, "a_partition_name_longer_than_36_chars", &entry));
+}
+
+TEST_F(DiskTest, DuplicateNameFirstWins) {
+  add_partition("misc", 40, 50, 0x10);
+  add_partition("misc", 50, 60, 0x20);
+  write_gpt();
+
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+  const BubPartitionIndexEntry* entry;
+  ASSERT_TRUE(bub_partition_index_find(&index_, "misc", &entry));
+  EXPECT_EQ(40U, entry->first_lba);
+}
+
+TEST_F(DiskTest, CorruptHeader) {
+  add_partition("misc", 40, 50, 0x10);
+  write_gpt();
+  disk_[BUB_BLOCK_SIZE + 40] ^= 0xff;
+
+  // The backup header at the last block takes over.
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+  const BubPartitionIndexEntry* entry;
+  EXPECT_TRUE(bub_partition_index_find(&index_, "misc", &entry));
+
+  GPTHeader header;
+  ASSERT_EQ(BUB_IO_RESULT_OK, bub_gpt_read_header(&dev_.parent, &header));
+  EXPECT_EQ(kDiskBlocks - 1, header.header_lba);
+
+  // Without the disk size the backup cannot be found.
+  dev_.parent.num_blocks = 0;
+  EXPECT_EQ(BUB_IO_RESULT_ERROR_IO,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+  EXPECT_FALSE(index_.valid);
+  EXPECT_EQ(BUB_IO_RESULT_ERROR_IO,
+            bub_gpt_read_header(&dev_.parent, &header));
+
+  dev_.parent.num_blocks = kDiskBlocks;
+  disk_[(kDiskBlocks - 1) * BUB_BLOCK_SIZE + 40] ^= 0xff;
+  EXPECT_EQ(BUB_IO_RESULT_ERROR_IO,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+  EXPECT_FALSE(index_.valid);
+}
+
+TEST_F(DiskTest, CorruptEntriesUseBackup) {
+  add_partition("boot_a", 40, 60, 0x10);
+  write_gpt();
+  // Rename the primary entry; only entry_crc32 catches this.
+  disk_[GPT_ENTRIES_LBA * BUB_BLOCK_SIZE + 56] = 'x';
+
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+  const BubPartitionIndexEntry* entry;
+  EXPECT_TRUE(bub_partition_index_find(&index_, "boot_a", &entry));
+  EXPECT_FALSE(bub_partition_index_find(&index_, "xoot_a", &entry));
+  // Primary header and entries, then backup header and entries.
+  EXPECT_EQ(4, dev_.num_reads);
+}
+
+TEST_F(DiskTest, NativeFourKBlocks) {
+  set_block_size(4096);
+  add_partition("misc", 40, 42, 0x10);
+  write_gpt();
+
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+  const BubPartitionIndexEntry* entry;
+  ASSERT_TRUE(bub_partition_index_find(&index_, "misc", &entry));
+  EXPECT_EQ(2U * 4096, bub_partition_size(entry, 4096));
+  EXPECT_EQ(2, dev_.num_reads);
+
+  disk_[4096 + 40] ^= 0xff;
+  EXPECT_EQ(BUB_IO_RESULT_OK,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+}
+
+TEST_F(DiskTest, TableGeometryFromHeader) {
+  add_partition("misc", 40, 50, 0x10);
+  write_gpt(4);
+
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+  EXPECT_EQ(1U, index_.num_entries);
+  EXPECT_EQ(2, dev_.num_reads);
+}
+
+TEST_F(DiskTest, LargeTable) {
+  // More entries than one read covers and than the index holds.
+  for (int n = 0; n < MAX_GPT_ENTRIES + 2; ++n) {
+    char name[8];
+    snprintf(name, sizeof(name), "p%d", n);
+    add_partition(name, 40 + n, 41 + n, (uint8_t)n);
+  }
+  write_gpt(256);
+
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+  EXPECT_EQ((uint32_t)MAX_GPT_ENTRIES, index_.num_entries);
+  // Header and two reads of 128 entries.
+  EXPECT_EQ(3, dev_.num_reads);
+  const BubPartitionIndexEntry* entry;
+  EXPECT_TRUE(bub_partition_index_find(&index_, "p127", &entry));
+  EXPECT_FALSE(bub_partition_index_find(&index_, "p128", &entry));
+}
+
+TEST_F(DiskTest, UniqueGuid) {
+  add_partition("system_a", 40, 50, 0x00);
+  write_gpt();
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+
+  char guid[BUB_GUID_STRING_SIZE];
+  ASSERT_TRUE(bub_disk_get_unique_guid(&index_, "system_a", guid,
+                                       sizeof(guid)));
+  EXPECT_STREQ("03020100-0504-0706-0809-0a0b0c0d0e0f", guid);
+  EXPECT_FALSE(bub_disk_get_unique_guid(&index_, "system_a", guid,
+                                        sizeof(guid) - 1));
+  EXPECT_FALSE(bub_disk_get_unique_guid(&index_, "system_b", guid,
+                                        sizeof(guid)));
+}
+
+TEST_F(DiskTest, PartitionIo) {
+  add_partition("misc", 40, 42, 0x10);
+  write_gpt();
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            bub_partition_index_build_from_disk(&index_, &dev_.parent));
+
+  const uint64_t size = 2 * BUB_BLOCK_SIZE;
+  std::vector<uint8_t> buf(size + 16, 0x5a);
+  size_t num_read;
+
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            bub_disk_write_to_partition(&dev_.parent, &index_, "misc",
+                                        buf.data(), -16, 16));
+  EXPECT_EQ(0x5a, disk_[40 * BUB_BLOCK_SIZE + size - 1]);
+  EXPECT_EQ(0, disk_[40 * BUB_BLOCK_SIZE + size - 17]);
+
+  // Writes never do partial I/O.
+  EXPECT_EQ(BUB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION,
+            bub_disk_write_to_partition(&dev_.parent, &index_, "misc",
+                                        buf.data(), size - 8, 16));
+  EXPECT_EQ(BUB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION,
+            bub_disk_write_to_partition(&dev_.parent, &index_, "misc",
+                                        buf.data(), -(int64_t)size - 1, 1));
+  EXPECT_EQ(BUB_IO_RESULT_ERROR_NO_SUCH_PARTITION,
+            bub_disk_write_to_partition(&dev_.parent, &index_, "boot",
+                                        buf.data(), 0, 1));
+
+  // Reads are truncated at the partition end.
+  ASSERT_EQ(BUB_IO_RESULT_OK,
+            bub_disk_read_from_partition(&dev_.parent, &index_, "misc",
+                                         buf.data(), size - 32, 64,
+                                         &num_read));
+  EXPECT_EQ(32U, num_read);
+  EXPECT_EQ(0, buf[15]);
+  EXPECT_EQ(0x5a, buf[16]);
+  EXPECT_EQ(BUB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION,
+            bub_disk_read_from_partition(&dev_.parent, &index_, "misc",
+                                         buf.data(), size + 1, 1,
+                                         &num_read));
+}
+
+// PciRoot(0)/Pci(1,0): an ACPI node, a PCI node and the end node.
+const uint8_t kDiskPath[] = {0x02, 0x01, 0x0c, 0x00, 0xd0, 0x41, 0x03, 0x0a,
+                             0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x06, 0x00,
+                             0x00, 0x01, 0x7f, 0xff, 0x04, 0x00};
+
+TEST(BootDiskHintTest, DevicePathSize) {
+  EXPECT_EQ(sizeof(kDiskPath),
+            bub_device_path_size(kDiskPath, sizeof(kDiskPath)));
+  // Trailing bytes after the end node are not part of the path.
+  std::vector<uint8_t> padded(kDiskPath, kDiskPath + sizeof(kDiskPath));
+  padded.resize(64, 0xee);
+  EXPECT_EQ(sizeof(kDiskPath),
+            bub_device_path_size(padded.data(), padded.size()));
+  // Missing end node.
+  EXPECT_EQ(0U, bub_device_path_size(kDiskPath, sizeof(kDiskPath) - 4));
+  // Node shorter than its header.
+  std::vector<uint8_t> broken(kDiskPath, kDiskPath + sizeof(kDiskPath));
+  broken[14] = 2;
+  EXPECT_EQ(0U, bub_device_path_size(broken.data(), broken.size()));
+}
+
+TEST(BootDiskHintTest, PackAndValidate) {
+  uint8_t guid[16];
+  for (int n = 0; n < 16; ++n)
+    guid[n] = (uint8_t)(0xa0 + n);
+  std::vector<uint8_t> buf(BUB_BOOT_DISK_HINT_MAX_SIZE);
+
+  size_t size = bub_boot_disk_hint_pack(guid, kDiskPath, sizeof(kDiskPath),
+                                        buf.data(), buf.size());
+  ASSERT_EQ(sizeof(BubBootDiskHint) + sizeof(kDiskPath), size);
+  EXPECT_NE(0, bub_boot_disk_hint_validate(buf.data(), size));
+
+  BubBootDiskHint hint;
+  memcpy(&hint, buf.data(), sizeof(hint));
+  EXPECT_EQ(sizeof(kDiskPath), hint.path_size);
+  EXPECT_EQ(0, memcmp(guid, hint.disk_guid, sizeof(guid)));
+  EXPECT_EQ(0, memcmp(kDiskPath, buf.data() + sizeof(hint),
+                      sizeof(kDiskPath)));
+
+  // Truncated or extended records are rejected.
+  EXPECT_EQ(0, bub_boot_disk_hint_validate(buf.data(), size - 1));
+  EXPECT_EQ(0, bub_boot_disk_hint_validate(buf.data(), size + 1));
+  EXPECT_EQ(0, bub_boot_disk_hint_validate(buf.data(), 8));
+  buf[0] = 'X';
+  EXPECT_EQ(0, bub_boot_disk_hint_validate(buf.data(), size));
+
+  // Paths that do not fit or are malformed are not packed.
+  EXPECT_EQ(0U, bub_boot_disk_hint_pack(guid, kDiskPath, sizeof(kDiskPath),
+                                        buf.data(), size - 1));
+  EXPECT_EQ(0U, bub_boot_disk_hint_pack(guid, kDiskPath,
+                                        sizeof(kDiskPath) - 4, buf.data(),
+                                        buf.size()));
+}
+
+class BootImageTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    const uint8_t magic[BOOT_MAGIC_SIZE] = BOOT_MAGIC;
+    memset(&hdr_, 0, sizeof(hdr_));
+    memcpy(hdr_.magic, magic, sizeof(magic));
+    hdr_.page_size = 2048;
+    hdr_.kernel_size = 5000;
+    hdr_.ramdisk_size = 3000;
+  }
+
+  boot_img_hdr hdr_;
+  BubBootImageLayout layout_;
+};
+
+namespace {
+
+// Returns the digest of |image|, a header page of |page_size| bytes followed
+// by the page-padded kernel and ramdisk.
+std::vector<uint8_t> image_digest(const std::vector<uint8_t>& image,
+                                  size_t page_size) {
+  BubSha256Ctx ctx;
+  std::vector<uint8_t> digest(BUB_SHA256_DIGEST_SIZE);
+  bub_sha256_init(&ctx);
+  EXPECT_EQ(1, bub_boot_image_hash_header(&ctx, image.data(), page_size));
+  bub_sha256_update(&ctx, image.data() + page_size, image.size() - page_size);
+  bub_sha256_final(&ctx, digest.data());
+  return digest;
+}
+
+}  // namespace
+
+TEST_F(BootImageTest, Layout) {
+  ASSERT_EQ(BUB_BOOT_IMAGE_RESULT_OK,
+            bub_boot_image_get_layout(&hdr_, 1024 * 1024, &layout_));
+  EXPECT_EQ(2048U, layout_.kernel_offset);
+  EXPECT_EQ(5000U, layout_.kernel_size);
+  EXPECT_EQ(3 * 2048U, layout_.ramdisk_offset);
+  EXPECT_EQ(3000U, layout_.ramdisk_size);
+  EXPECT_EQ(5 * 2048U, layout_.load_size);
+}
+
+TEST_F(BootImageTest, ExactFit) {
+  EXPECT_EQ(BUB_BOOT_IMAGE_RESULT_OK,
+            bub_boot_image_get_layout(&hdr_, 6 * 2048, &layout_));
+  EXPECT_EQ(BUB_BOOT_IMAGE_ERROR_SIZE,
+            bub_boot_image_get_layout(&hdr_, 6 * 2048 - 1, &layout_));
+}
+
+TEST_F(BootImageTest, BadMagic) {
+  hdr_.magic[7] = '?';
+  EXPECT_EQ(BUB_BOOT_IMAGE_ERROR_MAGIC,
+            bub_boot_image_get_layout(&hdr_, 1024 * 1024, &layout_));
+}
+
+TEST_F(BootImageTest, BadPageSize) {
+  hdr_.page_size = 0;
+  EXPECT_EQ(BUB_BOOT_IMAGE_ERROR_PAGE_SIZE,
+            bub_boot_image_get_layout(&hdr_, 1024 * 1024, &layout_));
+  hdr_.page_size = 1024 * 1024;
+  EXPECT_EQ(BUB_BOOT_IMAGE_ERROR_PAGE_SIZE,
+            bub_boot_image_get_layout(&hdr_, 1024 * 1024, &layout_));
+}
+
+TEST_F(BootImageTest, OversizedKernel) {
+  hdr_.kernel_size = 0xffffffff;
+  EXPECT_EQ(BUB_BOOT_IMAGE_ERROR_SIZE,
+            bub_boot_image_get_layout(&hdr_, 1024 * 1024, &layout_));
+}
+
+TEST_F(BootImageTest, NotCompressed) {
+  ASSERT_EQ(BUB_BOOT_IMAGE_RESULT_OK,
+            bub_boot_image_get_layout(&hdr_, 1024 * 1024, &layout_));
+  EXPECT_EQ(BUB_COMPRESSION_NONE, layout_.kernel_compression);
+  EXPECT_EQ(BUB_COMPRESSION_NONE, layout_.ramdisk_compression);
+  EXPECT_EQ(5000U, layout_.kernel_decompressed_size);
+  EXPECT_EQ(3000U, layout_.ramdisk_decompressed_size);
+}
+
+TEST_F(BootImageTest, Compressed) {
+  const uint8_t ext_magic[] = BUB_BOOT_IMAGE_EXT_MAGIC;
+  std::vector<uint8_t> header(BUB_BOOT_IMAGE_HEADER_SIZE);
+  BubBootImageExt ext;
+  memset(&ext, 0, sizeof(ext));
+  memcpy(ext.magic, ext_magic, sizeof(ext.magic));
+  ext.kernel_compression = BUB_COMPRESSION_LZ4;
+  ext.ramdisk_compression = BUB_COMPRESSION_GZIP;
+  ext.kernel_decompressed_size = 20000;
+  ext.ramdisk_decompressed_size = 30000;
+  hdr_.unused = BUB_BOOT_IMAGE_FLAG_COMPRESSED;
+  memcpy(header.data(), &hdr_, sizeof(hdr_));
+  memcpy(header.data() + sizeof(hdr_), &ext, sizeof(ext));
+  const boot_img_hdr* hdr =
+      reinterpret_cast<const boot_img_hdr*>(header.data());
+
+  ASSERT_EQ(BUB_BOOT_IMAGE_RESULT_OK,
+            bub_boot_image_get_layout(hdr, 1024 * 1024, &layout_));
+  // The stored sizes still define where things are on disk.
+  EXPECT_EQ(5 * 2048U, layout_.load_size);
+  EXPECT_EQ(BUB_COMPRESSION_LZ4, layout_.kernel_compression);
+  EXPECT_EQ(BUB_COMPRESSION_GZIP, layout_.ramdisk_compression);
+  EXPECT_EQ(20000U, layout_.kernel_decompressed_size);
+  EXPECT_EQ(30000U, layout_.ramdisk_decompressed_size);
+
+  // Uncompressed payloads must keep their size.
+  ext.ramdisk_compression = BUB_COMPRESSION_NONE;
+  memcpy(header.data() + sizeof(hdr_), &ext, sizeof(ext));
+  EXPECT_EQ(BUB_BOOT_IMAGE_ERROR_COMPRESSION,
+            bub_boot_image_get_layout(hdr, 1024 * 1024, &layout_));
+  ext.ramdisk_decompressed_size = 3000;
+  memcpy(header.data() + sizeof(hdr_), &ext, sizeof(ext));
+  EXPECT_EQ(BUB_BOOT_IMAGE_RESULT_OK,
+            bub_boot_image_get_layout(hdr, 1024 * 1024, &layout_));
+
+  ext.kernel_compression = 3;
+  memcpy(header.data() + sizeof(hdr_), &ext, sizeof(ext));
+  EXPECT_EQ(BUB_BOOT_IMAGE_ERROR_COMPRESSION,
+            bub_boot_image_get_layout(hdr, 1024 * 1024, &layout_));
+}
+
+TEST_F(BootImageTest, CompressedWithoutExtension) {
+  std::vector<uint8_t> header(BUB_BOOT_IMAGE_HEADER_SIZE);
+  hdr_.unused = BUB_BOOT_IMAGE_FLAG_COMPRESSED;
+  memcpy(header.data(), &hdr_, sizeof(hdr_));
+  EXPECT_EQ(BUB_BOOT_IMAGE_ERROR_COMPRESSION,
+            bub_boot_image_get_layout(
+                reinterpret_cast<const boot_img_hdr*>(header.data()),
+                1024 * 1024, &layout_));
+}
+
+TEST_F(BootImageTest, VerifyDigest) {
+  uint8_t digest[BUB_SHA256_DIGEST_SIZE];
+  for (size_t n = 0; n < sizeof(digest); ++n)
+    digest[n] = (uint8_t)(n * 7);
+  memcpy(hdr_.id, digest, sizeof(digest));
+
+  EXPECT_TRUE(bub_boot_image_verify_digest(&hdr_, digest));
+  digest[BUB_SHA256_DIGEST_SIZE - 1] ^= 1;
+  EXPECT_FALSE(bub_boot_image_verify_digest(&hdr_, digest));
+}
+
+TEST_F(BootImageTest, DigestCoversHeaderPage) {
+  const size_t kPageSize = 2048;
+  std::vector<uint8_t> image(6 * kPageSize, 0);
+  boot_img_hdr* hdr = reinterpret_cast<boot_img_hdr*>(image.data());
+  strcpy(reinterpret_cast<char*>(hdr_.cmdline), "console=ttyS0");
+  memcpy(hdr, &hdr_, sizeof(hdr_));
+  memset(image.data() + kPageSize, 'k', hdr_.kernel_size);
+  memset(image.data() + 4 * kPageSize, 'r', hdr_.ramdisk_size);
+
+  std::vector<uint8_t> digest = image_digest(image, kPageSize);
+  memcpy(hdr->id, digest.data(), digest.size());
+  EXPECT_TRUE(bub_boot_image_verify_digest(hdr, digest.data()));
+  // The recorded digest itself is not hashed.
+  EXPECT_EQ(digest, image_digest(image, kPageSize));
+
+  // Changing one byte of the command line fails verification.
+  hdr->cmdline[0] = 'C';
+  EXPECT_FALSE(bub_boot_image_verify_digest(
+      hdr, image_digest(image, kPageSize).data()));
+  hdr->cmdline[0] = 'c';
+  // So does changing a byte past the header in the header page.
+  image[kPageSize - 1] = 1;
+  EXPECT_FALSE(bub_boot_image_verify_digest(
+      hdr, image_digest(image, kPageSize).data()));
+}
+
+TEST_F(BootImageTest, DigestPageTooSmall) {
+  std::vector<uint8_t> page(sizeof(boot_img_hdr) - 1, 0);
+  BubSha256Ctx ctx;
+  bub_sha256_init(&ctx);
+  EXPECT_EQ(0, bub_boot_image_hash_header(&ctx, page.data(), page.size()));
+  EXPECT_EQ(0U, ctx.num_bytes);
+}
@@ -0,0 +1,144 @@
+#!/usr/bin/python
+
+# Copyright 2016, The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+"""Records the SHA-256 of a boot image's header, kernel and ramdisk in it.
+
+A boot loader built with BUB_VERIFY=1 hashes the header page, with the id
+field zeroed, and the page-padded kernel and ramdisk while it reads them. It
+refuses to boot a slot whose digest does not match the first 32 bytes of the
+header's id field, see bub_boot_image_verify_digest().
+"""
+
+from __future__ import print_function
+
+import argparse
+import hashlib
+import struct
+import sys
+
+BOOT_MAGIC = b'ANDROID!'
+# magic, then kernel_size, kernel_addr, ramdisk_size, ramdisk_addr,
+# second_size, second_addr, tags_addr, page_size, unused, os_version.
+HEADER_FORMAT = '<8s10I'
+# Offset of id[] in boot_img_hdr: the fields above, name[16], cmdline[512].
+ID_OFFSET = struct.calcsize(HEADER_FORMAT) + 16 + 512
+DIGEST_SIZE = 32
+# Size of boot_img_hdr: id[8] follows cmdline, then extra_cmdline[1024].
+HEADER_SIZE = ID_OFFSET + DIGEST_SIZE + 1024
+READ_SIZE = 1024 * 1024
+
+
+class BootImageError(Exception):
+  """Raised for malformed boot images."""
+
+
+def page_align(size, page_size):
+  return (size + page_size - 1) // page_size * page_size
+
+
+def load_region(header):
+  """Returns (offset, size) of the kernel and ramdisk pages.
+
+  Arguments:
+    header: The first ID_OFFSET bytes of a boot image.
+
+  Raises:
+    BootImageError: If the header is not a valid boot image header.
+  """
+  fields = struct.unpack_from(HEADER_FORMAT, header)
+  magic, kernel_size, ramdisk_size, page_size = (
+      fields[0], fields[1], fields[3], fields[8])
+  if magic != BOOT_MAGIC:
+    raise BootImageError('bad boot image magic')
+  if page_size < HEADER_SIZE:
+    raise BootImageError('bad page size')
+  return (page_size,
+          page_align(kernel_size, page_size) +
+          page_align(ramdisk_size, page_size))
+
+
+def compute_digest(image):
+  """Returns the digest bub_boot_image_verify_digest() expects for |image|.
+
+  The header page is hashed with the id field, where the digest is stored,
+  taken as zeros, see bub_boot_image_hash_header().
+
+  Arguments:
+    image: A boot image file object opened for binary reading.
+
+  Raises:
+    BootImageError: If the image is malformed or truncated.
+  """
+  image.seek(0)
+  header = image.read(ID_OFFSET)
+  if len(header) != ID_OFFSET:
+    raise BootImageError('truncated boot image header')
+  offset, size = load_region(header)
+
+  image.seek(0)
+  page = image.read(offset)
+  if len(page) != offset:
+    raise BootImageError('truncated boot image header')
+  sha = hashlib.sha256()
+  sha.update(page[:ID_OFFSET])
+  sha.update(b'\0' * DIGEST_SIZE)
+  sha.update(page[ID_OFFSET + DIGEST_SIZE:])
+  while size > 0:
+    data = image.read(min(size, READ_SIZE))
+    if not data:
+      raise BootImageError('boot image truncated before end of ramdisk')
+    sha.update(data)
+    size -= len(data)
+  return sha.digest()
+
+
+def read_digest(image):
+  """Returns the digest currently recorded in the header of |image|."""
+  image.seek(ID_OFFSET)
+  return image.read(DIGEST_SIZE)
+
+
+def write_digest(image, digest):
+  """Records |digest| in the header of |image|."""
+  image.seek(ID_OFFSET)
+  image.write(digest)
+
+
+def main(argv):
+  parser = argparse.ArgumentParser(description=__doc__)
+  parser.add_argument('--check', action='store_true',
+                      help='only check the recorded digest')
+  parser.add_argument('image', help='boot image to update or check')
+  args = parser.parse_args(argv[1:])
+
+  try:
+    with open(args.image, 'rb' if args.check else 'r+b') as image:
+      digest = compute_digest(image)
+      if args.check:
+        if read_digest(image) != digest:
+          print('%s: digest mismatch' % args.image, file=sys.stderr)
+          return 1
+      else:
+        write_digest(image, digest)
+  except (IOError, BootImageError) as e:
+    print('%s: %s' % (args.image, e), file=sys.stderr)
+    return 1
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv))
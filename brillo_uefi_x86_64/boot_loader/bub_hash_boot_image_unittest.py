@@ -0,0 +1,97 @@
+#!/usr/bin/python
+
+# Copyright 2016, The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+"""Unit-test for bub_hash_boot_image."""
+
+import hashlib
+import io
+import os
+import struct
+import tempfile
+import unittest
+
+import bub_hash_boot_image
+
+PAGE_SIZE = 2048
+CMDLINE_OFFSET = 64
+
+
+def make_image(kernel, ramdisk, magic=b'ANDROID!', trailer=b'second',
+               cmdline=b'console=ttyS0'):
+  """Returns a boot image with |kernel| and |ramdisk| as a BytesIO."""
+  header = struct.pack('<8s10I', magic, len(kernel), 0, len(ramdisk), 0,
+                       len(trailer), 0, 0, PAGE_SIZE, 0, 0)
+  header += b'\0' * (CMDLINE_OFFSET - len(header)) + cmdline
+  header += b'\0' * (PAGE_SIZE - len(header))
+  pad = lambda data: data + b'\0' * (-len(data) % PAGE_SIZE)
+  return io.BytesIO(header + pad(kernel) + pad(ramdisk) + trailer)
+
+
+class HashBootImageTest(unittest.TestCase):
+
+  def test_digest_covers_header_and_padded_kernel_and_ramdisk(self):
+    image = make_image(b'k' * 3000, b'r' * 10)
+    header = image.getvalue()[:PAGE_SIZE]
+    expected = hashlib.sha256(header + b'k' * 3000 + b'\0' * 1096 +
+                              b'r' * 10 + b'\0' * 2038).digest()
+    self.assertEqual(expected, bub_hash_boot_image.compute_digest(image))
+
+  def test_cmdline_change_fails_check(self):
+    handle, path = tempfile.mkstemp()
+    try:
+      with os.fdopen(handle, 'wb') as f:
+        f.write(make_image(b'kernel', b'ramdisk').getvalue())
+      self.assertEqual(0, bub_hash_boot_image.main(['hash', path]))
+      self.assertEqual(0, bub_hash_boot_image.main(['hash', '--check', path]))
+
+      with open(path, 'r+b') as f:
+        f.seek(CMDLINE_OFFSET)
+        f.write(b'C')
+      self.assertEqual(1, bub_hash_boot_image.main(['hash', '--check', path]))
+    finally:
+      os.unlink(path)
+
+  def test_small_page_size(self):
+    header = struct.pack('<8s10I', b'ANDROID!', 6, 0, 7, 0, 0, 0, 0, 1024, 0,
+                         0)
+    image = io.BytesIO(header + b'\0' * 4096)
+    self.assertRaises(bub_hash_boot_image.BootImageError,
+                      bub_hash_boot_image.compute_digest, image)
+
+  def test_write_then_read(self):
+    image = make_image(b'kernel', b'ramdisk')
+    digest = bub_hash_boot_image.compute_digest(image)
+    bub_hash_boot_image.write_digest(image, digest)
+    self.assertEqual(digest, bub_hash_boot_image.read_digest(image))
+    # The id field is not part of the hashed region.
+    self.assertEqual(digest, bub_hash_boot_image.compute_digest(image))
+    self.assertEqual(576, bub_hash_boot_image.ID_OFFSET)
+
+  def test_bad_magic(self):
+    image = make_image(b'kernel', b'ramdisk', magic=b'BROKEN!!')
+    self.assertRaises(bub_hash_boot_image.BootImageError,
+                      bub_hash_boot_image.compute_digest, image)
+
+  def test_truncated(self):
+    data = make_image(b'k' * 5000, b'r' * 5000).getvalue()
+    image = io.BytesIO(data[:3 * PAGE_SIZE])
+    self.assertRaises(bub_hash_boot_image.BootImageError,
+                      bub_hash_boot_image.compute_digest, image)
+
+
+if __name__ == '__main__':
+  unittest.main()
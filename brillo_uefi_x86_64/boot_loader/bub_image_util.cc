@@ -19,6 +19,14 @@
 
 #include "bub_image_util.h"
 
+#include <ftw.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
 static BubIOResult my_ops_read_from_partition(BubOps* ops,
                                               const char* partition, void* buf,
                                               int64_t offset, size_t num_bytes,
@@ -28,6 +36,21 @@ static BubIOResult my_ops_read_from_partition(BubOps* ops,
                                     out_num_read);
 }
 
+static BubIOResult my_ops_read_from_partition_async(BubOps* ops,
+                                                    const char* partition,
+                                                    void* buf, int64_t offset,
+                                                    size_t num_bytes,
+                                                    BubIORequest* request) {
+  return ((MyBubOps*)ops)
+      ->my_ops->read_from_partition_async(partition, buf, offset, num_bytes,
+                                          request);
+}
+
+static int my_ops_poll_completion(BubOps* ops, BubIORequest* request,
+                                  int wait) {
+  return ((MyBubOps*)ops)->my_ops->poll_completion(request, wait);
+}
+
 static BubIOResult my_ops_write_to_partition(BubOps* ops, const char* partition,
                                              const void* buf, int64_t offset,
                                              size_t num_bytes) {
@@ -37,46 +60,124 @@ static BubIOResult my_ops_write_to_partition(BubOps* ops, const char* partition,
 
 
 void MyOps::set_partition_dir(const base::FilePath& partition_dir) {
+  close_partitions();
   partition_dir_ = partition_dir;
 }
 
-BubIOResult MyOps::read_from_partition(const char* partition, void* buf,
-                                int64_t offset, size_t num_bytes,
-                                size_t* out_num_read) {
+MyOps::Partition* MyOps::open_partition(const char* partition) {
+  std::map<std::string, Partition>::iterator it = partitions_.find(partition);
+  if (it != partitions_.end())
+    return &it->second;
+
   base::FilePath path =
       partition_dir_.Append(std::string(partition)).AddExtension("img");
+  Partition p = {-1, NULL, 0};
+  p.fd = open(path.value().c_str(), O_RDWR);
+  if (p.fd < 0) {
+    fprintf(stderr, "Error opening file '%s': %s\n", path.value().c_str(),
+                strerror(errno));
+    return NULL;
+  }
 
-  if (offset < 0) {
-    int64_t file_size;
-    if (!base::GetFileSize(path, &file_size)) {
-      fprintf(stderr, "Error getting size of file '%s'\n",
-              path.value().c_str());
-      return BUB_IO_RESULT_ERROR_IO;
+  if (options_.backend == BACKEND_MMAP) {
+    struct stat st;
+    if (fstat(p.fd, &st) != 0 || !map_partition(&p, st.st_size)) {
+      fprintf(stderr, "Error mapping file '%s': %s\n", path.value().c_str(),
+              strerror(errno));
+      close(p.fd);
+      return NULL;
     }
-    offset = file_size - (-offset);
   }
 
-  int fd = open(path.value().c_str(), O_RDONLY);
-  if (fd < 0) {
-    fprintf(stderr, "Error opening file '%s': %s\n", path.value().c_str(),
-                strerror(errno));
-    return BUB_IO_RESULT_ERROR_IO;
+  return &(partitions_[partition] = p);
+}
+
+bool MyOps::map_partition(Partition* p, int64_t size) {
+  if (p->data != NULL) {
+    munmap(p->data, p->size);
+    p->data = NULL;
+  }
+  if (size > p->size && ftruncate(p->fd, size) != 0)
+    return false;
+  p->size = size;
+  if (size == 0)
+    return true;
+
+  void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+  if (data == MAP_FAILED)
+    return false;
+  p->data = (uint8_t*)data;
+  return true;
+}
+
+bool MyOps::sync_partitions() {
+  bool ret = true;
+
+  for (auto& it : partitions_) {
+    Partition* p = &it.second;
+    if (p->data != NULL && msync(p->data, p->size, MS_SYNC) != 0)
+      ret = false;
+    if (fsync(p->fd) != 0)
+      ret = false;
   }
-  if (lseek(fd, offset, SEEK_SET) != offset) {
-    fprintf(stderr, "Error seeking to pos %zd in file %s: %s\n", offset,
-                path.value().c_str(), strerror(errno));
-    close(fd);
+  return ret;
+}
+
+void MyOps::close_partitions() {
+  for (auto& it : partitions_) {
+    Partition* p = &it.second;
+    if (p->data != NULL)
+      munmap(p->data, p->size);
+    close(p->fd);
+  }
+  partitions_.clear();
+}
+
+bool MyOps::resolve_offset(Partition* p, int64_t* offset) {
+  int64_t file_size = p->size;
+  struct stat st;
+
+  if (*offset >= 0)
+    return true;
+  if (options_.backend != BACKEND_MMAP) {
+    if (fstat(p->fd, &st) != 0)
+      return false;
+    file_size = st.st_size;
+  }
+  *offset = file_size - (-*offset);
+  return true;
+}
+
+BubIOResult MyOps::read_from_partition(const char* partition, void* buf,
+                                int64_t offset, size_t num_bytes,
+                                size_t* out_num_read) {
+  num_reads++;
+  Partition* p = open_partition(partition);
+  if (p == NULL)
     return BUB_IO_RESULT_ERROR_IO;
+
+  ssize_t num_read = -1;
+  if (!resolve_offset(p, &offset)) {
+    fprintf(stderr, "Error getting size of partition '%s'\n", partition);
+  } else if (options_.backend != BACKEND_MMAP) {
+    num_read = pread(p->fd, buf, num_bytes, offset);
+  } else if (offset < 0) {
+    errno = EINVAL;
+  } else {
+    num_read = offset >= p->size ? 0 : std::min<int64_t>(num_bytes,
+                                                         p->size - offset);
+    if (num_read > 0)
+      memcpy(buf, p->data + offset, num_read);
   }
-  ssize_t num_read = read(fd, buf, num_bytes);
+  if (options_.backend == BACKEND_OPEN_PER_CALL)
+    close_partitions();
+
   if (num_read < 0) {
     fprintf(stderr, "Error reading %zd bytes from pos %" PRId64
-                " in file %s: %s\n",
-                num_bytes, offset, path.value().c_str(), strerror(errno));
-    close(fd);
+                " in partition %s: %s\n",
+                num_bytes, offset, partition, strerror(errno));
     return BUB_IO_RESULT_ERROR_IO;
   }
-  close(fd);
 
   if (out_num_read != NULL) {
     *out_num_read = num_read;
@@ -87,44 +188,69 @@ BubIOResult MyOps::read_from_partition(const char* partition, void* buf,
 
 BubIOResult MyOps::write_to_partition(const char* partition, const void* buf,
                                int64_t offset, size_t num_bytes) {
-  base::FilePath path =
-      partition_dir_.Append(std::string(partition)).AddExtension("img");
+  num_writes++;
+  Partition* p = open_partition(partition);
+  if (p == NULL)
+    return BUB_IO_RESULT_ERROR_IO;
 
-  if (offset < 0) {
-    int64_t file_size;
-    if (!base::GetFileSize(path, &file_size)) {
-      fprintf(stderr, "Error getting size of file '%s'\n",
-              path.value().c_str());
-      return BUB_IO_RESULT_ERROR_IO;
-    }
-    offset = file_size - (-offset);
+  ssize_t num_written = -1;
+  if (!resolve_offset(p, &offset)) {
+    fprintf(stderr, "Error getting size of partition '%s'\n", partition);
+  } else if (options_.backend != BACKEND_MMAP) {
+    num_written = pwrite(p->fd, buf, num_bytes, offset);
+    if (num_written >= 0 && options_.sync_writes && fsync(p->fd) != 0)
+      num_written = -1;
+  } else if (offset < 0) {
+    errno = EINVAL;
+  } else if (offset + (int64_t)num_bytes <= p->size ||
+             map_partition(p, offset + num_bytes)) {
+    memcpy(p->data + offset, buf, num_bytes);
+    num_written = num_bytes;
+    if (p->data != NULL && options_.sync_writes &&
+        msync(p->data, p->size, MS_SYNC) != 0)
+      num_written = -1;
   }
+  if (options_.backend == BACKEND_OPEN_PER_CALL)
+    close_partitions();
 
-  int fd = open(path.value().c_str(), O_WRONLY);
-  if (fd < 0) {
-    fprintf(stderr, "Error opening file '%s': %s\n", path.value().c_str(),
-                strerror(errno));
-    return BUB_IO_RESULT_ERROR_IO;
-  }
-  if (lseek(fd, offset, SEEK_SET) != offset) {
-    fprintf(stderr, "Error seeking to pos %zd in file %s: %s\n", offset,
-                path.value().c_str(), strerror(errno));
-    close(fd);
-    return BUB_IO_RESULT_ERROR_IO;
-  }
-  ssize_t num_written = write(fd, buf, num_bytes);
   if (num_written < 0) {
     fprintf(stderr, "Error writing %zd bytes at pos %"
-                    PRId64 " in file %s: %s\n",
-            num_bytes, offset, path.value().c_str(), strerror(errno));
-    close(fd);
+                    PRId64 " in partition %s: %s\n",
+            num_bytes, offset, partition, strerror(errno));
     return BUB_IO_RESULT_ERROR_IO;
   }
-  close(fd);
 
   return BUB_IO_RESULT_OK;
 }
 
+BubIOResult MyOps::read_from_partition_async(const char* partition,
+                                             void* buf, int64_t offset,
+                                             size_t num_bytes,
+                                             BubIORequest* request) {
+  num_reads++;
+  Partition* p = open_partition(partition);
+  if (p == NULL)
+    return BUB_IO_RESULT_ERROR_IO;
+
+  if (!resolve_offset(p, &offset)) {
+    fprintf(stderr, "Error getting size of partition '%s'\n", partition);
+    return BUB_IO_RESULT_ERROR_IO;
+  }
+  if (async_queue_ == NULL) {
+    async_queue_ = bub_async_queue_new(options_.async == ASYNC_IO_URING);
+    if (async_queue_ == NULL) {
+      fprintf(stderr, "Error creating asynchronous I/O queue\n");
+      return BUB_IO_RESULT_ERROR_IO;
+    }
+  }
+  return bub_async_queue_read(async_queue_, p->fd, buf, num_bytes, offset,
+                              request);
+}
+
+int MyOps::poll_completion(BubIORequest* request, int wait) {
+  return bub_async_queue_poll(async_queue_, request, wait);
+}
+
 void MyOps::write_ab_metadata(BubAbData* ab,
                               const uint8_t* magic,
                               uint8_t a_priority,
@@ -133,16 +259,28 @@ void MyOps::write_ab_metadata(BubAbData* ab,
                               uint8_t b_priority,
                               uint8_t b_tries_remaining,
                               uint8_t b_successful_boot) {
+  BubSlotData slots[2];
+
+  bub_memset(slots, 0, sizeof(slots));
+  slots[0].priority = a_priority;
+  slots[0].tries_remaining = a_tries_remaining;
+  slots[0].successful_boot = a_successful_boot;
+  slots[1].priority = b_priority;
+  slots[1].tries_remaining = b_tries_remaining;
+  slots[1].successful_boot = b_successful_boot;
+  write_ab_metadata(ab, magic, slots, 2);
+}
+
+void MyOps::write_ab_metadata(BubAbData* ab,
+                              const uint8_t* magic,
+                              const BubSlotData* slots,
+                              uint8_t num_slots) {
   bub_memset(ab, 0, sizeof(BubAbData));
   bub_memcpy(ab->magic, magic, sizeof(ab->magic));
   ab->major_version = BUB_MAJOR_VERSION;
   ab->minor_version = BUB_MINOR_VERSION;
-  ab->slots[0].priority = a_priority;
-  ab->slots[0].tries_remaining = a_tries_remaining;
-  ab->slots[0].successful_boot = a_successful_boot;
-  ab->slots[1].priority = b_priority;
-  ab->slots[1].tries_remaining = b_tries_remaining;
-  ab->slots[1].successful_boot = b_successful_boot;
+  ab->num_slots = num_slots;
+  bub_memcpy(ab->slots, slots, num_slots * sizeof(BubSlotData));
 }
 
 base::FilePath MyOps::make_metadata_image(const BubAbData* ab_metadata,
@@ -164,6 +302,8 @@ base::FilePath MyOps::make_metadata_image(const BubAbData* ab_metadata,
   for (size_t n = 0; n < sizeof(BubAbData); n++) {
     image[n] = image_data[n];
   }
+  // The image is truncated, which would leave a mapping of it dangling.
+  close_partitions();
   base::FilePath image_path = partition_dir_.Append(name);
   EXPECT_EQ(sizeof(BubAbData),
             static_cast<const size_t>(base::WriteFile(
@@ -172,31 +312,61 @@ base::FilePath MyOps::make_metadata_image(const BubAbData* ab_metadata,
   return image_path;
 }
 
+static int remove_entry(const char* path, const struct stat* st, int type,
+                        struct FTW* ftw) {
+  return remove(path);
+}
+
+TempDir::TempDir() {
+  char buf[] = "/tmp/bub-tests.XXXXXX";
+  if (mkdtemp(buf) != nullptr)
+    path_ = base::FilePath(buf);
+}
+
+TempDir::~TempDir() {
+  // Children come before their directory with FTW_DEPTH; FTW_PHYS removes
+  // symlinks rather than what they point to.
+  if (path_.empty())
+    return;
+  EXPECT_EQ(0, nftw(path_.value().c_str(), remove_entry, 16,
+                    FTW_DEPTH | FTW_PHYS));
+}
+
 void AbTest::SetUp() {
-  base::FilePath ret;
-  char* buf = strdup("/tmp/bub-tests.XXXXXX");
-  ASSERT_TRUE(mkdtemp(buf) != nullptr);
-  testdir_ = base::FilePath(buf);
+  ASSERT_FALSE(tempdir_.path().empty());
+  testdir_ = tempdir_.path();
   ops_.set_partition_dir(testdir_);
-  free(buf);
 }
 
-MyOps::MyOps() {
+MyOps::MyOps(const Options& options)
+    : options_(options), async_queue_(NULL) {
   bub_ops_ = new MyBubOps;
   bub_ops_->parent.read_from_partition = my_ops_read_from_partition;
   bub_ops_->parent.write_to_partition = my_ops_write_to_partition;
+  // Other backends may close an image while a read is in flight.
+  if (options_.backend == BACKEND_FD && options_.async != ASYNC_NONE) {
+    bub_ops_->parent.read_from_partition_async =
+        my_ops_read_from_partition_async;
+    bub_ops_->parent.poll_completion = my_ops_poll_completion;
+  } else {
+    bub_ops_->parent.read_from_partition_async = NULL;
+    bub_ops_->parent.poll_completion = NULL;
+  }
   bub_ops_->my_ops = this;
+  reset_io_counts();
 }
 
-MyOps::~MyOps() { delete bub_ops_; }
+MyOps::~MyOps() {
+  bub_async_queue_free(async_queue_);
+  close_partitions();
+  delete bub_ops_;
+}
 
 void AbTest::GenerateMiscImage(const BubAbData* ab_metadata) {
   ops_.make_metadata_image(ab_metadata, "misc.img");
 }
 
 int AbTest::CompareMiscImage(BubAbData ab_expected) {
-  const uint8_t A = 0, B = 1;
-  size_t num_bytes_read;
   BubAbData ab_expected_be;
   BubAbData* ab_actual = (BubAbData*)bub_calloc(sizeof(BubAbData));
 
@@ -208,16 +378,11 @@ int AbTest::CompareMiscImage(BubAbData ab_expected) {
   ab_expected_be.crc32 =
     bub_be32toh(bub_crc32(0, &ab_expected_be, sizeof(BubAbData)));
 
-  if ((ops_.bub_ops_)->parent.read_from_partition((BubOps *)ops_.bub_ops_,
-                                                  "misc", ab_actual, 0,
-                                                  sizeof(BubAbData),
-                                                  &num_bytes_read)) {
-    fprintf(stderr, "Could not read from misc partition.\n");
-    bub_free(ab_actual);
-    return 1;
-  }
-  if (num_bytes_read != sizeof(BubAbData)) {
-    fprintf(stderr, "Bad misc partition read.\n");
+  // The metadata in effect is the latest record of the metadata log, not
+  // necessarily the BubAbData at offset 0.
+  if (bub_read_ab_data_from_misc((BubOps*)ops_.bub_ops_, ab_actual) !=
+      BUB_AB_FLOW_RESULT_OK) {
+    fprintf(stderr, "Could not read metadata from misc partition.\n");
     bub_free(ab_actual);
     return 1;
   }
@@ -226,24 +391,19 @@ int AbTest::CompareMiscImage(BubAbData ab_expected) {
   EXPECT_EQ(0, bub_memcmp(&ab_expected_be, ab_actual, 8));
 
   // Check slots values.
-  EXPECT_EQ(ab_expected_be.slots[A].priority,
-            ab_actual->slots[A].priority);
-  EXPECT_EQ(ab_expected_be.slots[A].tries_remaining,
-            ab_actual->slots[A].tries_remaining);
-  EXPECT_EQ(ab_expected_be.slots[A].successful_boot,
-            ab_actual->slots[A].successful_boot);
-  EXPECT_EQ(0, bub_memcmp(ab_expected_be.slots[A].reserved,
-                          ab_actual->slots[A].reserved,
-                          sizeof(ab_actual->slots[A].reserved)));
-  EXPECT_EQ(ab_expected_be.slots[B].priority,
-            ab_actual->slots[B].priority);
-  EXPECT_EQ(ab_expected_be.slots[B].tries_remaining,
-            ab_actual->slots[B].tries_remaining);
-  EXPECT_EQ(ab_expected_be.slots[B].successful_boot,
-            ab_actual->slots[B].successful_boot);
-  EXPECT_EQ(0, bub_memcmp(&ab_expected_be.slots[B].reserved,
-                          ab_actual->slots[B].reserved,
-                          sizeof(ab_actual->slots[A].reserved)));
+  for (size_t i = 0; i < BUB_AB_MAX_SLOTS; ++i) {
+    SCOPED_TRACE(i);
+    EXPECT_EQ(ab_expected_be.slots[i].priority,
+              ab_actual->slots[i].priority);
+    EXPECT_EQ(ab_expected_be.slots[i].tries_remaining,
+              ab_actual->slots[i].tries_remaining);
+    EXPECT_EQ(ab_expected_be.slots[i].successful_boot,
+              ab_actual->slots[i].successful_boot);
+    EXPECT_EQ(0, bub_memcmp(ab_expected_be.slots[i].reserved,
+                            ab_actual->slots[i].reserved,
+                            sizeof(ab_actual->slots[i].reserved)));
+  }
+  EXPECT_EQ(ab_expected_be.num_slots, ab_actual->num_slots);
 
   // Check reserved and crc bytes.
   // TODO: Compute and compare crc value here.
@@ -251,7 +411,7 @@ int AbTest::CompareMiscImage(BubAbData ab_expected) {
                           ab_expected_be.reserved2,
                           sizeof(ab_expected_be.reserved2)));
 
-  EXPECT_EQ(ab_expected_be.crc32, ab_actual->crc32);
+  EXPECT_EQ(bub_be32toh(ab_expected_be.crc32), ab_actual->crc32);
 
   bub_free(ab_actual);
   return 0;
@@ -21,8 +21,12 @@
 #include <gtest/gtest.h>
 #include <base/files/file_util.h>
 
+#include <map>
+#include <string>
+
 #include "bub_sysdeps.h"
 #include "bub_ab_flow.h"
+#include "bub_async_posix.h"
 #include "bub_util.h"
 
 struct MyBubOps;
@@ -30,7 +34,38 @@ typedef struct MyBubOps MyBubOps;
 
 class MyOps {
  public:
-  MyOps();
+  // How partition images are accessed.
+  enum Backend {
+    // Opens the image for every read and write.
+    BACKEND_OPEN_PER_CALL,
+    // Keeps one fd per image and uses pread() and pwrite().
+    BACKEND_FD,
+    // Maps each image with mmap(); reads and writes are memory copies.
+    BACKEND_MMAP,
+  };
+
+  // How BubOps.read_from_partition_async reads, with BACKEND_FD only.
+  enum AsyncBackend {
+    // Not at all; bub_ops_read_async() falls back to read_from_partition.
+    ASYNC_NONE,
+    // With io_uring where the kernel allows it, with threads otherwise.
+    ASYNC_IO_URING,
+    // With a pool of pread() threads.
+    ASYNC_THREADS,
+  };
+
+  struct Options {
+    Options()
+        : backend(BACKEND_FD), sync_writes(false), async(ASYNC_IO_URING) {}
+
+    Backend backend;
+    // Makes every write durable with fsync() or msync(). Otherwise that
+    // only happens in sync_partitions().
+    bool sync_writes;
+    AsyncBackend async;
+  };
+
+  explicit MyOps(const Options& options = Options());
   ~MyOps();
 
   BubOps* bub_ops() { return (BubOps*)bub_ops_; }
@@ -40,6 +75,11 @@ class MyOps {
                                   size_t* out_num_read);
   BubIOResult write_to_partition(const char* partition, const void* buf,
                                  int64_t offset, size_t num_bytes);
+  // Counted in num_reads, like read_from_partition.
+  BubIOResult read_from_partition_async(const char* partition, void* buf,
+                                        int64_t offset, size_t num_bytes,
+                                        BubIORequest* request);
+  int poll_completion(BubIORequest* request, int wait);
 
   /* Assigns to |ab| metadata using |magic| and [a,b]_*| parameters. This
    * function does not swap byte order nor does it calculate the crc.
@@ -53,6 +93,14 @@ class MyOps {
                          uint8_t b_tries_remaining,
                          uint8_t b_successful_boot);
 
+  /* Like above, but with the first |num_slots| entries of |slots|, which
+   * need not be bootable.
+   */
+  void write_ab_metadata(BubAbData* ab,
+                         const uint8_t* magic,
+                         const BubSlotData* slots,
+                         uint8_t num_slots);
+
   /* Writes out a misc.img file in a temp directory using |ab_metadata|.
    * Byte swapping is done prior to writing to ensure the big endianness
    * expected in the Misc partition.
@@ -60,8 +108,49 @@ class MyOps {
   base::FilePath make_metadata_image(const BubAbData* ab_metadata,
                                    	 const char* name);
 
+  // Clears num_reads and num_writes.
+  void reset_io_counts() { num_reads = num_writes = 0; }
+
+  /* Flushes writes to all open partition images to disk.
+   *
+   * @return: false if any image could not be synced.
+   */
+  bool sync_partitions();
+
+  /* Closes and unmaps all partition images. Must be called before an image
+   * is replaced other than through this class; make_metadata_image() does
+   * so itself. No asynchronous read may be in flight.
+   */
+  void close_partitions();
+
   MyBubOps* bub_ops_;
   base::FilePath partition_dir_;
+  // Number of read_from_partition and write_to_partition calls.
+  int num_reads;
+  int num_writes;
+
+ private:
+  // An open partition image.
+  struct Partition {
+    int fd;
+    // Mapping of the whole image with BACKEND_MMAP, NULL if it is empty.
+    uint8_t* data;
+    // Size of the image with BACKEND_MMAP.
+    int64_t size;
+  };
+
+  // Returns the open image of |partition|, opening it if needed.
+  Partition* open_partition(const char* partition);
+  // Maps the first |size| bytes of |p|'s image, growing it if needed.
+  bool map_partition(Partition* p, int64_t size);
+  // Turns a negative |offset|, counted from the end of |p|, into one
+  // counted from the start.
+  bool resolve_offset(Partition* p, int64_t* offset);
+
+  Options options_;
+  std::map<std::string, Partition> partitions_;
+  // Created by the first asynchronous read.
+  BubAsyncQueue* async_queue_;
 };
 
 struct MyBubOps {
@@ -69,6 +158,27 @@ struct MyBubOps {
   MyOps* my_ops;
 };
 
+/* A fresh directory under /tmp for the files of one test. It is removed
+ * along with everything in it when the TempDir is destroyed.
+ */
+class TempDir {
+ public:
+  TempDir();
+  ~TempDir();
+
+  // Empty if the directory could not be created.
+  const base::FilePath& path() const { return path_; }
+  base::FilePath Append(const std::string& name) const {
+    return path_.Append(name);
+  }
+
+ private:
+  TempDir(const TempDir&) = delete;
+  TempDir& operator=(const TempDir&) = delete;
+
+  base::FilePath path_;
+};
+
 class AbTest : public ::testing::Test {
   public:
     AbTest() {}
@@ -81,13 +191,14 @@ class AbTest : public ::testing::Test {
      */
     void GenerateMiscImage(const BubAbData* ab_metadata);
 
-    /* Tests expected vs actual contents of ab metadata found in the Misc
-     * partition. Byte swapping to big endianness and crc for |ab_expected|
+    /* Tests expected vs actual contents of ab metadata in effect in the Misc
+     * partition, see bub_read_ab_data_from_misc(). Byte swapping to big endianness and crc for |ab_expected|
      * is done prior to test comparisons.
      */
     int CompareMiscImage(BubAbData ab_expected);
 
-    // Temporary directory created in SetUp().
+    // Temporary directory, removed after ops_ has closed its images.
+    TempDir tempdir_;
     base::FilePath testdir_;
 
     MyOps ops_;
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bub_log.h"
+
+/* Output is kept in a ring of BUB_LOG_SIZE bytes starting at |log_start|. */
+static char log_ring[BUB_LOG_SIZE];
+static size_t log_start;
+static size_t log_size;
+static int log_dropped;
+
+static void append_bytes(const char* data, size_t num_bytes) {
+  while (num_bytes-- > 0) {
+    log_ring[(log_start + log_size) % BUB_LOG_SIZE] = *data++;
+    if (log_size < BUB_LOG_SIZE) {
+      log_size++;
+    } else {
+      log_start = (log_start + 1) % BUB_LOG_SIZE;
+      log_dropped = 1;
+    }
+  }
+}
+
+/* Appends |value| in decimal. */
+static void append_u64(uint64_t value) {
+  char digits[20];
+  size_t n = 0;
+
+  do {
+    digits[n++] = '0' + (value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  while (n > 0)
+    append_bytes(&digits[--n], 1);
+}
+
+void bub_log(const char* message) {
+  // Stamped like the boot stages in bub.timings=, so both line up.
+  append_bytes("[", 1);
+  append_u64(bub_get_ticks());
+  append_bytes("] ", 2);
+  append_bytes(message, bub_strlen(message));
+
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
+  bub_print(message);
+#endif
+}
+
+size_t bub_log_read(char* buf, size_t buf_size) {
+  size_t skip = 0;
+  size_t n;
+
+  bub_assert(buf_size >= BUB_LOG_SIZE);
+
+  // Drop what is left of a line whose start was overwritten.
+  if (log_dropped) {
+    while (skip < log_size &&
+           log_ring[(log_start + skip) % BUB_LOG_SIZE] != '\n')
+      skip++;
+    if (skip < log_size)
+      skip++;
+  }
+
+  for (n = 0; n + skip < log_size; ++n)
+    buf[n] = log_ring[(log_start + skip + n) % BUB_LOG_SIZE];
+  return n;
+}
+
+void bub_log_reset(void) {
+  log_start = 0;
+  log_size = 0;
+  log_dropped = 0;
+}
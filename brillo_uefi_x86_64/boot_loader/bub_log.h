@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUB_LOG_H_
+#define BUB_LOG_H_
+
+#include "bub_sysdeps.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size of the ring bub_log() writes to. Once it is full, the oldest output is
+ * dropped.
+ */
+#define BUB_LOG_SIZE 4096
+
+/* Copies the log, oldest output first, into |buf|, which must hold at least
+ * BUB_LOG_SIZE bytes. If older output was dropped, the copy starts at the
+ * first complete line. No NUL is appended.
+ *
+ * @return number of bytes written to |buf|.
+ */
+size_t bub_log_read(char* buf, size_t buf_size);
+
+/* Clears the log. */
+void bub_log_reset(void);
+
+/* Makes the log readable by the OS. The UEFI boot loader stores it in the
+ * volatile EFI variable BubLog; elsewhere this does nothing. Implemented in
+ * bub_sysdeps_*.c.
+ */
+void bub_log_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUB_LOG_H_ */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <string>
+
+#include "bub_log.h"
+
+// Returns the current log contents.
+static std::string read_log() {
+  char buf[BUB_LOG_SIZE];
+  size_t len = bub_log_read(buf, sizeof(buf));
+  return std::string(buf, len);
+}
+
+TEST(LogTest, Empty) {
+  bub_log_reset();
+  EXPECT_EQ("", read_log());
+}
+
+TEST(LogTest, MessagesAreStamped) {
+  bub_log_reset();
+  bub_log("first\n");
+  bub_warning("second\n");
+  std::string log = read_log();
+
+  size_t first = log.find("] first\n");
+  size_t second = log.find("] WARNING: second\n");
+  ASSERT_NE(std::string::npos, first);
+  ASSERT_NE(std::string::npos, second);
+  EXPECT_LT(first, second);
+  EXPECT_EQ('[', log[0]);
+  EXPECT_EQ(log.size(), second + strlen("] WARNING: second\n"));
+}
+
+TEST(LogTest, OldestLinesDropped) {
+  std::string line(99, 'x');
+  line += "\n";
+  bub_log_reset();
+  bub_log("oldest\n");
+  for (int n = 0; n < 2 * BUB_LOG_SIZE / 100; ++n)
+    bub_log(line.c_str());
+  bub_log("newest\n");
+  std::string log = read_log();
+
+  EXPECT_EQ(std::string::npos, log.find("oldest"));
+  EXPECT_LE(log.size(), (size_t)BUB_LOG_SIZE);
+  // Only whole lines are kept.
+  EXPECT_EQ('[', log[0]);
+  EXPECT_EQ(log.size() - strlen("newest\n"), log.rfind("newest\n"));
+}
+
+TEST(LogTest, Reset) {
+  bub_log_reset();
+  bub_log("something\n");
+  bub_log_reset();
+  EXPECT_EQ("", read_log());
+}
@@ -27,43 +27,73 @@
 #include "bub_ab_flow.h"
 #include "bub_boot_kernel.h"
 #include "bub_sysdeps.h"
+#include "bub_timings.h"
 
 
 EFI_STATUS EFIAPI efi_main (EFI_HANDLE ImageHandle,
                             EFI_SYSTEM_TABLE* SystemTable) {
   MyBubOps ops;
+  BubAbSession ab_session;
   BubAbFlowResult ab_result;
   BubBootResult boot_result;
+  BubArenaMark arena_mark;
+  int slot_invalid;
   char slot_suffix[BUB_SUFFIX_SIZE] = {0};
   char boot_name[7] = "boot\0\0\0";
 
+  bub_timing_mark(BUB_STAGE_START);
   InitializeLib(ImageHandle, SystemTable);
   bub_print("Brillo UEFI A/B BOOT LOADER\n");
 
   if (!bub_init(&ops, ImageHandle))
     bub_error("Could not initialize Brillo Uefi object.");
 
+  // The A/B metadata is read once. Changes made by the attempts below are
+  // written together, right before a kernel starts or on a fatal error.
+  ab_result = bub_ab_session_load(&ab_session, (BubOps *)&ops);
+  if (ab_result != BUB_AB_FLOW_RESULT_OK) {
+    if (ab_result == BUB_AB_FLOW_ERROR_INVALID_METADATA &&
+        !bub_ab_session_flush(&ab_session))
+      bub_warning("Unable to reset metadata.\n");
+    bub_error("Could not read A/B metadata.\n");
+  }
+
   // Attempt AB flow and boot.  Invalidate metadata for slots having bad
-  // partition format.
+  // partition format or failing verification.
   do {
-    ab_result = bub_ab_flow((BubOps *)&ops, slot_suffix, BUB_SUFFIX_SIZE);
-    if (ab_result != BUB_AB_FLOW_RESULT_OK)
+    ab_result = bub_ab_session_select(&ab_session, slot_suffix,
+                                      BUB_SUFFIX_SIZE);
+    if (ab_result != BUB_AB_FLOW_RESULT_OK) {
+      bub_ab_session_flush(&ab_session);
       bub_error("Could not choose A/B slot.\n");
+    }
+    bub_timing_mark(BUB_STAGE_AB_FLOW);
+    bub_timing_set_slot(slot_suffix);
 
     bub_memcpy(boot_name + 4, slot_suffix, BUB_SUFFIX_SIZE);
 
-    boot_result = bub_boot_kernel(&ops, boot_name);
-    if (boot_result == BUB_BOOT_ERROR_PARTITION_INVALID_FORMAT) {
+    // A failed boot attempt frees its pages and unloads its kernel itself;
+    // its small allocations are dropped here along with the arena.
+    arena_mark = bub_arena_mark(&ops.arena);
+    boot_result = bub_boot_kernel(&ops, &ab_session, boot_name);
+    bub_arena_reset(&ops.arena, arena_mark);
+    slot_invalid = (boot_result == BUB_BOOT_ERROR_PARTITION_INVALID_FORMAT ||
+                    boot_result == BUB_BOOT_ERROR_VERIFICATION);
+    if (slot_invalid) {
       bub_warning("Marking slot as invalid.\n");
 
-      if (bub_ab_mark_as_invalid((MyBubOps *)&ops, slot_suffix))
+      if (!bub_ab_session_mark_as_invalid(&ab_session, slot_suffix)) {
+        bub_ab_session_flush(&ab_session);
         bub_error("Could not mark slot invalid.");
+      }
 
     }
-    else if (boot_result != BUB_BOOT_RESULT_OK)
+    else if (boot_result != BUB_BOOT_RESULT_OK) {
+      bub_ab_session_flush(&ab_session);
       bub_error("Error loading kernel.\n");
+    }
 
-  } while (boot_result == BUB_BOOT_ERROR_PARTITION_INVALID_FORMAT);
+  } while (slot_invalid);
 
   return EFI_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bub_ops.h"
+
+BubIOResult bub_ops_read_async(BubOps* ops, const char* partition, void* buf,
+                               int64_t offset, size_t num_bytes,
+                               BubIORequest* request) {
+  if (ops->read_from_partition_async != NULL)
+    return ops->read_from_partition_async(ops, partition, buf, offset,
+                                          num_bytes, request);
+
+  // Complete before it is started.
+  request->num_read = 0;
+  request->result = ops->read_from_partition(ops, partition, buf, offset,
+                                             num_bytes, &request->num_read);
+  return request->result;
+}
+
+int bub_ops_poll_completion(BubOps* ops, BubIORequest* request, int wait) {
+  if (ops->read_from_partition_async == NULL)
+    return 1;
+  return ops->poll_completion(ops, request, wait);
+}
@@ -50,6 +50,22 @@ typedef enum {
 struct BubOps;
 typedef struct BubOps BubOps;
 
+/* An asynchronous partition read, see BubOps.read_from_partition_async.
+ * The storage belongs to the caller but must not be touched while the
+ * read is in flight.
+ */
+typedef struct {
+  /* Outcome of the read, as returned and stored in |out_num_read| by
+   * read_from_partition. Only valid once the read has completed.
+   */
+  BubIOResult result;
+  size_t num_read;
+  /* Free for use by the caller. */
+  void* user_data;
+  /* Reserved for the BubOps implementation. */
+  uint64_t impl[6];
+} BubIORequest;
+
 /* High-level operations/functions/methods that are platform
  * dependent.
  */
@@ -75,6 +91,29 @@ struct BubOps {
                                      void* buf, int64_t offset,
                                      size_t num_bytes, size_t* out_num_read);
 
+  /* Starts the read read_from_partition would do and returns without
+   * waiting for it. If BUB_IO_RESULT_OK is returned, the read is in flight
+   * and |buf| and |request| belong to the implementation until
+   * poll_completion reports |request| complete; the outcome is then in
+   * |request|. Any other value is an error as for read_from_partition and
+   * nothing was started. Several reads may be in flight at once and they
+   * may complete in any order.
+   *
+   * Optional, may be NULL. Use bub_ops_read_async() rather than calling
+   * this directly; it falls back to read_from_partition.
+   */
+  BubIOResult (*read_from_partition_async)(BubOps* ops, const char* partition,
+                                           void* buf, int64_t offset,
+                                           size_t num_bytes,
+                                           BubIORequest* request);
+
+  /* Checks whether the read of |request| started by
+   * read_from_partition_async has completed, waiting for it if |wait| is
+   * non-zero. Returns non-zero once it has. Must be called until then for
+   * every read started. Set if and only if read_from_partition_async is.
+   */
+  int (*poll_completion)(BubOps* ops, BubIORequest* request, int wait);
+
   /* Writes |num_bytes| at offset |offset| from partition with name
    * |partition| (NUL-terminated UTF-8 string). If |offset| is
    * negative, its absolute value should be interpreted as the number
@@ -145,6 +184,25 @@ struct BubOps {
                                        char* guid_buf, size_t guid_buf_size);
 };
 
+/* Starts an asynchronous read with |ops|, see read_from_partition_async.
+ * If |ops| cannot read asynchronously, the read is done with
+ * read_from_partition before this returns and |request| is already
+ * complete.
+ *
+ * @return: BUB_IO_RESULT_OK if |request| must be passed to
+ *          bub_ops_poll_completion(), otherwise the error.
+ */
+BubIOResult bub_ops_read_async(BubOps* ops, const char* partition, void* buf,
+                               int64_t offset, size_t num_bytes,
+                               BubIORequest* request);
+
+/* Checks whether |request| started with bub_ops_read_async() has
+ * completed, see poll_completion.
+ *
+ * @return: non-zero once |request| has completed.
+ */
+int bub_ops_poll_completion(BubOps* ops, BubIORequest* request, int wait);
+
 #ifdef __cplusplus
 }
 #endif
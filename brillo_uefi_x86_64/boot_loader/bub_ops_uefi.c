@@ -19,117 +19,476 @@
 #include "bub_sysdeps.h"
 #include "bub_boot_kernel.h"
 
+/* uefi_call_wrapper's second arguments is the number of argumets for the
+ * called function
+ */
+#define NUM_ARGS_CREATE_EVENT 5
+#define NUM_ARGS_WAIT_FOR_EVENT 3
+#define NUM_ARGS_CLOSE_EVENT 1
+#define NUM_ARGS_CHECK_EVENT 1
+#define NUM_ARGS_READ_BLOCKS 5
+#define NUM_ARGS_READ_BLOCKS_EX 6
+#define NUM_ARGS_READ_DISK 5
+
+/* One EFI_BLOCK_IO2 read of a bub_stream_from_partition() pipeline. */
+typedef struct {
+  EFI_BLOCK_IO2_TOKEN token;
+  UINT8* buf;
+  UINTN num_bytes;
+  BOOLEAN in_flight;
+  UINT64 submit_ticks;
+} StreamRequest;
+
+/* The part of a BubIORequest owned by bub_read_from_partition_async(). */
+typedef struct {
+  EFI_BLOCK_IO2_TOKEN token;
+  BOOLEAN in_flight;
+} UefiIORequest;
+
+#if defined(__GNUC__) && __GNUC__ >= 4 && __GNUC_MINOR__ >= 6
+ _Static_assert(sizeof(UefiIORequest) <= sizeof(((BubIORequest*)0)->impl),
+                "UefiIORequest does not fit in BubIORequest!");
+#endif
+
+/* Returns the partition index of |bub|, rebuilding it first if it is stale,
+ * or NULL if the GPT cannot be read.
+ */
+static const BubPartitionIndex* current_index(MyBubOps* bub) {
+  if (bub->partition_index == NULL || !bub->partition_index->valid) {
+    if (EFI_ERROR(bub_partition_index_build(bub)))
+      return NULL;
+  }
+  return bub->partition_index;
+}
+
 BubIOResult bub_read_from_partition(BubOps* ops,
                                     const char* partition_name,
                                     void* buf,
                                     int64_t offset_from_partition,
                                     size_t num_bytes,
                                     size_t* out_num_read) {
-  bub_assert(partition_name != NULL);
-  bub_assert(buf != NULL);
-  bub_assert(out_num_read != NULL);
+  MyBubOps* bub = (MyBubOps*)ops;
+  const BubPartitionIndex* index = current_index(bub);
 
-  EFI_STATUS err;
-  GPTEntry *partition_entry;
-  UINT64 partition_size;
+  if (index == NULL)
+    return BUB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
+
+  return bub_disk_read_from_partition(&bub->block_dev.parent,
+                                      index,
+                                      partition_name,
+                                      buf,
+                                      offset_from_partition,
+                                      num_bytes,
+                                      out_num_read);
+}
+
+BubIOResult bub_write_to_partition(BubOps* ops,
+                                   const char* partition_name,
+                                   const void* buf,
+                                   int64_t offset_from_partition,
+                                   size_t num_bytes) {
   MyBubOps* bub = (MyBubOps*)ops;
+  const BubPartitionIndex* index = current_index(bub);
 
-  err = bub_partition_entry_by_name(bub->block_io,
-                                    partition_name,
-                                    &partition_entry);
-  if (EFI_ERROR(err))
+  if (index == NULL)
     return BUB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
 
-  partition_size = IMG_SIZE(partition_entry, bub->block_io);
+  return bub_disk_write_to_partition(&bub->block_dev.parent,
+                                     index,
+                                     partition_name,
+                                     buf,
+                                     offset_from_partition,
+                                     num_bytes);
+}
+
+/* Returns TRUE if |buf| satisfies the I/O alignment of |media|. */
+static BOOLEAN stream_buf_aligned(const EFI_BLOCK_IO_MEDIA* media,
+                                  const void* buf) {
+  return media->IoAlign <= 1 ||
+         ((UINTN)buf & (media->IoAlign - 1)) == 0;
+}
+
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
+/* Per-chunk ticks are only taken for the debug output. */
+#define stream_ticks() bub_get_ticks()
+
+static void stream_debug_chunk(UINTN chunk, UINTN num_bytes,
+                               UINT64 read_ticks, UINT64 process_ticks) {
+  Print(L"Chunk %d: %d bytes, read %ld ticks, processed %ld ticks\n",
+        chunk, num_bytes, read_ticks, process_ticks);
+}
+#else
+#define stream_ticks() ((UINT64)0)
+
+static void stream_debug_chunk(UINTN chunk, UINTN num_bytes,
+                               UINT64 read_ticks, UINT64 process_ticks) {}
+#endif
+
+/* Synchronously reads |num_bytes| at byte |disk_offset| of the disk into
+ * |buf|. Block-aligned ranges go through EFI_BLOCK_IO, anything else through
+ * EFI_DISK_IO.
+ */
+static EFI_STATUS stream_read_sync(MyBubOps* bub, UINT64 disk_offset,
+                                   UINT8* buf, UINTN num_bytes) {
+  EFI_BLOCK_IO_MEDIA* media = bub->block_io->Media;
+
+  if (disk_offset % media->BlockSize == 0 &&
+      num_bytes % media->BlockSize == 0 &&
+      stream_buf_aligned(media, buf)) {
+    return uefi_call_wrapper(bub->block_io->ReadBlocks, NUM_ARGS_READ_BLOCKS,
+                             bub->block_io,
+                             media->MediaId,
+                             disk_offset / media->BlockSize,
+                             num_bytes,
+                             buf);
+  }
+
+  return uefi_call_wrapper(bub->disk_io->ReadDisk, NUM_ARGS_READ_DISK,
+                           bub->disk_io,
+                           media->MediaId,
+                           disk_offset,
+                           num_bytes,
+                           buf);
+}
 
-  if (offset_from_partition < 0) {
-    if ((-offset_from_partition) > partition_size) {
-      bub_warning("Offset outside range.\n");
-      bub_free(partition_entry);
-      return BUB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
+/* Reads |num_bytes| at |disk_offset| into |buf| one chunk at a time. */
+static BubIOResult stream_sync(MyBubOps* bub, UINT64 disk_offset, UINT8* buf,
+                               UINT64 num_bytes, BubChunkFn chunk_fn,
+                               void* user_data) {
+  EFI_STATUS err;
+  UINT64 done = 0;
+  UINTN chunk = 0;
+
+  while (done < num_bytes) {
+    UINTN chunk_bytes = BUB_STREAM_CHUNK_SIZE;
+    UINT64 read_ticks;
+    UINT64 ticks;
+
+    if (num_bytes - done < chunk_bytes)
+      chunk_bytes = num_bytes - done;
+
+    ticks = stream_ticks();
+    err = stream_read_sync(bub, disk_offset + done, buf + done, chunk_bytes);
+    if (EFI_ERROR(err)) {
+      bub_warning("Could not read chunk from disk.\n");
+      return BUB_IO_RESULT_ERROR_IO;
     }
-    offset_from_partition = partition_size - (-offset_from_partition);
+    read_ticks = stream_ticks() - ticks;
+
+    ticks = stream_ticks();
+    if (chunk_fn != NULL && !chunk_fn(user_data, buf + done, chunk_bytes))
+      return BUB_IO_RESULT_ERROR_IO;
+    stream_debug_chunk(chunk, chunk_bytes, read_ticks,
+                       stream_ticks() - ticks);
+
+    done += chunk_bytes;
+    chunk++;
   }
 
-  // Check if num_bytes goes beyond partition end. If so, don't read beyond
-  // this boundary -- do a partial I/O instead.
-  if (num_bytes > partition_size - offset_from_partition)
-    *out_num_read = partition_size - offset_from_partition;
-  else
-    *out_num_read = num_bytes;
-
-  err = uefi_call_wrapper(bub->disk_io->ReadDisk, 5,
-                          bub->disk_io,
-                          bub->block_io->Media->MediaId,
-                          (partition_entry->first_lba *
-                            bub->block_io->Media->BlockSize) +
-                            offset_from_partition,
-                          *out_num_read,
+  return BUB_IO_RESULT_OK;
+}
+
+static EFI_STATUS stream_submit(MyBubOps* bub, StreamRequest* req,
+                                EFI_LBA lba, UINT8* buf, UINTN num_bytes) {
+  EFI_STATUS err;
+
+  req->buf = buf;
+  req->num_bytes = num_bytes;
+  req->token.TransactionStatus = EFI_SUCCESS;
+  req->submit_ticks = stream_ticks();
+  err = uefi_call_wrapper(bub->block_io2->ReadBlocksEx,
+                          NUM_ARGS_READ_BLOCKS_EX,
+                          bub->block_io2,
+                          bub->block_io2->Media->MediaId,
+                          lba,
+                          &req->token,
+                          num_bytes,
                           buf);
-  if (EFI_ERROR(err)) {
-    bub_warning("Could not read from Disk.\n");
-    *out_num_read = 0;
-    bub_free(partition_entry);
-    return BUB_IO_RESULT_ERROR_IO;
+  req->in_flight = !EFI_ERROR(err);
+  return err;
+}
+
+static EFI_STATUS stream_wait(StreamRequest* req) {
+  EFI_STATUS err;
+  UINTN event_index;
+
+  err = uefi_call_wrapper(BS->WaitForEvent, NUM_ARGS_WAIT_FOR_EVENT,
+                          1,
+                          &req->token.Event,
+                          &event_index);
+  req->in_flight = FALSE;
+  if (EFI_ERROR(err))
+    return err;
+  return req->token.TransactionStatus;
+}
+
+/* Reads the |num_bytes| (a multiple of the block size) starting at block
+ * |lba| into |buf| with two EFI_BLOCK_IO2 reads in flight. Chunks complete in
+ * order; when chunk N completes, chunk N + 2 is submitted before |chunk_fn|
+ * runs on chunk N so the device queue never drains during processing.
+ */
+static BubIOResult stream_async(MyBubOps* bub, EFI_LBA lba, UINT8* buf,
+                                UINT64 num_bytes, BubChunkFn chunk_fn,
+                                void* user_data) {
+  EFI_STATUS err;
+  StreamRequest reqs[2];
+  UINT32 block_size = bub->block_io2->Media->BlockSize;
+  BubIOResult result = BUB_IO_RESULT_OK;
+  UINT64 submitted = 0;
+  UINTN next = 0;
+  UINTN chunk = 0;
+  UINTN i;
+
+  bub_memset(reqs, 0, sizeof(reqs));
+  for (i = 0; i < 2; ++i) {
+    err = uefi_call_wrapper(BS->CreateEvent, NUM_ARGS_CREATE_EVENT,
+                            0,
+                            0,
+                            NULL,
+                            NULL,
+                            &reqs[i].token.Event);
+    if (EFI_ERROR(err)) {
+      bub_warning("Could not create block I/O event.\n");
+      if (i > 0)
+        uefi_call_wrapper(BS->CloseEvent, NUM_ARGS_CLOSE_EVENT,
+                          reqs[0].token.Event);
+      return stream_sync(bub, lba * block_size, buf, num_bytes,
+                         chunk_fn, user_data);
+    }
   }
 
-  bub_free(partition_entry);
-  return BUB_IO_RESULT_OK;
+  // Prime the pipeline.
+  for (i = 0; i < 2 && submitted < num_bytes; ++i) {
+    UINTN chunk_bytes = BUB_STREAM_CHUNK_SIZE;
+    if (num_bytes - submitted < chunk_bytes)
+      chunk_bytes = num_bytes - submitted;
+    err = stream_submit(bub, &reqs[i], lba + submitted / block_size,
+                        buf + submitted, chunk_bytes);
+    if (EFI_ERROR(err)) {
+      bub_warning("Could not submit block I/O read.\n");
+      result = BUB_IO_RESULT_ERROR_IO;
+      break;
+    }
+    submitted += chunk_bytes;
+  }
+
+  while (result == BUB_IO_RESULT_OK && reqs[next].in_flight) {
+    StreamRequest* req = &reqs[next];
+    UINT8* chunk_buf = req->buf;
+    UINTN chunk_bytes = req->num_bytes;
+    UINT64 read_ticks;
+    UINT64 ticks;
+
+    err = stream_wait(req);
+    read_ticks = stream_ticks() - req->submit_ticks;
+    if (EFI_ERROR(err)) {
+      bub_warning("Could not read chunk from disk.\n");
+      result = BUB_IO_RESULT_ERROR_IO;
+      break;
+    }
+
+    if (submitted < num_bytes) {
+      UINTN next_bytes = BUB_STREAM_CHUNK_SIZE;
+      if (num_bytes - submitted < next_bytes)
+        next_bytes = num_bytes - submitted;
+      err = stream_submit(bub, req, lba + submitted / block_size,
+                          buf + submitted, next_bytes);
+      if (EFI_ERROR(err)) {
+        bub_warning("Could not submit block I/O read.\n");
+        result = BUB_IO_RESULT_ERROR_IO;
+        break;
+      }
+      submitted += next_bytes;
+    }
+
+    ticks = stream_ticks();
+    if (chunk_fn != NULL && !chunk_fn(user_data, chunk_buf, chunk_bytes)) {
+      result = BUB_IO_RESULT_ERROR_IO;
+      break;
+    }
+    stream_debug_chunk(chunk, chunk_bytes, read_ticks,
+                       stream_ticks() - ticks);
+
+    chunk++;
+    next ^= 1;
+  }
+
+  // The buffers belong to the device until outstanding reads complete.
+  for (i = 0; i < 2; ++i) {
+    if (reqs[i].in_flight)
+      stream_wait(&reqs[i]);
+    uefi_call_wrapper(BS->CloseEvent, NUM_ARGS_CLOSE_EVENT,
+                      reqs[i].token.Event);
+  }
+
+  return result;
 }
 
-BubIOResult bub_write_to_partition(BubOps* ops,
-                                   const char* partition_name,
-                                   const void* buf,
-                                   int64_t offset_from_partition,
-                                   size_t num_bytes) {
+BubIOResult bub_stream_from_partition(MyBubOps* bub,
+                                      const char* partition_name,
+                                      void* buf,
+                                      UINT64 offset_from_partition,
+                                      UINT64 num_bytes,
+                                      BubChunkFn chunk_fn,
+                                      void* user_data) {
   bub_assert(partition_name != NULL);
   bub_assert(buf != NULL);
 
   EFI_STATUS err;
-  GPTEntry *partition_entry;
+  const BubPartitionIndexEntry *partition_entry;
   UINT64 partition_size;
-  MyBubOps* bub = (MyBubOps*)ops;
+  UINT64 disk_offset;
+  UINT64 aligned_bytes = 0;
+  UINT32 block_size = bub->block_io->Media->BlockSize;
+  BubIOResult result;
 
-  err = bub_partition_entry_by_name(bub->block_io,
-                                    partition_name,
-                                    &partition_entry);
+  err = bub_partition_index_lookup(bub, partition_name, &partition_entry);
   if (EFI_ERROR(err))
     return BUB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
 
   partition_size = IMG_SIZE(partition_entry, bub->block_io);
-
-  if (offset_from_partition < 0) {
-    if ((-offset_from_partition) > partition_size) {
-      bub_warning("Offset outside range.\n");
-      bub_free(partition_entry);
-      return BUB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
-    }
-    offset_from_partition = partition_size - (-offset_from_partition);
+  if (offset_from_partition > partition_size ||
+      num_bytes > partition_size - offset_from_partition) {
+    bub_warning("Cannot stream beyond partition boundary.\n");
+    return BUB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
   }
 
-  // Check if num_bytes goes beyond partition end. If so, error out -- no
-  // partial I/O.
-  if (num_bytes > partition_size - offset_from_partition) {
-    bub_warning("Cannot write beyond partition boundary.\n");
-    bub_free(partition_entry);
-    return BUB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
+  disk_offset = partition_entry->first_lba * block_size +
+                offset_from_partition;
+
+  if (bub->block_io2 != NULL &&
+      disk_offset % block_size == 0 &&
+      stream_buf_aligned(bub->block_io2->Media, buf))
+    aligned_bytes = num_bytes - num_bytes % block_size;
+
+  if (aligned_bytes == 0)
+    return stream_sync(bub, disk_offset, (UINT8*)buf, num_bytes,
+                       chunk_fn, user_data);
+
+  bub_debug("Streaming with EFI_BLOCK_IO2.\n");
+  result = stream_async(bub, disk_offset / block_size, (UINT8*)buf,
+                        aligned_bytes, chunk_fn, user_data);
+  if (result != BUB_IO_RESULT_OK || aligned_bytes == num_bytes)
+    return result;
+
+  // Trailing partial block.
+  return stream_sync(bub, disk_offset + aligned_bytes,
+                     (UINT8*)buf + aligned_bytes, num_bytes - aligned_bytes,
+                     chunk_fn, user_data);
+}
+
+BubIOResult bub_read_from_partition_async(BubOps* ops,
+                                          const char* partition_name,
+                                          void* buf,
+                                          int64_t offset_from_partition,
+                                          size_t num_bytes,
+                                          BubIORequest* request) {
+  MyBubOps* bub = (MyBubOps*)ops;
+  UefiIORequest* req = (UefiIORequest*)request->impl;
+  const BubPartitionIndex* index = current_index(bub);
+  EFI_BLOCK_IO_MEDIA* media = bub->block_io->Media;
+  UINT64 disk_offset;
+  EFI_STATUS err;
+  BubIOResult result;
+
+  bub_memset(req, 0, sizeof(UefiIORequest));
+  if (index == NULL)
+    return BUB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
+
+  result = bub_disk_resolve_read(&bub->block_dev.parent, index,
+                                 partition_name, offset_from_partition,
+                                 num_bytes, &disk_offset, &num_bytes);
+  if (result != BUB_IO_RESULT_OK)
+    return result;
+  request->result = BUB_IO_RESULT_OK;
+  request->num_read = num_bytes;
+
+  // EFI_BLOCK_IO2 only reads whole blocks into aligned buffers; anything
+  // else is read before returning.
+  err = EFI_UNSUPPORTED;
+  if (bub->block_io2 != NULL && num_bytes > 0 &&
+      disk_offset % media->BlockSize == 0 &&
+      num_bytes % media->BlockSize == 0 &&
+      stream_buf_aligned(bub->block_io2->Media, buf)) {
+    err = uefi_call_wrapper(BS->CreateEvent, NUM_ARGS_CREATE_EVENT,
+                            0,
+                            0,
+                            NULL,
+                            NULL,
+                            &req->token.Event);
+  }
+  if (EFI_ERROR(err)) {
+    err = stream_read_sync(bub, disk_offset, (UINT8*)buf, num_bytes);
+    if (EFI_ERROR(err)) {
+      bub_warning("Could not read from disk.\n");
+      request->num_read = 0;
+      return BUB_IO_RESULT_ERROR_IO;
+    }
+    return BUB_IO_RESULT_OK;
   }
 
-  err = uefi_call_wrapper(bub->disk_io->WriteDisk, 5,
-                          bub->disk_io,
-                          bub->block_io->Media->MediaId,
-                          (partition_entry->first_lba *
-                            bub->block_io->Media->BlockSize) +
-                            offset_from_partition,
+  req->token.TransactionStatus = EFI_SUCCESS;
+  err = uefi_call_wrapper(bub->block_io2->ReadBlocksEx,
+                          NUM_ARGS_READ_BLOCKS_EX,
+                          bub->block_io2,
+                          bub->block_io2->Media->MediaId,
+                          disk_offset / media->BlockSize,
+                          &req->token,
                           num_bytes,
                           buf);
-
   if (EFI_ERROR(err)) {
-    bub_warning("Could not write to Disk.\n");
-    bub_free(partition_entry);
+    bub_warning("Could not submit block I/O read.\n");
+    uefi_call_wrapper(BS->CloseEvent, NUM_ARGS_CLOSE_EVENT,
+                      req->token.Event);
+    request->num_read = 0;
     return BUB_IO_RESULT_ERROR_IO;
   }
-
-  bub_free(partition_entry);
+  req->in_flight = TRUE;
   return BUB_IO_RESULT_OK;
-}
\ No newline at end of file
+}
+
+int bub_poll_completion(BubOps* ops, BubIORequest* request, int wait) {
+  UefiIORequest* req = (UefiIORequest*)request->impl;
+  EFI_STATUS err;
+  UINTN event_index;
+
+  if (!req->in_flight)
+    return 1;
+
+  if (wait) {
+    err = uefi_call_wrapper(BS->WaitForEvent, NUM_ARGS_WAIT_FOR_EVENT,
+                            1,
+                            &req->token.Event,
+                            &event_index);
+  } else {
+    err = uefi_call_wrapper(BS->CheckEvent, NUM_ARGS_CHECK_EVENT,
+                            req->token.Event);
+    if (err == EFI_NOT_READY)
+      return 0;
+  }
+  if (!EFI_ERROR(err))
+    err = req->token.TransactionStatus;
+
+  uefi_call_wrapper(BS->CloseEvent, NUM_ARGS_CLOSE_EVENT, req->token.Event);
+  req->in_flight = FALSE;
+  if (EFI_ERROR(err)) {
+    bub_warning("Could not read from disk.\n");
+    request->result = BUB_IO_RESULT_ERROR_IO;
+    request->num_read = 0;
+  }
+  return 1;
+}
+
+int bub_get_unique_guid_for_partition(BubOps* ops,
+                                      const char* partition_name,
+                                      char* guid_buf,
+                                      size_t guid_buf_size) {
+  MyBubOps* bub = (MyBubOps*)ops;
+  const BubPartitionIndex* index = current_index(bub);
+
+  if (index == NULL)
+    return 0;
+
+  return bub_disk_get_unique_guid(index, partition_name, guid_buf,
+                                  guid_buf_size);
+}
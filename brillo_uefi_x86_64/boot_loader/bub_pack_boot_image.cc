@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Repacks a boot image written by mkbootimg with its kernel and ramdisk
+// compressed, for the boot loader to decompress while it reads them. See
+// BUB_BOOT_IMAGE_FLAG_COMPRESSED in bub_boot_image.h for the format.
+//
+// Usage: bub_pack_boot_image [--compression=C] [--kernel_compression=C]
+//                            [--ramdisk_compression=C] <in.img> <out.img>
+//
+// C is one of lz4 (the default), gzip or none. Already compressed input
+// images are decompressed first, so "none" turns a packed image back into a
+// plain one. The header is kept except for the sizes, and the SHA-256 of the
+// new kernel and ramdisk pages is recorded in the id field, as
+// bub_hash_boot_image.py does.
+//
+// Payloads that are compressed already, e.g. a bzImage kernel or a gzip'd
+// ramdisk, gain nothing from this; build them uncompressed instead.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "bub_boot_image.h"
+#include "bub_compress.h"
+#include "bub_decompress.h"
+#include "bub_sha256.h"
+
+namespace {
+
+bool read_file(const char* path, std::vector<uint8_t>* data) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  data->clear();
+  uint8_t buf[65536];
+  size_t num_read;
+  while ((num_read = fread(buf, 1, sizeof(buf), file)) > 0)
+    data->insert(data->end(), buf, buf + num_read);
+  bool ok = !ferror(file);
+  if (!ok)
+    perror(path);
+  fclose(file);
+  return ok;
+}
+
+bool write_file(const char* path, const std::vector<uint8_t>& data) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+  ok = fclose(file) == 0 && ok;
+  if (!ok)
+    perror(path);
+  return ok;
+}
+
+void append_padded(std::vector<uint8_t>* image,
+                   const std::vector<uint8_t>& data, uint32_t page_size) {
+  image->insert(image->end(), data.begin(), data.end());
+  image->resize((image->size() + page_size - 1) / page_size * page_size);
+}
+
+// Extracts a payload of |image| as it would be after the boot loader read
+// and decompressed it.
+bool get_payload(const std::vector<uint8_t>& image, uint64_t offset,
+                 uint64_t size, BubCompression compression,
+                 uint64_t decompressed_size, std::vector<uint8_t>* out) {
+  const uint8_t* data = image.data() + offset;
+  BubDecompressor d;
+
+  out->resize(decompressed_size);
+  bub_decompressor_init(&d, compression, data, size, out->data(),
+                        out->size());
+  return bub_decompressor_run(&d, size) == BUB_DECOMPRESS_RESULT_OK;
+}
+
+void usage() {
+  fprintf(stderr,
+          "Usage: bub_pack_boot_image [--compression=C] "
+          "[--kernel_compression=C]\n"
+          "                           [--ramdisk_compression=C] "
+          "<in.img> <out.img>\n"
+          "C is one of lz4, gzip or none.\n");
+}
+
+bool parse_compression(const char* arg, const char* flag,
+                       BubCompression* out) {
+  size_t len = strlen(flag);
+  if (strncmp(arg, flag, len) != 0 || arg[len] != '=')
+    return false;
+  if (!bub_compression_from_name(arg + len + 1, out)) {
+    fprintf(stderr, "Unknown compression '%s'.\n", arg + len + 1);
+    exit(1);
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  BubCompression kernel_compression = BUB_COMPRESSION_LZ4;
+  BubCompression ramdisk_compression = BUB_COMPRESSION_LZ4;
+  std::vector<const char*> paths;
+
+  for (int n = 1; n < argc; ++n) {
+    BubCompression both;
+    if (parse_compression(argv[n], "--compression", &both)) {
+      kernel_compression = ramdisk_compression = both;
+    } else if (parse_compression(argv[n], "--kernel_compression",
+                                 &kernel_compression) ||
+               parse_compression(argv[n], "--ramdisk_compression",
+                                 &ramdisk_compression)) {
+    } else if (argv[n][0] == '-') {
+      usage();
+      return 1;
+    } else {
+      paths.push_back(argv[n]);
+    }
+  }
+  if (paths.size() != 2) {
+    usage();
+    return 1;
+  }
+
+  std::vector<uint8_t> in;
+  if (!read_file(paths[0], &in))
+    return 1;
+  in.resize(std::max(in.size(), BUB_BOOT_IMAGE_HEADER_SIZE));
+
+  boot_img_hdr hdr;
+  BubBootImageLayout layout;
+  memcpy(&hdr, in.data(), sizeof(hdr));
+  if (bub_boot_image_get_layout(reinterpret_cast<boot_img_hdr*>(in.data()),
+                                in.size(), &layout) !=
+      BUB_BOOT_IMAGE_RESULT_OK) {
+    fprintf(stderr, "%s: not a valid boot image.\n", paths[0]);
+    return 1;
+  }
+
+  std::vector<uint8_t> kernel, ramdisk, second;
+  uint64_t load_offset = layout.kernel_offset;
+  if (!get_payload(in, load_offset, layout.kernel_size,
+                   layout.kernel_compression, layout.kernel_decompressed_size,
+                   &kernel) ||
+      !get_payload(in, load_offset + layout.ramdisk_offset,
+                   layout.ramdisk_size, layout.ramdisk_compression,
+                   layout.ramdisk_decompressed_size, &ramdisk)) {
+    fprintf(stderr, "%s: corrupt compressed payload.\n", paths[0]);
+    return 1;
+  }
+  uint64_t second_offset = load_offset + layout.load_size;
+  if (hdr.second_size > in.size() - second_offset) {
+    fprintf(stderr, "%s: truncated second stage.\n", paths[0]);
+    return 1;
+  }
+  second.assign(in.begin() + second_offset,
+                in.begin() + second_offset + hdr.second_size);
+
+  std::vector<uint8_t> packed_kernel, packed_ramdisk;
+  if (!bub_compress(kernel_compression, kernel, &packed_kernel) ||
+      !bub_compress(ramdisk_compression, ramdisk, &packed_ramdisk)) {
+    fprintf(stderr, "Compression failed.\n");
+    return 1;
+  }
+
+  if (hdr.page_size < sizeof(hdr)) {
+    fprintf(stderr, "Page size %u too small for a boot image header.\n",
+            hdr.page_size);
+    return 1;
+  }
+  bool compressed = kernel_compression != BUB_COMPRESSION_NONE ||
+                    ramdisk_compression != BUB_COMPRESSION_NONE;
+  if (compressed && hdr.page_size < BUB_BOOT_IMAGE_HEADER_SIZE) {
+    fprintf(stderr, "Page size %u too small for a compressed boot image.\n",
+            hdr.page_size);
+    return 1;
+  }
+
+  hdr.kernel_size = packed_kernel.size();
+  hdr.ramdisk_size = packed_ramdisk.size();
+  hdr.unused &= ~BUB_BOOT_IMAGE_FLAG_COMPRESSED;
+  std::vector<uint8_t> out(hdr.page_size);
+  if (compressed) {
+    const uint8_t ext_magic[] = BUB_BOOT_IMAGE_EXT_MAGIC;
+    BubBootImageExt ext;
+    memset(&ext, 0, sizeof(ext));
+    memcpy(ext.magic, ext_magic, sizeof(ext.magic));
+    ext.kernel_compression = kernel_compression;
+    ext.ramdisk_compression = ramdisk_compression;
+    ext.kernel_decompressed_size = kernel.size();
+    ext.ramdisk_decompressed_size = ramdisk.size();
+    hdr.unused |= BUB_BOOT_IMAGE_FLAG_COMPRESSED;
+    memcpy(out.data() + sizeof(hdr), &ext, sizeof(ext));
+  }
+  append_padded(&out, packed_kernel, hdr.page_size);
+  append_padded(&out, packed_ramdisk, hdr.page_size);
+
+  // The digest covers the final header page, so it is hashed last.
+  BubSha256Ctx ctx;
+  uint8_t digest[BUB_SHA256_DIGEST_SIZE];
+  memset(hdr.id, 0, sizeof(hdr.id));
+  memcpy(out.data(), &hdr, sizeof(hdr));
+  bub_sha256_init(&ctx);
+  bub_boot_image_hash_header(&ctx, out.data(), hdr.page_size);
+  bub_sha256_update(&ctx, out.data() + hdr.page_size,
+                    out.size() - hdr.page_size);
+  bub_sha256_final(&ctx, digest);
+  memcpy(hdr.id, digest, sizeof(digest));
+  memcpy(out.data(), &hdr, sizeof(hdr));
+
+  out.insert(out.end(), second.begin(), second.end());
+  if (!write_file(paths[1], out))
+    return 1;
+
+  printf("kernel:  %zu -> %zu bytes (%s)\n", kernel.size(),
+         packed_kernel.size(), bub_compression_name(kernel_compression));
+  printf("ramdisk: %zu -> %zu bytes (%s)\n", ramdisk.size(),
+         packed_ramdisk.size(), bub_compression_name(ramdisk_compression));
+  return 0;
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* SHA-256 as specified in FIPS 180-4. */
+
+#include "bub_sha256.h"
+#include "bub_cpu.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+static const uint32_t sha256_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror32(uint32_t x, unsigned int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t load_be32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void store_be32(uint8_t* p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+void bub_sha256_blocks_generic(uint32_t state[8], const uint8_t* data,
+                               size_t num_blocks) {
+  uint32_t w[64];
+  uint32_t a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  while (num_blocks--) {
+    for (i = 0; i < 16; ++i)
+      w[i] = load_be32(data + 4 * i);
+    for (i = 16; i < 64; ++i) {
+      uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^
+                    (w[i - 15] >> 3);
+      uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^
+                    (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+    for (i = 0; i < 64; ++i) {
+      t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) +
+           ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) +
+           ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+
+    data += BUB_SHA256_BLOCK_SIZE;
+  }
+}
+
+#if defined(__x86_64__)
+/* SHA extensions keep the state as ABEF/CDGH word pairs and do two rounds
+ * per SHA256RNDS2. Each iteration of the round loop below covers four
+ * rounds; SHA256MSG1/SHA256MSG2 extend the message schedule four words at a
+ * time, with msg[] holding the last sixteen words.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t* data,
+                                size_t num_blocks) {
+  const __m128i bswap_mask =
+    _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, abef_save, cdgh_save, tmp;
+  __m128i msg[4];
+  int i;
+
+  tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+  state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);            // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B);      // EFGH
+  state0 = _mm_alignr_epi8(tmp, state1, 8);      // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);   // CDGH
+
+  while (num_blocks--) {
+    abef_save = state0;
+    cdgh_save = state1;
+
+    for (i = 0; i < 16; ++i) {
+      if (i < 4) {
+        msg[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128((const __m128i*)(data + 16 * i)), bswap_mask);
+      } else {
+        tmp = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+        tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[(i + 3) & 3],
+                                                 msg[(i + 2) & 3], 4));
+        msg[i & 3] = _mm_sha256msg2_epu32(tmp, msg[(i + 3) & 3]);
+      }
+      tmp = _mm_add_epi32(msg[i & 3],
+                          _mm_loadu_si128((const __m128i*)&sha256_k[4 * i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, tmp);
+      tmp = _mm_shuffle_epi32(tmp, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, tmp);
+    }
+
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+    data += BUB_SHA256_BLOCK_SIZE;
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);         // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);      // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);   // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);      // HGFE
+  _mm_storeu_si128((__m128i*)&state[0], state0);
+  _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+#endif /* __x86_64__ */
+
+#if defined(__aarch64__)
+/* SHA256H/SHA256H2 do four rounds on the ABCD/EFGH halves of the state,
+ * SHA256SU0/SHA256SU1 extend the message schedule four words at a time.
+ */
+__attribute__((target("+crypto")))
+static void sha256_blocks_armv8(uint32_t state[8], const uint8_t* data,
+                                size_t num_blocks) {
+  uint32x4_t abcd, efgh, abcd_save, efgh_save, abcd_prev, tmp;
+  uint32x4_t msg[4];
+  int i;
+
+  abcd = vld1q_u32(&state[0]);
+  efgh = vld1q_u32(&state[4]);
+
+  while (num_blocks--) {
+    abcd_save = abcd;
+    efgh_save = efgh;
+
+    for (i = 0; i < 16; ++i) {
+      if (i < 4) {
+        msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+      } else {
+        msg[i & 3] = vsha256su1q_u32(
+          vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]),
+          msg[(i + 2) & 3], msg[(i + 3) & 3]);
+      }
+      tmp = vaddq_u32(msg[i & 3], vld1q_u32(&sha256_k[4 * i]));
+      abcd_prev = abcd;
+      abcd = vsha256hq_u32(abcd, efgh, tmp);
+      efgh = vsha256h2q_u32(efgh, abcd_prev, tmp);
+    }
+
+    abcd = vaddq_u32(abcd, abcd_save);
+    efgh = vaddq_u32(efgh, efgh_save);
+    data += BUB_SHA256_BLOCK_SIZE;
+  }
+
+  vst1q_u32(&state[0], abcd);
+  vst1q_u32(&state[4], efgh);
+}
+#endif /* __aarch64__ */
+
+BubSha256BlocksFn bub_sha256_hw(void) {
+#if defined(__x86_64__)
+  if (bub_cpu_has_feature(BUB_CPU_FEATURE_SHA_NI))
+    return sha256_blocks_shani;
+#elif defined(__aarch64__)
+  if (bub_cpu_has_feature(BUB_CPU_FEATURE_ARMV8_SHA2))
+    return sha256_blocks_armv8;
+#endif
+  return NULL;
+}
+
+const char* bub_sha256_hw_name(void) {
+#if defined(__x86_64__)
+  return "sha-ni";
+#elif defined(__aarch64__)
+  return "armv8-sha2";
+#else
+  return "none";
+#endif
+}
+
+static BubSha256BlocksFn sha256_impl;
+
+void bub_sha256_init(BubSha256Ctx* ctx) {
+  BubSha256BlocksFn impl = sha256_impl;
+
+  if (impl == NULL) {
+    impl = bub_sha256_hw();
+    if (impl == NULL)
+      impl = bub_sha256_blocks_generic;
+    sha256_impl = impl;
+  }
+  bub_sha256_init_with(ctx, impl);
+}
+
+void bub_sha256_init_with(BubSha256Ctx* ctx, BubSha256BlocksFn blocks) {
+  bub_memcpy(ctx->state, sha256_iv, sizeof(sha256_iv));
+  ctx->num_bytes = 0;
+  ctx->buf_len = 0;
+  ctx->blocks = blocks;
+}
+
+void bub_sha256_update(BubSha256Ctx* ctx, const void* data, size_t size) {
+  const uint8_t* p = (const uint8_t*)data;
+  size_t n;
+
+  ctx->num_bytes += size;
+
+  // Top up a partial block left over from the previous call.
+  if (ctx->buf_len > 0) {
+    n = BUB_SHA256_BLOCK_SIZE - ctx->buf_len;
+    if (n > size)
+      n = size;
+    bub_memcpy(ctx->buf + ctx->buf_len, p, n);
+    ctx->buf_len += n;
+    p += n;
+    size -= n;
+    if (ctx->buf_len < BUB_SHA256_BLOCK_SIZE)
+      return;
+    ctx->blocks(ctx->state, ctx->buf, 1);
+    ctx->buf_len = 0;
+  }
+
+  // Whole blocks are hashed in place.
+  n = size / BUB_SHA256_BLOCK_SIZE;
+  if (n > 0) {
+    ctx->blocks(ctx->state, p, n);
+    p += n * BUB_SHA256_BLOCK_SIZE;
+    size -= n * BUB_SHA256_BLOCK_SIZE;
+  }
+
+  if (size > 0) {
+    bub_memcpy(ctx->buf, p, size);
+    ctx->buf_len = size;
+  }
+}
+
+void bub_sha256_final(BubSha256Ctx* ctx,
+                      uint8_t digest[BUB_SHA256_DIGEST_SIZE]) {
+  uint64_t num_bits = ctx->num_bytes * 8;
+  int i;
+
+  // Pad with 0x80, zeros and the 64-bit big-endian message length.
+  ctx->buf[ctx->buf_len++] = 0x80;
+  if (ctx->buf_len > BUB_SHA256_BLOCK_SIZE - 8) {
+    bub_memset(ctx->buf + ctx->buf_len, 0,
+               BUB_SHA256_BLOCK_SIZE - ctx->buf_len);
+    ctx->blocks(ctx->state, ctx->buf, 1);
+    ctx->buf_len = 0;
+  }
+  bub_memset(ctx->buf + ctx->buf_len, 0,
+             BUB_SHA256_BLOCK_SIZE - 8 - ctx->buf_len);
+  store_be32(ctx->buf + BUB_SHA256_BLOCK_SIZE - 8, (uint32_t)(num_bits >> 32));
+  store_be32(ctx->buf + BUB_SHA256_BLOCK_SIZE - 4, (uint32_t)num_bits);
+  ctx->blocks(ctx->state, ctx->buf, 1);
+
+  for (i = 0; i < 8; ++i)
+    store_be32(digest + 4 * i, ctx->state[i]);
+}
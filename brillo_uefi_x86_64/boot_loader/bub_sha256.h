@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUB_SHA256_H_
+#define BUB_SHA256_H_
+
+#include "bub_sysdeps.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BUB_SHA256_DIGEST_SIZE 32
+#define BUB_SHA256_BLOCK_SIZE 64
+
+/* Compression function shared by the SHA-256 implementations below. Folds
+ * |num_blocks| consecutive 64-byte blocks at |data| into |state|.
+ */
+typedef void (*BubSha256BlocksFn)(uint32_t state[8], const uint8_t* data,
+                                  size_t num_blocks);
+
+/* Incremental SHA-256 state. Data may be fed in pieces of any size, so a
+ * digest can be computed while an image streams in from disk.
+ */
+typedef struct {
+  uint32_t state[8];
+  uint64_t num_bytes;
+  uint8_t buf[BUB_SHA256_BLOCK_SIZE];
+  size_t buf_len;
+  BubSha256BlocksFn blocks;
+} BubSha256Ctx;
+
+/* Initializes |ctx| using the fastest implementation available on the
+ * running CPU.
+ */
+void bub_sha256_init(BubSha256Ctx* ctx);
+
+/* Initializes |ctx| using the compression function |blocks|. */
+void bub_sha256_init_with(BubSha256Ctx* ctx, BubSha256BlocksFn blocks);
+
+/* Adds |size| bytes at |data| to the running digest in |ctx|. */
+void bub_sha256_update(BubSha256Ctx* ctx, const void* data, size_t size);
+
+/* Completes the digest in |ctx| and writes it to |digest|. |ctx| must be
+ * initialized again before it is reused.
+ */
+void bub_sha256_final(BubSha256Ctx* ctx,
+                      uint8_t digest[BUB_SHA256_DIGEST_SIZE]);
+
+/* Portable implementation. This is the reference the other implementations
+ * are checked against.
+ */
+void bub_sha256_blocks_generic(uint32_t state[8], const uint8_t* data,
+                               size_t num_blocks);
+
+/* Returns the hardware-accelerated implementation (SHA extensions on x86_64,
+ * SHA2 crypto extensions on ARMv8) if the running CPU supports it, otherwise
+ * NULL.
+ */
+BubSha256BlocksFn bub_sha256_hw(void);
+
+/* Returns a short name for the implementation bub_sha256_hw() selects from. */
+const char* bub_sha256_hw_name(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUB_SHA256_H_ */
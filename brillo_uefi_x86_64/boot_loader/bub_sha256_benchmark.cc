@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host benchmark for the libbub SHA-256 implementations. Reports throughput
+// in GB/s for buffer sizes from 64 B to 16 MiB, then how much verification
+// adds to loading a 32 MiB boot partition in 1 MiB chunks, the way the boot
+// loader streams it.
+//
+// Usage: bub_sha256_benchmark [--read_mbps=N] [boot-partition.img]
+//
+// Load time is measured by reading the given file, or a generated one, with
+// pread(). Files that are in the page cache read at memory speed, which makes
+// the overhead look worse than on a real disk; --read_mbps models a disk
+// reading N MB/s instead.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "bub_sha256.h"
+
+// Minimum number of bytes hashed per measurement, to keep timer resolution
+// and warm-up effects negligible for small buffers.
+#define MIN_BYTES_PER_RUN (256ULL * 1024 * 1024)
+
+// Boot partition size and read size of the load simulation. The chunk size
+// matches BUB_STREAM_CHUNK_SIZE in bub_boot_kernel.h.
+#define PARTITION_SIZE (32 * 1024 * 1024)
+#define CHUNK_SIZE (1024 * 1024)
+
+// Number of simulated loads; the median is reported.
+#define LOAD_RUNS 9
+
+struct Sha256Impl {
+  const char* name;
+  BubSha256BlocksFn fn;
+};
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void format_size(size_t size, char* buf, size_t buf_size) {
+  if (size >= 1024 * 1024)
+    snprintf(buf, buf_size, "%zu MiB", size >> 20);
+  else if (size >= 1024)
+    snprintf(buf, buf_size, "%zu KiB", size >> 10);
+  else
+    snprintf(buf, buf_size, "%zu B", size);
+}
+
+static double median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+// Per-chunk read and hash times of one simulated load, in seconds.
+struct LoadTimes {
+  std::vector<double> read;
+  std::vector<double> hash;
+};
+
+// Reads PARTITION_SIZE bytes of |fd| into |buf| in CHUNK_SIZE pieces,
+// hashing each piece right after it is read if |impl| is not NULL.
+static bool simulate_load(int fd, uint8_t* buf, const Sha256Impl* impl,
+                          double read_mbps, LoadTimes* times) {
+  BubSha256Ctx ctx;
+  uint8_t digest[BUB_SHA256_DIGEST_SIZE];
+
+  if (impl != NULL)
+    bub_sha256_init_with(&ctx, impl->fn);
+  for (size_t offset = 0; offset < PARTITION_SIZE; offset += CHUNK_SIZE) {
+    double start = now_seconds();
+    if (pread(fd, buf + offset, CHUNK_SIZE, offset) != CHUNK_SIZE) {
+      perror("pread");
+      return false;
+    }
+    double end = now_seconds();
+    times->read.push_back(read_mbps > 0 ? CHUNK_SIZE / (read_mbps * 1e6)
+                                        : end - start);
+    if (impl != NULL) {
+      start = now_seconds();
+      bub_sha256_update(&ctx, buf + offset, CHUNK_SIZE);
+      times->hash.push_back(now_seconds() - start);
+    }
+  }
+  if (impl != NULL)
+    bub_sha256_final(&ctx, digest);
+  return true;
+}
+
+// Returns the load time if chunk N is hashed while chunk N + 1 is read, as
+// the UEFI loader does with EFI_BLOCK_IO2.
+static double pipelined_time(const LoadTimes& times) {
+  double total = times.read[0];
+  for (size_t n = 1; n < times.read.size(); ++n)
+    total += std::max(times.read[n], times.hash[n - 1]);
+  return total + times.hash.back();
+}
+
+static double sum(const std::vector<double>& values) {
+  double total = 0;
+  for (double v : values)
+    total += v;
+  return total;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: bub_sha256_benchmark [--read_mbps=N] "
+          "[boot-partition.img]\n");
+}
+
+int main(int argc, char* argv[]) {
+  double read_mbps = 0;
+  const char* image_path = NULL;
+
+  for (int n = 1; n < argc; ++n) {
+    if (strncmp(argv[n], "--read_mbps=", 12) == 0) {
+      read_mbps = atof(argv[n] + 12);
+      if (read_mbps <= 0) {
+        usage();
+        return 1;
+      }
+    } else if (image_path == NULL) {
+      image_path = argv[n];
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  std::vector<Sha256Impl> impls;
+  impls.push_back({"generic", bub_sha256_blocks_generic});
+  if (bub_sha256_hw() != NULL)
+    impls.push_back({bub_sha256_hw_name(), bub_sha256_hw()});
+  else
+    fprintf(stderr, "No %s support on this CPU.\n", bub_sha256_hw_name());
+
+  std::vector<uint8_t> buf(PARTITION_SIZE);
+  for (size_t n = 0; n < buf.size(); ++n)
+    buf[n] = (uint8_t)(n * 131 + (n >> 11));
+
+  printf("%-10s", "size");
+  for (const Sha256Impl& impl : impls)
+    printf(" %12s", impl.name);
+  printf("    (GB/s)\n");
+
+  for (size_t size = 64; size <= 16 * 1024 * 1024; size *= 4) {
+    char size_str[16];
+    uint64_t iterations = (MIN_BYTES_PER_RUN + size - 1) / size;
+    if (iterations < 4)
+      iterations = 4;
+
+    format_size(size, size_str, sizeof(size_str));
+    printf("%-10s", size_str);
+    for (const Sha256Impl& impl : impls) {
+      BubSha256Ctx ctx;
+      uint8_t digest[BUB_SHA256_DIGEST_SIZE];
+      double start = now_seconds();
+      for (uint64_t i = 0; i < iterations; ++i) {
+        bub_sha256_init_with(&ctx, impl.fn);
+        bub_sha256_update(&ctx, buf.data(), size);
+        bub_sha256_final(&ctx, digest);
+      }
+      double elapsed = now_seconds() - start;
+      // Print the result so the loop cannot be optimized out.
+      if (digest[0] == 0x1 && digest[1] == 0x2)
+        fprintf(stderr, " ");
+      printf(" %12.2f", (double)size * iterations / elapsed / 1e9);
+    }
+    printf("\n");
+  }
+
+  std::string path;
+  if (image_path != NULL) {
+    path = image_path;
+  } else {
+    char tmp_path[] = "/tmp/bub_sha256_benchmark.XXXXXX";
+    int tmp_fd = mkstemp(tmp_path);
+    if (tmp_fd < 0 ||
+        write(tmp_fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+      perror("Could not write temporary partition image");
+      return 1;
+    }
+    close(tmp_fd);
+    path = tmp_path;
+  }
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    perror(path.c_str());
+    return 1;
+  }
+
+  printf("\n32 MiB boot partition in %d KiB chunks, %s, median of %d:\n",
+         CHUNK_SIZE / 1024,
+         read_mbps > 0 ? "modeled read speed" : "measured read speed",
+         LOAD_RUNS);
+  printf("%-12s %10s %10s %12s %12s\n", "", "load (ms)", "hash (ms)",
+         "serial", "pipelined");
+
+  int result = 0;
+  std::vector<double> plain_runs;
+  for (int run = 0; run < LOAD_RUNS; ++run) {
+    LoadTimes times;
+    if (!simulate_load(fd, buf.data(), NULL, read_mbps, &times)) {
+      result = 1;
+      break;
+    }
+    plain_runs.push_back(sum(times.read));
+  }
+  double plain = result == 0 ? median(plain_runs) : 0;
+  if (result == 0)
+    printf("%-12s %10.2f\n", "no verify", plain * 1e3);
+
+  for (const Sha256Impl& impl : impls) {
+    std::vector<double> hash_runs, serial_runs, pipelined_runs;
+    for (int run = 0; run < LOAD_RUNS && result == 0; ++run) {
+      LoadTimes times;
+      if (!simulate_load(fd, buf.data(), &impl, read_mbps, &times)) {
+        result = 1;
+        break;
+      }
+      hash_runs.push_back(sum(times.hash));
+      serial_runs.push_back(sum(times.read) + sum(times.hash));
+      pipelined_runs.push_back(pipelined_time(times));
+    }
+    if (result != 0)
+      break;
+    // Overheads are relative to the load without verification.
+    printf("%-12s %10.2f %10.2f %11.1f%% %11.1f%%\n", impl.name,
+           median(serial_runs) * 1e3, median(hash_runs) * 1e3,
+           (median(serial_runs) / plain - 1) * 100,
+           (median(pipelined_runs) / plain - 1) * 100);
+  }
+
+  close(fd);
+  if (image_path == NULL)
+    unlink(path.c_str());
+  return result;
+}
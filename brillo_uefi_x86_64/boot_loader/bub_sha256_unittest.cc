@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "bub_sha256.h"
+
+// Returns the lower-case hex digest of |size| bytes at |data| hashed with
+// |blocks| in a single update.
+static std::string sha256_hex(BubSha256BlocksFn blocks, const void* data,
+                              size_t size) {
+  BubSha256Ctx ctx;
+  uint8_t digest[BUB_SHA256_DIGEST_SIZE];
+  char hex[2 * BUB_SHA256_DIGEST_SIZE + 1];
+
+  bub_sha256_init_with(&ctx, blocks);
+  bub_sha256_update(&ctx, data, size);
+  bub_sha256_final(&ctx, digest);
+  for (size_t n = 0; n < sizeof(digest); ++n)
+    snprintf(hex + 2 * n, 3, "%02x", digest[n]);
+  return hex;
+}
+
+// Fills |buf| with a fixed pseudo-random byte pattern.
+static void fill_pattern(std::vector<uint8_t>* buf) {
+  uint32_t x = 0x12345678;
+  for (size_t n = 0; n < buf->size(); ++n) {
+    x = x * 1103515245 + 12345;
+    (*buf)[n] = (uint8_t)(x >> 16);
+  }
+}
+
+// FIPS 180-4 example vectors.
+static void check_known_values(BubSha256BlocksFn blocks) {
+  EXPECT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+            sha256_hex(blocks, "", 0));
+  EXPECT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+            sha256_hex(blocks, "abc", 3));
+  const char* two_blocks =
+      "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  EXPECT_EQ("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+            sha256_hex(blocks, two_blocks, strlen(two_blocks)));
+  std::vector<uint8_t> million_a(1000000, 'a');
+  EXPECT_EQ("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+            sha256_hex(blocks, million_a.data(), million_a.size()));
+}
+
+TEST(Sha256Test, GenericKnownValues) {
+  check_known_values(bub_sha256_blocks_generic);
+}
+
+TEST(Sha256Test, HardwareKnownValues) {
+  BubSha256BlocksFn hw = bub_sha256_hw();
+  if (hw == NULL) {
+    fprintf(stderr, "No %s support on this CPU, skipping.\n",
+            bub_sha256_hw_name());
+    return;
+  }
+  check_known_values(hw);
+}
+
+TEST(Sha256Test, HardwareMatchesGeneric) {
+  BubSha256BlocksFn hw = bub_sha256_hw();
+  if (hw == NULL) {
+    fprintf(stderr, "No %s support on this CPU, skipping.\n",
+            bub_sha256_hw_name());
+    return;
+  }
+
+  // Covers every padding case around one and two block boundaries, at every
+  // alignment within a 16-byte window.
+  std::vector<uint8_t> buf(300 + 16);
+  fill_pattern(&buf);
+  for (size_t align = 0; align < 16; ++align) {
+    for (size_t size = 0; size <= 300; ++size) {
+      const uint8_t* p = buf.data() + align;
+      ASSERT_EQ(sha256_hex(bub_sha256_blocks_generic, p, size),
+                sha256_hex(hw, p, size))
+          << "size " << size << " align " << align;
+    }
+  }
+}
+
+TEST(Sha256Test, ChunkedMatchesSingleShot) {
+  std::vector<uint8_t> buf(1 << 20);
+  fill_pattern(&buf);
+  std::string expected =
+      sha256_hex(bub_sha256_blocks_generic, buf.data(), buf.size());
+
+  // Split at uneven points so partial blocks are carried between updates.
+  BubSha256Ctx ctx;
+  uint8_t digest[BUB_SHA256_DIGEST_SIZE];
+  bub_sha256_init(&ctx);
+  size_t offset = 0;
+  for (size_t chunk = 1; offset < buf.size(); chunk = chunk * 3 + 1) {
+    size_t n = std::min(chunk, buf.size() - offset);
+    bub_sha256_update(&ctx, buf.data() + offset, n);
+    offset += n;
+  }
+  bub_sha256_final(&ctx, digest);
+
+  char hex[2 * BUB_SHA256_DIGEST_SIZE + 1];
+  for (size_t n = 0; n < sizeof(digest); ++n)
+    snprintf(hex + 2 * n, 3, "%02x", digest[n]);
+  EXPECT_EQ(expected, hex);
+}
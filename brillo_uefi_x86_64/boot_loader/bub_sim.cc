@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host simulation of the boot loader's slot selection and kernel load path on
+// a full disk image, e.g. the full-disk-image.img written by provision-device.
+// Runs the same GPT, A/B and boot image code as the UEFI application and
+// reports the disk I/O it takes.
+//
+// Usage: bub_sim [--write] [--verify] <full-disk-image.img>
+//
+// Without --write, A/B metadata updates are kept in memory and the image is
+// left untouched. --verify checks header page, kernel and ramdisk against the
+// digest in the boot image header, as the boot loader does when built with
+// BUB_VERIFY=1.
+// Compressed kernels and ramdisks are decompressed after the read.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "bub_ab_flow.h"
+#include "bub_boot_image.h"
+#include "bub_decompress.h"
+#include "bub_disk.h"
+#include "bub_sha256.h"
+#include "bub_sysdeps.h"
+
+namespace {
+
+// BubBlockDev over a memory-mapped disk image, counting the I/O it serves.
+struct SimBlockDev {
+  BubBlockDev parent;
+  uint8_t* data;
+  uint64_t size;
+  uint64_t num_reads;
+  uint64_t bytes_read;
+  uint64_t num_writes;
+  uint64_t bytes_written;
+};
+
+struct SimOps {
+  BubOps parent;
+  SimBlockDev* dev;
+  BubPartitionIndex index;
+};
+
+BubIOResult sim_read(BubBlockDev* dev, uint64_t offset, void* buf,
+                     size_t num_bytes) {
+  SimBlockDev* sim = reinterpret_cast<SimBlockDev*>(dev);
+  if (offset > sim->size || num_bytes > sim->size - offset)
+    return BUB_IO_RESULT_ERROR_IO;
+  memcpy(buf, sim->data + offset, num_bytes);
+  sim->num_reads++;
+  sim->bytes_read += num_bytes;
+  return BUB_IO_RESULT_OK;
+}
+
+BubIOResult sim_write(BubBlockDev* dev, uint64_t offset, const void* buf,
+                      size_t num_bytes) {
+  SimBlockDev* sim = reinterpret_cast<SimBlockDev*>(dev);
+  if (offset > sim->size || num_bytes > sim->size - offset)
+    return BUB_IO_RESULT_ERROR_IO;
+  memcpy(sim->data + offset, buf, num_bytes);
+  sim->num_writes++;
+  sim->bytes_written += num_bytes;
+  return BUB_IO_RESULT_OK;
+}
+
+BubIOResult sim_read_from_partition(BubOps* ops, const char* partition,
+                                    void* buf, int64_t offset,
+                                    size_t num_bytes, size_t* out_num_read) {
+  SimOps* sim = reinterpret_cast<SimOps*>(ops);
+  return bub_disk_read_from_partition(&sim->dev->parent, &sim->index,
+                                      partition, buf, offset, num_bytes,
+                                      out_num_read);
+}
+
+BubIOResult sim_write_to_partition(BubOps* ops, const char* partition,
+                                   const void* buf, int64_t offset,
+                                   size_t num_bytes) {
+  SimOps* sim = reinterpret_cast<SimOps*>(ops);
+  return bub_disk_write_to_partition(&sim->dev->parent, &sim->index,
+                                     partition, buf, offset, num_bytes);
+}
+
+int sim_get_unique_guid_for_partition(BubOps* ops, const char* partition,
+                                      char* guid_buf, size_t guid_buf_size) {
+  SimOps* sim = reinterpret_cast<SimOps*>(ops);
+  return bub_disk_get_unique_guid(&sim->index, partition, guid_buf,
+                                  guid_buf_size);
+}
+
+const char* compression_name(BubCompression compression) {
+  switch (compression) {
+    case BUB_COMPRESSION_NONE:
+      return "raw";
+    case BUB_COMPRESSION_LZ4:
+      return "lz4";
+    case BUB_COMPRESSION_GZIP:
+      return "gzip";
+  }
+  return "?";
+}
+
+// Decompresses the |size| byte payload at |in| into |out|.
+bool decompress(BubCompression compression, const uint8_t* in, uint64_t size,
+                std::vector<uint8_t>* out) {
+  BubDecompressor d;
+  bub_decompressor_init(&d, compression, in, size, out->data(), out->size());
+  return bub_decompressor_run(&d, size) == BUB_DECOMPRESS_RESULT_OK;
+}
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void usage() {
+  fprintf(stderr,
+          "Usage: bub_sim [--write] [--verify] <full-disk-image.img>\n");
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bool writable = false;
+  bool verify = false;
+  const char* image_path = NULL;
+
+  for (int n = 1; n < argc; ++n) {
+    if (strcmp(argv[n], "--write") == 0) {
+      writable = true;
+    } else if (strcmp(argv[n], "--verify") == 0) {
+      verify = true;
+    } else if (image_path == NULL) {
+      image_path = argv[n];
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (image_path == NULL) {
+    usage();
+    return 1;
+  }
+
+  int fd = open(image_path, writable ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    perror(image_path);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror(image_path);
+    return 1;
+  }
+
+  // A private mapping keeps metadata writes in memory unless --write is given.
+  void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                    writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  SimBlockDev dev;
+  memset(&dev, 0, sizeof(dev));
+  dev.parent.read = sim_read;
+  dev.parent.write = sim_write;
+  dev.parent.block_size = BUB_BLOCK_SIZE;
+  dev.parent.num_blocks = st.st_size / BUB_BLOCK_SIZE;
+  dev.data = static_cast<uint8_t*>(data);
+  dev.size = st.st_size;
+
+  SimOps ops;
+  memset(&ops, 0, sizeof(ops));
+  ops.parent.read_from_partition = sim_read_from_partition;
+  ops.parent.write_to_partition = sim_write_to_partition;
+  ops.parent.get_unique_guid_for_partition = sim_get_unique_guid_for_partition;
+  ops.dev = &dev;
+
+  double start = now_seconds();
+
+  if (bub_partition_index_build_from_disk(&ops.index, &dev.parent) !=
+      BUB_IO_RESULT_OK) {
+    fprintf(stderr, "Could not read GPT from %s.\n", image_path);
+    return 1;
+  }
+
+  // Mirrors the loop in efi_main().
+  char slot_suffix[BUB_SUFFIX_SIZE] = {0};
+  std::string boot_name;
+  BubBootImageLayout layout;
+  std::vector<uint8_t> image, kernel, ramdisk;
+  double verify_seconds = 0;
+  double decompress_seconds = 0;
+  int result = 0;
+  BubAbSession ab_session;
+  if (bub_ab_session_load(&ab_session, &ops.parent) !=
+      BUB_AB_FLOW_RESULT_OK) {
+    bub_ab_session_flush(&ab_session);
+    fprintf(stderr, "Could not read A/B metadata.\n");
+    result = 1;
+  }
+  while (result == 0) {
+    if (bub_ab_session_select(&ab_session, slot_suffix, BUB_SUFFIX_SIZE) !=
+        BUB_AB_FLOW_RESULT_OK) {
+      fprintf(stderr, "Could not choose A/B slot.\n");
+      result = 1;
+      break;
+    }
+    boot_name = std::string("boot") + slot_suffix;
+
+    std::vector<uint8_t> header(BUB_BOOT_IMAGE_HEADER_SIZE);
+    const boot_img_hdr* hdr =
+        reinterpret_cast<const boot_img_hdr*>(header.data());
+    size_t num_read;
+    const BubPartitionIndexEntry* entry;
+    if (sim_read_from_partition(&ops.parent, boot_name.c_str(), header.data(),
+                                0, header.size(),
+                                &num_read) != BUB_IO_RESULT_OK ||
+        num_read != header.size() ||
+        !bub_partition_index_find(&ops.index, boot_name.c_str(), &entry)) {
+      fprintf(stderr, "Could not read boot image header.\n");
+      result = 1;
+      break;
+    }
+
+    bool slot_invalid =
+        bub_boot_image_get_layout(hdr,
+                                  bub_partition_size(entry, BUB_BLOCK_SIZE),
+                                  &layout) != BUB_BOOT_IMAGE_RESULT_OK;
+    if (!slot_invalid) {
+      image.resize(layout.load_size);
+      if (sim_read_from_partition(&ops.parent, boot_name.c_str(),
+                                  image.data(), layout.kernel_offset,
+                                  layout.load_size,
+                                  &num_read) != BUB_IO_RESULT_OK ||
+          num_read != layout.load_size) {
+        fprintf(stderr, "Could not read kernel image.\n");
+        result = 1;
+        break;
+      }
+    }
+    if (!slot_invalid && verify) {
+      BubSha256Ctx ctx;
+      uint8_t digest[BUB_SHA256_DIGEST_SIZE];
+      double verify_start = now_seconds();
+      std::vector<uint8_t> page(hdr->page_size);
+      bub_sha256_init(&ctx);
+      slot_invalid =
+          sim_read_from_partition(&ops.parent, boot_name.c_str(),
+                                  page.data(), 0, page.size(),
+                                  &num_read) != BUB_IO_RESULT_OK ||
+          num_read != page.size() ||
+          !bub_boot_image_hash_header(&ctx, page.data(), page.size());
+      if (!slot_invalid) {
+        bub_sha256_update(&ctx, image.data(), image.size());
+        bub_sha256_final(&ctx, digest);
+        slot_invalid = !bub_boot_image_verify_digest(hdr, digest);
+      }
+      verify_seconds += now_seconds() - verify_start;
+    }
+    if (!slot_invalid && (layout.kernel_compression != BUB_COMPRESSION_NONE ||
+                          layout.ramdisk_compression != BUB_COMPRESSION_NONE)) {
+      double decompress_start = now_seconds();
+      kernel.resize(layout.kernel_decompressed_size);
+      ramdisk.resize(layout.ramdisk_decompressed_size);
+      slot_invalid =
+          !decompress(layout.kernel_compression, image.data(),
+                      layout.kernel_size, &kernel) ||
+          !decompress(layout.ramdisk_compression,
+                      image.data() + layout.ramdisk_offset,
+                      layout.ramdisk_size, &ramdisk);
+      decompress_seconds += now_seconds() - decompress_start;
+    }
+
+    if (slot_invalid) {
+      fprintf(stderr, "Slot %s has an invalid boot image, marking invalid.\n",
+              slot_suffix);
+      if (!bub_ab_session_mark_as_invalid(&ab_session, slot_suffix)) {
+        fprintf(stderr, "Could not mark slot invalid.\n");
+        result = 1;
+        break;
+      }
+      continue;
+    }
+    break;
+  }
+  // Where bub_boot_kernel() would start the kernel, or a fatal error.
+  if (!bub_ab_session_flush(&ab_session)) {
+    fprintf(stderr, "Could not write A/B metadata.\n");
+    result = 1;
+  }
+
+  double elapsed = now_seconds() - start;
+
+  if (result == 0) {
+    printf("slot:          %s\n", slot_suffix);
+    printf("kernel:        %llu bytes (%s, %llu stored)\n",
+           (unsigned long long)layout.kernel_decompressed_size,
+           compression_name(layout.kernel_compression),
+           (unsigned long long)layout.kernel_size);
+    printf("ramdisk:       %llu bytes (%s, %llu stored)\n",
+           (unsigned long long)layout.ramdisk_decompressed_size,
+           compression_name(layout.ramdisk_compression),
+           (unsigned long long)layout.ramdisk_size);
+  }
+  printf("reads:         %llu (%llu bytes)\n",
+         (unsigned long long)dev.num_reads,
+         (unsigned long long)dev.bytes_read);
+  printf("writes:        %llu (%llu bytes)%s\n",
+         (unsigned long long)dev.num_writes,
+         (unsigned long long)dev.bytes_written,
+         writable ? "" : ", discarded");
+  if (verify)
+    printf("verify time:   %.3f ms\n", verify_seconds * 1e3);
+  if (decompress_seconds > 0)
+    printf("inflate time:  %.3f ms\n", decompress_seconds * 1e3);
+  printf("wall time:     %.3f ms\n", elapsed * 1e3);
+
+  munmap(data, st.st_size);
+  close(fd);
+  return result;
+}
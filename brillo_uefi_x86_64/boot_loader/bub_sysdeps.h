@@ -45,6 +45,22 @@ extern "C" {
   __attribute__((format(printf, format_idx, arg_idx)))
 #define BUB_ATTR_NO_RETURN __attribute__((noreturn))
 
+/* Log levels for BUB_LOG_LEVEL. Messages of a level above BUB_LOG_LEVEL are
+ * compiled out. The default is BUB_LOG_LEVEL_DEBUG if BUB_ENABLE_DEBUG is
+ * defined, and BUB_LOG_LEVEL_WARNING otherwise.
+ */
+#define BUB_LOG_LEVEL_ERROR 1
+#define BUB_LOG_LEVEL_WARNING 2
+#define BUB_LOG_LEVEL_DEBUG 3
+
+#ifndef BUB_LOG_LEVEL
+#ifdef BUB_ENABLE_DEBUG
+#define BUB_LOG_LEVEL BUB_LOG_LEVEL_DEBUG
+#else
+#define BUB_LOG_LEVEL BUB_LOG_LEVEL_WARNING
+#endif
+#endif
+
 #define WIDEN2(x) L ## x
 #define WIDEN(x) WIDEN2(x)
 #define WFILE WIDEN(__FILE__)
@@ -112,10 +128,10 @@ void* bub_memset(void* dest, const int c, size_t n);
 int bub_safe_memcmp(const void* s1, const void* s2,
                     size_t n) BUB_ATTR_WARN_UNUSED_RESULT;
 
-#ifdef BUB_ENABLE_DEBUG
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_DEBUG
 /* printf()-style function, used for diagnostics.
  *
- * This has no effect unless BUB_ENABLE_DEBUG is defined.
+ * This has no effect unless BUB_LOG_LEVEL is BUB_LOG_LEVEL_DEBUG.
  */
 #define bub_debug(format)        \
   do {                           \
@@ -123,29 +139,42 @@ int bub_safe_memcmp(const void* s1, const void* s2,
   } while (0)
 #else
 #define bub_debug(format)
-#endif /* BUB_ENABLE_DEBUG */
+#endif
 
 /* Prints out a message (defined by |format|, printf()-style).
  */
 void bub_print(const char* format);
 
-/* Prints out a message (defined by |format|, printf()-style). This is
- * typically used if a runtime-error occurs.
+/* Appends |message| to the in-memory log, see bub_log.h. It is also printed
+ * if BUB_LOG_LEVEL is BUB_LOG_LEVEL_DEBUG.
  */
-#define bub_warning(format)        \
-  do {                             \
-    bub_print("WARNING: " format); \
-  } while (0)
+void bub_log(const char* message);
 
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_WARNING
+/* Logs a message (defined by |format|, printf()-style). This is
+ * typically used if a runtime-error occurs. Warnings go to the in-memory log
+ * rather than the console, which is slow on most firmware.
+ */
+#define bub_warning(format)      \
+  do {                           \
+    bub_log("WARNING: " format); \
+  } while (0)
+#else
+#define bub_warning(format)
+#endif
 
 /* Prints out a message (defined by |format|, printf()-style) and
- * calls bub_abort().
+ * calls bub_abort(). The message is left out below BUB_LOG_LEVEL_ERROR.
  */
+#if BUB_LOG_LEVEL >= BUB_LOG_LEVEL_ERROR
 #define bub_error(format)        \
   do {                           \
     bub_print("ERROR: " format); \
     bub_abort();                 \
   } while (0)
+#else
+#define bub_error(format) bub_abort()
+#endif
 
 /* Aborts the program or reboots the device. */
 void bub_abort(void) BUB_ATTR_NO_RETURN;
@@ -164,6 +193,12 @@ void* bub_malloc_(size_t size) BUB_ATTR_WARN_UNUSED_RESULT;
 /* Frees memory previously allocated with bub_malloc(). */
 void bub_free(void* ptr);
 
+/* Returns a monotonically increasing timestamp in platform-specific ticks
+ * (the time stamp counter on x86). Only the difference between two values
+ * taken on the same boot is meaningful.
+ */
+uint64_t bub_get_ticks(void);
+
 /* Returns the lenght of |str|, excluding the terminating NUL-byte. */
 size_t bub_strlen(const char* str) BUB_ATTR_WARN_UNUSED_RESULT;
 
@@ -21,7 +21,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "bub_log.h"
 #include "bub_sysdeps.h"
 
 int bub_memcmp(const void* src1, const void* src2, size_t n) {
@@ -60,6 +62,14 @@ void bub_abort(void) { abort(); }
 
 void bub_print(const char* format) { fprintf(stderr, format); }
 
+void bub_log_flush(void) {}
+
 void* bub_malloc_(size_t size) { return malloc(size); }
 
-void bub_free(void* ptr) { free(ptr); }
\ No newline at end of file
+void bub_free(void* ptr) { free(ptr); }
+
+uint64_t bub_get_ticks(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
\ No newline at end of file
@@ -16,7 +16,22 @@
 
 #include <efi.h>
 #include <efilib.h>
+#include "bub_arena.h"
+#include "bub_log.h"
 #include "bub_sysdeps.h"
+#include "bub_util.h"
+
+#define NUM_ARGS_SET_VARIABLE 5
+
+/* Vendor GUID and name of the volatile variable bub_log_flush() writes. The
+ * OS finds it in efivarfs as BubLog-4f3b60d1-8a2e-4c71-b9f3-2e5d7a01c6e4.
+ */
+#define BUB_LOG_VENDOR_GUID \
+  {0x4f3b60d1, 0x8a2e, 0x4c71, {0xb9, 0xf3, 0x2e, 0x5d, 0x7a, 0x01, 0xc6, 0xe4}}
+static CHAR16 log_variable[] = L"BubLog";
+
+/* Messages up to this many bytes are converted without an allocation. */
+#define PRINT_BUF_SIZE 256
 
 int bub_memcmp(const void* src1, const void* src2, size_t n) {
   return (int)CompareMem(src1, src2, (UINTN)n);
@@ -51,17 +66,44 @@ int bub_safe_memcmp(const void* s1, const void* s2, size_t n) {
 }
 
 void bub_print(const char* format) {
+   static uint16_t print_buf[PRINT_BUF_SIZE];
    size_t utf8_bytes = bub_strlen(format) + 1;
    size_t max_ucs2_bytes = utf8_bytes * 2;
-   uint16_t* format_ucs2 = (uint16_t*)bub_calloc(max_ucs2_bytes);
-   if (format_ucs2 == NULL)
-     return;
-   if (!utf8_to_ucs2(format, utf8_bytes, format_ucs2, max_ucs2_bytes))
+   uint16_t* format_ucs2 = print_buf;
+
+   if (max_ucs2_bytes > sizeof(print_buf)) {
+     format_ucs2 = (uint16_t*)bub_calloc(max_ucs2_bytes);
+     if (format_ucs2 == NULL)
+       return;
+   }
+   if (!utf8_to_ucs2((const uint8_t*)format, utf8_bytes, format_ucs2,
+                     max_ucs2_bytes))
      Print(format_ucs2);
-   bub_free(format_ucs2);
+   if (format_ucs2 != print_buf)
+     bub_free(format_ucs2);
+}
+
+void bub_log_flush(void) {
+  static char log_buf[BUB_LOG_SIZE];
+  EFI_GUID vendor_guid = BUB_LOG_VENDOR_GUID;
+  size_t log_bytes = bub_log_read(log_buf, sizeof(log_buf));
+
+  if (log_bytes == 0)
+    return;
+
+  // Runtime access without non-volatile storage: the log is readable from
+  // the OS until the next reset and costs no flash writes.
+  uefi_call_wrapper(RT->SetVariable, NUM_ARGS_SET_VARIABLE,
+                    log_variable,
+                    &vendor_guid,
+                    EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                    EFI_VARIABLE_RUNTIME_ACCESS,
+                    log_bytes,
+                    log_buf);
 }
 
 void bub_abort(void) {
+  bub_log_flush();
   bub_print("\nABORTING...\n");
   uefi_call_wrapper(BS->Stall, 1, 5 * 1000 * 1000);
   uefi_call_wrapper(BS->Exit, 4,
@@ -71,10 +113,20 @@ void bub_abort(void) {
                     NULL);
 }
 
+/* Allocations come from the default arena while it has room, and from the
+ * firmware pool otherwise, e.g. before bub_init() has set up the arena.
+ */
 void* bub_malloc_(size_t size) {
   EFI_STATUS err;
+  BubArena* arena = bub_arena_get_default();
   void *x;
 
+  if (arena != NULL) {
+    x = bub_arena_alloc(arena, size);
+    if (x != NULL)
+      return x;
+  }
+
   err = uefi_call_wrapper(BS->AllocatePool, 3,
                           EfiBootServicesData,
                           (UINTN)size,
@@ -89,6 +141,13 @@ void* bub_malloc_(size_t size) {
 
 void bub_free(void* ptr) {
   EFI_STATUS err;
+  BubArena* arena = bub_arena_get_default();
+
+  if (arena != NULL && bub_arena_owns(arena, ptr)) {
+    bub_arena_free(arena, ptr);
+    return;
+  }
+
   err = uefi_call_wrapper(BS->FreePool, 1, ptr);
 
   if (EFI_ERROR(err)) {
@@ -99,4 +158,16 @@ void bub_free(void* ptr) {
 
 size_t bub_strlen(const char* str) {
   return strlena(str);
+}
+
+uint64_t bub_get_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  return 0;
+#endif
 }
\ No newline at end of file
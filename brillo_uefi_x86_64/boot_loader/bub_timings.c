@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bub_timings.h"
+
+/* Longest slot suffix recorded, excluding the NUL. */
+#define SLOT_MAX_LEN 7
+
+/* Stage names as they appear on the command line. Keep in sync with
+ * BubTimingStage and bub_timings_report.py.
+ */
+static const char* const stage_names[BUB_STAGE_NUM] = {
+  "start",
+  "disk",
+  "init",
+  "ab",
+  "header",
+  "kernel",
+  "load",
+  "exec",
+};
+
+static uint64_t stage_ticks[BUB_STAGE_NUM];
+static char slot[SLOT_MAX_LEN + 1];
+static int kernel_placement_known;
+static int kernel_in_place;
+
+void bub_timing_mark(BubTimingStage stage) {
+  bub_assert(stage < BUB_STAGE_NUM);
+  stage_ticks[stage] = bub_get_ticks();
+}
+
+void bub_timing_set_slot(const char* slot_suffix) {
+  size_t n;
+
+  for (n = 0; n < SLOT_MAX_LEN && slot_suffix[n] != '\0'; ++n)
+    slot[n] = slot_suffix[n];
+  slot[n] = '\0';
+}
+
+void bub_timing_set_kernel_in_place(int in_place) {
+  kernel_placement_known = 1;
+  kernel_in_place = in_place != 0;
+}
+
+void bub_timings_reset(void) {
+  bub_memset(stage_ticks, 0, sizeof(stage_ticks));
+  bub_memset(slot, 0, sizeof(slot));
+  kernel_placement_known = 0;
+  kernel_in_place = 0;
+}
+
+/* Appends |str| to |buf| at |*pos|. */
+static void append_str(char* buf, size_t* pos, const char* str) {
+  while (*str != '\0')
+    buf[(*pos)++] = *str++;
+}
+
+/* Appends |value| in decimal to |buf| at |*pos|. */
+static void append_u64(char* buf, size_t* pos, uint64_t value) {
+  char digits[20];
+  size_t n = 0;
+
+  do {
+    digits[n++] = '0' + (value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  while (n > 0)
+    buf[(*pos)++] = digits[--n];
+}
+
+size_t bub_timings_format(char* buf, size_t buf_size) {
+  size_t pos = 0;
+  size_t n;
+
+  bub_assert(buf_size >= BUB_TIMINGS_MAX_LEN);
+
+  // Worst case: 12 + 7 + 8 * (1 + 6 + 1 + 20) + 10 + 1 = 254 bytes.
+  append_str(buf, &pos, BUB_TIMINGS_PARAM);
+  append_str(buf, &pos, slot);
+  for (n = 0; n < BUB_STAGE_NUM; ++n) {
+    if (stage_ticks[n] == 0)
+      continue;
+    buf[pos++] = ',';
+    append_str(buf, &pos, stage_names[n]);
+    buf[pos++] = ':';
+    append_u64(buf, &pos, stage_ticks[n]);
+  }
+  if (kernel_placement_known) {
+    append_str(buf, &pos, ",inplace:");
+    append_u64(buf, &pos, kernel_in_place);
+  }
+  buf[pos] = '\0';
+
+  return pos;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUB_TIMINGS_H_
+#define BUB_TIMINGS_H_
+
+#include "bub_sysdeps.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Boot stage markers. Each marker is stamped when the stage completes, except
+ * BUB_STAGE_START which is stamped on entry to the boot loader and
+ * BUB_STAGE_START_IMAGE which is stamped right before control is handed to the
+ * kernel.
+ */
+typedef enum {
+  BUB_STAGE_START,
+  BUB_STAGE_DISK_IO,
+  BUB_STAGE_INIT,
+  BUB_STAGE_AB_FLOW,
+  BUB_STAGE_HEADER_READ,
+  BUB_STAGE_KERNEL_READ,
+  BUB_STAGE_LOAD_IMAGE,
+  BUB_STAGE_START_IMAGE,
+  BUB_STAGE_NUM
+} BubTimingStage;
+
+/* Kernel command line parameter carrying the markers. */
+#define BUB_TIMINGS_PARAM "bub.timings="
+
+/* Upper bound of the string bub_timings_format() produces, including the
+ * terminating NUL.
+ */
+#define BUB_TIMINGS_MAX_LEN 256
+
+/* Records the current tick count for |stage|. Stamping a stage again, e.g.
+ * when falling back to the other slot, overwrites the earlier value.
+ */
+void bub_timing_mark(BubTimingStage stage);
+
+/* Records the slot suffix, e.g. "_a", the markers belong to. */
+void bub_timing_set_slot(const char* slot_suffix);
+
+/* Records whether the kernel was loaded where its EFI stub can run it
+ * without relocating it first, see bub_boot_image_kernel_runs_in_place().
+ */
+void bub_timing_set_kernel_in_place(int in_place);
+
+/* Clears all markers, the slot and the kernel placement. */
+void bub_timings_reset(void);
+
+/* Formats the recorded markers as a kernel command line parameter of the form
+ *
+ *   bub.timings=<slot>,<stage>:<ticks>,<stage>:<ticks>,...[,inplace:<0|1>]
+ *
+ * where <ticks> is the absolute tick count from bub_get_ticks() in decimal.
+ * Stages that were not reached are omitted, as is inplace if
+ * bub_timing_set_kernel_in_place() was not called. |buf| must hold at least
+ * BUB_TIMINGS_MAX_LEN bytes.
+ *
+ * @return: length of the string written to |buf|, excluding the NUL.
+ */
+size_t bub_timings_format(char* buf, size_t buf_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUB_TIMINGS_H_ */
@@ -0,0 +1,193 @@
+#!/usr/bin/python
+
+# Copyright 2016, The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+"""Reports boot loader stage timings published in bub.timings=.
+
+Each input file holds the kernel command line (/proc/cmdline) or the kernel
+log of one boot. The boot loader stamps every stage with the TSC; the report
+shows how long each stage took, per boot and aggregated per slot, and how
+often the kernel was loaded where its EFI stub could run it without
+relocating it.
+"""
+
+from __future__ import print_function
+
+import argparse
+import re
+import sys
+
+# Stage order as published by the boot loader, see bub_timings.c.
+STAGES = ['start', 'disk', 'init', 'ab', 'header', 'kernel', 'load', 'exec']
+
+TIMINGS_RE = re.compile(r'bub\.timings=(\S*)')
+TSC_MHZ_RE = re.compile(r'tsc: (?:Refined TSC clocksource calibration:|'
+                        r'Detected) ([0-9.]+) MHz')
+
+
+class Boot(object):
+  """Stage markers of a single boot."""
+
+  def __init__(self, name, slot, ticks, tsc_mhz=None, in_place=None):
+    self.name = name
+    self.slot = slot
+    self.ticks = ticks
+    self.tsc_mhz = tsc_mhz
+    # True or False if the boot loader recorded the kernel placement.
+    self.in_place = in_place
+
+  def durations(self):
+    """Returns {stage: ticks spent in the stage}.
+
+    The 'start' stage is the time from reset to the boot loader entry, every
+    other stage runs from the previous recorded marker to its own.
+    """
+    result = {}
+    previous = 0
+    for stage in STAGES:
+      if stage not in self.ticks:
+        continue
+      result[stage] = self.ticks[stage] - previous
+      previous = self.ticks[stage]
+    return result
+
+
+def parse_timings(value):
+  """Parses the value of bub.timings= into (slot, {stage: ticks}, in_place).
+
+  in_place is None if the value does not record the kernel placement.
+  """
+  fields = value.split(',')
+  slot = fields[0]
+  ticks = {}
+  in_place = None
+  for field in fields[1:]:
+    stage, sep, count = field.partition(':')
+    if sep and stage == 'inplace' and count in ('0', '1'):
+      in_place = count == '1'
+      continue
+    if not sep or stage not in STAGES:
+      raise ValueError('Bad stage marker "%s"' % field)
+    ticks[stage] = int(count)
+  return slot, ticks, in_place
+
+
+def parse_boot(name, text):
+  """Returns the Boot described by |text|, or None if it has no markers."""
+  matches = TIMINGS_RE.findall(text)
+  if not matches:
+    return None
+  slot, ticks, in_place = parse_timings(matches[-1])
+  tsc = TSC_MHZ_RE.findall(text)
+  return Boot(name, slot, ticks, float(tsc[-1]) if tsc else None, in_place)
+
+
+def to_ms(ticks, tsc_mhz):
+  return ticks / (tsc_mhz * 1000.0)
+
+
+def median(values):
+  values = sorted(values)
+  mid = len(values) // 2
+  if len(values) % 2:
+    return values[mid]
+  return (values[mid - 1] + values[mid]) / 2.0
+
+
+def format_row(label, values, unit_fn):
+  cells = []
+  for stage in STAGES + ['total']:
+    cells.append('%10s' % ('-' if values.get(stage) is None
+                           else '%.2f' % unit_fn(values[stage])))
+  return '%-24s %s' % (label, ' '.join(cells))
+
+
+def report(boots, tsc_mhz, out):
+  """Writes per-boot and per-slot stage durations to |out|.
+
+  Durations are in milliseconds when the TSC frequency is known, from
+  |tsc_mhz| or the kernel log of the boot, and in millions of ticks otherwise.
+  """
+  header = '%-24s %s' % ('boot', ' '.join('%10s' % s
+                                          for s in STAGES + ['total']))
+  per_slot = {}
+
+  print('Per boot (ms, or Mticks if TSC frequency unknown):', file=out)
+  print(header, file=out)
+  for boot in boots:
+    mhz = tsc_mhz or boot.tsc_mhz
+    if mhz:
+      unit_fn = lambda t, mhz=mhz: to_ms(t, mhz)
+    else:
+      unit_fn = lambda t: t / 1e6
+    durations = boot.durations()
+    if 'exec' in boot.ticks:
+      durations['total'] = boot.ticks['exec']
+    print(format_row('%s (%s)' % (boot.name, boot.slot), durations, unit_fn),
+          file=out)
+    per_slot.setdefault(boot.slot, []).append(
+        dict((k, unit_fn(v)) for k, v in durations.items()))
+
+  print('', file=out)
+  print('Per slot median:', file=out)
+  print(header, file=out)
+  for slot in sorted(per_slot):
+    rows = per_slot[slot]
+    medians = {}
+    for stage in STAGES + ['total']:
+      values = [row[stage] for row in rows if stage in row]
+      if values:
+        medians[stage] = median(values)
+    print(format_row('%s (%d boots)' % (slot, len(rows)), medians,
+                     lambda v: v), file=out)
+
+  placements = {}
+  for boot in boots:
+    if boot.in_place is not None:
+      placements.setdefault(boot.slot, []).append(boot.in_place)
+  if placements:
+    print('', file=out)
+    print('Kernel run in place (no EFI stub relocation):', file=out)
+    for slot in sorted(placements):
+      print('%-24s %d of %d boots' % (slot, sum(placements[slot]),
+                                      len(placements[slot])), file=out)
+
+
+def main(argv):
+  parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+  parser.add_argument('--tsc_mhz', type=float,
+                      help='TSC frequency, overrides the kernel log value')
+  parser.add_argument('inputs', nargs='+',
+                      help='Files with /proc/cmdline or dmesg of one boot')
+  args = parser.parse_args(argv[1:])
+
+  boots = []
+  for path in args.inputs:
+    with open(path) as f:
+      boot = parse_boot(path, f.read())
+    if boot is None:
+      print('%s: no bub.timings= found, skipping.' % path, file=sys.stderr)
+      continue
+    boots.append(boot)
+
+  if not boots:
+    return 1
+  report(boots, args.tsc_mhz, sys.stdout)
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv))
@@ -0,0 +1,110 @@
+#!/usr/bin/python
+
+# Copyright 2016, The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+"""Unit-test for bub_timings_report."""
+
+import unittest
+
+try:
+  from StringIO import StringIO
+except ImportError:
+  from io import StringIO
+
+import bub_timings_report
+
+CMDLINE = ('console=ttyS0 bub.timings=_b,start:1000,disk:1500,init:2000,'
+           'ab:2600,header:2700,kernel:5700,load:6700,exec:7000 quiet\n')
+
+
+class ParseTest(unittest.TestCase):
+  """Unit tests for parsing the command line parameter."""
+
+  def testParseCmdline(self):
+    boot = bub_timings_report.parse_boot('boot0', CMDLINE)
+    self.assertEqual(boot.slot, '_b')
+    self.assertEqual(boot.ticks['kernel'], 5700)
+    self.assertEqual(boot.tsc_mhz, None)
+
+  def testDurations(self):
+    boot = bub_timings_report.parse_boot('boot0', CMDLINE)
+    durations = boot.durations()
+    self.assertEqual(durations['start'], 1000)
+    self.assertEqual(durations['kernel'], 3000)
+    self.assertEqual(durations['exec'], 300)
+
+  def testMissingStage(self):
+    boot = bub_timings_report.parse_boot(
+        'boot0', 'bub.timings=_a,start:10,ab:40')
+    self.assertEqual(boot.durations(), {'start': 10, 'ab': 30})
+
+  def testTscFromKernelLog(self):
+    text = ('[    0.000000] Command line: ' + CMDLINE +
+            '[    0.000000] tsc: Detected 2400.000 MHz processor\n')
+    boot = bub_timings_report.parse_boot('boot0', text)
+    self.assertEqual(boot.tsc_mhz, 2400.0)
+
+  def testNoTimings(self):
+    self.assertEqual(bub_timings_report.parse_boot('x', 'console=ttyS0'), None)
+
+  def testInPlace(self):
+    boot = bub_timings_report.parse_boot(
+        'boot0', 'bub.timings=_a,start:10,load:40,inplace:1')
+    self.assertEqual(boot.in_place, True)
+    self.assertEqual(boot.durations(), {'start': 10, 'load': 30})
+    boot = bub_timings_report.parse_boot('boot0', CMDLINE)
+    self.assertEqual(boot.in_place, None)
+
+  def testBadMarker(self):
+    with self.assertRaises(ValueError):
+      bub_timings_report.parse_timings('_a,bogus:12')
+
+
+class ReportTest(unittest.TestCase):
+  """Unit tests for the aggregated report."""
+
+  def testPerSlotMedian(self):
+    boots = [
+        bub_timings_report.parse_boot('b0',
+                                      'bub.timings=_a,start:1000,exec:3000'),
+        bub_timings_report.parse_boot('b1',
+                                      'bub.timings=_a,start:1000,exec:5000'),
+        bub_timings_report.parse_boot('b2',
+                                      'bub.timings=_b,start:1000,exec:2000'),
+    ]
+    out = StringIO()
+    bub_timings_report.report(boots, 1.0, out)
+    lines = out.getvalue().splitlines()
+    slot_a = [l for l in lines if l.startswith('_a (2 boots)')][0]
+    # 'exec' medians 3000 ticks at 1 MHz, 'total' medians 4000 ticks.
+    self.assertEqual(slot_a.split()[-2:], ['3.00', '4.00'])
+
+  def testInPlaceCount(self):
+    boots = [
+        bub_timings_report.parse_boot('b0',
+                                      'bub.timings=_a,exec:3000,inplace:1'),
+        bub_timings_report.parse_boot('b1',
+                                      'bub.timings=_a,exec:5000,inplace:0'),
+        bub_timings_report.parse_boot('b2', 'bub.timings=_b,exec:2000'),
+    ]
+    out = StringIO()
+    bub_timings_report.report(boots, 1.0, out)
+    lines = out.getvalue().splitlines()
+    self.assertEqual(lines[-1].split(), ['_a', '1', 'of', '2', 'boots'])
+
+
+if __name__ == '__main__':
+  unittest.main()
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "bub_timings.h"
+
+// Returns the tick value of |stage| in |timings|, or 0 if absent.
+static uint64_t stage_value(const std::string& timings, const char* stage) {
+  std::string key = std::string(",") + stage + ":";
+  size_t pos = timings.find(key);
+  if (pos == std::string::npos)
+    return 0;
+  return strtoull(timings.c_str() + pos + key.size(), NULL, 10);
+}
+
+TEST(TimingsTest, Empty) {
+  char buf[BUB_TIMINGS_MAX_LEN];
+  bub_timings_reset();
+  EXPECT_EQ(strlen(BUB_TIMINGS_PARAM), bub_timings_format(buf, sizeof(buf)));
+  EXPECT_STREQ(BUB_TIMINGS_PARAM, buf);
+}
+
+TEST(TimingsTest, SlotAndStages) {
+  char buf[BUB_TIMINGS_MAX_LEN];
+  bub_timings_reset();
+  bub_timing_set_slot("_b");
+  bub_timing_mark(BUB_STAGE_START);
+  bub_timing_mark(BUB_STAGE_AB_FLOW);
+  bub_timing_mark(BUB_STAGE_START_IMAGE);
+  size_t len = bub_timings_format(buf, sizeof(buf));
+  std::string timings(buf);
+
+  EXPECT_EQ(timings.size(), len);
+  EXPECT_EQ(0U, timings.find("bub.timings=_b,start:"));
+  EXPECT_EQ(std::string::npos, timings.find("kernel"));
+  EXPECT_NE(0U, stage_value(timings, "start"));
+  EXPECT_LE(stage_value(timings, "start"), stage_value(timings, "ab"));
+  EXPECT_LE(stage_value(timings, "ab"), stage_value(timings, "exec"));
+}
+
+TEST(TimingsTest, RemarkOverwrites) {
+  char buf[BUB_TIMINGS_MAX_LEN];
+  bub_timings_reset();
+  bub_timing_set_slot("_a");
+  bub_timing_mark(BUB_STAGE_AB_FLOW);
+  bub_timings_format(buf, sizeof(buf));
+  uint64_t first = stage_value(buf, "ab");
+
+  bub_timing_set_slot("_b");
+  bub_timing_mark(BUB_STAGE_AB_FLOW);
+  bub_timings_format(buf, sizeof(buf));
+  std::string timings(buf);
+  EXPECT_EQ(0U, timings.find("bub.timings=_b,ab:"));
+  EXPECT_EQ(timings.find(",ab:"), timings.rfind(",ab:"));
+  EXPECT_LE(first, stage_value(timings, "ab"));
+}
+
+TEST(TimingsTest, FitsMaxLength) {
+  char buf[BUB_TIMINGS_MAX_LEN];
+  bub_timings_reset();
+  bub_timing_set_slot("_slotnamethatistoolong");
+  for (int n = 0; n < BUB_STAGE_NUM; ++n)
+    bub_timing_mark((BubTimingStage)n);
+  bub_timing_set_kernel_in_place(1);
+  size_t len = bub_timings_format(buf, sizeof(buf));
+  EXPECT_LT(len, (size_t)BUB_TIMINGS_MAX_LEN);
+  EXPECT_EQ(0U, std::string(buf).find("bub.timings=_slotna,"));
+}
+
+TEST(TimingsTest, KernelInPlace) {
+  char buf[BUB_TIMINGS_MAX_LEN];
+  bub_timings_reset();
+  bub_timing_set_slot("_a");
+  bub_timing_mark(BUB_STAGE_LOAD_IMAGE);
+  bub_timings_format(buf, sizeof(buf));
+  EXPECT_EQ(std::string::npos, std::string(buf).find("inplace"));
+
+  bub_timing_set_kernel_in_place(0);
+  bub_timings_format(buf, sizeof(buf));
+  std::string timings(buf);
+  EXPECT_EQ(timings.size() - strlen(",inplace:0"), timings.find(",inplace:0"));
+
+  bub_timing_set_kernel_in_place(7);
+  bub_timings_format(buf, sizeof(buf));
+  EXPECT_NE(std::string::npos, std::string(buf).find(",inplace:1"));
+
+  bub_timings_reset();
+  bub_timings_format(buf, sizeof(buf));
+  EXPECT_STREQ(BUB_TIMINGS_PARAM, buf);
+}
@@ -49,9 +49,31 @@ uint32_t bub_be32toh(uint32_t in);
 /* Converts a 64-bit unsigned integer from big-endian to host byte order. */
 uint64_t bub_be64toh(uint64_t in);
 
-/* Calculates and returns crc32 value of |data| given byte size, |data_size|. */
+/* Signature shared by the crc32 implementations below. */
+typedef uint32_t (*BubCrc32Fn)(uint32_t crc_in, const void *buf, size_t size);
+
+/* Calculates and returns crc32 value of |data| given byte size, |data_size|.
+ * Uses the fastest implementation available on the running CPU.
+ */
 uint32_t bub_crc32(uint32_t crc_in, const void *buf, int size);
 
+/* Byte-at-a-time table implementation. This is the reference the other
+ * implementations are checked against.
+ */
+uint32_t bub_crc32_reference(uint32_t crc_in, const void *buf, size_t size);
+
+/* Portable slicing-by-8 implementation. */
+uint32_t bub_crc32_slice8(uint32_t crc_in, const void *buf, size_t size);
+
+/* Returns the hardware-accelerated implementation (PCLMULQDQ folding on
+ * x86_64, CRC32 instructions on ARMv8) if the running CPU supports it,
+ * otherwise NULL.
+ */
+BubCrc32Fn bub_crc32_hw(void);
+
+/* Returns a short name for the implementation bub_crc32_hw() selects from. */
+const char *bub_crc32_hw_name(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "disk_manifest.h"
+#include <base/json/json_reader.h>
+#include <base/values.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "../boot_loader/bub_sha256.h"
+#include "make_disk_image.h"
+
+using namespace base;
+using namespace std;
+
+FilePath disk_manifest_path(const FilePath& output) {
+  return FilePath(output.value() + ".manifest");
+}
+
+/* Numbers are stored as strings, as JSON readers go through double and
+ * sizes and nanosecond times do not fit in 53 bits.
+ */
+static int get_uint64(const DictionaryValue* dict, const string& key,
+                      uint64_t* value) {
+  string str;
+  char* end;
+
+  if (!dict->GetString(key, &str) || str.empty() || str[0] == '-')
+    return 0;
+  errno = 0;
+  *value = strtoull(str.c_str(), &end, 10);
+  return *end == '\0' && errno == 0;
+}
+
+static int get_int64(const DictionaryValue* dict, const string& key,
+                     int64_t* value) {
+  string str;
+  char* end;
+
+  if (!dict->GetString(key, &str) || str.empty())
+    return 0;
+  errno = 0;
+  *value = strtoll(str.c_str(), &end, 10);
+  return *end == '\0' && errno == 0;
+}
+
+int read_disk_manifest(const FilePath& path, DiskManifest* manifest) {
+  string json;
+  const DictionaryValue* dict;
+  const ListValue* partitions;
+
+  if (!ReadFileToString(path, &json))
+    return 0;
+  unique_ptr<Value> root = JSONReader::Read(json);
+  if (!root || !root->GetAsDictionary(&dict) ||
+      !get_uint64(dict, "disk_size", &manifest->disk_size) ||
+      !get_uint64(dict, "output_size", &manifest->output_size) ||
+      !get_int64(dict, "output_mtime_ns", &manifest->output_mtime_ns) ||
+      !dict->GetList("partitions", &partitions))
+    return 0;
+
+  manifest->partitions.clear();
+  for (size_t n = 0; n < partitions->GetSize(); ++n) {
+    const DictionaryValue* p;
+    PartitionRecord record;
+
+    if (!partitions->GetDictionary(n, &p) ||
+        !p->GetString("label", &record.label) ||
+        !get_uint64(p, "offset", &record.offset) ||
+        !get_uint64(p, "size", &record.size) ||
+        !p->GetString("image", &record.image) ||
+        !get_uint64(p, "image_size", &record.image_size) ||
+        !get_int64(p, "image_mtime_ns", &record.image_mtime_ns) ||
+        !p->GetString("image_sha256", &record.image_sha256))
+      return 0;
+    manifest->partitions.push_back(record);
+  }
+  return 1;
+}
+
+/* Quotes |str| as a JSON string. */
+static string quote(const string& str) {
+  string out = "\"";
+
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((uint8_t)c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      out += escape;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+int write_disk_manifest(const FilePath& path, const DiskManifest& manifest) {
+  string json = "{\n  \"disk_size\": " +
+                quote(to_string(manifest.disk_size)) +
+                ",\n  \"output_size\": " +
+                quote(to_string(manifest.output_size)) +
+                ",\n  \"output_mtime_ns\": " +
+                quote(to_string(manifest.output_mtime_ns)) +
+                ",\n  \"partitions\": [";
+
+  for (size_t n = 0; n < manifest.partitions.size(); ++n) {
+    const PartitionRecord& record = manifest.partitions[n];
+    json += string(n > 0 ? "," : "") + "\n    {\"label\": " +
+            quote(record.label) + ", \"offset\": " +
+            quote(to_string(record.offset)) + ", \"size\": " +
+            quote(to_string(record.size)) + ",\n     \"image\": " +
+            quote(record.image) + ", \"image_size\": " +
+            quote(to_string(record.image_size)) +
+            ", \"image_mtime_ns\": " +
+            quote(to_string(record.image_mtime_ns)) +
+            ",\n     \"image_sha256\": " + quote(record.image_sha256) + "}";
+  }
+  json += "\n  ]\n}\n";
+
+  if (WriteFile(path, json.data(), json.size()) != (int)json.size()) {
+    cerr << "ERROR: Cannot write " << path.value() << "\n";
+    return 0;
+  }
+  return 1;
+}
+
+int stat_file(const FilePath& path, uint64_t* size, int64_t* mtime_ns) {
+  struct stat st;
+
+  if (stat(path.value().c_str(), &st) != 0)
+    return 0;
+  *size = st.st_size;
+  *mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  return 1;
+}
+
+int hash_file(const FilePath& path, string* sha256) {
+  vector<uint8_t> buf(COPY_BUFFER_SIZE);
+  uint8_t digest[BUB_SHA256_DIGEST_SIZE];
+  BubSha256Ctx ctx;
+  ssize_t num_read;
+
+  int fd = open(path.value().c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "ERROR: Cannot open " << path.value() << "\n";
+    return 0;
+  }
+  bub_sha256_init(&ctx);
+  while ((num_read = read(fd, buf.data(), buf.size())) != 0) {
+    if (num_read < 0) {
+      if (errno == EINTR)
+        continue;
+      cerr << "ERROR: Cannot read " << path.value() << "\n";
+      close(fd);
+      return 0;
+    }
+    bub_sha256_update(&ctx, buf.data(), num_read);
+  }
+  close(fd);
+  bub_sha256_final(&ctx, digest);
+
+  sha256->clear();
+  for (uint8_t byte : digest) {
+    static const char hex[] = "0123456789abcdef";
+    *sha256 += hex[byte >> 4];
+    *sha256 += hex[byte & 15];
+  }
+  return 1;
+}
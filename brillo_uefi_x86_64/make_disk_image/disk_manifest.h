@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BUB_DISK_MANIFEST_H_
+#define BUB_DISK_MANIFEST_H_
+
+#include <stdint.h>
+#include <base/files/file_util.h>
+
+#include <string>
+#include <vector>
+
+/* What a disk image was built from, for one partition. */
+struct PartitionRecord {
+  std::string label;
+  uint64_t offset;
+  uint64_t size;
+  // Image written to the partition, or empty if it was left empty.
+  std::string image;
+  // Size, modification time and SHA-256 of |image| in hex.
+  uint64_t image_size;
+  int64_t image_mtime_ns;
+  std::string image_sha256;
+};
+
+/* Sidecar manifest that make_disk_image --incremental keeps next to a raw
+ * disk image. The size and modification time of the image itself tell
+ * whether anything else wrote to it since.
+ */
+struct DiskManifest {
+  uint64_t disk_size;
+  uint64_t output_size;
+  int64_t output_mtime_ns;
+  std::vector<PartitionRecord> partitions;
+};
+
+/* Returns the manifest path for the disk image |output|. */
+base::FilePath disk_manifest_path(const base::FilePath& output);
+
+/* Reads and writes the JSON manifest at |path|. Reading fails quietly, as
+ * a missing or damaged manifest only means a full rebuild.
+ */
+int read_disk_manifest(const base::FilePath& path, DiskManifest* manifest);
+int write_disk_manifest(const base::FilePath& path,
+                        const DiskManifest& manifest);
+
+/* Stats |path| into |size| and |mtime_ns|. */
+int stat_file(const base::FilePath& path, uint64_t* size, int64_t* mtime_ns);
+
+/* Hashes the contents of |path| into |sha256| as lowercase hex. */
+int hash_file(const base::FilePath& path, std::string* sha256);
+
+#endif /* BUB_DISK_MANIFEST_H_ */
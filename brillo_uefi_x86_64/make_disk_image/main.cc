@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "make_disk_image.h"
+
+#include <iostream>
+
+using namespace std;
+
+static void print_usage(void) {
+  cerr << "Usage:\n"
+          "  make_disk_image\n"
+          "    --input=/PATH/TO/PARTITION_TABLE.bpt\n"
+          "    --output=/PATH/TO/DISK_IMAGE\n"
+          "    [--image=LABEL:/PATH/TO/IMAGE ...]\n"
+          "    [--allow_empty_partitions]\n"
+          "    [--jobs=N]\n"
+          "    [--no_clone]\n"
+          "    [--sparse | --incremental]\n\n";
+}
+
+int main(int argc, const char *argv[]) {
+  DiskImageArgs args;
+  DiskImageStats stats;
+
+  if (!parse_disk_image_args(argc, argv, &args)) {
+    print_usage();
+    return 1;
+  }
+
+  if (!make_disk_image(args, &stats))
+    return 1;
+
+  cout << args.output.value() << ": " << stats.logical_size << " bytes, "
+       << stats.bytes_written << " written, " << stats.bytes_cloned
+       << " cloned, " << stats.bytes_allocated << " allocated, "
+       << stats.bytes_reused << " reused\n";
+  return 0;
+}
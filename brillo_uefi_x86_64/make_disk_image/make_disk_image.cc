@@ -0,0 +1,1191 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "make_disk_image.h"
+#include <base/json/json_reader.h>
+#include <base/values.h>
+#include "base/strings/string_number_conversions.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "../boot_loader/bub_util.h"
+#include "disk_manifest.h"
+#include "sparse_image.h"
+
+using namespace base;
+using namespace std;
+
+/* A run of a partition image that is not known to be zero. */
+struct ImageExtent {
+  // Offset in the expanded image and length, in bytes.
+  uint64_t offset;
+  uint64_t length;
+  // Offset of the data in the image file, or -1 if the run is |fill|
+  // repeated.
+  int64_t file_offset;
+  uint32_t fill;
+};
+
+/* A partition image opened for reading. */
+struct InputImage {
+  int fd;
+  // Size of the expanded image.
+  uint64_t size;
+  vector<ImageExtent> extents;
+};
+
+/* Partitions written from the same image. The first one is written from
+ * the image, the others are copied from the first.
+ */
+struct ImageJob {
+  FilePath image;
+  vector<const DiskPartition*> partitions;
+};
+
+/* Part of the disk image in sparse mode, either |data| or an extent of
+ * |image|, at |offset| of the disk.
+ */
+struct DiskPiece {
+  uint64_t offset;
+  const vector<uint8_t>* data;
+  const InputImage* image;
+  const ImageExtent* extent;
+};
+
+int pread_full(int fd, void* buf, size_t size, uint64_t offset) {
+  uint8_t* p = (uint8_t*)buf;
+
+  while (size > 0) {
+    ssize_t n = pread(fd, p, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  return 1;
+}
+
+int pwrite_full(int fd, const void* buf, size_t size, uint64_t offset) {
+  const uint8_t* p = (const uint8_t*)buf;
+
+  while (size > 0) {
+    ssize_t n = pwrite(fd, p, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  return 1;
+}
+
+int is_zero(const uint8_t* buf, size_t size) {
+  return size == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, size - 1) == 0);
+}
+
+/* Parses sizes the way bpttool writes them, e.g. "32 MiB" or "4096". */
+static int parse_size(const string& str, uint64_t* size) {
+  static const struct {
+    const char* suffix;
+    uint64_t multiplier;
+  } units[] = {
+    {"", 1},
+    {"B", 1},
+    {"KiB", 1ULL << 10},
+    {"MiB", 1ULL << 20},
+    {"GiB", 1ULL << 30},
+    {"TiB", 1ULL << 40},
+    {"KB", 1000ULL},
+    {"MB", 1000ULL * 1000},
+    {"GB", 1000ULL * 1000 * 1000},
+    {"TB", 1000ULL * 1000 * 1000 * 1000},
+  };
+  const char* end;
+  uint64_t value = 0;
+
+  for (end = str.c_str(); *end >= '0' && *end <= '9'; ++end) {
+    if (value > (UINT64_MAX - 9) / 10)
+      return 0;
+    value = value * 10 + (*end - '0');
+  }
+  if (end == str.c_str())
+    return 0;
+  while (*end == ' ')
+    ++end;
+
+  for (const auto& unit : units) {
+    if (strcmp(end, unit.suffix) == 0) {
+      if (value > UINT64_MAX / unit.multiplier)
+        return 0;
+      *size = value * unit.multiplier;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Reads |key| of |dict|, a number of bytes or a size string. */
+static int get_size(const DictionaryValue* dict, const string& key,
+                    uint64_t* size) {
+  double number;
+  string str;
+
+  if (dict->GetDouble(key, &number)) {
+    // Integers above 2^53 do not survive the trip through double.
+    if (number < 0 || number > 9007199254740992.0 ||
+        number != (double)(uint64_t)number)
+      return 0;
+    *size = (uint64_t)number;
+    return 1;
+  }
+  return dict->GetString(key, &str) && parse_size(str, size);
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+int parse_guid(const string& str, uint8_t* guid) {
+  // Position of each printed byte on disk, as in bub_disk_get_unique_guid().
+  static const uint8_t guid_byte_order[16] = {3, 2, 1, 0, 5, 4, 7, 6,
+                                              8, 9, 10, 11, 12, 13, 14, 15};
+  size_t pos = 0;
+
+  if (str.size() != BUB_GUID_STRING_SIZE - 1)
+    return 0;
+
+  for (int i = 0; i < 16; ++i) {
+    if (i == 4 || i == 6 || i == 8 || i == 10) {
+      if (str[pos++] != '-')
+        return 0;
+    }
+    int high = hex_value(str[pos++]);
+    int low = hex_value(str[pos++]);
+    if (high < 0 || low < 0)
+      return 0;
+    guid[guid_byte_order[i]] = (uint8_t)(high << 4 | low);
+  }
+  return 1;
+}
+
+static int parse_partition(const DictionaryValue* dict, size_t index,
+                           DiskPartition* part) {
+  string str;
+  double number;
+
+  if (!dict->GetString("label", &part->label) || part->label.empty() ||
+      part->label.size() > ENTRY_NAME_LEN) {
+    cerr << "ERROR: Partition " << index << " needs a label of 1 to "
+         << ENTRY_NAME_LEN << " characters.\n";
+    return 0;
+  }
+  for (char c : part->label) {
+    if ((uint8_t)c >= 0x80) {
+      cerr << "ERROR: Partition label " << part->label
+           << " is not ASCII.\n";
+      return 0;
+    }
+  }
+
+  if (!get_size(dict, "offset", &part->offset) ||
+      !get_size(dict, "size", &part->size)) {
+    cerr << "ERROR: Partition " << part->label
+         << " has no offset or size. Lay out the table with bpttool"
+            " make_table first.\n";
+    return 0;
+  }
+  if (part->offset % BUB_BLOCK_SIZE != 0 || part->size % BUB_BLOCK_SIZE != 0 ||
+      part->size == 0) {
+    cerr << "ERROR: Partition " << part->label
+         << " is not made of whole " << BUB_BLOCK_SIZE << " byte blocks.\n";
+    return 0;
+  }
+
+  if (!dict->GetString("guid", &str) || !parse_guid(str, part->guid) ||
+      !dict->GetString("type_guid", &str) ||
+      !parse_guid(str, part->type_guid)) {
+    cerr << "ERROR: Partition " << part->label
+         << " needs a guid and type_guid in GUID form.\n";
+    return 0;
+  }
+
+  part->flags = 0;
+  if (dict->GetString("flags", &str)) {
+    char* end;
+    errno = 0;
+    part->flags = strtoull(str.c_str(), &end, 0);
+    if (str.empty() || *end != '\0' || errno != 0) {
+      cerr << "ERROR: Bad flags for partition " << part->label << ".\n";
+      return 0;
+    }
+  } else if (dict->GetDouble("flags", &number)) {
+    part->flags = (uint64_t)number;
+  }
+  return 1;
+}
+
+int parse_partition_table(const string& json, DiskLayout* layout) {
+  unique_ptr<Value> root = JSONReader::Read(json);
+  const DictionaryValue* dict;
+  const DictionaryValue* settings;
+  const ListValue* partitions;
+  string str;
+
+  if (!root || !root->GetAsDictionary(&dict) ||
+      !dict->GetDictionary("settings", &settings) ||
+      !dict->GetList("partitions", &partitions)) {
+    cerr << "ERROR: Partition table needs \"settings\" and \"partitions\".\n";
+    return 0;
+  }
+
+  // The partitions must fit between the primary GPT and the backup GPT.
+  const uint64_t gpt_size =
+      (1 + DISK_GPT_ENTRIES_BLOCKS) * (uint64_t)BUB_BLOCK_SIZE;
+  const uint64_t first_usable = BUB_BLOCK_SIZE + gpt_size;
+  if (!get_size(settings, "disk_size", &layout->disk_size) ||
+      layout->disk_size % BUB_BLOCK_SIZE != 0 ||
+      layout->disk_size < first_usable + gpt_size) {
+    cerr << "ERROR: Bad disk_size in partition table.\n";
+    return 0;
+  }
+  const uint64_t end_usable = layout->disk_size - gpt_size;
+
+  if (!settings->GetString("disk_guid", &str) ||
+      !parse_guid(str, layout->disk_guid)) {
+    cerr << "ERROR: Partition table needs a disk_guid in GUID form.\n";
+    return 0;
+  }
+
+  layout->partitions.clear();
+  for (size_t n = 0; n < partitions->GetSize(); ++n) {
+    const DictionaryValue* p;
+    DiskPartition part;
+    bool ignore = false;
+
+    if (!partitions->GetDictionary(n, &p)) {
+      cerr << "ERROR: Partition " << n << " is not an object.\n";
+      return 0;
+    }
+    // bpttool leaves ignored partitions out of the GPT.
+    if (p->GetBoolean("ignore", &ignore) && ignore)
+      continue;
+    if (!parse_partition(p, n, &part))
+      return 0;
+    if (part.offset < first_usable || part.offset > end_usable ||
+        part.size > end_usable - part.offset) {
+      cerr << "ERROR: Partition " << part.label
+           << " does not fit between the GPTs.\n";
+      return 0;
+    }
+    layout->partitions.push_back(part);
+  }
+
+  if (layout->partitions.size() > DISK_GPT_NUM_ENTRIES) {
+    cerr << "ERROR: More than " << DISK_GPT_NUM_ENTRIES << " partitions.\n";
+    return 0;
+  }
+
+  vector<const DiskPartition*> sorted;
+  set<string> labels;
+  for (const DiskPartition& part : layout->partitions) {
+    sorted.push_back(&part);
+    if (!labels.insert(part.label).second) {
+      cerr << "ERROR: Duplicate partition label " << part.label << ".\n";
+      return 0;
+    }
+  }
+  sort(sorted.begin(), sorted.end(),
+       [](const DiskPartition* a, const DiskPartition* b) {
+         return a->offset < b->offset;
+       });
+  for (size_t n = 1; n < sorted.size(); ++n) {
+    if (sorted[n - 1]->offset + sorted[n - 1]->size > sorted[n]->offset) {
+      cerr << "ERROR: Partitions " << sorted[n - 1]->label << " and "
+           << sorted[n]->label << " overlap.\n";
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void write_protective_mbr(uint8_t* mbr, uint64_t num_blocks) {
+  uint8_t* entry = mbr + 446;
+  uint32_t first_lba = 1;
+  uint32_t num_lbas =
+      num_blocks - 1 > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)(num_blocks - 1);
+
+  // One partition of type 0xEE covering the disk, CHS 0/0/2 to the maximum.
+  entry[2] = 0x02;
+  entry[4] = 0xEE;
+  entry[5] = entry[6] = entry[7] = 0xFF;
+  bub_memcpy(entry + 8, &first_lba, sizeof(first_lba));
+  bub_memcpy(entry + 12, &num_lbas, sizeof(num_lbas));
+  mbr[510] = 0x55;
+  mbr[511] = 0xAA;
+}
+
+void build_gpt(const DiskLayout& layout, vector<uint8_t>* primary,
+               vector<uint8_t>* backup) {
+  const uint64_t num_blocks = layout.disk_size / BUB_BLOCK_SIZE;
+  const size_t entries_size = DISK_GPT_ENTRIES_BLOCKS * BUB_BLOCK_SIZE;
+  vector<uint8_t> entries(entries_size, 0);
+  GPTHeader header;
+
+  for (size_t n = 0; n < layout.partitions.size(); ++n) {
+    const DiskPartition& part = layout.partitions[n];
+    GPTEntry entry;
+
+    bub_memset(&entry, 0, sizeof(entry));
+    bub_memcpy(entry.type_GUID, part.type_guid, sizeof(entry.type_GUID));
+    bub_memcpy(entry.unique_GUID, part.guid, sizeof(entry.unique_GUID));
+    entry.first_lba = part.offset / BUB_BLOCK_SIZE;
+    entry.last_lba = (part.offset + part.size) / BUB_BLOCK_SIZE - 1;
+    entry.flags = part.flags;
+    for (size_t c = 0; c < part.label.size(); ++c)
+      entry.name[c] = (uint8_t)part.label[c];
+    bub_memcpy(&entries[n * sizeof(GPTEntry)], &entry, sizeof(entry));
+  }
+
+  bub_memset(&header, 0, sizeof(header));
+  bub_memcpy(header.signature, GPT_MAGIC, sizeof(header.signature));
+  header.revision = GPT_REVISION;
+  header.header_size = GPT_MIN_SIZE;
+  header.header_lba = 1;
+  header.alternate_header_lba = num_blocks - 1;
+  header.first_usable_lba = GPT_ENTRIES_LBA + DISK_GPT_ENTRIES_BLOCKS;
+  header.last_usable_lba = num_blocks - 2 - DISK_GPT_ENTRIES_BLOCKS;
+  bub_memcpy(header.disk_guid, layout.disk_guid, sizeof(header.disk_guid));
+  header.entry_lba = GPT_ENTRIES_LBA;
+  header.entry_count = DISK_GPT_NUM_ENTRIES;
+  header.entry_size = sizeof(GPTEntry);
+  header.entry_crc32 = bub_crc32(0, entries.data(), entries.size());
+  header.header_crc32 = bub_crc32(0, &header, header.header_size);
+
+  primary->assign(GPT_ENTRIES_LBA * BUB_BLOCK_SIZE + entries_size, 0);
+  write_protective_mbr(primary->data(), num_blocks);
+  bub_memcpy(primary->data() + BUB_BLOCK_SIZE, &header, BUB_BLOCK_SIZE);
+  bub_memcpy(primary->data() + GPT_ENTRIES_LBA * BUB_BLOCK_SIZE,
+             entries.data(), entries_size);
+
+  // The backup header swaps the header locations and points to the copy of
+  // the entries right in front of it.
+  header.header_lba = num_blocks - 1;
+  header.alternate_header_lba = 1;
+  header.entry_lba = num_blocks - 1 - DISK_GPT_ENTRIES_BLOCKS;
+  header.header_crc32 = 0;
+  header.header_crc32 = bub_crc32(0, &header, header.header_size);
+
+  backup->assign(entries_size + BUB_BLOCK_SIZE, 0);
+  bub_memcpy(backup->data(), entries.data(), entries_size);
+  bub_memcpy(backup->data() + entries_size, &header, BUB_BLOCK_SIZE);
+}
+
+static int open_sparse_image(int fd, const SparseHeader& header,
+                             InputImage* image) {
+  uint64_t pos = header.file_hdr_sz;
+  uint64_t offset = 0;
+
+  if (header.major_version != SPARSE_MAJOR_VERSION ||
+      header.file_hdr_sz < sizeof(SparseHeader) ||
+      header.chunk_hdr_sz < sizeof(SparseChunkHeader) ||
+      header.blk_sz == 0 || header.blk_sz % 4 != 0)
+    return 0;
+
+  for (uint32_t n = 0; n < header.total_chunks; ++n) {
+    SparseChunkHeader chunk;
+    uint32_t fill;
+
+    if (!pread_full(fd, &chunk, sizeof(chunk), pos))
+      return 0;
+    uint64_t length = (uint64_t)chunk.chunk_sz * header.blk_sz;
+
+    switch (chunk.chunk_type) {
+      case CHUNK_TYPE_RAW:
+        if (chunk.total_sz != header.chunk_hdr_sz + length)
+          return 0;
+        if (length > 0) {
+          image->extents.push_back(
+              {offset, length, (int64_t)(pos + header.chunk_hdr_sz), 0});
+        }
+        break;
+      case CHUNK_TYPE_FILL:
+        if (chunk.total_sz != header.chunk_hdr_sz + sizeof(fill) ||
+            !pread_full(fd, &fill, sizeof(fill), pos + header.chunk_hdr_sz))
+          return 0;
+        if (fill != 0 && length > 0)
+          image->extents.push_back({offset, length, -1, fill});
+        break;
+      case CHUNK_TYPE_DONT_CARE:
+      case CHUNK_TYPE_CRC32:
+        break;
+      default:
+        return 0;
+    }
+    pos += chunk.total_sz;
+    offset += length;
+  }
+
+  if (offset != (uint64_t)header.total_blks * header.blk_sz)
+    return 0;
+  image->size = offset;
+  return 1;
+}
+
+static void open_raw_image(int fd, uint64_t file_size, InputImage* image) {
+  uint64_t offset = 0;
+
+  image->size = file_size;
+  while (offset < file_size) {
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    off_t hole;
+
+    if (data < 0 && errno == ENXIO)
+      break;  // Only a hole is left.
+    if (data < 0) {
+      // No SEEK_DATA here, so all of the rest is data.
+      data = offset;
+      hole = file_size;
+    } else {
+      if ((uint64_t)data >= file_size)
+        break;
+      hole = lseek(fd, data, SEEK_HOLE);
+      if (hole < 0 || (uint64_t)hole > file_size)
+        hole = file_size;
+    }
+    image->extents.push_back(
+        {(uint64_t)data, (uint64_t)(hole - data), data, 0});
+    offset = hole;
+  }
+}
+
+/* Opens |path|, a raw or Android sparse image, and lists its extents. */
+static int open_image(const FilePath& path, InputImage* image) {
+  SparseHeader header;
+  struct stat st;
+
+  image->extents.clear();
+  image->fd = open(path.value().c_str(), O_RDONLY);
+  if (image->fd < 0 || fstat(image->fd, &st) != 0) {
+    cerr << "ERROR: Cannot open " << path.value() << "\n";
+    if (image->fd >= 0)
+      close(image->fd);
+    return 0;
+  }
+
+  if ((uint64_t)st.st_size >= sizeof(header) &&
+      pread_full(image->fd, &header, sizeof(header), 0) &&
+      header.magic == SPARSE_HEADER_MAGIC) {
+    if (!open_sparse_image(image->fd, header, image)) {
+      cerr << "ERROR: Bad sparse image " << path.value() << "\n";
+      close(image->fd);
+      return 0;
+    }
+    return 1;
+  }
+
+  open_raw_image(image->fd, st.st_size, image);
+  return 1;
+}
+
+int write_nonzero(int fd, uint64_t offset, const uint8_t* buf, size_t size,
+                  DiskImageStats* stats) {
+  size_t run_start = 0;
+  size_t pos = 0;
+
+  while (pos < size) {
+    size_t block = min((size_t)ZERO_BLOCK_SIZE, size - pos);
+    if (is_zero(buf + pos, block)) {
+      if (pos > run_start) {
+        if (!pwrite_full(fd, buf + run_start, pos - run_start,
+                         offset + run_start))
+          return 0;
+        stats->bytes_written += pos - run_start;
+      }
+      run_start = pos + block;
+    }
+    pos += block;
+  }
+  if (pos > run_start) {
+    if (!pwrite_full(fd, buf + run_start, pos - run_start, offset + run_start))
+      return 0;
+    stats->bytes_written += pos - run_start;
+  }
+  return 1;
+}
+
+static int write_fill(int fd, uint64_t offset, uint64_t length, uint32_t fill,
+                      uint8_t* buf, DiskImageStats* stats) {
+  size_t size = (size_t)min(length, (uint64_t)COPY_BUFFER_SIZE);
+
+  for (size_t n = 0; n + sizeof(fill) <= size; n += sizeof(fill))
+    bub_memcpy(buf + n, &fill, sizeof(fill));
+  for (uint64_t done = 0; done < length; done += size) {
+    size = (size_t)min(length - done, (uint64_t)COPY_BUFFER_SIZE);
+    if (!pwrite_full(fd, buf, size, offset + done))
+      return 0;
+  }
+  stats->bytes_written += length;
+  return 1;
+}
+
+/* Writes |image| to |offset| of |fd| through the COPY_BUFFER_SIZE bytes at
+ * |buf|.
+ */
+static int write_image(int fd, uint64_t offset, const InputImage& image,
+                       uint8_t* buf, DiskImageStats* stats) {
+  for (const ImageExtent& extent : image.extents) {
+    if (extent.file_offset < 0) {
+      if (!write_fill(fd, offset + extent.offset, extent.length, extent.fill,
+                      buf, stats))
+        return 0;
+      continue;
+    }
+    for (uint64_t done = 0; done < extent.length; ) {
+      size_t size = (size_t)min(extent.length - done,
+                                (uint64_t)COPY_BUFFER_SIZE);
+      if (!pread_full(image.fd, buf, size, extent.file_offset + done) ||
+          !write_nonzero(fd, offset + extent.offset + done, buf, size, stats))
+        return 0;
+      done += size;
+    }
+  }
+  return 1;
+}
+
+/* Copies |length| bytes from |src| to |dst| within |fd|, in the kernel if
+ * it can.
+ */
+static int copy_range(int fd, uint64_t src, uint64_t dst, uint64_t length,
+                      uint8_t* buf, DiskImageStats* stats) {
+#ifdef __NR_copy_file_range
+  while (length > 0) {
+    loff_t in = src;
+    loff_t out = dst;
+    ssize_t n = syscall(__NR_copy_file_range, fd, &in, fd, &out,
+                        (size_t)min(length, (uint64_t)1 << 30), 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;  // Not supported here, copy the rest through |buf|.
+    src += n;
+    dst += n;
+    length -= n;
+    stats->bytes_written += n;
+  }
+#endif
+  while (length > 0) {
+    size_t size = (size_t)min(length, (uint64_t)COPY_BUFFER_SIZE);
+    if (!pread_full(fd, buf, size, src) ||
+        !write_nonzero(fd, dst, buf, size, stats))
+      return 0;
+    src += size;
+    dst += size;
+    length -= size;
+  }
+  return 1;
+}
+
+/* Makes the |length| bytes at |dst| of |fd| a copy of those at |src|. The
+ * blocks are shared if the file system can, otherwise only the parts of
+ * |src| that are not holes are copied.
+ */
+static int copy_within(int fd, uint64_t src, uint64_t dst, uint64_t length,
+                       uint8_t* buf, DiskImageStats* stats) {
+#ifdef FICLONERANGE
+  struct file_clone_range range;
+  range.src_fd = fd;
+  range.src_offset = src;
+  range.src_length = length;
+  range.dest_offset = dst;
+  if (ioctl(fd, FICLONERANGE, &range) == 0) {
+    stats->bytes_cloned += length;
+    return 1;
+  }
+#endif
+
+  uint64_t offset = src;
+  const uint64_t end = src + length;
+  while (offset < end) {
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    off_t hole;
+
+    if (data < 0 && errno == ENXIO)
+      break;
+    if (data < 0) {
+      data = offset;
+      hole = end;
+    } else {
+      if ((uint64_t)data >= end)
+        break;
+      hole = lseek(fd, data, SEEK_HOLE);
+      if (hole < 0 || (uint64_t)hole > end)
+        hole = end;
+    }
+    if (!copy_range(fd, data, dst + (data - src), hole - data, buf, stats))
+      return 0;
+    offset = hole;
+  }
+  return 1;
+}
+
+static int image_fits(const ImageJob& job, const InputImage& image) {
+  for (const DiskPartition* part : job.partitions) {
+    if (image.size > part->size) {
+      cerr << "ERROR: " << job.image.value() << " does not fit in partition "
+           << part->label << "\n";
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int write_image_job(int fd, const ImageJob& job, bool clone,
+                           DiskImageStats* stats) {
+  const DiskPartition* first = job.partitions[0];
+  vector<uint8_t> buf(COPY_BUFFER_SIZE);
+  InputImage image;
+
+  if (!open_image(job.image, &image))
+    return 0;
+  int ret = image_fits(job, image);
+
+  // Past the end of the image the first copy is all holes, so copying a
+  // few more bytes keeps the length block-aligned for FICLONERANGE.
+  uint64_t copy_length = (image.size + ZERO_BLOCK_SIZE - 1) /
+                         ZERO_BLOCK_SIZE * ZERO_BLOCK_SIZE;
+  for (const DiskPartition* part : job.partitions)
+    copy_length = min(copy_length, part->size);
+
+  for (size_t n = 0; ret && n < job.partitions.size(); ++n) {
+    const DiskPartition* part = job.partitions[n];
+    int ok;
+
+    if (n > 0 && clone)
+      ok = copy_within(fd, first->offset, part->offset, copy_length,
+                       buf.data(), stats);
+    else
+      ok = write_image(fd, part->offset, image, buf.data(), stats);
+    if (!ok) {
+      cerr << "ERROR: Cannot write partition " << part->label << "\n";
+      ret = 0;
+    }
+  }
+
+  close(image.fd);
+  return ret;
+}
+
+/* Groups the partitions of |layout| by the image they are written from. */
+static int plan_jobs(const DiskImageArgs& args, const DiskLayout& layout,
+                     vector<ImageJob>* jobs) {
+  map<string, size_t> job_by_image;
+
+  for (const auto& image : args.images) {
+    auto it = find_if(layout.partitions.begin(), layout.partitions.end(),
+                      [&image](const DiskPartition& part) {
+                        return part.label == image.first;
+                      });
+    if (it == layout.partitions.end()) {
+      cerr << "ERROR: No partition " << image.first << " in "
+           << args.input.value() << "\n";
+      return 0;
+    }
+  }
+
+  for (const DiskPartition& part : layout.partitions) {
+    auto image = args.images.find(part.label);
+    if (image == args.images.end()) {
+      if (!args.allow_empty_partitions) {
+        cerr << "ERROR: No image for partition " << part.label
+             << ". Use --allow_empty_partitions to leave it empty.\n";
+        return 0;
+      }
+      continue;
+    }
+
+    auto job = job_by_image.find(image->second.value());
+    if (job == job_by_image.end()) {
+      job = job_by_image.insert(make_pair(image->second.value(),
+                                          jobs->size())).first;
+      jobs->push_back(ImageJob());
+      jobs->back().image = image->second;
+    }
+    (*jobs)[job->second].partitions.push_back(&part);
+  }
+  return 1;
+}
+
+int parse_disk_image_args(int argc, const char *argv[], DiskImageArgs* args) {
+  args->num_jobs = std::thread::hardware_concurrency();
+  if (args->num_jobs < 1)
+    args->num_jobs = 1;
+
+  for (int n = 1; n < argc; ++n) {
+    string arg = argv[n];
+    size_t equals = arg.find('=');
+    string name = arg.substr(0, equals);
+    string value;
+
+    if (name == "--allow_empty_partitions" && equals == string::npos) {
+      args->allow_empty_partitions = true;
+      continue;
+    }
+    if (name == "--no_clone" && equals == string::npos) {
+      args->clone = false;
+      continue;
+    }
+    if (name == "--sparse" && equals == string::npos) {
+      args->sparse = true;
+      continue;
+    }
+    if (name == "--incremental" && equals == string::npos) {
+      args->incremental = true;
+      continue;
+    }
+    if (name != "--output" && name != "--input" && name != "--image" &&
+        name != "--jobs") {
+      cerr << "ERROR: Unknown option " << arg << "\n";
+      return 0;
+    }
+
+    if (equals != string::npos) {
+      value = arg.substr(equals + 1);
+    } else if (n + 1 < argc) {
+      value = argv[++n];
+    } else {
+      cerr << "ERROR: " << name << " needs a value\n";
+      return 0;
+    }
+
+    if (name == "--output") {
+      args->output = FilePath(value);
+    } else if (name == "--input") {
+      args->input = FilePath(value);
+    } else if (name == "--jobs") {
+      if (!StringToInt(value, &args->num_jobs) || args->num_jobs < 1) {
+        cerr << "ERROR: --jobs must be a positive number\n";
+        return 0;
+      }
+    } else {
+      size_t colon = value.find(':');
+      if (colon == string::npos || colon == 0 || colon + 1 == value.size()) {
+        cerr << "ERROR: --image takes LABEL:/PATH/TO/IMAGE\n";
+        return 0;
+      }
+      if (!args->images.insert(make_pair(value.substr(0, colon),
+                                         FilePath(value.substr(colon + 1))))
+               .second) {
+        cerr << "ERROR: More than one image for " << value.substr(0, colon)
+             << "\n";
+        return 0;
+      }
+    }
+  }
+
+  if (args->output.empty() || args->input.empty()) {
+    cerr << "ERROR: Specify --input and --output\n";
+    return 0;
+  }
+  if (args->sparse && args->incremental) {
+    cerr << "ERROR: --incremental only applies to raw images\n";
+    return 0;
+  }
+  return 1;
+}
+
+/* Writes |jobs| to |fd| on args.num_jobs threads. */
+static int run_image_jobs(int fd, const DiskImageArgs& args,
+                          const vector<ImageJob>& jobs,
+                          DiskImageStats* stats) {
+  std::atomic<size_t> next(0);
+  std::atomic<int> failed(0);
+  std::mutex stats_lock;
+  vector<std::thread> threads;
+  auto worker = [&]() {
+    DiskImageStats job_stats;
+    size_t i;
+
+    bub_memset(&job_stats, 0, sizeof(job_stats));
+    while ((i = next++) < jobs.size()) {
+      if (!write_image_job(fd, jobs[i], args.clone, &job_stats))
+        failed = 1;
+    }
+    std::lock_guard<std::mutex> lock(stats_lock);
+    stats->bytes_written += job_stats.bytes_written;
+    stats->bytes_cloned += job_stats.bytes_cloned;
+  };
+
+  // The calling thread is one of the jobs.
+  for (int n = 1; n < args.num_jobs && (size_t)n < jobs.size(); ++n)
+    threads.push_back(std::thread(worker));
+  worker();
+  for (std::thread& thread : threads)
+    thread.join();
+
+  return !failed;
+}
+
+/* Writes the raw disk image. Everything that is not written stays a hole
+ * and reads as zeros.
+ */
+static int write_raw_disk_image(int fd, const DiskImageArgs& args,
+                                const DiskLayout& layout,
+                                const vector<ImageJob>& jobs,
+                                const vector<uint8_t>& primary,
+                                const vector<uint8_t>& backup,
+                                DiskImageStats* stats) {
+  if (ftruncate(fd, layout.disk_size) != 0 ||
+      !pwrite_full(fd, primary.data(), primary.size(), 0) ||
+      !pwrite_full(fd, backup.data(), backup.size(),
+                   layout.disk_size - backup.size())) {
+    cerr << "ERROR: Cannot write " << args.output.value() << "\n";
+    return 0;
+  }
+  stats->bytes_written = primary.size() + backup.size();
+
+  return run_image_jobs(fd, args, jobs, stats);
+}
+
+/* Zeros the |length| bytes at |offset| of |fd|, punching a hole if the
+ * file system can.
+ */
+static int zero_range(int fd, uint64_t offset, uint64_t length,
+                      DiskImageStats* stats) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                length) == 0)
+    return 1;
+#endif
+
+  vector<uint8_t> zeros(min(length, (uint64_t)COPY_BUFFER_SIZE), 0);
+  for (uint64_t done = 0; done < length; ) {
+    size_t size = (size_t)min(length - done, (uint64_t)zeros.size());
+    if (!pwrite_full(fd, zeros.data(), size, offset + done))
+      return 0;
+    stats->bytes_written += size;
+    done += size;
+  }
+  return 1;
+}
+
+/* Fills in |manifest| for |layout| and |args|. Images are only hashed if
+ * their size or modification time differ from the record of the same
+ * image in |old|, if any.
+ */
+static int record_partitions(const DiskImageArgs& args,
+                             const DiskLayout& layout,
+                             const DiskManifest* old,
+                             DiskManifest* manifest) {
+  map<string, PartitionRecord> known;
+
+  if (old != NULL) {
+    for (const PartitionRecord& record : old->partitions) {
+      if (!record.image.empty())
+        known[record.image] = record;
+    }
+  }
+
+  manifest->disk_size = layout.disk_size;
+  manifest->partitions.clear();
+  for (const DiskPartition& part : layout.partitions) {
+    PartitionRecord record;
+    record.label = part.label;
+    record.offset = part.offset;
+    record.size = part.size;
+    record.image_size = 0;
+    record.image_mtime_ns = 0;
+
+    auto image = args.images.find(part.label);
+    if (image != args.images.end()) {
+      record.image = image->second.value();
+      if (!stat_file(image->second, &record.image_size,
+                     &record.image_mtime_ns)) {
+        cerr << "ERROR: Cannot open " << record.image << "\n";
+        return 0;
+      }
+      auto it = known.find(record.image);
+      if (it != known.end() && it->second.image_size == record.image_size &&
+          it->second.image_mtime_ns == record.image_mtime_ns) {
+        record.image_sha256 = it->second.image_sha256;
+      } else {
+        if (!hash_file(image->second, &record.image_sha256))
+          return 0;
+        known[record.image] = record;
+      }
+    }
+    manifest->partitions.push_back(record);
+  }
+  return 1;
+}
+
+/* Returns non-zero if the disk image at args.output is still the one |old|
+ * describes and has the partition layout of |manifest|, so that partitions
+ * can be rewritten in place.
+ */
+static int can_update(const DiskImageArgs& args, const DiskManifest& old,
+                      const DiskManifest& manifest) {
+  uint64_t size;
+  int64_t mtime_ns;
+
+  if (!stat_file(args.output, &size, &mtime_ns) || size != old.output_size ||
+      mtime_ns != old.output_mtime_ns || old.disk_size != manifest.disk_size ||
+      old.partitions.size() != manifest.partitions.size())
+    return 0;
+  for (size_t n = 0; n < old.partitions.size(); ++n) {
+    if (old.partitions[n].label != manifest.partitions[n].label ||
+        old.partitions[n].offset != manifest.partitions[n].offset ||
+        old.partitions[n].size != manifest.partitions[n].size)
+      return 0;
+  }
+  return 1;
+}
+
+/* Rewrites the GPTs and the partitions whose image content differs from
+ * |old| in the disk image |fd| was built from |old|. The partitions are
+ * zeroed first, so the result is the same as that of a full build.
+ */
+static int update_raw_disk_image(int fd, const DiskImageArgs& args,
+                                 const DiskLayout& layout,
+                                 const vector<ImageJob>& jobs,
+                                 const vector<uint8_t>& primary,
+                                 const vector<uint8_t>& backup,
+                                 const DiskManifest& old,
+                                 const DiskManifest& manifest,
+                                 DiskImageStats* stats) {
+  set<string> changed;
+  vector<ImageJob> changed_jobs;
+
+  // The entries may have new names, GUIDs or flags, which the CRCs cover.
+  if (!pwrite_full(fd, primary.data(), primary.size(), 0) ||
+      !pwrite_full(fd, backup.data(), backup.size(),
+                   layout.disk_size - backup.size())) {
+    cerr << "ERROR: Cannot write " << args.output.value() << "\n";
+    return 0;
+  }
+  stats->bytes_written = primary.size() + backup.size();
+
+  for (size_t n = 0; n < manifest.partitions.size(); ++n) {
+    const PartitionRecord& record = manifest.partitions[n];
+    if (record.image_sha256 == old.partitions[n].image_sha256) {
+      stats->bytes_reused += record.size;
+      continue;
+    }
+    changed.insert(record.label);
+    if (!zero_range(fd, record.offset, record.size, stats)) {
+      cerr << "ERROR: Cannot write " << args.output.value() << "\n";
+      return 0;
+    }
+  }
+
+  for (const ImageJob& job : jobs) {
+    ImageJob changed_job;
+    changed_job.image = job.image;
+    for (const DiskPartition* part : job.partitions) {
+      if (changed.count(part->label))
+        changed_job.partitions.push_back(part);
+    }
+    if (!changed_job.partitions.empty())
+      changed_jobs.push_back(changed_job);
+  }
+  return run_image_jobs(fd, args, changed_jobs, stats);
+}
+
+static int write_piece(SparseImageWriter* writer, const DiskPiece& piece,
+                       uint8_t* buf) {
+  if (piece.data != NULL)
+    return writer->write(piece.offset, piece.data->data(),
+                         piece.data->size());
+
+  const ImageExtent& extent = *piece.extent;
+  if (extent.file_offset < 0) {
+    for (size_t n = 0; n + sizeof(extent.fill) <= COPY_BUFFER_SIZE;
+         n += sizeof(extent.fill))
+      bub_memcpy(buf + n, &extent.fill, sizeof(extent.fill));
+  }
+  for (uint64_t done = 0; done < extent.length; ) {
+    size_t size = (size_t)min(extent.length - done,
+                              (uint64_t)COPY_BUFFER_SIZE);
+    if ((extent.file_offset >= 0 &&
+         !pread_full(piece.image->fd, buf, size, extent.file_offset + done)) ||
+        !writer->write(piece.offset + done, buf, size))
+      return 0;
+    done += size;
+  }
+  return 1;
+}
+
+/* Writes the disk image as an Android sparse image, front to back. Slot
+ * copies are read from their image again rather than cloned.
+ */
+static int write_sparse_disk_image(int fd, const DiskImageArgs& args,
+                                   const DiskLayout& layout,
+                                   const vector<ImageJob>& jobs,
+                                   const vector<uint8_t>& primary,
+                                   const vector<uint8_t>& backup,
+                                   DiskImageStats* stats) {
+  vector<InputImage> images(jobs.size());
+  vector<DiskPiece> pieces;
+  vector<uint8_t> buf(COPY_BUFFER_SIZE);
+  size_t num_open = 0;
+  int ret = 1;
+
+  if (layout.disk_size % SPARSE_BLOCK_SIZE != 0 ||
+      layout.disk_size / SPARSE_BLOCK_SIZE > UINT32_MAX) {
+    cerr << "ERROR: disk_size must be a multiple of " << SPARSE_BLOCK_SIZE
+         << " bytes and below 16 TiB for sparse images\n";
+    return 0;
+  }
+
+  pieces.push_back({0, &primary, NULL, NULL});
+  pieces.push_back({layout.disk_size - backup.size(), &backup, NULL, NULL});
+  for (size_t n = 0; ret && n < jobs.size(); ++n) {
+    if (!open_image(jobs[n].image, &images[n])) {
+      ret = 0;
+      break;
+    }
+    num_open++;
+    ret = image_fits(jobs[n], images[n]);
+    for (const DiskPartition* part : jobs[n].partitions) {
+      for (const ImageExtent& extent : images[n].extents) {
+        pieces.push_back(
+            {part->offset + extent.offset, NULL, &images[n], &extent});
+      }
+    }
+  }
+  sort(pieces.begin(), pieces.end(),
+       [](const DiskPiece& a, const DiskPiece& b) {
+         return a.offset < b.offset;
+       });
+
+  if (ret) {
+    SparseImageWriter writer(fd, layout.disk_size);
+    for (size_t n = 0; ret && n < pieces.size(); ++n)
+      ret = write_piece(&writer, pieces[n], buf.data());
+    if (ret)
+      ret = writer.finish();
+    if (!ret)
+      cerr << "ERROR: Cannot write " << args.output.value() << "\n";
+    stats->bytes_written = writer.bytes_written();
+  }
+
+  for (size_t n = 0; n < num_open; ++n)
+    close(images[n].fd);
+  return ret;
+}
+
+int make_disk_image(const DiskImageArgs& args, DiskImageStats* stats) {
+  const FilePath manifest_path = disk_manifest_path(args.output);
+  DiskLayout layout;
+  DiskManifest old;
+  DiskManifest manifest;
+  vector<ImageJob> jobs;
+  vector<uint8_t> primary;
+  vector<uint8_t> backup;
+  string json;
+  bool update = false;
+  struct stat st;
+
+  bub_memset(stats, 0, sizeof(*stats));
+  if (!ReadFileToString(args.input, &json)) {
+    cerr << "ERROR: Cannot read " << args.input.value() << "\n";
+    return 0;
+  }
+  if (!parse_partition_table(json, &layout) ||
+      !plan_jobs(args, layout, &jobs))
+    return 0;
+
+  if (args.incremental) {
+    bool have_old = read_disk_manifest(manifest_path, &old);
+    if (!record_partitions(args, layout, have_old ? &old : NULL, &manifest))
+      return 0;
+    update = have_old && can_update(args, old, manifest);
+  }
+  // The manifest describes a finished image only.
+  if (unlink(manifest_path.value().c_str()) != 0 && errno != ENOENT) {
+    cerr << "ERROR: Cannot remove " << manifest_path.value() << "\n";
+    return 0;
+  }
+
+  build_gpt(layout, &primary, &backup);
+  int fd = open(args.output.value().c_str(),
+                update ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    cerr << "ERROR: Cannot create " << args.output.value() << "\n";
+    return 0;
+  }
+  stats->logical_size = layout.disk_size;
+
+  int ret;
+  if (args.sparse)
+    ret = write_sparse_disk_image(fd, args, layout, jobs, primary, backup,
+                                  stats);
+  else if (update)
+    ret = update_raw_disk_image(fd, args, layout, jobs, primary, backup, old,
+                                manifest, stats);
+  else
+    ret = write_raw_disk_image(fd, args, layout, jobs, primary, backup, stats);
+
+  if (fstat(fd, &st) == 0)
+    stats->bytes_allocated = (uint64_t)st.st_blocks * 512;
+  if (close(fd) != 0) {
+    cerr << "ERROR: Cannot write " << args.output.value() << "\n";
+    ret = 0;
+  }
+
+  if (ret && args.incremental) {
+    ret = stat_file(args.output, &manifest.output_size,
+                    &manifest.output_mtime_ns) &&
+          write_disk_manifest(manifest_path, manifest);
+  }
+  return ret;
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BUB_DISK_IMAGE_H_
+#define BUB_DISK_IMAGE_H_
+
+#include <stdint.h>
+#include <base/files/file_util.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../boot_loader/bub_disk.h"
+
+// Number of entries in the GPTs written, as bpttool writes them.
+#define DISK_GPT_NUM_ENTRIES 128
+// Blocks taken by the entry array of one GPT.
+#define DISK_GPT_ENTRIES_BLOCKS \
+  (DISK_GPT_NUM_ENTRIES * sizeof(GPTEntry) / BUB_BLOCK_SIZE)
+// Granularity at which all-zero parts of images are skipped.
+#define ZERO_BLOCK_SIZE 4096
+// Size of the buffers images are copied through.
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+/* One partition of a partition table. GUIDs are in on-disk byte order. */
+struct DiskPartition {
+  std::string label;
+  // Offset from the start of the disk and size, in bytes.
+  uint64_t offset;
+  uint64_t size;
+  uint8_t type_guid[16];
+  uint8_t guid[16];
+  uint64_t flags;
+};
+
+/* A disk laid out by bpttool make_table. */
+struct DiskLayout {
+  uint64_t disk_size;
+  uint8_t disk_guid[16];
+  std::vector<DiskPartition> partitions;
+};
+
+/* Arguments of make_disk_image, see print_usage() in main.cc. */
+struct DiskImageArgs {
+  DiskImageArgs()
+      : allow_empty_partitions(false), num_jobs(1), clone(true),
+        sparse(false), incremental(false) {}
+
+  base::FilePath output;
+  base::FilePath input;
+  // Image to write to each partition, by label.
+  std::map<std::string, base::FilePath> images;
+  bool allow_empty_partitions;
+  int num_jobs;
+  // Share the blocks of partitions written from the same image.
+  bool clone;
+  // Write an Android sparse image instead of a raw one.
+  bool sparse;
+  // Keep a manifest next to the raw image and only rewrite the partitions
+  // whose images changed since.
+  bool incremental;
+};
+
+/* What make_disk_image() did, in bytes. */
+struct DiskImageStats {
+  // Size of the disk image.
+  uint64_t logical_size;
+  // Bytes passed to write() and copy_file_range().
+  uint64_t bytes_written;
+  // Bytes shared with another partition through FICLONERANGE.
+  uint64_t bytes_cloned;
+  // Bytes allocated to the disk image on the file system afterwards.
+  uint64_t bytes_allocated;
+  // Bytes of partitions left as they were by an incremental rebuild.
+  uint64_t bytes_reused;
+};
+
+/* pread() and pwrite() that retry until all |size| bytes are done. */
+int pread_full(int fd, void* buf, size_t size, uint64_t offset);
+int pwrite_full(int fd, const void* buf, size_t size, uint64_t offset);
+
+/* Returns non-zero if the |size| bytes at |buf| are all zero. */
+int is_zero(const uint8_t* buf, size_t size);
+
+/* Writes the |size| bytes at |buf| to |offset| of |fd|, skipping all-zero
+ * ZERO_BLOCK_SIZE blocks, and adds the bytes written to
+ * stats->bytes_written.
+ */
+int write_nonzero(int fd, uint64_t offset, const uint8_t* buf, size_t size,
+                  DiskImageStats* stats);
+
+/* Parses the command line. Option values may follow the option either
+ * after '=' or as the next argument, as with bpttool.
+ */
+int parse_disk_image_args(int argc, const char *argv[], DiskImageArgs* args);
+
+/* Parses a "12345678-9abc-def0-1234-56789abcdef0" GUID string into |guid|
+ * in GPT byte order.
+ */
+int parse_guid(const std::string& str, uint8_t* guid);
+
+/* Parses the JSON output of bpttool make_table into |layout|. Partition
+ * offsets and GUIDs must be resolved; partitions marked "ignore" are
+ * skipped. The layout is checked to fit the disk between the two GPTs
+ * without overlaps.
+ */
+int parse_partition_table(const std::string& json, DiskLayout* layout);
+
+/* Builds the GPTs for |layout|. |primary| receives the protective MBR, the
+ * primary header and its entries, to be written at the start of the disk.
+ * |backup| receives the backup entries and header, to be written at its
+ * end.
+ */
+void build_gpt(const DiskLayout& layout, std::vector<uint8_t>* primary,
+               std::vector<uint8_t>* backup);
+
+/* Writes the disk image described by |args| and fills in |stats|.
+ *
+ * The output is a sparse file: all-zero blocks of the partition images,
+ * holes in raw images and don't-care chunks of Android sparse images are
+ * skipped. Partitions written from the same image, such as the A and B
+ * copies of a slot, are written once and then cloned with FICLONERANGE,
+ * or copied in the kernel if the file system cannot share blocks. Images
+ * are written by args.num_jobs threads.
+ *
+ * With args.sparse the output is an Android sparse image instead, written
+ * front to back by one thread. Its DONT_CARE chunks are exactly the holes
+ * the raw output would have.
+ *
+ * With args.incremental a manifest of the layout and of the size,
+ * modification time and SHA-256 of each image is kept next to the raw
+ * output. If the output and the partition offsets and sizes are unchanged
+ * since, only the GPTs and the partitions whose image contents differ are
+ * rewritten, in place. Images whose size and modification time match are
+ * not hashed again.
+ */
+int make_disk_image(const DiskImageArgs& args, DiskImageStats* stats);
+
+#endif /* BUB_DISK_IMAGE_H_ */
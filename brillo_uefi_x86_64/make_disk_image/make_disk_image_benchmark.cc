@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Host benchmark for full disk image assembly. Builds images for a
+// brillo_uefi_x86_64-like layout (EFI, two boot and system slots, empty misc
+// and odm slots, userdata up to the end) and reports the time, file size and
+// allocated size of the raw image, with and without cloning, of the sparse
+// image, and of the sparse image expanded with unsparse_image(). It also
+// times an incremental rebuild after a boot.img change. If a bpttool binary
+// is given, `bpttool make_disk_image` is timed as well.
+//
+// Usage: make_disk_image_benchmark [DISK_SIZE_MIB [/PATH/TO/bpttool]]
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/files/file_util.h>
+
+#include "make_disk_image.h"
+#include "sparse_image.h"
+
+#define MiB (1024ULL * 1024)
+
+extern char** environ;
+
+static const char kTypeGuid[] = "ebd0a0a2-b9e5-4433-87c0-68b6b72699c7";
+
+static const struct {
+  const char* label;
+  uint64_t size_mib;
+  // Image written to the partition and its size, or NULL.
+  const char* image;
+  uint64_t data_mib;
+} kPartitions[] = {
+    {"EFI", 300, "EFI.img", 8},
+    {"boot_a", 32, "boot.img", 16},
+    {"boot_b", 32, "boot.img", 16},
+    {"system_a", 512, "system.img", 256},
+    {"system_b", 512, "system.img", 256},
+    {"misc", 1, NULL, 0},
+    {"odm_a", 256, NULL, 0},
+    {"odm_b", 256, NULL, 0},
+    // Grows to the end of the disk.
+    {"userdata", 0, "userdata.img", 4},
+};
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, const base::FilePath& path,
+                   double elapsed) {
+  struct stat st;
+  if (stat(path.value().c_str(), &st) != 0)
+    bub_memset(&st, 0, sizeof(st));
+  printf("%-24s %10.2f %14llu %14llu\n", name, elapsed,
+         (unsigned long long)st.st_size,
+         (unsigned long long)st.st_blocks * 512);
+}
+
+// Writes |data_mib| MiB of incompressible data in which every fourth MiB is
+// zeros, as file systems leave free space.
+static int write_image(const base::FilePath& path, uint64_t data_mib,
+                       uint32_t seed) {
+  std::vector<uint8_t> buf(MiB);
+  uint32_t x = seed;
+  int fd = open(path.value().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return 0;
+  for (uint64_t n = 0; n < data_mib; ++n) {
+    for (size_t i = 0; i < buf.size(); ++i) {
+      x = x * 1103515245 + 12345;
+      buf[i] = n % 4 == 3 ? 0 : (uint8_t)(x >> 16);
+    }
+    if (!pwrite_full(fd, buf.data(), buf.size(), n * MiB)) {
+      close(fd);
+      return 0;
+    }
+  }
+  return close(fd) == 0;
+}
+
+static std::string table_json(uint64_t disk_size) {
+  std::string json = "{\"settings\": {\"disk_size\": " +
+                     std::to_string(disk_size) +
+                     ", \"disk_guid\": \"01234567-89ab-cdef-0123-"
+                     "456789abcdef\"}, \"partitions\": [";
+  uint64_t offset = 1 * MiB;
+  int n = 0;
+  for (const auto& part : kPartitions) {
+    uint64_t size = part.size_mib * MiB;
+    char guid[64];
+    if (size == 0)
+      size = disk_size - offset - 1 * MiB;
+    snprintf(guid, sizeof(guid), "%08x-2222-3333-4444-555555555555", ++n);
+    json += std::string(n > 1 ? ", " : "") + "{\"label\": \"" + part.label +
+            "\", \"offset\": " + std::to_string(offset) + ", \"size\": " +
+            std::to_string(size) + ", \"guid\": \"" + guid +
+            "\", \"type_guid\": \"" + kTypeGuid + "\"}";
+    offset += size;
+  }
+  return json + "]}";
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t disk_mib = argc > 1 ? strtoull(argv[1], NULL, 0) : 4096;
+  char dir_name[] = "/tmp/make_disk_image_benchmark.XXXXXX";
+  uint64_t fixed_mib = 1;
+
+  for (const auto& part : kPartitions)
+    fixed_mib += part.size_mib;
+  if (disk_mib < fixed_mib + 1 + 8 || mkdtemp(dir_name) == NULL) {
+    fprintf(stderr,
+            "Usage: %s [DISK_SIZE_MIB [/PATH/TO/bpttool]]\n"
+            "DISK_SIZE_MIB must be at least %llu.\n",
+            argv[0], (unsigned long long)(fixed_mib + 1 + 8));
+    return 1;
+  }
+  base::FilePath dir(dir_name);
+
+  DiskImageArgs args;
+  std::string json = table_json(disk_mib * MiB);
+  args.input = dir.Append("partition-table.bpt");
+  args.output = dir.Append("full-disk-image.img");
+  args.allow_empty_partitions = true;
+  args.num_jobs = std::thread::hardware_concurrency();
+  if (base::WriteFile(args.input, json.data(), json.size()) !=
+      (int)json.size()) {
+    fprintf(stderr, "Cannot write %s.\n", args.input.value().c_str());
+    return 1;
+  }
+  for (const auto& part : kPartitions) {
+    if (part.image == NULL)
+      continue;
+    args.images[part.label] = dir.Append(part.image);
+    if (!write_image(dir.Append(part.image), part.data_mib, 0x12345678)) {
+      fprintf(stderr, "Cannot write %s.\n", part.image);
+      return 1;
+    }
+  }
+
+  printf("%-24s %10s %14s %14s\n", "method", "seconds", "file size",
+         "allocated");
+
+  const struct {
+    const char* name;
+    bool clone;
+    bool sparse;
+  } runs[] = {
+      {"raw", true, false},
+      {"raw, no clone", false, false},
+      {"sparse", false, true},
+  };
+  DiskImageStats stats;
+  double start;
+  for (const auto& run : runs) {
+    args.clone = run.clone;
+    args.sparse = run.sparse;
+    start = now_seconds();
+    if (!make_disk_image(args, &stats)) {
+      fprintf(stderr, "make_disk_image failed.\n");
+      return 1;
+    }
+    report(run.name, args.output, now_seconds() - start);
+  }
+
+  // A kernel-only change, as after `m bootimage`.
+  args.sparse = false;
+  args.clone = true;
+  args.incremental = true;
+  base::FilePath boot_path = dir.Append("boot.img");
+  if (!make_disk_image(args, &stats) ||
+      !write_image(boot_path, kPartitions[1].data_mib, 0x87654321)) {
+    fprintf(stderr, "make_disk_image failed.\n");
+    return 1;
+  }
+  start = now_seconds();
+  if (!make_disk_image(args, &stats)) {
+    fprintf(stderr, "make_disk_image failed.\n");
+    return 1;
+  }
+  report("incremental, new boot", args.output, now_seconds() - start);
+  args.incremental = false;
+
+  // The sparse image, expanded as for QEMU.
+  args.sparse = true;
+  if (!make_disk_image(args, &stats)) {
+    fprintf(stderr, "make_disk_image failed.\n");
+    return 1;
+  }
+  base::FilePath unsparse_path = dir.Append("unsparse.img");
+  start = now_seconds();
+  int in_fd = open(args.output.value().c_str(), O_RDONLY);
+  int out_fd = open(unsparse_path.value().c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (in_fd < 0 || out_fd < 0 || !unsparse_image(in_fd, out_fd, &stats) ||
+      close(out_fd) != 0) {
+    fprintf(stderr, "unsparse_image failed.\n");
+    return 1;
+  }
+  close(in_fd);
+  report("sparse + unsparse_image", unsparse_path, now_seconds() - start);
+  unlink(unsparse_path.value().c_str());
+
+  if (argc > 2) {
+    std::vector<std::string> spawn_args = {
+        argv[2], "make_disk_image", "--output=" + args.output.value(),
+        "--input=" + args.input.value(), "--allow_empty_partitions"};
+    for (const auto& image : args.images)
+      spawn_args.push_back("--image=" + image.first + ":" +
+                           image.second.value());
+    std::vector<char*> spawn_argv;
+    for (std::string& arg : spawn_args)
+      spawn_argv.push_back(&arg[0]);
+    spawn_argv.push_back(NULL);
+
+    pid_t pid;
+    int status;
+    start = now_seconds();
+    if (posix_spawn(&pid, argv[2], NULL, NULL, spawn_argv.data(),
+                    environ) != 0 ||
+        waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Cannot run %s.\n", argv[2]);
+      return 1;
+    }
+    report("bpttool", args.output, now_seconds() - start);
+  }
+
+  std::string command = "rm -rf " + dir.value();
+  return system(command.c_str()) == 0 ? 0 : 1;
+}
@@ -0,0 +1,616 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../boot_loader/bub_image_util.h"
+#include "make_disk_image.h"
+#include "sparse_image.h"
+
+#define MiB (1024 * 1024)
+
+static const char kDiskGuid[] = "01234567-89ab-cdef-0123-456789abcdef";
+static const char kTypeGuid[] = "ebd0a0a2-b9e5-4433-87c0-68b6b72699c7";
+
+/* BubBlockDev reading from a disk image in memory. */
+struct MemBlockDev {
+  BubBlockDev parent;
+  const std::vector<uint8_t>* disk;
+};
+
+static BubIOResult mem_read(BubBlockDev* dev, uint64_t offset, void* buf,
+                            size_t num_bytes) {
+  const std::vector<uint8_t>* disk = ((MemBlockDev*)dev)->disk;
+  if (offset > disk->size() || num_bytes > disk->size() - offset)
+    return BUB_IO_RESULT_ERROR_IO;
+  memcpy(buf, disk->data() + offset, num_bytes);
+  return BUB_IO_RESULT_OK;
+}
+
+static std::string partition_json(const char* label, uint64_t offset,
+                                  uint64_t size, const char* guid) {
+  return std::string("{\"label\": \"") + label + "\", \"offset\": " +
+         std::to_string(offset) + ", \"size\": " + std::to_string(size) +
+         ", \"guid\": \"" + guid + "\", \"type_guid\": \"" + kTypeGuid +
+         "\", \"flags\": \"0x0000000000000004\"}";
+}
+
+static std::string table_json(const std::string& disk_size,
+                              const std::vector<std::string>& partitions) {
+  std::string json = "{\"settings\": {\"disk_size\": " + disk_size +
+                     ", \"disk_guid\": \"" + kDiskGuid +
+                     "\"}, \"partitions\": [";
+  for (size_t n = 0; n < partitions.size(); ++n)
+    json += (n > 0 ? ", " : "") + partitions[n];
+  return json + "]}";
+}
+
+// A 16 MiB disk with two boot slots, a system partition, an empty misc
+// partition and userdata up to the backup GPT.
+static std::string test_table_json() {
+  return table_json(
+      "\"16 MiB\"",
+      {partition_json("boot_a", 1 * MiB, 1 * MiB,
+                      "11111111-2222-3333-4444-555555555555"),
+       partition_json("boot_b", 2 * MiB, 1 * MiB,
+                      "21111111-2222-3333-4444-555555555555"),
+       partition_json("system", 4 * MiB, 2 * MiB,
+                      "31111111-2222-3333-4444-555555555555"),
+       partition_json("misc", 8 * MiB, 64 * 1024,
+                      "41111111-2222-3333-4444-555555555555"),
+       "{\"label\": \"odm\", \"ignore\": true}",
+       partition_json("userdata", 9 * MiB, 16 * MiB - 9 * MiB - 33 * 512,
+                      "51111111-2222-3333-4444-555555555555")});
+}
+
+TEST(DiskImageTest, ParseGuid) {
+  uint8_t guid[16];
+  const uint8_t expected[16] = {0x67, 0x45, 0x23, 0x01, 0xab, 0x89,
+                                0xef, 0xcd, 0x01, 0x23, 0x45, 0x67,
+                                0x89, 0xab, 0xcd, 0xef};
+
+  EXPECT_EQ(1, parse_guid(kDiskGuid, guid));
+  EXPECT_EQ(0, memcmp(expected, guid, sizeof(guid)));
+  EXPECT_EQ(1, parse_guid("01234567-89AB-CDEF-0123-456789ABCDEF", guid));
+  EXPECT_EQ(0, memcmp(expected, guid, sizeof(guid)));
+
+  EXPECT_EQ(0, parse_guid("auto", guid));
+  EXPECT_EQ(0, parse_guid("0123456789ab-cdef-0123-456789abcdef-", guid));
+  EXPECT_EQ(0, parse_guid("01234567-89ab-cdef-0123-456789abcdeg", guid));
+}
+
+TEST(DiskImageTest, ParsePartitionTable) {
+  DiskLayout layout;
+
+  ASSERT_EQ(1, parse_partition_table(test_table_json(), &layout));
+  EXPECT_EQ(16U * MiB, layout.disk_size);
+  ASSERT_EQ(5U, layout.partitions.size());
+  EXPECT_EQ("boot_a", layout.partitions[0].label);
+  EXPECT_EQ(1U * MiB, layout.partitions[0].offset);
+  EXPECT_EQ(1U * MiB, layout.partitions[0].size);
+  EXPECT_EQ(4U, layout.partitions[0].flags);
+  EXPECT_EQ("userdata", layout.partitions[4].label);
+
+  ASSERT_EQ(1, parse_partition_table(
+                   table_json("4294967296", {partition_json(
+                                  "system", 1 * MiB, 3 * 1024ULL * MiB,
+                                  kDiskGuid)}),
+                   &layout));
+  EXPECT_EQ(4096ULL * MiB, layout.disk_size);
+  EXPECT_EQ(3072ULL * MiB, layout.partitions[0].size);
+}
+
+TEST(DiskImageTest, RejectsBadPartitionTables) {
+  DiskLayout layout;
+  const char* guid = "11111111-2222-3333-4444-555555555555";
+
+  EXPECT_EQ(0, parse_partition_table("{", &layout));
+  EXPECT_EQ(0, parse_partition_table("{\"partitions\": []}", &layout));
+  // Not in whole blocks.
+  EXPECT_EQ(0, parse_partition_table(table_json("\"16 MiB\"", {
+      partition_json("a", 1 * MiB + 1, 1 * MiB, guid)}), &layout));
+  EXPECT_EQ(0, parse_partition_table(table_json("\"16 MiB\"", {
+      partition_json("a", 1 * MiB, 1000, guid)}), &layout));
+  // On the primary or backup GPT.
+  EXPECT_EQ(0, parse_partition_table(table_json("\"16 MiB\"", {
+      partition_json("a", 33 * 512, 1 * MiB, guid)}), &layout));
+  EXPECT_EQ(0, parse_partition_table(table_json("\"16 MiB\"", {
+      partition_json("a", 15 * MiB, 1 * MiB, guid)}), &layout));
+  // Overlapping, or with the same label.
+  EXPECT_EQ(0, parse_partition_table(table_json("\"16 MiB\"", {
+      partition_json("a", 2 * MiB, 2 * MiB, guid),
+      partition_json("b", 1 * MiB, 2 * MiB, guid)}), &layout));
+  EXPECT_EQ(0, parse_partition_table(table_json("\"16 MiB\"", {
+      partition_json("a", 1 * MiB, 1 * MiB, guid),
+      partition_json("a", 2 * MiB, 1 * MiB, guid)}), &layout));
+  // Not laid out by bpttool make_table.
+  EXPECT_EQ(0, parse_partition_table(table_json("\"16 MiB\"", {
+      "{\"label\": \"a\", \"size\": \"1 MiB\", \"guid\": \"auto\","
+      " \"type_guid\": \"brillo_boot\"}"}), &layout));
+  EXPECT_EQ(0, parse_partition_table(table_json("\"16 MiB\"", {
+      partition_json("a", 1 * MiB, 1 * MiB, "auto")}), &layout));
+  EXPECT_EQ(0, parse_partition_table(table_json("\"16 MiB\"", {
+      partition_json("a_label_longer_than_thirty_six_chars_", 1 * MiB, 1 * MiB,
+                     guid)}), &layout));
+}
+
+TEST(DiskImageTest, BootLoaderReadsGpt) {
+  DiskLayout layout;
+  std::vector<uint8_t> primary;
+  std::vector<uint8_t> backup;
+  BubPartitionIndex index;
+  const BubPartitionIndexEntry* entry;
+  char guid[BUB_GUID_STRING_SIZE];
+
+  ASSERT_EQ(1, parse_partition_table(test_table_json(), &layout));
+  build_gpt(layout, &primary, &backup);
+  EXPECT_EQ(34U * 512, primary.size());
+  EXPECT_EQ(33U * 512, backup.size());
+  EXPECT_EQ(0xEE, primary[446 + 4]);
+  EXPECT_EQ(0xAA, primary[511]);
+
+  std::vector<uint8_t> disk(layout.disk_size);
+  memcpy(disk.data(), primary.data(), primary.size());
+  memcpy(disk.data() + disk.size() - backup.size(), backup.data(),
+         backup.size());
+  MemBlockDev dev = {{mem_read, NULL, BUB_BLOCK_SIZE,
+                      layout.disk_size / BUB_BLOCK_SIZE}, &disk};
+
+  for (int corrupt_primary = 0; corrupt_primary < 2; ++corrupt_primary) {
+    SCOPED_TRACE(corrupt_primary);
+    if (corrupt_primary)
+      disk[BUB_BLOCK_SIZE] ^= 0xFF;
+
+    ASSERT_EQ(BUB_IO_RESULT_OK,
+              bub_partition_index_build_from_disk(&index, &dev.parent));
+    EXPECT_EQ(5U, index.num_entries);
+    for (const DiskPartition& part : layout.partitions) {
+      ASSERT_NE(0, bub_partition_index_find(&index, part.label.c_str(),
+                                            &entry));
+      EXPECT_EQ(part.offset / BUB_BLOCK_SIZE, entry->first_lba);
+      EXPECT_EQ((part.offset + part.size) / BUB_BLOCK_SIZE - 1,
+                entry->last_lba);
+    }
+    EXPECT_EQ(0, bub_partition_index_find(&index, "odm", &entry));
+    ASSERT_NE(0, bub_disk_get_unique_guid(&index, "boot_b", guid,
+                                          sizeof(guid)));
+    EXPECT_STREQ("21111111-2222-3333-4444-555555555555", guid);
+  }
+}
+
+TEST(DiskImageTest, ParseArgs) {
+  DiskImageArgs args;
+  const char* argv[] = {"make_disk_image", "--output", "disk.img",
+                        "--input=table.bpt", "--image", "boot_a:boot.img",
+                        "--image=boot_b:boot.img", "--jobs=3",
+                        "--allow_empty_partitions", "--no_clone",
+                        "--sparse"};
+
+  ASSERT_EQ(1, parse_disk_image_args(11, argv, &args));
+  EXPECT_EQ("disk.img", args.output.value());
+  EXPECT_EQ("table.bpt", args.input.value());
+  EXPECT_EQ(2U, args.images.size());
+  EXPECT_EQ("boot.img", args.images["boot_b"].value());
+  EXPECT_EQ(3, args.num_jobs);
+  EXPECT_TRUE(args.allow_empty_partitions);
+  EXPECT_FALSE(args.clone);
+  EXPECT_TRUE(args.sparse);
+
+  const char* twice[] = {"make_disk_image", "--output=a", "--input=b",
+                         "--image=boot_a:x", "--image=boot_a:y"};
+  DiskImageArgs args2;
+  EXPECT_EQ(0, parse_disk_image_args(5, twice, &args2));
+  const char* bad_image[] = {"make_disk_image", "--output=a", "--input=b",
+                             "--image=boot_a"};
+  DiskImageArgs args3;
+  EXPECT_EQ(0, parse_disk_image_args(4, bad_image, &args3));
+  const char* no_output[] = {"make_disk_image", "--input=b"};
+  DiskImageArgs args4;
+  EXPECT_EQ(0, parse_disk_image_args(2, no_output, &args4));
+  const char* missing_value[] = {"make_disk_image", "--output=a", "--input"};
+  DiskImageArgs args5;
+  EXPECT_EQ(0, parse_disk_image_args(3, missing_value, &args5));
+  const char* sparse_incremental[] = {"make_disk_image", "--output=a",
+                                      "--input=b", "--sparse",
+                                      "--incremental"};
+  DiskImageArgs args6;
+  EXPECT_EQ(0, parse_disk_image_args(5, sparse_incremental, &args6));
+}
+
+TEST(DiskImageTest, SparseImageWriter) {
+  char path[] = "/tmp/bub-tests.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  unlink(path);
+
+  // Block 1 is written in three pieces, block 3 is filled with 0x01020304,
+  // block 4 is written as zeros and block 6 is data.
+  const uint64_t size = 8 * SPARSE_BLOCK_SIZE;
+  std::vector<uint8_t> expected(size, 0);
+  std::vector<uint8_t> data(SPARSE_BLOCK_SIZE);
+  for (size_t n = 0; n < data.size(); ++n)
+    data[n] = (uint8_t)(n * 13 + 1);
+  const uint32_t fill = 0x01020304;
+  std::vector<uint8_t> fill_block(SPARSE_BLOCK_SIZE);
+  for (size_t n = 0; n < fill_block.size(); n += sizeof(fill))
+    memcpy(&fill_block[n], &fill, sizeof(fill));
+  std::vector<uint8_t> zeros(SPARSE_BLOCK_SIZE, 0);
+  const struct {
+    uint64_t offset;
+    const uint8_t* data;
+    size_t size;
+  } writes[] = {
+      {SPARSE_BLOCK_SIZE + 10, data.data(), 100},
+      {SPARSE_BLOCK_SIZE + 200, data.data() + 200, 1000},
+      {SPARSE_BLOCK_SIZE + 3000, data.data() + 3000, 1096},
+      {3 * SPARSE_BLOCK_SIZE, fill_block.data(), SPARSE_BLOCK_SIZE},
+      {4 * SPARSE_BLOCK_SIZE, zeros.data(), SPARSE_BLOCK_SIZE},
+      {6 * SPARSE_BLOCK_SIZE, data.data(), SPARSE_BLOCK_SIZE},
+  };
+
+  SparseImageWriter writer(fd, size);
+  for (const auto& w : writes) {
+    ASSERT_EQ(1, writer.write(w.offset, w.data, w.size));
+    memcpy(&expected[w.offset], w.data, w.size);
+  }
+  ASSERT_EQ(1, writer.finish());
+  EXPECT_EQ((uint64_t)lseek(fd, 0, SEEK_END), writer.bytes_written());
+
+  SparseHeader header;
+  ASSERT_EQ((ssize_t)sizeof(header), pread(fd, &header, sizeof(header), 0));
+  EXPECT_EQ(SPARSE_HEADER_MAGIC, header.magic);
+  EXPECT_EQ(8U, header.total_blks);
+  // DONT_CARE, RAW, DONT_CARE, FILL, DONT_CARE, RAW, DONT_CARE and CRC32.
+  EXPECT_EQ(8U, header.total_chunks);
+  // Two raw blocks, three chunks with a 4-byte value and five without.
+  EXPECT_EQ(sizeof(header) + 2 * SPARSE_BLOCK_SIZE +
+                8 * sizeof(SparseChunkHeader) + 2 * 4,
+            writer.bytes_written());
+
+  int pipe_fds[2];
+  ASSERT_EQ(0, pipe(pipe_fds));
+  std::vector<uint8_t> expanded;
+  std::thread reader([&pipe_fds, &expanded]() {
+    uint8_t buf[4096];
+    ssize_t num_read;
+    while ((num_read = read(pipe_fds[0], buf, sizeof(buf))) > 0)
+      expanded.insert(expanded.end(), buf, buf + num_read);
+  });
+  DiskImageStats stats;
+  ASSERT_EQ(0, lseek(fd, 0, SEEK_SET));
+  EXPECT_EQ(1, unsparse_image(fd, pipe_fds[1], &stats));
+  close(pipe_fds[1]);
+  reader.join();
+  close(pipe_fds[0]);
+  close(fd);
+  EXPECT_EQ(size, stats.logical_size);
+  EXPECT_EQ(size, stats.bytes_written);
+  EXPECT_TRUE(expected == expanded);
+
+  // Going backwards is an error, and so is everything after it.
+  fd = open("/dev/null", O_WRONLY);
+  ASSERT_GE(fd, 0);
+  SparseImageWriter backwards(fd, size);
+  EXPECT_EQ(1, backwards.write(SPARSE_BLOCK_SIZE, data.data(), 1));
+  EXPECT_EQ(0, backwards.write(0, data.data(), 1));
+  EXPECT_EQ(0, backwards.finish());
+  close(fd);
+}
+
+class MakeDiskImageTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_FALSE(dir_.path().empty());
+    table_ = path("partition-table.bpt");
+    ASSERT_TRUE(base::WriteFile(table_, test_table_json().data(),
+                                test_table_json().size()) > 0);
+    ASSERT_EQ(1, parse_partition_table(test_table_json(), &layout_));
+    expected_.assign(layout_.disk_size, 0);
+    std::vector<uint8_t> primary;
+    std::vector<uint8_t> backup;
+    build_gpt(layout_, &primary, &backup);
+    put(0, primary);
+    put(layout_.disk_size - backup.size(), backup);
+    MakeBootImage();
+    MakeSystemImage();
+  }
+
+  base::FilePath path(const char* name) {
+    return dir_.Append(name);
+  }
+
+  void put(uint64_t offset, const std::vector<uint8_t>& data) {
+    memcpy(expected_.data() + offset, data.data(), data.size());
+  }
+
+  static std::vector<uint8_t> pattern(size_t size, uint8_t seed) {
+    std::vector<uint8_t> data(size);
+    for (size_t n = 0; n < size; ++n)
+      data[n] = (uint8_t)(seed + n * 7 + (n >> 12));
+    return data;
+  }
+
+  // 100 KiB of data, 64 KiB of written zeros, 36 KiB of data, a 64 KiB hole
+  // and another 100 KiB of data.
+  void MakeBootImage() {
+    int fd = open(path("boot.img").value().c_str(), O_CREAT | O_WRONLY, 0644);
+    ASSERT_GE(fd, 0);
+    std::vector<uint8_t> zeros(64 * 1024, 0);
+    const struct {
+      uint64_t offset;
+      std::vector<uint8_t> data;
+    } pieces[] = {
+        {0, pattern(100 * 1024, 1)},
+        {100 * 1024, zeros},
+        {164 * 1024, pattern(36 * 1024, 2)},
+        {264 * 1024, pattern(100 * 1024, 3)},
+    };
+    for (const auto& piece : pieces) {
+      ASSERT_EQ((ssize_t)piece.data.size(),
+                pwrite(fd, piece.data.data(), piece.data.size(),
+                       piece.offset));
+      put(1 * MiB + piece.offset, piece.data);
+      put(2 * MiB + piece.offset, piece.data);
+    }
+    close(fd);
+  }
+
+  // Android sparse image with 4 KiB blocks: 2 raw blocks, 10 blocks don't
+  // care, 3 blocks filled with 0xdeadbeef, 5 blocks filled with zero, a
+  // CRC32 chunk and 1 raw block.
+  void MakeSystemImage() {
+    const uint32_t blk_sz = 4096;
+    std::vector<uint8_t> image;
+    auto append = [&image](const void* data, size_t size) {
+      image.insert(image.end(), (const uint8_t*)data,
+                   (const uint8_t*)data + size);
+    };
+    auto chunk = [&append](uint16_t type, uint32_t blocks, uint32_t size) {
+      SparseChunkHeader header = {type, 0, blocks,
+                                  (uint32_t)sizeof(header) + size};
+      append(&header, sizeof(header));
+    };
+    SparseHeader header = {SPARSE_HEADER_MAGIC, 1, 0,
+                           sizeof(SparseHeader), sizeof(SparseChunkHeader),
+                           blk_sz, 21, 6, 0};
+    const uint64_t base = 4 * MiB;
+    uint32_t fill = 0xdeadbeef;
+    uint32_t zero = 0;
+
+    append(&header, sizeof(header));
+    std::vector<uint8_t> raw = pattern(2 * blk_sz, 4);
+    chunk(CHUNK_TYPE_RAW, 2, raw.size());
+    append(raw.data(), raw.size());
+    put(base, raw);
+    chunk(CHUNK_TYPE_DONT_CARE, 10, 0);
+    chunk(CHUNK_TYPE_FILL, 3, sizeof(fill));
+    append(&fill, sizeof(fill));
+    for (uint32_t n = 0; n < 3 * blk_sz; n += sizeof(fill))
+      memcpy(expected_.data() + base + 12 * blk_sz + n, &fill, sizeof(fill));
+    chunk(CHUNK_TYPE_FILL, 5, sizeof(zero));
+    append(&zero, sizeof(zero));
+    chunk(CHUNK_TYPE_CRC32, 0, sizeof(zero));
+    append(&zero, sizeof(zero));
+    raw = pattern(blk_sz, 5);
+    chunk(CHUNK_TYPE_RAW, 1, raw.size());
+    append(raw.data(), raw.size());
+    put(base + 20 * blk_sz, raw);
+
+    ASSERT_EQ((int)image.size(),
+              base::WriteFile(path("system.img"), (const char*)image.data(),
+                              image.size()));
+  }
+
+  DiskImageArgs Args() {
+    DiskImageArgs args;
+    args.input = table_;
+    args.output = path("full-disk-image.img");
+    args.images["boot_a"] = path("boot.img");
+    args.images["boot_b"] = path("boot.img");
+    args.images["system"] = path("system.img");
+    args.allow_empty_partitions = true;
+    return args;
+  }
+
+  std::vector<uint8_t> ReadOutput(const char* name = "full-disk-image.img") {
+    std::string data;
+    EXPECT_TRUE(base::ReadFileToString(path(name), &data));
+    return std::vector<uint8_t>(data.begin(), data.end());
+  }
+
+  TempDir dir_;
+  base::FilePath table_;
+  DiskLayout layout_;
+  std::vector<uint8_t> expected_;
+};
+
+TEST_F(MakeDiskImageTest, WritesOnlyData) {
+  // GPTs, the non-zero blocks of boot.img twice and 6 blocks of system.img.
+  const uint64_t expected_written =
+      (34 + 33) * 512 + 2 * 236 * 1024 + 6 * 4096;
+
+  for (int num_jobs : {1, 4}) {
+    for (bool clone : {false, true}) {
+      SCOPED_TRACE(testing::Message() << num_jobs << " " << clone);
+      DiskImageArgs args = Args();
+      DiskImageStats stats;
+      args.num_jobs = num_jobs;
+      args.clone = clone;
+
+      ASSERT_EQ(1, make_disk_image(args, &stats));
+      EXPECT_TRUE(expected_ == ReadOutput());
+      EXPECT_EQ(16U * MiB, stats.logical_size);
+      if (clone) {
+        EXPECT_LE(stats.bytes_written, expected_written);
+      } else {
+        EXPECT_EQ(expected_written, stats.bytes_written);
+        EXPECT_EQ(0U, stats.bytes_cloned);
+      }
+    }
+  }
+}
+
+TEST_F(MakeDiskImageTest, Sparse) {
+  DiskImageArgs args = Args();
+  DiskImageStats stats;
+  args.sparse = true;
+
+  ASSERT_EQ(1, make_disk_image(args, &stats));
+  EXPECT_EQ(16U * MiB, stats.logical_size);
+  std::vector<uint8_t> sparse = ReadOutput();
+  EXPECT_EQ(sparse.size(), stats.bytes_written);
+  // The slot copies are stored twice, but nothing else is.
+  EXPECT_LT(sparse.size(), 1U * MiB);
+
+  int in_fd = open(args.output.value().c_str(), O_RDONLY);
+  ASSERT_GE(in_fd, 0);
+  int out_fd = open(path("unsparse.img").value().c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(out_fd, 0);
+  EXPECT_EQ(1, unsparse_image(in_fd, out_fd, &stats));
+  close(in_fd);
+  close(out_fd);
+  EXPECT_EQ(16U * MiB, stats.logical_size);
+  EXPECT_LT(stats.bytes_written, 1U * MiB);
+  std::string data;
+  ASSERT_TRUE(base::ReadFileToString(path("unsparse.img"), &data));
+  EXPECT_TRUE(expected_ == std::vector<uint8_t>(data.begin(), data.end()));
+
+  // The image ends with the CRC32 chunk. Damage the checksum.
+  sparse[sparse.size() - 1] ^= 1;
+  ASSERT_EQ((int)sparse.size(),
+            base::WriteFile(args.output, (const char*)sparse.data(),
+                            sparse.size()));
+  in_fd = open(args.output.value().c_str(), O_RDONLY);
+  ASSERT_GE(in_fd, 0);
+  out_fd = open(path("unsparse.img").value().c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(out_fd, 0);
+  EXPECT_EQ(0, unsparse_image(in_fd, out_fd, &stats));
+  close(in_fd);
+  close(out_fd);
+}
+
+TEST_F(MakeDiskImageTest, Incremental) {
+  const uint64_t gpt_size = (34 + 33) * 512;
+  uint64_t partitions_size = 0;
+  for (const DiskPartition& part : layout_.partitions)
+    partitions_size += part.size;
+  DiskImageArgs args = Args();
+  DiskImageStats stats;
+  args.incremental = true;
+  base::FilePath manifest = path("full-disk-image.img.manifest");
+
+  ASSERT_EQ(1, make_disk_image(args, &stats));
+  EXPECT_TRUE(expected_ == ReadOutput());
+  EXPECT_EQ(0U, stats.bytes_reused);
+  EXPECT_TRUE(base::PathExists(manifest));
+
+  // Nothing changed: only the GPTs are written.
+  ASSERT_EQ(1, make_disk_image(args, &stats));
+  EXPECT_TRUE(expected_ == ReadOutput());
+  EXPECT_EQ(gpt_size, stats.bytes_written);
+  EXPECT_EQ(partitions_size, stats.bytes_reused);
+
+  // The same contents with a new modification time are hashed again but
+  // not rewritten.
+  std::vector<uint8_t> boot = ReadOutput("boot.img");
+  ASSERT_EQ((int)boot.size(), base::WriteFile(path("boot.img"),
+                                              (const char*)boot.data(),
+                                              boot.size()));
+  ASSERT_EQ(1, make_disk_image(args, &stats));
+  EXPECT_EQ(gpt_size, stats.bytes_written);
+
+  // A smaller boot.img rewrites both boot slots, and the rest of the old
+  // image in them is gone.
+  std::vector<uint8_t> new_boot = pattern(50 * 1024, 9);
+  ASSERT_EQ((int)new_boot.size(),
+            base::WriteFile(path("boot.img"), (const char*)new_boot.data(),
+                            new_boot.size()));
+  ASSERT_EQ(1, make_disk_image(args, &stats));
+  EXPECT_EQ(partitions_size - 2 * 1 * MiB, stats.bytes_reused);
+  DiskImageArgs full_args = Args();
+  full_args.output = path("full.img");
+  DiskImageStats full_stats;
+  ASSERT_EQ(1, make_disk_image(full_args, &full_stats));
+  std::vector<uint8_t> full = ReadOutput("full.img");
+  EXPECT_TRUE(full == ReadOutput());
+
+  // So does leaving them empty.
+  args.images.erase("boot_b");
+  full_args.images.erase("boot_b");
+  ASSERT_EQ(1, make_disk_image(args, &stats));
+  EXPECT_EQ(partitions_size - 1 * MiB, stats.bytes_reused);
+  ASSERT_EQ(1, make_disk_image(full_args, &full_stats));
+  EXPECT_TRUE(ReadOutput("full.img") == ReadOutput());
+
+  // Anything else writing to the image makes the next build a full one.
+  int fd = open(args.output.value().c_str(), O_WRONLY);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(1, pwrite(fd, "x", 1, 5 * MiB));
+  // The write may land in the same clock tick as the build.
+  const struct timespec times[2] = {{0, UTIME_OMIT}, {1, 0}};
+  ASSERT_EQ(0, futimens(fd, times));
+  close(fd);
+  ASSERT_EQ(1, make_disk_image(args, &stats));
+  EXPECT_EQ(0U, stats.bytes_reused);
+  EXPECT_TRUE(ReadOutput("full.img") == ReadOutput());
+
+  // As does a damaged manifest.
+  ASSERT_EQ(1, base::WriteFile(manifest, "{", 1));
+  ASSERT_EQ(1, make_disk_image(args, &stats));
+  EXPECT_EQ(0U, stats.bytes_reused);
+
+  // A build without --incremental drops the manifest.
+  args.incremental = false;
+  ASSERT_EQ(1, make_disk_image(args, &stats));
+  EXPECT_FALSE(base::PathExists(manifest));
+}
+
+TEST_F(MakeDiskImageTest, Errors) {
+  DiskImageStats stats;
+  DiskImageArgs args = Args();
+
+  args.allow_empty_partitions = false;
+  EXPECT_EQ(0, make_disk_image(args, &stats));
+
+  args = Args();
+  args.images["nonexistent"] = path("boot.img");
+  EXPECT_EQ(0, make_disk_image(args, &stats));
+
+  args = Args();
+  args.images["misc"] = path("boot.img");
+  EXPECT_EQ(0, make_disk_image(args, &stats));
+
+  args = Args();
+  args.images["misc"] = path("missing.img");
+  EXPECT_EQ(0, make_disk_image(args, &stats));
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BUB_SPARSE_FORMAT_H_
+#define BUB_SPARSE_FORMAT_H_
+
+#include <stdint.h>
+
+/* On-disk layout of Android sparse images, as read and written by
+ * system/core/libsparse. All fields are little-endian.
+ */
+
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+#define SPARSE_MAJOR_VERSION 1
+
+#define CHUNK_TYPE_RAW 0xCAC1
+#define CHUNK_TYPE_FILL 0xCAC2
+#define CHUNK_TYPE_DONT_CARE 0xCAC3
+#define CHUNK_TYPE_CRC32 0xCAC4
+
+typedef struct {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  // Size of this header and of each chunk header, in bytes.
+  uint16_t file_hdr_sz;
+  uint16_t chunk_hdr_sz;
+  // Block size in bytes, a multiple of 4.
+  uint32_t blk_sz;
+  // Size of the expanded image in blocks.
+  uint32_t total_blks;
+  uint32_t total_chunks;
+  // CRC32 of the expanded image. Unused, libsparse writes zero.
+  uint32_t image_checksum;
+} __attribute__((__packed__)) SparseHeader;
+
+typedef struct {
+  uint16_t chunk_type;
+  uint16_t reserved1;
+  // Size of the chunk in the expanded image, in blocks.
+  uint32_t chunk_sz;
+  // Size of the chunk in the sparse image, including this header.
+  uint32_t total_sz;
+} __attribute__((__packed__)) SparseChunkHeader;
+
+#endif /* BUB_SPARSE_FORMAT_H_ */
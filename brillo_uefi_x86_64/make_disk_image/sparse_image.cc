@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "sparse_image.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "../boot_loader/bub_util.h"
+
+using namespace std;
+
+// Sparse output is written to the file in pieces of about this size.
+#define OUT_BUFFER_SIZE (1024 * 1024)
+
+/* Returns the CRC32 of the data |crc| is the CRC32 of, followed by |length|
+ * zero bytes.
+ */
+static uint32_t crc32_zeros(uint32_t crc, uint64_t length) {
+  // CRC32 of 2^k zero bytes at index k.
+  static const vector<uint32_t> zeros_crc = []() {
+    vector<uint32_t> table(63);
+    uint8_t zero = 0;
+    table[0] = bub_crc32(0, &zero, 1);
+    for (size_t k = 1; k < table.size(); ++k) {
+      table[k] = crc32_combine(table[k - 1], table[k - 1],
+                               (z_off_t)1 << (k - 1));
+    }
+    return table;
+  }();
+
+  for (size_t k = 0; length > 0; ++k, length >>= 1) {
+    if (length & 1)
+      crc = crc32_combine(crc, zeros_crc[k], (z_off_t)1 << k);
+  }
+  return crc;
+}
+
+SparseImageWriter::SparseImageWriter(int fd, uint64_t size)
+    : fd_(fd),
+      num_blocks_(size / SPARSE_BLOCK_SIZE),
+      write_end_(0),
+      out_pos_(0),
+      num_chunks_(0),
+      next_block_(0),
+      crc_(0),
+      chunk_type_(0),
+      chunk_blocks_(0),
+      chunk_fill_(0),
+      chunk_header_pos_(0),
+      partial_(SPARSE_BLOCK_SIZE),
+      partial_block_(0),
+      partial_valid_(false),
+      failed_(false) {
+  SparseHeader header;
+
+  // Filled in by finish().
+  bub_memset(&header, 0, sizeof(header));
+  out_.reserve(OUT_BUFFER_SIZE + SPARSE_BLOCK_SIZE);
+  append(&header, sizeof(header));
+}
+
+int SparseImageWriter::write(uint64_t offset, const uint8_t* data,
+                             size_t size) {
+  const uint64_t image_size = num_blocks_ * SPARSE_BLOCK_SIZE;
+
+  if (offset < write_end_ || offset > image_size ||
+      size > image_size - offset) {
+    failed_ = true;
+    return 0;
+  }
+  write_end_ = offset + size;
+
+  while (size > 0) {
+    uint64_t block = offset / SPARSE_BLOCK_SIZE;
+    size_t in_block = offset % SPARSE_BLOCK_SIZE;
+    size_t n = min((size_t)SPARSE_BLOCK_SIZE - in_block, size);
+
+    if (partial_valid_ && partial_block_ != block)
+      flush_partial();
+    if (!partial_valid_ && n == SPARSE_BLOCK_SIZE) {
+      add_block(block, data);
+    } else {
+      if (!partial_valid_) {
+        bub_memset(partial_.data(), 0, SPARSE_BLOCK_SIZE);
+        partial_block_ = block;
+        partial_valid_ = true;
+      }
+      bub_memcpy(&partial_[in_block], data, n);
+      if (in_block + n == SPARSE_BLOCK_SIZE)
+        flush_partial();
+    }
+    offset += n;
+    data += n;
+    size -= n;
+  }
+  return !failed_;
+}
+
+int SparseImageWriter::finish() {
+  SparseHeader header;
+  SparseChunkHeader crc_header = {
+      CHUNK_TYPE_CRC32, 0, 0,
+      (uint32_t)(sizeof(SparseChunkHeader) + sizeof(crc_))};
+
+  if (partial_valid_)
+    flush_partial();
+  close_chunk();
+  skip_to(num_blocks_);
+  append(&crc_header, sizeof(crc_header));
+  append(&crc_, sizeof(crc_));
+  num_chunks_++;
+  flush();
+
+  header.magic = SPARSE_HEADER_MAGIC;
+  header.major_version = SPARSE_MAJOR_VERSION;
+  header.minor_version = 0;
+  header.file_hdr_sz = sizeof(SparseHeader);
+  header.chunk_hdr_sz = sizeof(SparseChunkHeader);
+  header.blk_sz = SPARSE_BLOCK_SIZE;
+  header.total_blks = (uint32_t)num_blocks_;
+  header.total_chunks = num_chunks_;
+  header.image_checksum = 0;
+  put(0, &header, sizeof(header));
+  return !failed_;
+}
+
+void SparseImageWriter::add_block(uint64_t block, const uint8_t* data) {
+  uint32_t fill;
+  uint16_t type;
+
+  // All-zero blocks are left to DONT_CARE chunks.
+  if (is_zero(data, SPARSE_BLOCK_SIZE))
+    return;
+  bub_memcpy(&fill, data, sizeof(fill));
+  if (memcmp(data, data + sizeof(fill), SPARSE_BLOCK_SIZE - sizeof(fill)) == 0)
+    type = CHUNK_TYPE_FILL;
+  else
+    type = CHUNK_TYPE_RAW;
+
+  if (chunk_blocks_ > 0 &&
+      (type != chunk_type_ || block != next_block_ ||
+       (type == CHUNK_TYPE_FILL && fill != chunk_fill_) ||
+       (type == CHUNK_TYPE_RAW && chunk_blocks_ == SPARSE_MAX_RAW_BLOCKS)))
+    close_chunk();
+  skip_to(block);
+
+  if (chunk_blocks_ == 0) {
+    SparseChunkHeader header;
+
+    chunk_type_ = type;
+    chunk_fill_ = fill;
+    chunk_header_pos_ = bytes_written();
+    // Filled in by close_chunk().
+    bub_memset(&header, 0, sizeof(header));
+    append(&header, sizeof(header));
+    if (type == CHUNK_TYPE_FILL)
+      append(&fill, sizeof(fill));
+  }
+  if (type == CHUNK_TYPE_RAW)
+    append(data, SPARSE_BLOCK_SIZE);
+  chunk_blocks_++;
+  next_block_ = block + 1;
+  crc_ = bub_crc32(crc_, data, SPARSE_BLOCK_SIZE);
+}
+
+void SparseImageWriter::flush_partial() {
+  partial_valid_ = false;
+  add_block(partial_block_, partial_.data());
+}
+
+void SparseImageWriter::close_chunk() {
+  SparseChunkHeader header;
+
+  if (chunk_blocks_ == 0)
+    return;
+  header.chunk_type = chunk_type_;
+  header.reserved1 = 0;
+  header.chunk_sz = chunk_blocks_;
+  header.total_sz = sizeof(header);
+  if (chunk_type_ == CHUNK_TYPE_RAW)
+    header.total_sz += chunk_blocks_ * SPARSE_BLOCK_SIZE;
+  else
+    header.total_sz += sizeof(chunk_fill_);
+  put(chunk_header_pos_, &header, sizeof(header));
+  num_chunks_++;
+  chunk_blocks_ = 0;
+}
+
+/* Covers the blocks from |next_block_| up to |block| with DONT_CARE
+ * chunks.
+ */
+void SparseImageWriter::skip_to(uint64_t block) {
+  while (next_block_ < block) {
+    uint32_t num_blocks =
+        (uint32_t)min(block - next_block_, (uint64_t)UINT32_MAX);
+    SparseChunkHeader header = {CHUNK_TYPE_DONT_CARE, 0, num_blocks,
+                                (uint32_t)sizeof(SparseChunkHeader)};
+
+    close_chunk();
+    append(&header, sizeof(header));
+    num_chunks_++;
+    crc_ = crc32_zeros(crc_, (uint64_t)num_blocks * SPARSE_BLOCK_SIZE);
+    next_block_ += num_blocks;
+  }
+}
+
+void SparseImageWriter::append(const void* data, size_t size) {
+  out_.insert(out_.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+  if (out_.size() >= OUT_BUFFER_SIZE)
+    flush();
+}
+
+/* Overwrites output at |pos|. Headers are appended whole, so they are either
+ * still in |out_| or already in the file.
+ */
+void SparseImageWriter::put(uint64_t pos, const void* data, size_t size) {
+  if (pos >= out_pos_)
+    bub_memcpy(&out_[pos - out_pos_], data, size);
+  else if (!pwrite_full(fd_, data, size, pos))
+    failed_ = true;
+}
+
+void SparseImageWriter::flush() {
+  if (!out_.empty() && !pwrite_full(fd_, out_.data(), out_.size(), out_pos_))
+    failed_ = true;
+  out_pos_ += out_.size();
+  out_.clear();
+}
+
+static int read_full(int fd, void* buf, size_t size) {
+  uint8_t* p = (uint8_t*)buf;
+
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+static int write_full(int fd, const void* buf, size_t size) {
+  const uint8_t* p = (const uint8_t*)buf;
+
+  while (size > 0) {
+    ssize_t n = ::write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+/* Reads and drops |size| bytes of |fd| through the COPY_BUFFER_SIZE bytes
+ * at |buf|.
+ */
+static int skip_input(int fd, size_t size, uint8_t* buf) {
+  while (size > 0) {
+    size_t n = min(size, (size_t)COPY_BUFFER_SIZE);
+    if (!read_full(fd, buf, n))
+      return 0;
+    size -= n;
+  }
+  return 1;
+}
+
+/* Writes |length| bytes of the 32-bit |value| repeated to |offset| of
+ * |fd|, and returns the CRC32 of the data before and these bytes in |crc|.
+ * Zeros are not written to regular files, which read them from holes.
+ */
+static int expand_fill(int fd, bool seekable, uint64_t offset,
+                       uint64_t length, uint32_t value, uint8_t* buf,
+                       uint32_t* crc, DiskImageStats* stats) {
+  for (size_t n = 0; n + sizeof(value) <= COPY_BUFFER_SIZE; n += sizeof(value))
+    bub_memcpy(buf + n, &value, sizeof(value));
+
+  if (value == 0) {
+    *crc = crc32_zeros(*crc, length);
+    if (seekable)
+      return 1;
+  }
+
+  for (uint64_t done = 0; done < length; ) {
+    size_t size = (size_t)min(length - done, (uint64_t)COPY_BUFFER_SIZE);
+    if (value != 0)
+      *crc = bub_crc32(*crc, buf, size);
+    if (seekable ? !pwrite_full(fd, buf, size, offset + done)
+                 : !write_full(fd, buf, size))
+      return 0;
+    stats->bytes_written += size;
+    done += size;
+  }
+  return 1;
+}
+
+int unsparse_image(int in_fd, int out_fd, DiskImageStats* stats) {
+  vector<uint8_t> buf(COPY_BUFFER_SIZE);
+  SparseHeader header;
+  struct stat st;
+  uint64_t offset = 0;
+  uint32_t crc = 0;
+
+  bub_memset(stats, 0, sizeof(*stats));
+  if (!read_full(in_fd, &header, sizeof(header)) ||
+      header.magic != SPARSE_HEADER_MAGIC ||
+      header.major_version != SPARSE_MAJOR_VERSION ||
+      header.file_hdr_sz < sizeof(SparseHeader) ||
+      header.chunk_hdr_sz < sizeof(SparseChunkHeader) ||
+      header.blk_sz == 0 || header.blk_sz % 4 != 0 ||
+      !skip_input(in_fd, header.file_hdr_sz - sizeof(header), buf.data())) {
+    cerr << "ERROR: Not an Android sparse image\n";
+    return 0;
+  }
+  stats->logical_size = (uint64_t)header.total_blks * header.blk_sz;
+
+  bool seekable = fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode);
+  if (seekable && (ftruncate(out_fd, 0) != 0 ||
+                   ftruncate(out_fd, stats->logical_size) != 0)) {
+    cerr << "ERROR: Cannot resize output\n";
+    return 0;
+  }
+
+  for (uint32_t n = 0; n < header.total_chunks; ++n) {
+    SparseChunkHeader chunk;
+    uint32_t value;
+    int ok = 1;
+
+    if (!read_full(in_fd, &chunk, sizeof(chunk)) ||
+        !skip_input(in_fd, header.chunk_hdr_sz - sizeof(chunk), buf.data()) ||
+        chunk.total_sz < header.chunk_hdr_sz) {
+      cerr << "ERROR: Truncated sparse image\n";
+      return 0;
+    }
+    uint64_t length = (uint64_t)chunk.chunk_sz * header.blk_sz;
+    uint32_t data_size = chunk.total_sz - header.chunk_hdr_sz;
+    if (length > stats->logical_size - offset) {
+      cerr << "ERROR: Chunk " << n << " ends past the image\n";
+      return 0;
+    }
+
+    switch (chunk.chunk_type) {
+      case CHUNK_TYPE_RAW:
+        if (data_size != length) {
+          cerr << "ERROR: Bad RAW chunk " << n << "\n";
+          return 0;
+        }
+        for (uint64_t done = 0; ok && done < length; ) {
+          size_t size =
+              (size_t)min(length - done, (uint64_t)COPY_BUFFER_SIZE);
+          if (!read_full(in_fd, buf.data(), size)) {
+            cerr << "ERROR: Truncated sparse image\n";
+            return 0;
+          }
+          crc = bub_crc32(crc, buf.data(), size);
+          if (seekable) {
+            ok = write_nonzero(out_fd, offset + done, buf.data(), size, stats);
+          } else {
+            ok = write_full(out_fd, buf.data(), size);
+            stats->bytes_written += size;
+          }
+          done += size;
+        }
+        break;
+      case CHUNK_TYPE_FILL:
+        if (data_size != sizeof(value) ||
+            !read_full(in_fd, &value, sizeof(value))) {
+          cerr << "ERROR: Bad FILL chunk " << n << "\n";
+          return 0;
+        }
+        ok = expand_fill(out_fd, seekable, offset, length, value, buf.data(),
+                         &crc, stats);
+        break;
+      case CHUNK_TYPE_DONT_CARE:
+        if (data_size != 0) {
+          cerr << "ERROR: Bad DONT_CARE chunk " << n << "\n";
+          return 0;
+        }
+        ok = expand_fill(out_fd, seekable, offset, length, 0, buf.data(),
+                         &crc, stats);
+        break;
+      case CHUNK_TYPE_CRC32:
+        if (data_size != sizeof(value) ||
+            !read_full(in_fd, &value, sizeof(value))) {
+          cerr << "ERROR: Bad CRC32 chunk " << n << "\n";
+          return 0;
+        }
+        if (value != crc) {
+          cerr << "ERROR: CRC32 mismatch at chunk " << n << "\n";
+          return 0;
+        }
+        break;
+      default:
+        cerr << "ERROR: Unknown chunk type " << chunk.chunk_type << "\n";
+        return 0;
+    }
+    if (!ok) {
+      cerr << "ERROR: Cannot write output\n";
+      return 0;
+    }
+    offset += length;
+  }
+
+  if (offset != stats->logical_size) {
+    cerr << "ERROR: Chunks do not cover the image\n";
+    return 0;
+  }
+  return 1;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BUB_SPARSE_IMAGE_H_
+#define BUB_SPARSE_IMAGE_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "make_disk_image.h"
+#include "sparse_format.h"
+
+// Block size of the sparse images written.
+#define SPARSE_BLOCK_SIZE 4096
+// Largest RAW chunk written, in blocks.
+#define SPARSE_MAX_RAW_BLOCKS (64 * 1024 * 1024 / SPARSE_BLOCK_SIZE)
+
+/* Writes an Android sparse image of a |size| byte image to |fd|, from
+ * writes that come in increasing offset order. Blocks that are never
+ * written or all zeros become DONT_CARE chunks and blocks repeating one
+ * 32-bit value become FILL chunks. A CRC32 chunk with the checksum of the
+ * expanded image ends the file.
+ *
+ * The output is written front to back, except that chunk and file headers
+ * are filled in once known, so |fd| must be a regular file.
+ */
+class SparseImageWriter {
+ public:
+  // |size| must be a multiple of SPARSE_BLOCK_SIZE.
+  SparseImageWriter(int fd, uint64_t size);
+
+  /* Writes |size| bytes at |offset| of the expanded image. |offset| must
+   * not be below the end of the previous write.
+   *
+   * @return: 0 on I/O errors or bad offsets, 1 otherwise.
+   */
+  int write(uint64_t offset, const uint8_t* data, size_t size);
+
+  // Writes the rest of the image. Returns 0 on I/O errors.
+  int finish();
+
+  // Size of the sparse image written so far.
+  uint64_t bytes_written() const { return out_pos_ + out_.size(); }
+
+ private:
+  void add_block(uint64_t block, const uint8_t* data);
+  void flush_partial();
+  void close_chunk();
+  void skip_to(uint64_t block);
+  void append(const void* data, size_t size);
+  void put(uint64_t pos, const void* data, size_t size);
+  void flush();
+
+  int fd_;
+  uint64_t num_blocks_;
+  // End of the previous write.
+  uint64_t write_end_;
+  // Output not yet written to |fd_|, which starts at |out_pos_|.
+  std::vector<uint8_t> out_;
+  uint64_t out_pos_;
+  uint32_t num_chunks_;
+  // First block not in a chunk yet, and CRC32 of the blocks before it.
+  uint64_t next_block_;
+  uint32_t crc_;
+  // The RAW or FILL chunk being written, if |chunk_blocks_| is non-zero.
+  uint16_t chunk_type_;
+  uint32_t chunk_blocks_;
+  uint32_t chunk_fill_;
+  uint64_t chunk_header_pos_;
+  // A block only partly written so far, if |partial_valid_|.
+  std::vector<uint8_t> partial_;
+  uint64_t partial_block_;
+  bool partial_valid_;
+  bool failed_;
+};
+
+/* Expands the Android sparse image read from |in_fd| to |out_fd|. |in_fd|
+ * is read front to back only and may be a pipe. If |out_fd| is a regular
+ * file, it is truncated to the image size and only non-zero blocks are
+ * written; otherwise every byte is. CRC32 chunks are checked.
+ *
+ * stats->logical_size receives the image size and stats->bytes_written the
+ * bytes written to |out_fd|.
+ */
+int unsparse_image(int in_fd, int out_fd, DiskImageStats* stats);
+
+#endif /* BUB_SPARSE_IMAGE_H_ */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "sparse_image.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+
+using namespace std;
+
+static void print_usage(void) {
+  cerr << "Usage:\n"
+          "  unsparse_image INPUT OUTPUT\n\n"
+          "Expands the Android sparse image INPUT to OUTPUT. Either may be\n"
+          "'-' for stdin or stdout.\n\n";
+}
+
+int main(int argc, const char *argv[]) {
+  DiskImageStats stats;
+  int in_fd = STDIN_FILENO;
+  int out_fd = STDOUT_FILENO;
+
+  if (argc != 3) {
+    print_usage();
+    return 1;
+  }
+
+  if (strcmp(argv[1], "-") != 0) {
+    in_fd = open(argv[1], O_RDONLY);
+    if (in_fd < 0) {
+      cerr << "ERROR: Cannot open " << argv[1] << "\n";
+      return 1;
+    }
+  }
+  if (strcmp(argv[2], "-") != 0) {
+    out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+      cerr << "ERROR: Cannot create " << argv[2] << "\n";
+      return 1;
+    }
+  }
+
+  if (!unsparse_image(in_fd, out_fd, &stats))
+    return 1;
+  if (out_fd != STDOUT_FILENO && close(out_fd) != 0) {
+    cerr << "ERROR: Cannot write " << argv[2] << "\n";
+    return 1;
+  }
+
+  if (out_fd != STDOUT_FILENO) {
+    cout << argv[2] << ": " << stats.logical_size << " bytes, "
+         << stats.bytes_written << " written\n";
+  }
+  return 0;
+}
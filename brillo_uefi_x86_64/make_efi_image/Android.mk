@@ -16,9 +16,71 @@
 
 LOCAL_PATH := $(call my-dir)
 
+common_cflags := \
+    -D_FILE_OFFSET_BITS=64 \
+    -Wa,--noexecstack \
+    -Werror \
+    -Wall \
+    -Wextra \
+    -Wformat=2 \
+    -Wno-psabi \
+    -Wno-unused-parameter \
+    -ffunction-sections \
+    -fstack-protector-strong \
+    -fvisibility=hidden
+common_cppflags := \
+    -Wnon-virtual-dtor \
+    -fno-strict-aliasing
+common_ldflags := \
+    -Wl,--gc-sections
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := libefiimg_unittest
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CLANG := true
+LOCAL_CFLAGS := $(common_cflags)
+LOCAL_CPPFLAGS := $(common_cppflags)
+LOCAL_LDFLAGS := $(common_ldflags)
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/make_efi_image.h \
+    $(LOCAL_PATH)/../boot_loader/bub_image_util.h \
+    $(LOCAL_PATH)/../boot_loader/bub_sysdeps.h \
+    $(LOCAL_PATH)/../boot_loader/bub_util.h \
+    external/gtest/include
+LOCAL_STATIC_LIBRARIES := \
+    libbub_host \
+    libgmock_host \
+    libgtest_host
+LOCAL_SHARED_LIBRARIES := \
+    libchrome
+LOCAL_SRC_FILES := \
+    ../boot_loader/bub_image_util.cc \
+    make_efi_image.cc \
+    make_efi_image_unittest.cc
+LOCAL_LDLIBS_linux := -lrt -lpthread
+include $(BUILD_HOST_NATIVE_TEST)
+
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := make_efi_image
-LOCAL_MODULE_CLASS := EXECUTABLES
-LOCAL_IS_HOST_MODULE := true
 LOCAL_MODULE := make_efi_image
-include $(BUILD_PREBUILT)
\ No newline at end of file
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_IS_HOST_MODULE := true
+LOCAL_MODULE_CLASS := EXECUTABLES
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CLANG := true
+LOCAL_CFLAGS := $(common_cflags)
+LOCAL_CPPFLAGS := $(common_cppflags)
+LOCAL_LDFLAGS := $(common_ldflags)
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/make_efi_image.h \
+    $(LOCAL_PATH)/../boot_loader/bub_sysdeps.h \
+    $(LOCAL_PATH)/../boot_loader/bub_util.h
+LOCAL_STATIC_LIBRARIES := \
+    libbub_host
+LOCAL_SHARED_LIBRARIES := \
+    libchrome
+LOCAL_SRC_FILES := \
+    main.cc \
+    make_efi_image.cc
+LOCAL_LDLIBS_linux := -lrt
+include $(BUILD_HOST_EXECUTABLE)
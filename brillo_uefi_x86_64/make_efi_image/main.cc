@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "make_efi_image.h"
+
+#include <iostream>
+
+using namespace std;
+
+static void print_usage(void) {
+  cerr << "Usage:\n"
+          "  make_efi_image SIZE /PATH/TO/EFI_IMAGE\n"
+          "    [/PATH/TO/HOST_EFI_FILE:/PATH/TO/TARGET_EFI_FILE ...]\n\n"
+          "Writes a FAT image of SIZE bytes with the given files. File times\n"
+          "are SOURCE_DATE_EPOCH if set, otherwise 1980-01-01.\n\n";
+}
+
+int main(int argc, const char *argv[]) {
+  EfiImageArgs args;
+
+  if (!parse_efi_image_args(argc, argv, &args)) {
+    print_usage();
+    return 1;
+  }
+  return make_efi_image(args) ? 0 : 1;
+}
@@ -0,0 +1,822 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "make_efi_image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "../boot_loader/bub_sysdeps.h"
+
+using namespace base;
+using namespace std;
+
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define ATTR_LONG_NAME 0x0f
+// Lowercase flags of a short entry, as Windows NT and Linux use them.
+#define CASE_LOWER_BASE 0x08
+#define CASE_LOWER_EXT 0x10
+// Characters of a long name held by one directory entry.
+#define LFN_CHARS_PER_ENTRY 13
+#define LFN_MAX_CHARS 255
+// Size of the buffer files are copied through.
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+/* A file or directory in the image. */
+struct FatNode {
+  string name;
+  uint8_t name83[11];
+  uint8_t case_flags;
+  bool long_name;
+  bool is_dir;
+  FilePath host;
+  // File size, or the size of the entries of a directory.
+  uint64_t size;
+  uint32_t first_cluster;
+  uint32_t num_clusters;
+  size_t parent;
+  vector<size_t> children;
+};
+
+static void put_le16(uint8_t* p, uint16_t value) {
+  p[0] = value & 0xff;
+  p[1] = value >> 8;
+}
+
+static void put_le32(uint8_t* p, uint32_t value) {
+  put_le16(p, value & 0xffff);
+  put_le16(p + 2, value >> 16);
+}
+
+static int pwrite_full(int fd, const void* buf, size_t size,
+                       uint64_t offset) {
+  const uint8_t* p = (const uint8_t*)buf;
+
+  while (size > 0) {
+    ssize_t num_written = pwrite(fd, p, size, offset);
+    if (num_written < 0 && errno == EINTR)
+      continue;
+    if (num_written <= 0)
+      return 0;
+    p += num_written;
+    offset += num_written;
+    size -= num_written;
+  }
+  return 1;
+}
+
+int parse_efi_image_args(int argc, const char* argv[], EfiImageArgs* args) {
+  char* end;
+
+  if (argc < 3)
+    return 0;
+
+  errno = 0;
+  unsigned long long size = strtoull(argv[1], &end, 10);
+  if (argv[1][0] < '0' || argv[1][0] > '9' || *end != '\0' || errno != 0 ||
+      size == 0 || size > UINT32_MAX * (uint64_t)FAT_SECTOR_SIZE) {
+    cerr << "ERROR: Bad image size " << argv[1] << "\n";
+    return 0;
+  }
+  args->image_size = (size + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE *
+                     FAT_SECTOR_SIZE;
+  args->output = FilePath(argv[2]);
+
+  for (int n = 3; n < argc; ++n) {
+    const char* colon = strchr(argv[n], ':');
+    if (colon == NULL || colon == argv[n] || colon[1] == '\0') {
+      cerr << "ERROR: " << argv[n]
+           << " is not /PATH/TO/HOST_EFI_FILE:/PATH/TO/TARGET_EFI_FILE\n";
+      return 0;
+    }
+    EfiFile file;
+    file.host = FilePath(string(argv[n], colon - argv[n]));
+    file.target = colon + 1;
+    args->files.push_back(file);
+  }
+
+  const char* epoch = getenv("SOURCE_DATE_EPOCH");
+  if (epoch != NULL && epoch[0] != '\0') {
+    errno = 0;
+    long long timestamp = strtoll(epoch, &end, 10);
+    if (*end != '\0' || errno != 0) {
+      cerr << "ERROR: Bad SOURCE_DATE_EPOCH " << epoch << "\n";
+      return 0;
+    }
+    args->timestamp = (time_t)timestamp;
+  }
+  return 1;
+}
+
+/* Fills in the FAT size and cluster count of |layout| for its cluster
+ * size and FAT entry size.
+ */
+static int size_fats(FatLayout* layout) {
+  const uint32_t overhead =
+      layout->reserved_sectors + layout->root_dir_sectors;
+
+  layout->fat_sectors = 1;
+  for (;;) {
+    uint64_t used = overhead + (uint64_t)layout->num_fats * layout->fat_sectors;
+    if (used >= layout->num_sectors)
+      return 0;
+    uint32_t clusters =
+        (layout->num_sectors - used) / layout->sectors_per_cluster;
+    uint64_t fat_bytes = ((uint64_t)clusters + 2) * layout->fat_bits / 8 + 1;
+    uint32_t needed = (fat_bytes + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE;
+    if (needed <= layout->fat_sectors) {
+      layout->first_data_sector = used;
+      layout->num_clusters = clusters;
+      return clusters > 0;
+    }
+    layout->fat_sectors = needed;
+  }
+}
+
+int compute_fat_layout(uint64_t num_sectors, FatLayout* layout) {
+  // Cluster sizes Microsoft's FAT specification recommends, by volume size.
+  static const struct {
+    uint32_t max_sectors;
+    uint32_t sectors_per_cluster;
+  } fat32_clusters[] = {
+      {532480, 1}, {16777216, 8}, {33554432, 16}, {67108864, 32},
+      {UINT32_MAX, 64},
+  }, fat16_clusters[] = {
+      {32680, 2}, {262144, 4}, {524288, 8}, {1048576, 16}, {2097152, 32},
+      {UINT32_MAX, 64},
+  };
+
+  if (num_sectors > UINT32_MAX) {
+    cerr << "ERROR: Image too large for FAT\n";
+    return 0;
+  }
+  bub_memset(layout, 0, sizeof(*layout));
+  layout->num_sectors = num_sectors;
+  layout->num_fats = 2;
+
+  // FAT32 when there are enough clusters of the recommended size.
+  layout->fat_bits = 32;
+  layout->reserved_sectors = 32;
+  for (const auto& entry : fat32_clusters) {
+    if (num_sectors <= entry.max_sectors) {
+      layout->sectors_per_cluster = entry.sectors_per_cluster;
+      break;
+    }
+  }
+  if (size_fats(layout) && layout->num_clusters >= FAT32_MIN_CLUSTERS)
+    return 1;
+
+  layout->fat_bits = 16;
+  layout->reserved_sectors = 1;
+  layout->root_dir_sectors =
+      FAT_ROOT_ENTRIES * FAT_DIR_ENTRY_SIZE / FAT_SECTOR_SIZE;
+  for (const auto& entry : fat16_clusters) {
+    if (num_sectors <= entry.max_sectors) {
+      layout->sectors_per_cluster = entry.sectors_per_cluster;
+      break;
+    }
+  }
+  if (size_fats(layout) && layout->num_clusters >= FAT16_MIN_CLUSTERS &&
+      layout->num_clusters < FAT32_MIN_CLUSTERS)
+    return 1;
+
+  // FAT12 with the smallest clusters that keep the count in range.
+  layout->fat_bits = 12;
+  for (layout->sectors_per_cluster = 1; layout->sectors_per_cluster <= 128;
+       layout->sectors_per_cluster *= 2) {
+    if (!size_fats(layout))
+      break;
+    if (layout->num_clusters < FAT16_MIN_CLUSTERS)
+      return 1;
+  }
+  cerr << "ERROR: Image of " << num_sectors << " sectors is too small\n";
+  return 0;
+}
+
+/* Characters allowed in short names besides letters and digits. */
+static bool is_short_char(char c) {
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+         (c >= '0' && c <= '9') || (c != 0 && strchr("!#$%&'()-@^_`{}~", c));
+}
+
+/* Returns CASE_LOWER_BASE-like |lower_flag| if |part| is all lowercase, 0
+ * if it has no lowercase letters, and -1 if it has both cases.
+ */
+static int case_of(const string& part, int lower_flag) {
+  bool lower = false;
+  bool upper = false;
+
+  for (char c : part) {
+    lower |= c >= 'a' && c <= 'z';
+    upper |= c >= 'A' && c <= 'Z';
+  }
+  if (lower && upper)
+    return -1;
+  return lower ? lower_flag : 0;
+}
+
+int fat_short_name(const string& name, uint8_t name83[11],
+                   uint8_t* case_flags) {
+  size_t dot = name.find('.');
+  string base = name.substr(0, dot);
+  string ext = dot == string::npos ? "" : name.substr(dot + 1);
+
+  if (base.empty() || base.size() > 8 || ext.size() > 3 ||
+      (dot != string::npos && ext.empty()))
+    return 0;
+  for (char c : base + ext) {
+    if (!is_short_char(c))
+      return 0;
+  }
+  int base_case = case_of(base, CASE_LOWER_BASE);
+  int ext_case = case_of(ext, CASE_LOWER_EXT);
+  if (base_case < 0 || ext_case < 0)
+    return 0;
+
+  bub_memset(name83, ' ', 11);
+  for (size_t n = 0; n < base.size(); ++n)
+    name83[n] = toupper(base[n]);
+  for (size_t n = 0; n < ext.size(); ++n)
+    name83[8 + n] = toupper(ext[n]);
+  *case_flags = base_case | ext_case;
+  return 1;
+}
+
+/* Returns non-zero if |name| can be a long name. */
+static int valid_long_name(const string& name) {
+  if (name.empty() || name.size() > LFN_MAX_CHARS || name == "." ||
+      name == ".." || name.back() == '.' || name.back() == ' ')
+    return 0;
+  for (char c : name) {
+    // Only ASCII, which long names hold as UCS-2.
+    if (c < 0x20 || c > 0x7e || strchr("\"*/:<>?\\|", c))
+      return 0;
+  }
+  return 1;
+}
+
+/* Picks the short name of a node that needs a long name, "BASIS~N.EXT" as
+ * Windows makes them, unlike any of |taken|.
+ */
+static void make_numbered_name(const vector<string>& taken, FatNode* node) {
+  string base;
+  string ext;
+  size_t last_dot = node->name.rfind('.');
+
+  for (size_t n = 0; n < node->name.size(); ++n) {
+    char c = node->name[n];
+    if (c == ' ' || c == '.') {
+      if (n == last_dot && n != 0)
+        break;
+      continue;
+    }
+    base += is_short_char(c) ? (char)toupper(c) : '_';
+  }
+  if (last_dot != string::npos && last_dot != 0) {
+    for (size_t n = last_dot + 1; n < node->name.size() && ext.size() < 3;
+         ++n) {
+      char c = node->name[n];
+      if (c != ' ')
+        ext += is_short_char(c) ? (char)toupper(c) : '_';
+    }
+  }
+  if (base.empty())
+    base = "_";
+
+  for (unsigned number = 1;; ++number) {
+    string tail = "~" + to_string(number);
+    string name = base.substr(0, 8 - tail.size()) + tail;
+    bub_memset(node->name83, ' ', 11);
+    bub_memcpy(node->name83, name.data(), name.size());
+    bub_memcpy(node->name83 + 8, ext.data(), ext.size());
+
+    if (find(taken.begin(), taken.end(),
+             string((const char*)node->name83, 11)) == taken.end())
+      return;
+  }
+}
+
+static bool same_name(const string& a, const string& b) {
+  return a.size() == b.size() && strncasecmp(a.c_str(), b.c_str(),
+                                             a.size()) == 0;
+}
+
+/* Adds the node called |name| to directory |parent| of |nodes|, or returns
+ * the existing directory of that name in |*index|.
+ */
+static int add_node(vector<FatNode>* nodes, size_t parent, const string& name,
+                    bool is_dir, size_t* index) {
+  for (size_t child : (*nodes)[parent].children) {
+    if (!same_name((*nodes)[child].name, name))
+      continue;
+    if (!is_dir || !(*nodes)[child].is_dir)
+      return 0;
+    *index = child;
+    return 1;
+  }
+
+  FatNode node;
+  node.name = name;
+  node.is_dir = is_dir;
+  node.size = 0;
+  node.first_cluster = 0;
+  node.num_clusters = 0;
+  node.parent = parent;
+  node.long_name = !fat_short_name(name, node.name83, &node.case_flags);
+
+  vector<string> taken;
+  for (size_t child : (*nodes)[parent].children)
+    taken.push_back(string((const char*)(*nodes)[child].name83, 11));
+  if (node.long_name) {
+    node.case_flags = 0;
+    make_numbered_name(taken, &node);
+  } else {
+    // A name such as "BOOTX6~1.EFI" may be what an earlier long name was
+    // shortened to. That one gets another number.
+    taken.push_back(string((const char*)node.name83, 11));
+    for (size_t child : (*nodes)[parent].children) {
+      FatNode* other = &(*nodes)[child];
+      if (memcmp(other->name83, node.name83, 11) == 0)
+        make_numbered_name(taken, other);
+    }
+  }
+  *index = nodes->size();
+  (*nodes)[parent].children.push_back(*index);
+  nodes->push_back(node);
+  return 1;
+}
+
+/* Builds the tree of |files| in |nodes|, with the root directory first. */
+static int build_tree(const vector<EfiFile>& files, vector<FatNode>* nodes) {
+  FatNode root;
+  root.is_dir = true;
+  root.long_name = false;
+  root.size = 0;
+  root.first_cluster = 0;
+  root.num_clusters = 0;
+  root.parent = 0;
+  nodes->assign(1, root);
+
+  for (const EfiFile& file : files) {
+    vector<string> names;
+    size_t start = 0;
+    for (;;) {
+      size_t slash = file.target.find('/', start);
+      string name = file.target.substr(start, slash - start);
+      if (!name.empty())
+        names.push_back(name);
+      if (slash == string::npos)
+        break;
+      start = slash + 1;
+    }
+    if (names.empty()) {
+      cerr << "ERROR: No target path for " << file.host.value() << "\n";
+      return 0;
+    }
+
+    size_t dir = 0;
+    for (size_t n = 0; n < names.size(); ++n) {
+      bool is_dir = n + 1 < names.size();
+      size_t index;
+      if (!valid_long_name(names[n])) {
+        cerr << "ERROR: Bad file name " << names[n] << " in " << file.target
+             << "\n";
+        return 0;
+      }
+      if (!add_node(nodes, dir, names[n], is_dir, &index)) {
+        cerr << "ERROR: " << file.target
+             << " clashes with another path in the image\n";
+        return 0;
+      }
+      dir = index;
+    }
+
+    struct stat st;
+    FatNode& node = (*nodes)[dir];
+    if (stat(file.host.value().c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      cerr << "ERROR: Cannot read " << file.host.value() << "\n";
+      return 0;
+    }
+    if ((uint64_t)st.st_size > UINT32_MAX) {
+      cerr << "ERROR: " << file.host.value() << " is too large for FAT\n";
+      return 0;
+    }
+    node.host = file.host;
+    node.size = st.st_size;
+  }
+  return 1;
+}
+
+/* Number of directory entries |node| takes in its parent. */
+static size_t num_entries(const FatNode& node) {
+  if (!node.long_name)
+    return 1;
+  return 1 + (node.name.size() + LFN_CHARS_PER_ENTRY - 1) /
+                 LFN_CHARS_PER_ENTRY;
+}
+
+/* Assigns contiguous clusters to the directories and then to the files, in
+ * the order of |nodes|.
+ */
+static int allocate_clusters(const FatLayout& layout, vector<FatNode>* nodes,
+                             uint32_t* next_cluster) {
+  const uint64_t cluster_size =
+      (uint64_t)layout.sectors_per_cluster * FAT_SECTOR_SIZE;
+
+  *next_cluster = 2;
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t n = 0; n < nodes->size(); ++n) {
+      FatNode& node = (*nodes)[n];
+      if (node.is_dir != (pass == 0))
+        continue;
+      if (node.is_dir) {
+        // Sub-directories start with "." and "..".
+        size_t entries = n == 0 ? 0 : 2;
+        for (size_t child : node.children)
+          entries += num_entries((*nodes)[child]);
+        node.size = entries * FAT_DIR_ENTRY_SIZE;
+        if (n == 0 && layout.fat_bits != 32) {
+          if (entries > FAT_ROOT_ENTRIES) {
+            cerr << "ERROR: More than " << FAT_ROOT_ENTRIES
+                 << " entries in the root directory\n";
+            return 0;
+          }
+          continue;
+        }
+      }
+      uint64_t clusters = (node.size + cluster_size - 1) / cluster_size;
+      // Directories take at least one cluster, even if empty.
+      if (node.is_dir && clusters == 0)
+        clusters = 1;
+      if (clusters > (uint64_t)layout.num_clusters + 2 - *next_cluster) {
+        cerr << "ERROR: The files do not fit in the image\n";
+        return 0;
+      }
+      node.first_cluster = clusters > 0 ? *next_cluster : 0;
+      node.num_clusters = clusters;
+      *next_cluster += clusters;
+    }
+  }
+  return 1;
+}
+
+static void set_fat_entry(const FatLayout& layout, vector<uint8_t>* fat,
+                          uint32_t cluster, uint32_t value) {
+  if (layout.fat_bits == 32) {
+    put_le32(&(*fat)[cluster * 4], value);
+  } else if (layout.fat_bits == 16) {
+    put_le16(&(*fat)[cluster * 2], value);
+  } else {
+    uint8_t* p = &(*fat)[cluster * 3 / 2];
+    if (cluster & 1) {
+      p[0] = (p[0] & 0x0f) | (value & 0x0f) << 4;
+      p[1] = value >> 4;
+    } else {
+      p[0] = value & 0xff;
+      p[1] = (p[1] & 0xf0) | ((value >> 8) & 0x0f);
+    }
+  }
+}
+
+static vector<uint8_t> build_fat(const FatLayout& layout,
+                                 const vector<FatNode>& nodes) {
+  const uint32_t end_of_chain = layout.fat_bits == 32   ? 0x0fffffff
+                                : layout.fat_bits == 16 ? 0xffff
+                                                        : 0xfff;
+  vector<uint8_t> fat((size_t)layout.fat_sectors * FAT_SECTOR_SIZE, 0);
+
+  // The media byte, then an end of chain marker.
+  set_fat_entry(layout, &fat, 0, (end_of_chain & ~0xffu) | 0xf8);
+  set_fat_entry(layout, &fat, 1, end_of_chain);
+  for (const FatNode& node : nodes) {
+    for (uint32_t n = 0; n < node.num_clusters; ++n) {
+      uint32_t cluster = node.first_cluster + n;
+      set_fat_entry(layout, &fat, cluster,
+                    n + 1 < node.num_clusters ? cluster + 1 : end_of_chain);
+    }
+  }
+  return fat;
+}
+
+/* FAT time and date of |timestamp|, which cannot be before 1980. */
+static void fat_time(time_t timestamp, uint16_t* time, uint16_t* date) {
+  struct tm tm;
+
+  if (timestamp < FAT_DEFAULT_TIMESTAMP)
+    timestamp = FAT_DEFAULT_TIMESTAMP;
+  gmtime_r(&timestamp, &tm);
+  if (tm.tm_year > 2107 - 1900) {
+    *time = 0xbf7d;
+    *date = 0xff9f;
+    return;
+  }
+  *time = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+  *date = (tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday;
+}
+
+static void put_short_entry(uint8_t* entry, const uint8_t name83[11],
+                            uint8_t attr, uint8_t case_flags,
+                            uint32_t cluster, uint32_t size, uint16_t time,
+                            uint16_t date) {
+  bub_memcpy(entry, name83, 11);
+  entry[11] = attr;
+  entry[12] = case_flags;
+  put_le16(entry + 14, time);
+  put_le16(entry + 16, date);
+  put_le16(entry + 18, date);
+  put_le16(entry + 20, cluster >> 16);
+  put_le16(entry + 22, time);
+  put_le16(entry + 24, date);
+  put_le16(entry + 26, cluster & 0xffff);
+  put_le32(entry + 28, size);
+}
+
+static uint8_t short_name_checksum(const uint8_t name83[11]) {
+  uint8_t sum = 0;
+  for (int n = 0; n < 11; ++n)
+    sum = ((sum & 1) << 7) + (sum >> 1) + name83[n];
+  return sum;
+}
+
+/* Writes the long name entries of |node| to |entry|, last part first as
+ * they are stored. Returns the number of entries.
+ */
+static size_t put_long_entries(uint8_t* entry, const FatNode& node) {
+  // Offsets of the 13 UCS-2 characters in an entry.
+  static const uint8_t char_offsets[LFN_CHARS_PER_ENTRY] = {
+      1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+  const size_t count = num_entries(node) - 1;
+  const uint8_t checksum = short_name_checksum(node.name83);
+
+  for (size_t n = 0; n < count; ++n) {
+    uint8_t* p = entry + (count - 1 - n) * FAT_DIR_ENTRY_SIZE;
+    p[0] = (n + 1) | (n + 1 == count ? 0x40 : 0);
+    p[11] = ATTR_LONG_NAME;
+    p[13] = checksum;
+    for (size_t i = 0; i < LFN_CHARS_PER_ENTRY; ++i) {
+      size_t pos = n * LFN_CHARS_PER_ENTRY + i;
+      // A terminating zero if there is room, then padding.
+      uint16_t c = pos < node.name.size()    ? (uint8_t)node.name[pos]
+                   : pos == node.name.size() ? 0
+                                             : 0xffff;
+      put_le16(p + char_offsets[i], c);
+    }
+  }
+  return count;
+}
+
+static vector<uint8_t> build_directory(const vector<FatNode>& nodes,
+                                       size_t index, uint64_t size,
+                                       time_t timestamp) {
+  static const uint8_t dot[11] = {'.', ' ', ' ', ' ', ' ', ' ',
+                                  ' ', ' ', ' ', ' ', ' '};
+  static const uint8_t dot_dot[11] = {'.', '.', ' ', ' ', ' ', ' ',
+                                      ' ', ' ', ' ', ' ', ' '};
+  const FatNode& dir = nodes[index];
+  vector<uint8_t> data(size, 0);
+  uint8_t* entry = data.data();
+  uint16_t time;
+  uint16_t date;
+
+  fat_time(timestamp, &time, &date);
+  if (index != 0) {
+    put_short_entry(entry, dot, ATTR_DIRECTORY, 0, dir.first_cluster, 0,
+                    time, date);
+    entry += FAT_DIR_ENTRY_SIZE;
+    // The root directory is cluster 0 here, even on FAT32.
+    put_short_entry(entry, dot_dot, ATTR_DIRECTORY, 0,
+                    dir.parent == 0 ? 0 : nodes[dir.parent].first_cluster, 0,
+                    time, date);
+    entry += FAT_DIR_ENTRY_SIZE;
+  }
+  for (size_t child : dir.children) {
+    const FatNode& node = nodes[child];
+    if (node.long_name)
+      entry += put_long_entries(entry, node) * FAT_DIR_ENTRY_SIZE;
+    put_short_entry(entry, node.name83,
+                    node.is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE,
+                    node.case_flags, node.first_cluster,
+                    node.is_dir ? 0 : node.size, time, date);
+    entry += FAT_DIR_ENTRY_SIZE;
+  }
+  return data;
+}
+
+/* Builds the boot sector, and for FAT32 the FSInfo sector, of |layout|. */
+static vector<uint8_t> build_boot_sectors(const FatLayout& layout,
+                                          uint32_t volume_id,
+                                          uint32_t next_cluster) {
+  vector<uint8_t> boot(2 * FAT_SECTOR_SIZE, 0);
+  uint8_t* p = boot.data();
+  const bool fat32 = layout.fat_bits == 32;
+
+  // A jump over the BPB to code that halts.
+  p[0] = 0xeb;
+  p[1] = fat32 ? 0x58 : 0x3c;
+  p[2] = 0x90;
+  bub_memcpy(p + 3, "MSWIN4.1", 8);
+  put_le16(p + 11, FAT_SECTOR_SIZE);
+  p[13] = layout.sectors_per_cluster;
+  put_le16(p + 14, layout.reserved_sectors);
+  p[16] = layout.num_fats;
+  put_le16(p + 17, fat32 ? 0 : FAT_ROOT_ENTRIES);
+  if (!fat32 && layout.num_sectors < 0x10000)
+    put_le16(p + 19, layout.num_sectors);
+  else
+    put_le32(p + 32, layout.num_sectors);
+  p[21] = 0xf8;
+  if (!fat32)
+    put_le16(p + 22, layout.fat_sectors);
+  put_le16(p + 24, 32);
+  put_le16(p + 26, 64);
+
+  uint8_t* ext = p + 36;
+  if (fat32) {
+    put_le32(p + 36, layout.fat_sectors);
+    put_le32(p + 44, 2);
+    put_le16(p + 48, 1);
+    put_le16(p + 50, 6);
+    ext = p + 64;
+  }
+  ext[0] = 0x80;
+  ext[2] = 0x29;
+  put_le32(ext + 3, volume_id);
+  bub_memcpy(ext + 7, "NO NAME    ", 11);
+  bub_memcpy(ext + 18, fat32 ? "FAT32   " : layout.fat_bits == 16
+                                               ? "FAT16   "
+                                               : "FAT12   ",
+             8);
+  static const uint8_t halt[] = {0xfa, 0xf4, 0xeb, 0xfd};
+  bub_memcpy(ext + 26, halt, sizeof(halt));
+  p[510] = 0x55;
+  p[511] = 0xaa;
+
+  if (fat32) {
+    uint8_t* info = p + FAT_SECTOR_SIZE;
+    put_le32(info, 0x41615252);
+    put_le32(info + 484, 0x61417272);
+    put_le32(info + 488, layout.num_clusters + 2 - next_cluster);
+    put_le32(info + 492, next_cluster);
+    put_le32(info + 508, 0xaa550000);
+  } else {
+    boot.resize(FAT_SECTOR_SIZE);
+  }
+  return boot;
+}
+
+/* Copies |node|'s host file to |offset| of |fd|, the image at |output|. */
+static int copy_file(int fd, const FilePath& output, const FatNode& node,
+                     uint64_t offset, vector<uint8_t>* buf) {
+  uint64_t done = 0;
+  ssize_t num_read;
+
+  int in_fd = open(node.host.value().c_str(), O_RDONLY);
+  if (in_fd < 0) {
+    cerr << "ERROR: Cannot open " << node.host.value() << "\n";
+    return 0;
+  }
+  while ((num_read = read(in_fd, buf->data(), buf->size())) != 0) {
+    if (num_read < 0 && errno == EINTR)
+      continue;
+    if (num_read < 0) {
+      cerr << "ERROR: Cannot read " << node.host.value() << "\n";
+      close(in_fd);
+      return 0;
+    }
+    if (done + num_read > node.size)
+      break;
+    if (!pwrite_full(fd, buf->data(), num_read, offset + done)) {
+      cerr << "ERROR: Cannot write " << output.value() << "\n";
+      close(in_fd);
+      return 0;
+    }
+    done += num_read;
+  }
+  close(in_fd);
+
+  // The clusters were counted from the size the file had before.
+  if (done != node.size || num_read != 0) {
+    cerr << "ERROR: " << node.host.value() << " changed while copying\n";
+    return 0;
+  }
+  return 1;
+}
+
+int make_efi_image(const EfiImageArgs& args) {
+  FatLayout layout;
+  vector<FatNode> nodes;
+  uint32_t next_cluster;
+
+  if (!compute_fat_layout(args.image_size / FAT_SECTOR_SIZE, &layout) ||
+      !build_tree(args.files, &nodes) ||
+      !allocate_clusters(layout, &nodes, &next_cluster))
+    return 0;
+
+  const uint64_t cluster_size =
+      (uint64_t)layout.sectors_per_cluster * FAT_SECTOR_SIZE;
+  auto cluster_offset = [&](uint32_t cluster) {
+    return ((uint64_t)layout.first_data_sector +
+            (uint64_t)(cluster - 2) * layout.sectors_per_cluster) *
+           FAT_SECTOR_SIZE;
+  };
+
+  vector<uint8_t> fat = build_fat(layout, nodes);
+  vector<vector<uint8_t>> dirs(nodes.size());
+  for (size_t n = 0; n < nodes.size(); ++n) {
+    if (!nodes[n].is_dir)
+      continue;
+    uint64_t size = n == 0 && layout.fat_bits != 32
+                        ? (uint64_t)layout.root_dir_sectors * FAT_SECTOR_SIZE
+                        : nodes[n].num_clusters * cluster_size;
+    dirs[n] = build_directory(nodes, n, size, args.timestamp);
+  }
+
+  // The volume ID is usually the creation time; a checksum of the metadata
+  // keeps it reproducible.
+  uint32_t volume_id = bub_crc32(0, fat.data(), fat.size());
+  for (const vector<uint8_t>& dir : dirs)
+    volume_id = bub_crc32(volume_id, dir.data(), dir.size());
+  vector<uint8_t> boot = build_boot_sectors(layout, volume_id, next_cluster);
+
+  int fd = open(args.output.value().c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                0644);
+  if (fd < 0) {
+    cerr << "ERROR: Cannot create " << args.output.value() << "\n";
+    return 0;
+  }
+
+  // Everything is written in increasing offset order; the rest of the
+  // image stays a hole.
+  int ret = pwrite_full(fd, boot.data(), boot.size(), 0);
+  if (ret && layout.fat_bits == 32)
+    ret = pwrite_full(fd, boot.data(), boot.size(), 6 * FAT_SECTOR_SIZE);
+  for (uint32_t n = 0; ret && n < layout.num_fats; ++n) {
+    ret = pwrite_full(fd, fat.data(), fat.size(),
+                      ((uint64_t)layout.reserved_sectors +
+                       (uint64_t)n * layout.fat_sectors) * FAT_SECTOR_SIZE);
+  }
+  if (ret && layout.fat_bits != 32) {
+    ret = pwrite_full(fd, dirs[0].data(), dirs[0].size(),
+                      ((uint64_t)layout.reserved_sectors +
+                       (uint64_t)layout.num_fats * layout.fat_sectors) *
+                          FAT_SECTOR_SIZE);
+  }
+
+  for (size_t n = 0; ret && n < nodes.size(); ++n) {
+    if (nodes[n].is_dir && nodes[n].num_clusters > 0) {
+      ret = pwrite_full(fd, dirs[n].data(), dirs[n].size(),
+                        cluster_offset(nodes[n].first_cluster));
+    }
+  }
+  if (!ret || ftruncate(fd, args.image_size) != 0) {
+    cerr << "ERROR: Cannot write " << args.output.value() << "\n";
+    close(fd);
+    return 0;
+  }
+
+  vector<uint8_t> buf(COPY_BUFFER_SIZE);
+  for (const FatNode& node : nodes) {
+    if (node.is_dir || node.num_clusters == 0)
+      continue;
+    if (!copy_file(fd, args.output, node, cluster_offset(node.first_cluster),
+                   &buf)) {
+      close(fd);
+      return 0;
+    }
+  }
+
+  if (close(fd) != 0) {
+    cerr << "ERROR: Cannot write " << args.output.value() << "\n";
+    return 0;
+  }
+  return 1;
+}
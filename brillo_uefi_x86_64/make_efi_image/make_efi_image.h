@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BUB_EFI_IMAGE_H_
+#define BUB_EFI_IMAGE_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <base/files/file_util.h>
+
+#include <string>
+#include <vector>
+
+#define FAT_SECTOR_SIZE 512
+#define FAT_DIR_ENTRY_SIZE 32
+// Root directory entries of FAT12 and FAT16 file systems.
+#define FAT_ROOT_ENTRIES 512
+// Cluster counts from which a file system is FAT16 and FAT32.
+#define FAT16_MIN_CLUSTERS 4085
+#define FAT32_MIN_CLUSTERS 65525
+// Time stamp of all files if SOURCE_DATE_EPOCH is not set, 1980-01-01.
+#define FAT_DEFAULT_TIMESTAMP 315532800
+
+/* Geometry of a FAT file system, in FAT_SECTOR_SIZE byte sectors. */
+struct FatLayout {
+  // 12, 16 or 32.
+  int fat_bits;
+  uint32_t num_sectors;
+  uint32_t sectors_per_cluster;
+  uint32_t reserved_sectors;
+  uint32_t num_fats;
+  // Size of one FAT.
+  uint32_t fat_sectors;
+  // Size of the fixed root directory of FAT12 and FAT16, 0 on FAT32.
+  uint32_t root_dir_sectors;
+  uint32_t first_data_sector;
+  // Clusters in the data area, numbered from 2.
+  uint32_t num_clusters;
+};
+
+/* A file to put in the image: |host| is copied to |target|, a path of
+ * '/'-separated names in the image.
+ */
+struct EfiFile {
+  base::FilePath host;
+  std::string target;
+};
+
+/* Arguments of make_efi_image, see print_usage() in main.cc. */
+struct EfiImageArgs {
+  EfiImageArgs() : image_size(0), timestamp(FAT_DEFAULT_TIMESTAMP) {}
+
+  uint64_t image_size;
+  base::FilePath output;
+  std::vector<EfiFile> files;
+  // Modification time of every file and directory.
+  time_t timestamp;
+};
+
+/* Parses "SIZE OUTPUT HOST:TARGET..." as the make_efi_image script took
+ * them. SIZE is rounded up to whole sectors. The time stamp comes from
+ * SOURCE_DATE_EPOCH if it is set.
+ */
+int parse_efi_image_args(int argc, const char* argv[], EfiImageArgs* args);
+
+/* Lays out a FAT file system of |num_sectors|. Sizes that allow at least
+ * FAT32_MIN_CLUSTERS clusters with the usual cluster size get FAT32, as
+ * EFI system partitions should; smaller ones get FAT16 or FAT12.
+ */
+int compute_fat_layout(uint64_t num_sectors, FatLayout* layout);
+
+/* Returns the 8.3 directory entry name for |name| in |name83| and the
+ * lowercase flags for the entry in |case_flags|, if |name| can be stored
+ * without a long name. Otherwise returns 0.
+ */
+int fat_short_name(const std::string& name, uint8_t name83[11],
+                   uint8_t* case_flags);
+
+/* Writes the FAT image described by |args| front to back in one pass: boot
+ * sector, FATs, directories and file data. Files and directories are laid
+ * out in contiguous clusters in the order given, so the same arguments and
+ * inputs always give the same image.
+ */
+int make_efi_image(const EfiImageArgs& args);
+
+#endif /* BUB_EFI_IMAGE_H_ */
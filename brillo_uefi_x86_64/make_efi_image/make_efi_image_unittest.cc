@@ -0,0 +1,500 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../boot_loader/bub_image_util.h"
+#include "make_efi_image.h"
+
+#define MiB (1024 * 1024)
+
+static uint32_t get_le16(const uint8_t* p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+  return get_le16(p) | get_le16(p + 2) << 16;
+}
+
+/* Reads files from a FAT image the way a FAT driver would, from the boot
+ * sector only.
+ */
+class FatReader {
+ public:
+  explicit FatReader(const std::string& path) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    EXPECT_GE(fd_, 0);
+    boot_ = Read(0, FAT_SECTOR_SIZE);
+    EXPECT_EQ(0x55, boot_[510]);
+    EXPECT_EQ(0xaa, boot_[511]);
+    EXPECT_EQ((uint32_t)FAT_SECTOR_SIZE, get_le16(&boot_[11]));
+    sectors_per_cluster_ = boot_[13];
+    uint32_t reserved = get_le16(&boot_[14]);
+    uint32_t num_fats = boot_[16];
+    root_entries_ = get_le16(&boot_[17]);
+    uint32_t num_sectors = get_le16(&boot_[19]);
+    if (num_sectors == 0)
+      num_sectors = get_le32(&boot_[32]);
+    fat_sectors_ = get_le16(&boot_[22]);
+    if (fat_sectors_ == 0)
+      fat_sectors_ = get_le32(&boot_[36]);
+    fat_offset_ = (uint64_t)reserved * FAT_SECTOR_SIZE;
+    root_offset_ = fat_offset_ + (uint64_t)num_fats * fat_sectors_ *
+                                     FAT_SECTOR_SIZE;
+    uint32_t root_sectors =
+        (root_entries_ * FAT_DIR_ENTRY_SIZE + FAT_SECTOR_SIZE - 1) /
+        FAT_SECTOR_SIZE;
+    data_offset_ = root_offset_ + (uint64_t)root_sectors * FAT_SECTOR_SIZE;
+    uint32_t data_sectors =
+        num_sectors - reserved - num_fats * fat_sectors_ - root_sectors;
+    num_clusters_ = data_sectors / sectors_per_cluster_;
+    // The cluster count alone decides the FAT type.
+    fat_bits_ = num_clusters_ < FAT16_MIN_CLUSTERS   ? 12
+                : num_clusters_ < FAT32_MIN_CLUSTERS ? 16
+                                                     : 32;
+    fat_ = Read(fat_offset_, (size_t)fat_sectors_ * FAT_SECTOR_SIZE);
+    // All FAT copies are the same.
+    for (uint32_t n = 1; n < num_fats; ++n) {
+      EXPECT_TRUE(fat_ == Read(fat_offset_ + (uint64_t)n * fat_.size(),
+                               fat_.size()));
+    }
+  }
+
+  ~FatReader() { close(fd_); }
+
+  std::vector<uint8_t> Read(uint64_t offset, size_t size) {
+    std::vector<uint8_t> buf(size);
+    EXPECT_EQ((ssize_t)size, pread(fd_, buf.data(), size, offset));
+    return buf;
+  }
+
+  uint32_t FatEntry(uint32_t cluster) {
+    if (fat_bits_ == 32)
+      return get_le32(&fat_[cluster * 4]) & 0x0fffffff;
+    if (fat_bits_ == 16)
+      return get_le16(&fat_[cluster * 2]);
+    uint32_t value = get_le16(&fat_[cluster * 3 / 2]);
+    return cluster & 1 ? value >> 4 : value & 0xfff;
+  }
+
+  bool IsEndOfChain(uint32_t value) {
+    return value >= (fat_bits_ == 32 ? 0x0ffffff8u
+                     : fat_bits_ == 16 ? 0xfff8u
+                                       : 0xff8u);
+  }
+
+  std::vector<uint8_t> ReadChain(uint32_t cluster) {
+    const size_t cluster_size = sectors_per_cluster_ * FAT_SECTOR_SIZE;
+    std::vector<uint8_t> data;
+    while (cluster != 0) {
+      EXPECT_GE(cluster, 2U);
+      EXPECT_LT(cluster, num_clusters_ + 2);
+      if (cluster < 2 || cluster >= num_clusters_ + 2 ||
+          data.size() > fat_.size() * cluster_size)
+        break;
+      std::vector<uint8_t> part =
+          Read(data_offset_ + (uint64_t)(cluster - 2) * cluster_size,
+               cluster_size);
+      data.insert(data.end(), part.begin(), part.end());
+      uint32_t next = FatEntry(cluster);
+      if (IsEndOfChain(next))
+        break;
+      cluster = next;
+    }
+    return data;
+  }
+
+  std::vector<uint8_t> RootDir() {
+    if (fat_bits_ == 32)
+      return ReadChain(get_le32(&boot_[44]));
+    return Read(root_offset_, root_entries_ * FAT_DIR_ENTRY_SIZE);
+  }
+
+  struct Entry {
+    std::string long_name;
+    std::string short_name;
+    uint8_t attr;
+    uint32_t cluster;
+    uint32_t size;
+  };
+
+  // Lists |dir|, checking long name checksums on the way.
+  std::vector<Entry> List(const std::vector<uint8_t>& dir) {
+    std::vector<Entry> entries;
+    std::string long_name;
+    int checksum = -1;
+    for (size_t pos = 0; pos + FAT_DIR_ENTRY_SIZE <= dir.size();
+         pos += FAT_DIR_ENTRY_SIZE) {
+      const uint8_t* p = &dir[pos];
+      if (p[0] == 0)
+        break;
+      if (p[11] == 0x0f) {
+        static const uint8_t offsets[] = {1,  3,  5,  7,  9,  14, 16,
+                                          18, 20, 22, 24, 28, 30};
+        std::string part;
+        for (uint8_t offset : offsets) {
+          uint32_t c = get_le16(p + offset);
+          if (c == 0 || c == 0xffff)
+            break;
+          part += (char)c;
+        }
+        long_name = (p[0] & 0x40) ? part : part + long_name;
+        checksum = p[13];
+        continue;
+      }
+      uint8_t sum = 0;
+      for (int n = 0; n < 11; ++n)
+        sum = ((sum & 1) << 7) + (sum >> 1) + p[n];
+      if (!long_name.empty()) {
+        EXPECT_EQ(checksum, sum);
+      }
+
+      Entry entry;
+      std::string base((const char*)p, 8);
+      std::string ext((const char*)p + 8, 3);
+      base.erase(base.find_last_not_of(' ') + 1);
+      ext.erase(ext.find_last_not_of(' ') + 1);
+      entry.short_name = ext.empty() ? base : base + "." + ext;
+      entry.long_name = long_name;
+      entry.attr = p[11];
+      entry.cluster = get_le16(p + 20) << 16 | get_le16(p + 26);
+      entry.size = get_le32(p + 28);
+      entries.push_back(entry);
+      long_name.clear();
+    }
+    return entries;
+  }
+
+  // Finds |path| like mdir does, by long or short name in any case.
+  bool Find(const std::string& path, Entry* found) {
+    std::vector<uint8_t> dir = RootDir();
+    size_t start = 0;
+    while (start < path.size()) {
+      size_t slash = path.find('/', start);
+      std::string name = path.substr(start, slash - start);
+      start = slash == std::string::npos ? path.size() : slash + 1;
+      if (name.empty())
+        continue;
+      bool match = false;
+      for (const Entry& entry : List(dir)) {
+        if (strcasecmp(entry.long_name.c_str(), name.c_str()) == 0 ||
+            strcasecmp(entry.short_name.c_str(), name.c_str()) == 0) {
+          *found = entry;
+          match = true;
+          break;
+        }
+      }
+      if (!match)
+        return false;
+      if (start < path.size()) {
+        if (!(found->attr & 0x10))
+          return false;
+        dir = ReadChain(found->cluster);
+      }
+    }
+    return true;
+  }
+
+  std::vector<uint8_t> ReadFile(const std::string& path) {
+    Entry entry;
+    EXPECT_TRUE(Find(path, &entry)) << path;
+    std::vector<uint8_t> data = ReadChain(entry.cluster);
+    EXPECT_GE(data.size(), entry.size);
+    data.resize(entry.size);
+    return data;
+  }
+
+  std::vector<uint8_t> boot_;
+  std::vector<uint8_t> fat_;
+  int fd_;
+  int fat_bits_;
+  uint32_t sectors_per_cluster_;
+  uint32_t root_entries_;
+  uint32_t fat_sectors_;
+  uint32_t num_clusters_;
+  uint64_t fat_offset_;
+  uint64_t root_offset_;
+  uint64_t data_offset_;
+};
+
+TEST(EfiImageTest, Layout) {
+  FatLayout layout;
+
+  ASSERT_EQ(1, compute_fat_layout(512 * 1024 / FAT_SECTOR_SIZE, &layout));
+  EXPECT_EQ(12, layout.fat_bits);
+  EXPECT_EQ(1U, layout.sectors_per_cluster);
+  EXPECT_LT(layout.num_clusters, (uint32_t)FAT16_MIN_CLUSTERS);
+
+  ASSERT_EQ(1, compute_fat_layout(16 * MiB / FAT_SECTOR_SIZE, &layout));
+  EXPECT_EQ(16, layout.fat_bits);
+  EXPECT_GE(layout.num_clusters, (uint32_t)FAT16_MIN_CLUSTERS);
+
+  // The EFI partition of device-partitions.bpt.
+  ASSERT_EQ(1, compute_fat_layout(300 * MiB / FAT_SECTOR_SIZE, &layout));
+  EXPECT_EQ(32, layout.fat_bits);
+  EXPECT_EQ(8U, layout.sectors_per_cluster);
+  EXPECT_EQ(32U, layout.reserved_sectors);
+  EXPECT_EQ(0U, layout.root_dir_sectors);
+  EXPECT_GE(layout.num_clusters, (uint32_t)FAT32_MIN_CLUSTERS);
+
+  for (uint64_t sectors = 64; sectors < 4 * 1024 * 1024;
+       sectors = sectors * 3 / 2) {
+    SCOPED_TRACE(sectors);
+    ASSERT_EQ(1, compute_fat_layout(sectors, &layout));
+    // Each FAT has room for every cluster and the data area fits.
+    EXPECT_GE((uint64_t)layout.fat_sectors * FAT_SECTOR_SIZE * 8,
+              ((uint64_t)layout.num_clusters + 2) * layout.fat_bits);
+    EXPECT_LE(layout.first_data_sector +
+                  (uint64_t)layout.num_clusters * layout.sectors_per_cluster,
+              sectors);
+    int bits = layout.num_clusters < FAT16_MIN_CLUSTERS   ? 12
+               : layout.num_clusters < FAT32_MIN_CLUSTERS ? 16
+                                                          : 32;
+    EXPECT_EQ(bits, layout.fat_bits);
+  }
+
+  EXPECT_EQ(0, compute_fat_layout(16, &layout));
+}
+
+TEST(EfiImageTest, ShortNames) {
+  uint8_t name83[11];
+  uint8_t flags;
+
+  ASSERT_EQ(1, fat_short_name("BOOTX64.EFI", name83, &flags));
+  EXPECT_EQ(0, memcmp("BOOTX64 EFI", name83, 11));
+  EXPECT_EQ(0, flags);
+  ASSERT_EQ(1, fat_short_name("bootx64.efi", name83, &flags));
+  EXPECT_EQ(0, memcmp("BOOTX64 EFI", name83, 11));
+  EXPECT_EQ(0x18, flags);
+  ASSERT_EQ(1, fat_short_name("grub", name83, &flags));
+  EXPECT_EQ(0, memcmp("GRUB       ", name83, 11));
+  EXPECT_EQ(0x08, flags);
+  ASSERT_EQ(1, fat_short_name("foo.EFI", name83, &flags));
+  EXPECT_EQ(0x08, flags);
+
+  EXPECT_EQ(0, fat_short_name("Bootx64.efi", name83, &flags));
+  EXPECT_EQ(0, fat_short_name("toolongname", name83, &flags));
+  EXPECT_EQ(0, fat_short_name("a.b.c", name83, &flags));
+  EXPECT_EQ(0, fat_short_name("a b", name83, &flags));
+  EXPECT_EQ(0, fat_short_name(".efi", name83, &flags));
+  EXPECT_EQ(0, fat_short_name("a.", name83, &flags));
+}
+
+TEST(EfiImageTest, ParseArgs) {
+  EfiImageArgs args;
+  const char* argv[] = {"make_efi_image", "1000", "/tmp/efi image.img",
+                        "/out/bootx64.efi:/EFI/BOOT/bootx64.efi",
+                        "grub.cfg:EFI/grub/grub.cfg"};
+
+  unsetenv("SOURCE_DATE_EPOCH");
+  ASSERT_EQ(1, parse_efi_image_args(5, argv, &args));
+  EXPECT_EQ(1024U, args.image_size);
+  EXPECT_EQ("/tmp/efi image.img", args.output.value());
+  ASSERT_EQ(2U, args.files.size());
+  EXPECT_EQ("/out/bootx64.efi", args.files[0].host.value());
+  EXPECT_EQ("/EFI/BOOT/bootx64.efi", args.files[0].target);
+  EXPECT_EQ(FAT_DEFAULT_TIMESTAMP, args.timestamp);
+
+  setenv("SOURCE_DATE_EPOCH", "1500000000", 1);
+  EfiImageArgs args2;
+  ASSERT_EQ(1, parse_efi_image_args(3, argv, &args2));
+  EXPECT_EQ(1500000000, args2.timestamp);
+  setenv("SOURCE_DATE_EPOCH", "soon", 1);
+  EXPECT_EQ(0, parse_efi_image_args(3, argv, &args2));
+  unsetenv("SOURCE_DATE_EPOCH");
+
+  const char* no_output[] = {"make_efi_image", "1000"};
+  EXPECT_EQ(0, parse_efi_image_args(2, no_output, &args2));
+  const char* bad_size[] = {"make_efi_image", "-1", "out.img"};
+  EXPECT_EQ(0, parse_efi_image_args(3, bad_size, &args2));
+  const char* bad_file[] = {"make_efi_image", "1000", "out.img", "host"};
+  EXPECT_EQ(0, parse_efi_image_args(4, bad_file, &args2));
+}
+
+class MakeEfiImageTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_FALSE(dir_.path().empty());
+  }
+
+  base::FilePath path(const std::string& name) {
+    return dir_.Append(name);
+  }
+
+  // Writes |size| bytes of a pattern to the host file |name|.
+  std::vector<uint8_t> MakeFile(const std::string& name, size_t size) {
+    std::vector<uint8_t> data(size);
+    for (size_t n = 0; n < size; ++n)
+      data[n] = (uint8_t)(n * 7 + name.size() + (n >> 9));
+    EXPECT_EQ((int)size, base::WriteFile(path(name), (const char*)data.data(),
+                                         size));
+    return data;
+  }
+
+  EfiImageArgs Args(uint64_t image_size) {
+    EfiImageArgs args;
+    args.image_size = image_size;
+    args.output = path("efi.img");
+    return args;
+  }
+
+  void AddFile(EfiImageArgs* args, const std::string& host,
+               const std::string& target) {
+    EfiFile file;
+    file.host = path(host);
+    file.target = target;
+    args->files.push_back(file);
+  }
+
+  std::string ReadOutput() {
+    std::string data;
+    EXPECT_TRUE(base::ReadFileToString(path("efi.img"), &data));
+    return data;
+  }
+
+  TempDir dir_;
+};
+
+TEST_F(MakeEfiImageTest, FilesReadBack) {
+  std::vector<uint8_t> boot = MakeFile("bootx64.efi", 100 * 1024 + 5);
+  std::vector<uint8_t> cfg = MakeFile("grub.cfg", 700);
+  std::vector<uint8_t> empty = MakeFile("startup.nsh", 0);
+  std::vector<uint8_t> shell = MakeFile("shell.efi", 3000);
+  const struct {
+    const char* host;
+    const char* target;
+    const std::vector<uint8_t>* data;
+  } files[] = {
+      {"bootx64.efi", "/EFI/BOOT/bootx64.efi", &boot},
+      {"grub.cfg", "EFI/BOOT/grub.cfg", &cfg},
+      {"startup.nsh", "startup.nsh", &empty},
+      {"shell.efi", "EFI/Tools/An EFI shell with a long name.efi", &shell},
+      {"shell.efi", "EFI/Tools/longfilename1.efi", &shell},
+      {"shell.efi", "EFI/Tools/longfilename2.efi", &shell},
+      // What longfilename1.efi would be shortened to.
+      {"grub.cfg", "EFI/Tools/LONGFI~1.EFI", &cfg},
+  };
+
+  for (uint64_t size : {512 * 1024, 16 * MiB, 300 * MiB}) {
+    SCOPED_TRACE(size);
+    EfiImageArgs args = Args(size);
+    for (const auto& file : files)
+      AddFile(&args, file.host, file.target);
+    ASSERT_EQ(1, make_efi_image(args));
+
+    struct stat st;
+    ASSERT_EQ(0, stat(args.output.value().c_str(), &st));
+    EXPECT_EQ((off_t)size, st.st_size);
+
+    FatReader reader(args.output.value());
+    for (const auto& file : files) {
+      SCOPED_TRACE(file.target);
+      EXPECT_TRUE(*file.data == reader.ReadFile(file.target));
+    }
+
+    // Short names in a directory are unique.
+    FatReader::Entry tools;
+    ASSERT_TRUE(reader.Find("efi/tools", &tools));
+    EXPECT_EQ(0x10, tools.attr);
+    std::vector<FatReader::Entry> entries =
+        reader.List(reader.ReadChain(tools.cluster));
+    std::set<std::string> short_names;
+    for (const FatReader::Entry& entry : entries)
+      EXPECT_TRUE(short_names.insert(entry.short_name).second);
+    // ".", "..", and the four files.
+    EXPECT_EQ(6U, entries.size());
+    EXPECT_EQ(".", entries[0].short_name);
+    EXPECT_EQ("..", entries[1].short_name);
+
+    if (reader.fat_bits_ == 32) {
+      // FSInfo and the backup boot sector.
+      std::vector<uint8_t> info = reader.Read(FAT_SECTOR_SIZE,
+                                              FAT_SECTOR_SIZE);
+      EXPECT_EQ(0x41615252U, get_le32(&info[0]));
+      uint32_t free_clusters = 0;
+      for (uint32_t n = 2; n < reader.num_clusters_ + 2; ++n)
+        free_clusters += reader.FatEntry(n) == 0;
+      EXPECT_EQ(free_clusters, get_le32(&info[488]));
+      EXPECT_TRUE(reader.boot_ == reader.Read(6 * FAT_SECTOR_SIZE,
+                                               FAT_SECTOR_SIZE));
+    }
+  }
+}
+
+TEST_F(MakeEfiImageTest, Reproducible) {
+  MakeFile("bootx64.efi", 5000);
+  EfiImageArgs args = Args(16 * MiB);
+  AddFile(&args, "bootx64.efi", "EFI/BOOT/bootx64.efi");
+
+  ASSERT_EQ(1, make_efi_image(args));
+  std::string first = ReadOutput();
+  ASSERT_EQ(1, make_efi_image(args));
+  EXPECT_TRUE(first == ReadOutput());
+
+  args.timestamp = 1500000000;
+  ASSERT_EQ(1, make_efi_image(args));
+  std::string second = ReadOutput();
+  EXPECT_FALSE(first == second);
+  FatReader reader(args.output.value());
+  EXPECT_EQ(5000U, reader.ReadFile("efi/boot/BOOTX64.EFI").size());
+}
+
+TEST_F(MakeEfiImageTest, Errors) {
+  MakeFile("bootx64.efi", 5000);
+  MakeFile("large.efi", 1 * MiB);
+
+  EfiImageArgs args = Args(512 * 1024);
+  AddFile(&args, "bootx64.efi", "EFI/BOOT/bootx64.efi");
+  AddFile(&args, "bootx64.efi", "efi/boot/BOOTX64.EFI");
+  EXPECT_EQ(0, make_efi_image(args));
+
+  args = Args(512 * 1024);
+  AddFile(&args, "bootx64.efi", "EFI/BOOT");
+  AddFile(&args, "bootx64.efi", "EFI/BOOT/bootx64.efi");
+  EXPECT_EQ(0, make_efi_image(args));
+
+  args = Args(512 * 1024);
+  AddFile(&args, "large.efi", "large.efi");
+  EXPECT_EQ(0, make_efi_image(args));
+
+  args = Args(512 * 1024);
+  AddFile(&args, "bootx64.efi", "EFI/BOOT/boot*.efi");
+  EXPECT_EQ(0, make_efi_image(args));
+
+  args = Args(512 * 1024);
+  AddFile(&args, "missing.efi", "EFI/BOOT/bootx64.efi");
+  EXPECT_EQ(0, make_efi_image(args));
+
+  args = Args(512 * 1024);
+  AddFile(&args, "bootx64.efi", "/");
+  EXPECT_EQ(0, make_efi_image(args));
+}
@@ -60,7 +60,7 @@ LOCAL_SRC_FILES := \
     make_misc_image.cc \
     make_misc_image_unittest.cc \
     ../boot_loader/bub_image_util.cc
-LOCAL_LDLIBS_linux := -lrt
+LOCAL_LDLIBS_linux := -lrt -lpthread
 include $(BUILD_HOST_NATIVE_TEST)
 
 include $(CLEAR_VARS)
@@ -89,5 +89,33 @@ LOCAL_SRC_FILES := \
     main.cc \
     make_misc_image.cc \
     ../boot_loader/bub_image_util.cc
-LOCAL_LDLIBS_linux := -lrt
+LOCAL_LDLIBS_linux := -lrt -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := make_misc_image_benchmark
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MODULE_TAGS := optional
+LOCAL_CPP_EXTENSION := .cc
+LOCAL_CLANG := true
+LOCAL_CFLAGS := $(common_cflags)
+LOCAL_CPPFLAGS := $(common_cppflags)
+LOCAL_LDFLAGS := $(common_ldflags)
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/make_misc_image.h \
+    $(LOCAL_PATH)/../boot_loader/bub_ab_flow.h \
+    $(LOCAL_PATH)/../boot_loader/bub_image_util.h \
+    $(LOCAL_PATH)/../boot_loader/bub_sysdeps.h \
+    $(LOCAL_PATH)/../boot_loader/bub_util.h
+LOCAL_STATIC_LIBRARIES := \
+    libbub_host \
+    libgmock_host \
+    libgtest_host
+LOCAL_SHARED_LIBRARIES := \
+    libchrome
+LOCAL_SRC_FILES := \
+    make_misc_image.cc \
+    make_misc_image_benchmark.cc \
+    ../boot_loader/bub_image_util.cc
+LOCAL_LDLIBS_linux := -lrt -lpthread
 include $(BUILD_HOST_EXECUTABLE)
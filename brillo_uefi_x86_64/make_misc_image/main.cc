@@ -23,19 +23,41 @@
  */
 
 #include "make_misc_image.h"
+#include <base/command_line.h>
 
 static void print_usage(void) {
   cerr << "Usage:\n"
           "  make_misc_image\n"
           "    --abmetadata=a_priority,a_tries_remaining,a_successful_boot,\n"
           "                 b_priority,b_tries_remaining,b_successful_boot\n"
-          "    --output=/PATH/TO/MISC_IMAGE\n\n";
+          "    --output=/PATH/TO/MISC_IMAGE\n"
+          "  make_misc_image\n"
+          "    --manifest=/PATH/TO/MANIFEST\n"
+          "    [--jobs=N]\n\n";
+}
+
+static int main_batch(int argc, const char *argv[]) {
+  base::FilePath manifest;
+  vector<MiscImageSpec> specs;
+  int num_jobs;
+
+  if (!parse_batch_args(argc, argv, &manifest, &num_jobs) ||
+      !parse_manifest(manifest, &specs)) {
+    print_usage();
+    return 0;
+  }
+
+  return make_misc_images(specs, num_jobs);
 }
 
 int main(int argc, const char *argv[]) {
   BubSlotData metadata[2];
   base::FilePath misc_name;
 
+  base::CommandLine::Init(argc, argv);
+  if (base::CommandLine::ForCurrentProcess()->HasSwitch("manifest"))
+    return main_batch(argc, argv);
+
   if (!parse_command_line_args(argc, argv, metadata, &misc_name)) {
     print_usage();
     return 0;
@@ -27,8 +27,23 @@
 #include "base/strings/string_tokenizer.h"
 #include "base/strings/string_number_conversions.h"
 
+#include <stddef.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <fstream>
+#include <thread>
+
 using namespace base;
 
+/* Metadata shared by all images of a batch, see make_misc_images(). */
+struct MetadataTemplate {
+  // Metadata with zeroed slots and crc32.
+  BubAbData data;
+  // CRC32 of the bytes of |data| before the slots.
+  uint32_t prefix_crc32;
+};
+
 static int set_slots_from_tokens(StringTokenizer* st,
                                  BubSlotData (&metadata)[2]) {
   int attribute_value;
@@ -87,19 +102,141 @@ int parse_command_line_args(int argc, const char *argv[],
   return 1;
 }
 
-int make_misc_image(const BubSlotData (&metadata)[2], const FilePath* fname) {
+static void init_template(MetadataTemplate* t) {
   MyOps ops;
-  BubAbData misc_data;
-
-  ops.write_ab_metadata(&misc_data,
-                        (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
-                        metadata[0].priority,
-                        metadata[0].tries_remaining,
-                        metadata[0].successful_boot,
-                        metadata[1].priority,
-                        metadata[1].tries_remaining,
-                        metadata[1].successful_boot);
-  ops.make_metadata_image(&misc_data, fname->value().c_str());
+  BubSlotData slots[2];
+
+  bub_memset(slots, 0, sizeof(slots));
+  ops.write_ab_metadata(&t->data, (uint8_t[4])BUB_BOOT_CTRL_MAGIC, slots, 2);
+  t->prefix_crc32 = bub_crc32(0, &t->data, offsetof(BubAbData, slots));
+}
+
+/* Writes the image of |spec|, the same bytes MyOps::make_metadata_image()
+ * writes.
+ */
+static int write_misc_image(const MetadataTemplate& t,
+                            const MiscImageSpec& spec) {
+  const size_t prefix = offsetof(BubAbData, slots);
+  BubAbData data = t.data;
+  uint32_t crc;
+
+  for (int i = 0; i < 2; ++i) {
+    data.slots[i].priority = spec.slots[i].priority;
+    data.slots[i].tries_remaining = spec.slots[i].tries_remaining;
+    data.slots[i].successful_boot = spec.slots[i].successful_boot;
+  }
+  crc = bub_crc32(t.prefix_crc32, (const uint8_t*)&data + prefix,
+                  sizeof(BubAbData) - prefix);
+  data.crc32 = bub_be32toh(crc);
+
+  const char* path = spec.output.value().c_str();
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    cerr << "ERROR: Cannot create " << path << ": " << strerror(errno) << "\n";
+    return 0;
+  }
+  ssize_t num_written = write(fd, &data, sizeof(data));
+  if (close(fd) != 0 || num_written != (ssize_t)sizeof(data)) {
+    cerr << "ERROR: Cannot write " << path << "\n";
+    return 0;
+  }
+  return 1;
+}
+
+int parse_batch_args(int argc, const char *argv[], FilePath* manifest,
+                     int* num_jobs) {
+  CommandLine::Reset();
+  CommandLine::Init(argc, argv);
+  CommandLine* command_line = CommandLine::ForCurrentProcess();
+
+  *manifest = command_line->GetSwitchValuePath("manifest");
+  if (manifest->empty()) {
+    cerr << "ERROR: Specify manifest as --manifest=/PATH/TO/MANIFEST\n";
+    return 0;
+  }
+
+  *num_jobs = std::thread::hardware_concurrency();
+  if (*num_jobs < 1)
+    *num_jobs = 1;
+  if (command_line->HasSwitch("jobs") &&
+      (!StringToInt(command_line->GetSwitchValueASCII("jobs"), num_jobs) ||
+       *num_jobs < 1)) {
+    cerr << "ERROR: --jobs must be a positive number\n";
+    return 0;
+  }
 
   return 1;
 }
+
+int parse_manifest(const FilePath& manifest, vector<MiscImageSpec>* specs) {
+  std::ifstream in(manifest.value());
+  string line;
+  int line_number = 0;
+
+  if (!in) {
+    cerr << "ERROR: Cannot open " << manifest.value() << "\n";
+    return 0;
+  }
+
+  while (getline(in, line)) {
+    ++line_number;
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    // The six values follow the sixth comma from the end.
+    size_t comma = line.size();
+    for (int n = 0; n < 6 && comma != string::npos; ++n)
+      comma = comma == 0 ? string::npos : line.rfind(',', comma - 1);
+    if (comma == string::npos || comma == 0) {
+      cerr << "ERROR: " << manifest.value() << ":" << line_number
+           << ": Need an output path and 6 ab_metadata attribute values.\n";
+      return 0;
+    }
+
+    MiscImageSpec spec;
+    bub_memset(spec.slots, 0, sizeof(spec.slots));
+    spec.output = FilePath(line.substr(0, comma));
+    StringTokenizer tokens(line.substr(comma + 1), ",");
+    if (!set_slots_from_tokens(&tokens, spec.slots)) {
+      cerr << "ERROR: " << manifest.value() << ":" << line_number
+           << ": Bad ab_metadata attribute values.\n";
+      return 0;
+    }
+    specs->push_back(spec);
+  }
+
+  return 1;
+}
+
+int make_misc_images(const vector<MiscImageSpec>& specs, int num_jobs) {
+  MetadataTemplate t;
+  std::atomic<size_t> next(0);
+  std::atomic<int> failed(0);
+  vector<std::thread> threads;
+
+  init_template(&t);
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next++) < specs.size()) {
+      if (!write_misc_image(t, specs[i]))
+        failed = 1;
+    }
+  };
+
+  // The calling thread is one of the jobs.
+  for (int n = 1; n < num_jobs && (size_t)n < specs.size(); ++n)
+    threads.push_back(std::thread(worker));
+  worker();
+  for (std::thread& thread : threads)
+    thread.join();
+
+  return !failed;
+}
+
+int make_misc_image(const BubSlotData (&metadata)[2], const FilePath* fname) {
+  vector<MiscImageSpec> specs(1);
+
+  specs[0].output = *fname;
+  bub_memcpy(specs[0].slots, metadata, sizeof(specs[0].slots));
+  return make_misc_images(specs, 1);
+}
@@ -32,6 +32,7 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 #include "../boot_loader/bub_image_util.h"
 
 #define MAX_FILE_NAME_LENGTH 255
@@ -43,4 +44,34 @@ int parse_command_line_args(int argc, const char *argv[],
 
 int make_misc_image(const BubSlotData (&metadata)[2], const base::FilePath* fname);
 
+/* One misc image of a batch. */
+struct MiscImageSpec {
+  base::FilePath output;
+  BubSlotData slots[2];
+};
+
+/* Parses the arguments of batch mode, --manifest=PATH and optionally
+ * --jobs=N. |num_jobs| defaults to the number of CPUs.
+ */
+int parse_batch_args(int argc, const char *argv[], base::FilePath* manifest,
+                     int* num_jobs);
+
+/* Reads a batch manifest into |specs|. Each line holds an output path and
+ * the six values of --ab_metadata, all separated by commas:
+ *
+ *   out/device0001/misc.img,15,0,1,14,0,1
+ *
+ * The values are taken from the end of the line, so the path may contain
+ * commas. Empty lines and lines starting with '#' are skipped.
+ */
+int parse_manifest(const base::FilePath& manifest,
+                   vector<MiscImageSpec>* specs);
+
+/* Writes the images of |specs| on |num_jobs| threads. Only the slots and
+ * the CRC32 differ between images, so the rest of the metadata and the
+ * CRC32 of the bytes before the slots are computed once. All images are
+ * attempted even if some fail.
+ */
+int make_misc_images(const vector<MiscImageSpec>& specs, int num_jobs);
+
 #endif /* BUB_MISC_IMAGE_H_ */
\ No newline at end of file
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Host benchmark for batch misc image generation. Reports images per second
+// for one MyOps::make_metadata_image() call per image, for
+// make_misc_images() with 1 to 2 * CPUs jobs and, if a make_misc_image
+// binary is given, for one process per image.
+//
+// Usage: make_misc_image_benchmark [NUM_IMAGES [/PATH/TO/make_misc_image]]
+
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <thread>
+
+#include "make_misc_image.h"
+
+extern char** environ;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, size_t num_images, double elapsed) {
+  printf("%-24s %12.0f\n", name, num_images / elapsed);
+}
+
+int main(int argc, char* argv[]) {
+  size_t num_images = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000;
+  char dir[] = "/tmp/make_misc_image_benchmark.XXXXXX";
+  vector<MiscImageSpec> specs(num_images);
+
+  if (num_images == 0 || mkdtemp(dir) == NULL) {
+    fprintf(stderr, "Usage: %s [NUM_IMAGES [/PATH/TO/make_misc_image]]\n",
+            argv[0]);
+    return 1;
+  }
+  for (size_t n = 0; n < num_images; ++n) {
+    char name[32];
+    snprintf(name, sizeof(name), "misc%zu.img", n);
+    specs[n].output = base::FilePath(dir).Append(name);
+    bub_memset(specs[n].slots, 0, sizeof(specs[n].slots));
+    specs[n].slots[0].priority = 15;
+    specs[n].slots[0].tries_remaining = n % 8;
+    specs[n].slots[1].priority = 14;
+    specs[n].slots[1].successful_boot = 1;
+  }
+
+  printf("%-24s %12s\n", "method", "images/s");
+
+  double start = now_seconds();
+  for (size_t n = 0; n < num_images; ++n) {
+    MyOps ops;
+    BubAbData data;
+    char name[32];
+    ops.set_partition_dir(base::FilePath(dir));
+    ops.write_ab_metadata(&data, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                          15, n % 8, 0, 14, 0, 1);
+    snprintf(name, sizeof(name), "misc%zu.img", n);
+    ops.make_metadata_image(&data, name);
+  }
+  report("make_metadata_image", num_images, now_seconds() - start);
+
+  int max_jobs = 2 * std::thread::hardware_concurrency();
+  for (int num_jobs = 1; num_jobs <= max_jobs; num_jobs *= 2) {
+    char name[32];
+    start = now_seconds();
+    if (!make_misc_images(specs, num_jobs)) {
+      fprintf(stderr, "make_misc_images failed.\n");
+      return 1;
+    }
+    snprintf(name, sizeof(name), "batch, %d jobs", num_jobs);
+    report(name, num_images, now_seconds() - start);
+  }
+
+  if (argc > 2) {
+    // Forking is slow enough that a few hundred runs tell the rate.
+    size_t num_spawns = num_images < 500 ? num_images : 500;
+    start = now_seconds();
+    for (size_t n = 0; n < num_spawns; ++n) {
+      string output = "--output=" + specs[n].output.value();
+      const char* spawn_argv[] = {argv[2], "--ab_metadata=15,1,0,14,0,1",
+                                  output.c_str(), NULL};
+      pid_t pid;
+      int status;
+      if (posix_spawn(&pid, argv[2], NULL, NULL, (char**)spawn_argv,
+                      environ) != 0 ||
+          waitpid(pid, &status, 0) != pid) {
+        fprintf(stderr, "Cannot run %s.\n", argv[2]);
+        return 1;
+      }
+    }
+    report("process per image", num_spawns, now_seconds() - start);
+  }
+
+  for (size_t n = 0; n < num_images; ++n)
+    unlink(specs[n].output.value().c_str());
+  rmdir(dir);
+  return 0;
+}
@@ -192,3 +192,101 @@ TEST_F(AbTest, MissingOutput) {
               metadata, &misc_name));
 }
 
+
+// Writes |contents| to a manifest in |dir| and parses it into |specs|.
+static int parse_manifest_string(const base::FilePath& dir,
+                                 const string& contents,
+                                 vector<MiscImageSpec>* specs) {
+  base::FilePath manifest = dir.Append("manifest.csv");
+  EXPECT_EQ((int)contents.size(),
+            base::WriteFile(manifest, contents.data(), contents.size()));
+  specs->clear();
+  return parse_manifest(manifest, specs);
+}
+
+TEST_F(AbTest, BatchMatchesSingleImages) {
+  string manifest = "# path,a_priority,...\n\n";
+  for (int n = 0; n < 200; ++n) {
+    manifest += testdir_.Append("misc" + std::to_string(n) + ".img").value();
+    manifest += "," + std::to_string(n % 16) + "," + std::to_string(n % 8) +
+                "," + std::to_string(n % 2) + "," +
+                std::to_string(15 - n % 16) + ",0,1\n";
+  }
+  vector<MiscImageSpec> specs;
+  ASSERT_EQ(1, parse_manifest_string(testdir_, manifest, &specs));
+  ASSERT_EQ(200U, specs.size());
+  EXPECT_EQ(1, make_misc_images(specs, 4));
+
+  for (int n = 0; n < 200; ++n) {
+    SCOPED_TRACE(n);
+    BubAbData data;
+    string expected;
+    string actual;
+    ops_.write_ab_metadata(&data, (uint8_t[4])BUB_BOOT_CTRL_MAGIC,
+                           n % 16, n % 8, n % 2, 15 - n % 16, 0, 1);
+    ASSERT_TRUE(base::ReadFileToString(
+        ops_.make_metadata_image(&data, "expected.img"), &expected));
+    ASSERT_TRUE(base::ReadFileToString(specs[n].output, &actual));
+    EXPECT_EQ(expected, actual);
+  }
+}
+
+TEST_F(AbTest, ManifestPaths) {
+  vector<MiscImageSpec> specs;
+
+  ASSERT_EQ(1, parse_manifest_string(testdir_, "a,b/misc.img,15,0,1,14,0,1",
+                                     &specs));
+  ASSERT_EQ(1U, specs.size());
+  EXPECT_EQ("a,b/misc.img", specs[0].output.value());
+  EXPECT_EQ(14, specs[0].slots[1].priority);
+
+  EXPECT_EQ(0, parse_manifest_string(testdir_, ",15,0,1,14,0,1", &specs));
+  EXPECT_EQ(0, parse_manifest_string(testdir_, "15,0,1,14,0,1", &specs));
+  EXPECT_EQ(0, parse_manifest_string(testdir_, "misc.img,15,0,1,14,0",
+                                     &specs));
+  EXPECT_EQ(0, parse_manifest_string(testdir_,
+                                     "ok.img,15,0,1,14,0,1\n"
+                                     "bad.img,15,8,1,14,0,1\n",
+                                     &specs));
+  EXPECT_EQ(0, parse_manifest(testdir_.Append("missing.csv"), &specs));
+}
+
+TEST_F(AbTest, BatchReportsFailures) {
+  vector<MiscImageSpec> specs(3);
+
+  for (size_t n = 0; n < specs.size(); ++n)
+    bub_memset(specs[n].slots, 0, sizeof(specs[n].slots));
+  specs[0].output = testdir_.Append("ok0.img");
+  specs[1].output = testdir_.Append("no-such-dir").Append("misc.img");
+  specs[2].output = testdir_.Append("ok2.img");
+  EXPECT_EQ(0, make_misc_images(specs, 2));
+  EXPECT_TRUE(base::PathExists(specs[0].output));
+  EXPECT_TRUE(base::PathExists(specs[2].output));
+}
+
+TEST_F(AbTest, BatchArgs) {
+  base::FilePath manifest;
+  int num_jobs = 0;
+
+  EXPECT_EQ(1, parse_batch_args(2,
+                                (const char *[]){"make_misc_image",
+                                                 "--manifest=m.csv"},
+                                &manifest, &num_jobs));
+  EXPECT_EQ("m.csv", manifest.value());
+  EXPECT_LE(1, num_jobs);
+  EXPECT_EQ(1, parse_batch_args(3,
+                                (const char *[]){"make_misc_image",
+                                                 "--manifest=m.csv",
+                                                 "--jobs=3"},
+                                &manifest, &num_jobs));
+  EXPECT_EQ(3, num_jobs);
+  EXPECT_EQ(0, parse_batch_args(3,
+                                (const char *[]){"make_misc_image",
+                                                 "--manifest=m.csv",
+                                                 "--jobs=0"},
+                                &manifest, &num_jobs));
+  EXPECT_EQ(0, parse_batch_args(2,
+                                (const char *[]){"make_misc_image",
+                                                 "--jobs=3"},
+                                &manifest, &num_jobs));
+}
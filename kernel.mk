@@ -26,6 +26,7 @@
 # TARGET_KERNEL_CONFIGS to specify a set of additional kernel config files.
 # TARGET_KERNEL_DTB to define a DTB to build.
 # TARGET_KERNEL_DTB_APPEND to append the built DTB to the kernel.
+# TARGET_KERNEL_CLEAN_BUILD set to true to clean before every kernel build.
 
 
 # Brillo does not support prebuilt kernels.
@@ -109,7 +110,23 @@ KERNEL_OUT := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ
 KERNEL_BIN := $(KERNEL_OUT)/arch/$(KERNEL_SRC_ARCH)/boot/$(KERNEL_NAME)
 
 # Figure out which kernel version is being built (disregard -stable version).
+# Asking the kernel tree is slow, so the answer is cached in KERNEL_OUT and
+# keyed on the source revision plus the top-level Makefile, which is where
+# the version numbers live.
+KERNEL_VERSION_CACHE := $(KERNEL_OUT)/.kernelversion
+KERNEL_VERSION_KEY := $(firstword $(shell \
+	(git -C $(TARGET_KERNEL_SRC) rev-parse HEAD 2>/dev/null; \
+	 cat $(TARGET_KERNEL_SRC)/Makefile) | sha1sum))
+KERNEL_VERSION_CACHED := $(shell cat $(KERNEL_VERSION_CACHE) 2>/dev/null)
+ifeq ($(firstword $(KERNEL_VERSION_CACHED)),$(KERNEL_VERSION_KEY))
+KERNEL_VERSION := $(word 2,$(KERNEL_VERSION_CACHED))
+else
 KERNEL_VERSION := $(shell $(MAKE) --no-print-directory -C $(TARGET_KERNEL_SRC) -s SUBLEVEL="" kernelversion)
+ifneq ($(KERNEL_VERSION),)
+$(shell mkdir -p $(KERNEL_OUT) && \
+	echo $(KERNEL_VERSION_KEY) $(KERNEL_VERSION) > $(KERNEL_VERSION_CACHE))
+endif
+endif
 
 # Brillo kernel config file sources.
 KERNEL_CONFIG_DIR := device/generic/brillo/kconfig
@@ -126,6 +143,7 @@ KERNEL_CONFIG_SRC := $(KERNEL_CONFIG_DEFAULT) \
 		     $(TARGET_KERNEL_CONFIGS) \
 		     $(KERNEL_CONFIG_REQUIRED)
 KERNEL_CONFIG := $(KERNEL_OUT)/.config
+KERNEL_CONFIG_HASH := $(KERNEL_OUT)/.config.sha1
 
 KERNEL_MERGE_CONFIG := device/generic/brillo/mergeconfig.sh
 KERNEL_HEADERS_INSTALL := $(KERNEL_OUT)/usr
@@ -157,12 +175,28 @@ define build_kernel
 		$(1)
 endef
 
-$(KERNEL_BIN): $(KERNEL_CONFIG) | $(KERNEL_OUT)
+# Kbuild tracks its own dependencies, so it is always run and decides what
+# needs rebuilding. The tree is only cleaned when the merged config differs
+# from the one recorded by the last successful build; re-merging fragments
+# that produce the same .config does not count.
+ifeq ($(TARGET_KERNEL_CLEAN_BUILD),true)
+KERNEL_CLEAN_CHECK := false
+else
+KERNEL_CLEAN_CHECK := cmp -s $(KERNEL_CONFIG_HASH).new $(KERNEL_CONFIG_HASH)
+endif
+
+$(KERNEL_BIN): $(KERNEL_CONFIG) FORCE | $(KERNEL_OUT)
 	$(hide) echo "Building $(KERNEL_ARCH) $(KERNEL_VERSION) kernel ..."
-	$(hide) rm -rf $(KERNEL_OUT)/arch/$(KERNEL_ARCH)/boot/dts
-	$(hide) rm -rf $(PRODUCT_OUT)/kernel.dtb $(PRODUCT_OUT)/kernel-and-dtb
-	$(hide) $(MAKE) -C $(TARGET_KERNEL_SRC) mrproper
+	$(hide) sha1sum < $(KERNEL_CONFIG) > $(KERNEL_CONFIG_HASH).new
+	$(hide) set -e ; if ! $(KERNEL_CLEAN_CHECK) ; then \
+		echo "Cleaning kernel tree ..." ; \
+		rm -f $(KERNEL_CONFIG_HASH) ; \
+		rm -rf $(KERNEL_OUT)/arch/$(KERNEL_ARCH)/boot/dts ; \
+		rm -rf $(PRODUCT_OUT)/kernel.dtb $(PRODUCT_OUT)/kernel-and-dtb ; \
+		$(MAKE) -C $(TARGET_KERNEL_SRC) mrproper ; \
+	fi
 	$(call build_kernel,all)
+	$(hide) mv $(KERNEL_CONFIG_HASH).new $(KERNEL_CONFIG_HASH)
 
 $(KERNEL_MODULES_INSTALL): $(KERNEL_BIN)
 	$(hide) echo "Installing kernel modules ..."